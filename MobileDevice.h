@@ -424,6 +424,12 @@ extern "C" {
     __DLLIMPORT uint64_t AMDServiceConnectionSend(AMDServiceConnectionRef serviceConnection, const void *message, size_t length);
     __DLLIMPORT uint64_t AMDServiceConnectionReceive(AMDServiceConnectionRef serviceConnection, void *buffer, size_t size);
     
+    /*
+     * Returns the socket underlying a service connection.
+     */
+    
+    __DLLIMPORT int AMDServiceConnectionGetSocket(AMDServiceConnectionRef serviceConnection);
+    
     /*
      * Invalidates a service connection.
      */
@@ -0,0 +1,318 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "admission.h"
+
+/*
+ * Rates are measured over windows of kWindow seconds. A window much longer than that
+ * spans an idle period and only restarts the measurement.
+ */
+#define kWindow        2.0
+#define kHoldWindows   5
+#define kFlushShare    0.05         /* Less flushing per window doesn't limit anyone.  */
+#define kPollInterval  20000
+
+static const char kMagic[8] = "DTADM1";
+
+typedef struct {
+    int32_t  pid;
+    uint32_t used;
+    uint32_t running;
+    uint32_t waiting;
+    uint64_t bytes;
+    uint64_t sampleBytes;
+    double   throughput;
+    char     name[64];
+} admission_slot_t;
+
+typedef struct {
+    char     magic[8];
+    uint32_t size;                  /* sizeof(admission_state_t) of the creator.       */
+    uint32_t limit;
+    uint32_t probing;               /* The limit was raised at the last window's end.  */
+    uint32_t hold;                  /* Windows left before probing again.              */
+    double   sampleTime;
+    uint64_t sampleBytes;
+    double   before;                /* Aggregate rate before the last raise.           */
+    double   throughput;
+    uint64_t bytes;
+    uint64_t flushBytes;
+    uint64_t flushNanoseconds;      /* Summed over all flushes, also concurrent ones.  */
+    uint64_t sampleFlushBytes;
+    uint64_t sampleFlushNanoseconds;
+    double   writeBefore;           /* Write bandwidth before the last raise, 0 - none. */
+    double   writeThroughput;       /* 0 - no flush in the last window.                */
+    admission_slot_t slots[kDTAdmissionMaximumSlots];
+} admission_state_t;
+
+struct dt_admission {
+    int fd;
+    admission_state_t *state;
+
+    /*
+     * flock() doesn't exclude threads sharing the descriptor.
+     */
+    pthread_mutex_t lock;
+};
+
+static double monotonicTime(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void admissionLock(DTAdmissionRef admission) {
+    pthread_mutex_lock(&admission->lock);
+    while (flock(admission->fd, LOCK_EX) != 0 && errno == EINTR);
+}
+
+static void admissionUnlock(DTAdmissionRef admission) {
+    flock(admission->fd, LOCK_UN);
+    pthread_mutex_unlock(&admission->lock);
+}
+
+/*
+ * Frees the slots of processes that exited without unregistering.
+ */
+static void reclaimSlots(admission_state_t *state) {
+    for (uint32_t i = 0; i < kDTAdmissionMaximumSlots; i++) {
+        admission_slot_t *slot = &state->slots[i];
+        if (slot->used && kill(slot->pid, 0) != 0 && errno == ESRCH)
+            memset(slot, 0, sizeof(admission_slot_t));
+    }
+}
+
+static void countTransfers(const admission_state_t *state, uint32_t *running, uint32_t *waiting, uint32_t *clients) {
+    *running = *waiting = 0;
+    if (clients) *clients = 0;
+    for (uint32_t i = 0; i < kDTAdmissionMaximumSlots; i++) {
+        if (!state->slots[i].used) continue;
+        *running += state->slots[i].running;
+        *waiting += state->slots[i].waiting;
+        if (clients) (*clients)++;
+    }
+}
+
+/*
+ * Ends the current window if it is over and adjusts the limit. Called locked.
+ */
+static void evaluateWindow(admission_state_t *state, double now) {
+    double elapsed = now - state->sampleTime;
+    if (elapsed < 0) {
+        /*
+         * The state file outlived a reboot and CLOCK_MONOTONIC started over. Start a new
+         * window now instead of waiting for the clock to pass the old one.
+         */
+        reclaimSlots(state);
+        state->sampleTime = now;
+        state->sampleBytes = __atomic_load_n(&state->bytes, __ATOMIC_RELAXED);
+        state->sampleFlushBytes = __atomic_load_n(&state->flushBytes, __ATOMIC_RELAXED);
+        state->sampleFlushNanoseconds = __atomic_load_n(&state->flushNanoseconds, __ATOMIC_RELAXED);
+        for (uint32_t i = 0; i < kDTAdmissionMaximumSlots; i++)
+            state->slots[i].sampleBytes = __atomic_load_n(&state->slots[i].bytes, __ATOMIC_RELAXED);
+        state->probing = 0;
+        return;
+    }
+    if (elapsed < kWindow) return;
+
+    reclaimSlots(state);
+    uint64_t bytes = __atomic_load_n(&state->bytes, __ATOMIC_RELAXED);
+    state->throughput = (double)(bytes - state->sampleBytes) / elapsed;
+    state->sampleBytes = bytes;
+    state->sampleTime = now;
+    uint64_t flushBytes = __atomic_load_n(&state->flushBytes, __ATOMIC_RELAXED);
+    uint64_t flushNanoseconds = __atomic_load_n(&state->flushNanoseconds, __ATOMIC_RELAXED);
+    double flushSeconds = (flushNanoseconds - state->sampleFlushNanoseconds) / 1e9;
+    state->writeThroughput = flushSeconds > 0 ? (double)(flushBytes - state->sampleFlushBytes) / flushSeconds : 0;
+    state->sampleFlushBytes = flushBytes;
+    state->sampleFlushNanoseconds = flushNanoseconds;
+    for (uint32_t i = 0; i < kDTAdmissionMaximumSlots; i++) {
+        admission_slot_t *slot = &state->slots[i];
+        if (!slot->used) continue;
+        uint64_t slotBytes = __atomic_load_n(&slot->bytes, __ATOMIC_RELAXED);
+        slot->throughput = (double)(slotBytes - slot->sampleBytes) / elapsed;
+        slot->sampleBytes = slotBytes;
+    }
+    if (elapsed > 4 * kWindow) {
+        state->probing = 0;
+        return;
+    }
+
+    uint32_t running, waiting;
+    countTransfers(state, &running, &waiting, NULL);
+    if (state->hold) state->hold--;
+    if (!waiting || running < state->limit) {
+        /*
+         * Demand was met; the last raise, if any, stands.
+         */
+        state->probing = 0;
+    } else if (state->probing) {
+        /*
+         * A window without flushes says nothing about the disk, and flushes that take
+         * next to no time (the page cache, tmpfs) vary too much to compare.
+         */
+        bool faster = state->throughput > state->before * (1 + kDTAdmissionGain);
+        bool diskKeptUp = !state->writeBefore || !state->writeThroughput || flushSeconds < kFlushShare * elapsed ||
+                          state->writeThroughput >= state->writeBefore * (1 - kDTAdmissionWriteLoss);
+        if (faster && diskKeptUp) {
+            state->before = state->throughput;
+            if (state->writeThroughput) state->writeBefore = state->writeThroughput;
+            if (state->limit < kDTAdmissionMaximumSlots) state->limit++;
+        } else {
+            if (state->limit > 1) state->limit--;
+            state->probing = 0;
+            state->hold = kHoldWindows;
+        }
+    } else if (!state->hold && state->limit < kDTAdmissionMaximumSlots) {
+        state->before = state->throughput;
+        state->writeBefore = state->writeThroughput;
+        state->limit++;
+        state->probing = 1;
+    }
+}
+
+DTAdmissionRef DTAdmissionOpen(const char *path) {
+    DTAdmissionRef admission = calloc(1, sizeof(struct dt_admission));
+    if (!admission) return NULL;
+    admission->fd = open(path, O_RDWR | O_CREAT, 0666);
+    if (admission->fd < 0) {
+        free(admission);
+        return NULL;
+    }
+    pthread_mutex_init(&admission->lock, NULL);
+    admissionLock(admission);
+
+    struct stat info;
+    bool fresh = fstat(admission->fd, &info) != 0 || info.st_size != sizeof(admission_state_t);
+    if (fresh && (ftruncate(admission->fd, 0) != 0 || ftruncate(admission->fd, sizeof(admission_state_t)) != 0)) {
+        admissionUnlock(admission);
+        DTAdmissionClose(admission);
+        return NULL;
+    }
+    void *map = mmap(NULL, sizeof(admission_state_t), PROT_READ | PROT_WRITE, MAP_SHARED, admission->fd, 0);
+    if (map == MAP_FAILED) {
+        admissionUnlock(admission);
+        DTAdmissionClose(admission);
+        return NULL;
+    }
+    admission->state = map;
+    if (fresh || memcmp(admission->state->magic, kMagic, sizeof(kMagic)) || admission->state->size != sizeof(admission_state_t)) {
+        memset(admission->state, 0, sizeof(admission_state_t));
+        memcpy(admission->state->magic, kMagic, sizeof(kMagic));
+        admission->state->size = sizeof(admission_state_t);
+        admission->state->limit = 1;
+        admission->state->sampleTime = monotonicTime();
+    }
+    admissionUnlock(admission);
+    return admission;
+}
+
+void DTAdmissionClose(DTAdmissionRef admission) {
+    if (!admission) return;
+    if (admission->state) munmap(admission->state, sizeof(admission_state_t));
+    close(admission->fd);
+    pthread_mutex_destroy(&admission->lock);
+    free(admission);
+}
+
+int DTAdmissionRegister(DTAdmissionRef admission, const char *name) {
+    int result = -1;
+    admissionLock(admission);
+    reclaimSlots(admission->state);
+    for (uint32_t i = 0; i < kDTAdmissionMaximumSlots && result < 0; i++) {
+        admission_slot_t *slot = &admission->state->slots[i];
+        if (slot->used) continue;
+        memset(slot, 0, sizeof(admission_slot_t));
+        slot->used = 1;
+        slot->pid = getpid();
+        snprintf(slot->name, sizeof(slot->name), "%s", name ? name : "");
+        result = (int)i;
+    }
+    admissionUnlock(admission);
+    return result;
+}
+
+void DTAdmissionUnregister(DTAdmissionRef admission, int slot) {
+    if (slot < 0 || slot >= kDTAdmissionMaximumSlots) return;
+    admissionLock(admission);
+    memset(&admission->state->slots[slot], 0, sizeof(admission_slot_t));
+    admissionUnlock(admission);
+}
+
+bool DTAdmissionAcquire(DTAdmissionRef admission, int slot, bool (*cancelled)(void *context), void *context) {
+    if (slot < 0 || slot >= kDTAdmissionMaximumSlots) return !(cancelled && cancelled(context));
+    admission_slot_t *client = &admission->state->slots[slot];
+
+    admissionLock(admission);
+    client->waiting++;
+    admissionUnlock(admission);
+
+    /*
+     * Waiters are in other processes too, so this polls rather than waits on a
+     * condition.
+     */
+    for (;;) {
+        admissionLock(admission);
+        evaluateWindow(admission->state, monotonicTime());
+        uint32_t running, waiting;
+        countTransfers(admission->state, &running, &waiting, NULL);
+        bool admitted = running < admission->state->limit;
+        bool giveUp = !admitted && cancelled && cancelled(context);
+        if (admitted || giveUp) {
+            client->waiting--;
+            if (admitted) client->running++;
+            admissionUnlock(admission);
+            return admitted;
+        }
+        admissionUnlock(admission);
+        usleep(kPollInterval);
+    }
+}
+
+void DTAdmissionRelease(DTAdmissionRef admission, int slot) {
+    if (slot < 0 || slot >= kDTAdmissionMaximumSlots) return;
+    admissionLock(admission);
+    if (admission->state->slots[slot].running) admission->state->slots[slot].running--;
+    admissionUnlock(admission);
+}
+
+void DTAdmissionAddBytes(DTAdmissionRef admission, int slot, uint64_t bytes) {
+    admission_state_t *state = admission->state;
+    __atomic_fetch_add(&state->bytes, bytes, __ATOMIC_RELAXED);
+    if (slot >= 0 && slot < kDTAdmissionMaximumSlots)
+        __atomic_fetch_add(&state->slots[slot].bytes, bytes, __ATOMIC_RELAXED);
+
+    double now = monotonicTime();
+    if (now - state->sampleTime < kWindow) return;
+    admissionLock(admission);
+    evaluateWindow(state, now);
+    admissionUnlock(admission);
+}
+
+void DTAdmissionAddFlush(DTAdmissionRef admission, uint64_t bytes, double seconds) {
+    admission_state_t *state = admission->state;
+    __atomic_fetch_add(&state->flushBytes, bytes, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&state->flushNanoseconds, (uint64_t)(seconds * 1e9) + 1, __ATOMIC_RELAXED);
+}
+
+void DTAdmissionGetStatus(DTAdmissionRef admission, int slot, DTAdmissionStatus *status) {
+    memset(status, 0, sizeof(DTAdmissionStatus));
+    admissionLock(admission);
+    evaluateWindow(admission->state, monotonicTime());
+    countTransfers(admission->state, &status->running, &status->waiting, &status->clients);
+    status->limit = admission->state->limit;
+    status->throughput = admission->state->throughput;
+    status->writeThroughput = admission->state->writeThroughput;
+    if (slot >= 0 && slot < kDTAdmissionMaximumSlots)
+        status->clientThroughput = admission->state->slots[slot].throughput;
+    admissionUnlock(admission);
+}
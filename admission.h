@@ -0,0 +1,78 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Host-wide admission control for file transfers, shared by every fetchsymbols process
+ * that opens the same state file. The file is mapped by all of them and holds
+ *
+ *   the admission limit    transfers allowed to run at once on the host
+ *   one slot per client    process id, name, running and waiting transfers, bytes
+ *                          received, receive rate over the last window
+ *   the aggregate          bytes received by all clients, rate over the last window
+ *
+ * and is updated under flock(). Slots of processes that died are reclaimed.
+ *
+ * A slot's rate is its device's receive bandwidth. Transfers write straight into mapped
+ * files and flush them with msync() when complete; the flushes give the disk's write
+ * bandwidth separately, as bytes flushed per second spent flushing. The page cache
+ * hides a saturated disk from the receive rate until dirty page throttling starts, but
+ * not from the flushes: each one gets a smaller share of the disk.
+ *
+ * The limit starts at 1. At the end of every window in which transfers were waiting
+ * for admission, it is raised by one if the aggregate rate rose by kDTAdmissionGain
+ * since the last raise and the write bandwidth did not fall by kDTAdmissionWriteLoss
+ * (once flushing takes a noticeable share of the window), and lowered again otherwise;
+ * after lowering it stays put for a few windows before probing again.
+ */
+typedef struct dt_admission *DTAdmissionRef;
+
+#define kDTAdmissionMaximumSlots 64
+#define kDTAdmissionGain         0.05
+#define kDTAdmissionWriteLoss    0.25
+
+typedef struct {
+    uint32_t limit;
+    uint32_t running;               /* Admitted transfers of all clients.              */
+    uint32_t waiting;
+    uint32_t clients;
+    double   throughput;            /* Aggregate bytes per second, last window.        */
+    double   clientThroughput;      /* Of the slot asked for.                          */
+    double   writeThroughput;       /* Bytes flushed per second flushing, last window. */
+} DTAdmissionStatus;
+
+/*
+ * Maps the state file at path, creating it if needed.
+ */
+DTAdmissionRef DTAdmissionOpen(const char *path);
+void DTAdmissionClose(DTAdmissionRef admission);
+
+/*
+ * Takes a slot for one device. Returns -1 if all slots are in use; transfers of such a
+ * client are admitted without limit.
+ */
+int DTAdmissionRegister(DTAdmissionRef admission, const char *name);
+void DTAdmissionUnregister(DTAdmissionRef admission, int slot);
+
+/*
+ * Blocks until the transfer is admitted. Returns false without admitting it once
+ * cancelled(context) returns true.
+ */
+bool DTAdmissionAcquire(DTAdmissionRef admission, int slot, bool (*cancelled)(void *context), void *context);
+void DTAdmissionRelease(DTAdmissionRef admission, int slot);
+
+/*
+ * Counts received bytes. Lock free unless a window has ended.
+ */
+void DTAdmissionAddBytes(DTAdmissionRef admission, int slot, uint64_t bytes);
+
+/*
+ * Counts a completed flush of 'bytes' that took 'seconds'. Lock free.
+ */
+void DTAdmissionAddFlush(DTAdmissionRef admission, uint64_t bytes, double seconds);
+
+void DTAdmissionGetStatus(DTAdmissionRef admission, int slot, DTAdmissionStatus *status);
+
+#endif
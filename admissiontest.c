@@ -0,0 +1,312 @@
+/*
+ * admissiontest - tests of the host-wide admission control in admission.c.
+ *
+ * Three fetchsymbols client processes share a state file and fetch from one standin
+ * whose connections run at 1 MB/s each and 2 MB/s together (-b 1024 -t 2048): the
+ * limit must rise while a transfer more still adds throughput and fall back once one
+ * doesn't. The clients are then killed in the middle of their transfers, and their
+ * slots and admissions must be reclaimed. A simulated disk that takes one flush at a
+ * time, behind a link that is never the bottleneck, must hold the limit down although
+ * the receive rate keeps rising. Finally a state file whose window started in the
+ * future, as after a reboot, must start a new window at once. Windows are 2 s long,
+ * so this takes about 20 s. Build with the library and standin in the current
+ * directory:
+ *
+ *   cc standin.c -lpthread -o standin
+ *   xcrun -sdk macosx clang -F/System/Library/PrivateFrameworks -framework MobileDevice -framework CoreFoundation admissiontest.c fetchsymbols.c workpool.c wiretrace.c arena.c metrics.c -o admissiontest
+ *   ./admissiontest [path to standin]
+ *
+ * admission.c is compiled into the test, so it is not listed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "admission.c"
+#include "fetchsymbols.h"
+
+#define kClientCount 3
+#define kFileCount   8
+#define kFileSize    (512 * 1024)
+
+/*
+ * The simulated transfers: 1 MB received at 8 MB/s, then flushed to a 4 MB/s disk.
+ */
+#define kSimulatedSize      (1024 * 1024)
+#define kSimulatedChunk     (64 * 1024)
+#define kSimulatedThreads   4
+#define kReceiveRate        (8.0 * 1024 * 1024)
+#define kDiskRate           (4.0 * 1024 * 1024)
+
+static const char *standin_path = "./standin";
+static char data_directory[PATH_MAX];
+static char base_directory[PATH_MAX];
+static uint32_t failures = 0;
+
+static void check(const char *name, bool passed, const char *format, ...) {
+    printf("[%c] %s", passed ? '+' : '-', name);
+    if (!passed && format) {
+        va_list args;
+        va_start(args, format);
+        printf(": ");
+        vprintf(format, args);
+        va_end(args);
+    }
+    putchar('\n');
+    if (!passed) failures++;
+}
+
+static bool createFiles(void) {
+    uint8_t *buffer = malloc(kFileSize);
+    if (!buffer) return false;
+    uint32_t state = 0x13579bdf;
+    for (int i = 0; i < kFileCount; i++) {
+        for (size_t j = 0; j < kFileSize; j++) {
+            state = state * 1664525 + 1013904223;
+            buffer[j] = (uint8_t)(state >> 24);
+        }
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/file%d", data_directory, i);
+        FILE *file = fopen(path, "wb");
+        bool written = file && fwrite(buffer, 1, kFileSize, file) == kFileSize;
+        if (file) written = (fclose(file) == 0) && written;
+        if (!written) {
+            free(buffer);
+            return false;
+        }
+    }
+    free(buffer);
+    return true;
+}
+
+/*
+ * Starts standin with the given options on 'port' and waits until it accepts.
+ */
+static pid_t startStandin(const char *options[], uint16_t port) {
+    char portString[8];
+    snprintf(portString, sizeof(portString), "%u", port);
+    const char *arguments[16] = {standin_path};
+    int count = 1;
+    while (options && *options && count < 12) arguments[count++] = *options++;
+    arguments[count++] = data_directory;
+    arguments[count++] = portString;
+    arguments[count] = NULL;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        if (null >= 0) dup2(null, STDOUT_FILENO);
+        execv(standin_path, (char *const *)arguments);
+        _exit(127);
+    }
+    if (pid < 0) return -1;
+
+    for (int attempt = 0; attempt < 200; attempt++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in address = {0};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        bool connected = fd >= 0 && connect(fd, (struct sockaddr *)&address, sizeof(address)) == 0;
+        if (fd >= 0) close(fd);
+        if (connected) return pid;
+        usleep(10000);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+static void stopProcess(pid_t pid) {
+    if (pid <= 0) return;
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+}
+
+/*
+ * A client process: its own mapping of the state file (flock() doesn't exclude
+ * descriptors inherited across fork), two transfers at a time, all files over and
+ * over until it is killed.
+ */
+static pid_t startClient(const char *statePath, uint16_t port, int number) {
+    pid_t pid = fork();
+    if (pid != 0) return pid;
+
+    char directory[PATH_MAX], name[16];
+    snprintf(directory, sizeof(directory), "%s/client%d", base_directory, number);
+    snprintf(name, sizeof(name), "client%d", number);
+    mkdir(directory, 0755);
+    DTAdmissionRef admission = DTAdmissionOpen(statePath);
+    DTSessionRef session = DTSessionCreateWithAddress("127.0.0.1", port);
+    if (!admission || !session) _exit(1);
+    DTSessionSetAdmission(session, admission, name);
+    DTSessionSetMaximumTransfers(session, 2);
+    for (;;) {
+        for (int i = 0; i < kFileCount; i++) {
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/file%d", directory, i);
+            DTSessionFetchFileAsync(session, i, path, NULL, NULL);
+        }
+        DTSessionWait(session);
+    }
+}
+
+/*
+ * Polls the limit until it falls below its peak or 'seconds' pass. Returns the peak;
+ * *last is the limit at the end.
+ */
+static uint32_t followLimit(DTAdmissionRef admission, double seconds, uint32_t *last) {
+    double deadline = monotonicTime() + seconds;
+    uint32_t peak = 0;
+    DTAdmissionStatus status;
+    do {
+        usleep(100000);
+        DTAdmissionGetStatus(admission, -1, &status);
+        if (status.limit > peak) {
+            printf("[*] Limit %u at %.1f MB/s received, %.1f MB/s written.\n", status.limit,
+                   status.throughput / (1024 * 1024), status.writeThroughput / (1024 * 1024));
+            peak = status.limit;
+        }
+        *last = status.limit;
+    } while (*last == peak && monotonicTime() < deadline);
+    printf("[*] Limit %u at %.1f MB/s received, %.1f MB/s written.\n", status.limit,
+           status.throughput / (1024 * 1024), status.writeThroughput / (1024 * 1024));
+    return peak;
+}
+
+static void processCase(uint16_t port) {
+    char statePath[PATH_MAX];
+    snprintf(statePath, sizeof(statePath), "%s/processes.admission", base_directory);
+    const char *options[] = {"-b", "1024", "-t", "2048", NULL};
+    pid_t server = startStandin(options, port);
+    if (server < 0) {
+        check("admission rises and backs off across processes", false, "standin did not start");
+        return;
+    }
+    DTAdmissionRef admission = DTAdmissionOpen(statePath);
+    pid_t clients[kClientCount];
+    for (int i = 0; i < kClientCount; i++) clients[i] = startClient(statePath, port, i);
+    if (!admission) {
+        check("admission rises and backs off across processes", false, "can not open %s", statePath);
+        for (int i = 0; i < kClientCount; i++) stopProcess(clients[i]);
+        stopProcess(server);
+        return;
+    }
+
+    /*
+     * 1 MB/s with one transfer and 2 MB/s with two: the third gains nothing and goes.
+     */
+    uint32_t last = 0;
+    uint32_t peak = followLimit(admission, 16, &last);
+    DTAdmissionStatus status;
+    DTAdmissionGetStatus(admission, -1, &status);
+    check("admission rises and backs off across processes", peak == 3 && last == 2 && status.clients == kClientCount,
+          "peak %u, then %u, %u clients", peak, last, status.clients);
+
+    /*
+     * Killed with transfers admitted and waiting: the next window end frees their slots.
+     */
+    for (int i = 0; i < kClientCount; i++) stopProcess(clients[i]);
+    double deadline = monotonicTime() + 3 * kWindow;
+    do {
+        usleep(100000);
+        DTAdmissionGetStatus(admission, -1, &status);
+    } while ((status.clients || status.running || status.waiting) && monotonicTime() < deadline);
+    check("slots of dead processes are reclaimed", !status.clients && !status.running && !status.waiting,
+          "%u clients, %u running, %u waiting", status.clients, status.running, status.waiting);
+
+    /*
+     * A window that began in the future: the state file survived a reboot.
+     */
+    admission->state->sampleTime = monotonicTime() + 1e6;
+    DTAdmissionGetStatus(admission, -1, &status);
+    check("a window from before a reboot restarts at once", admission->state->sampleTime <= monotonicTime(),
+          "window starts in %.0f s", admission->state->sampleTime - monotonicTime());
+    DTAdmissionClose(admission);
+    stopProcess(server);
+}
+
+typedef struct {
+    DTAdmissionRef admission;
+    int slot;
+    pthread_mutex_t disk;
+    volatile bool stop;
+} simulation_t;
+
+static bool simulationStopped(void *context) {
+    return ((simulation_t *)context)->stop;
+}
+
+/*
+ * Transfers whose receive rate doesn't depend on how many run, flushed through a disk
+ * that writes one file at a time.
+ */
+static void *simulatedTransfers(void *arg) {
+    simulation_t *simulation = arg;
+    while (!simulation->stop && DTAdmissionAcquire(simulation->admission, simulation->slot, simulationStopped, simulation)) {
+        for (uint32_t received = 0; received < kSimulatedSize && !simulation->stop; received += kSimulatedChunk) {
+            usleep((useconds_t)(kSimulatedChunk / kReceiveRate * 1e6));
+            DTAdmissionAddBytes(simulation->admission, simulation->slot, kSimulatedChunk);
+        }
+        double start = monotonicTime();
+        pthread_mutex_lock(&simulation->disk);
+        usleep((useconds_t)(kSimulatedSize / kDiskRate * 1e6));
+        pthread_mutex_unlock(&simulation->disk);
+        DTAdmissionAddFlush(simulation->admission, kSimulatedSize, monotonicTime() - start);
+        DTAdmissionRelease(simulation->admission, simulation->slot);
+    }
+    return NULL;
+}
+
+static void diskCase(void) {
+    char statePath[PATH_MAX];
+    snprintf(statePath, sizeof(statePath), "%s/disk.admission", base_directory);
+    simulation_t simulation = {DTAdmissionOpen(statePath), -1, PTHREAD_MUTEX_INITIALIZER, false};
+    if (!simulation.admission) {
+        check("a saturated disk holds the limit down", false, "can not open %s", statePath);
+        return;
+    }
+    simulation.slot = DTAdmissionRegister(simulation.admission, "simulation");
+    pthread_t threads[kSimulatedThreads];
+    for (int i = 0; i < kSimulatedThreads; i++) pthread_create(&threads[i], NULL, simulatedTransfers, &simulation);
+
+    /*
+     * A second transfer raises the receive rate from 2.7 to 4 MB/s, but its flushes
+     * wait for the other's: a flush slows from 4 to 2.7 MB/s and the raise is undone.
+     */
+    uint32_t last = 0;
+    uint32_t peak = followLimit(simulation.admission, 10, &last);
+    check("a saturated disk holds the limit down", peak == 2 && last == 1, "peak %u, then %u", peak, last);
+
+    simulation.stop = true;
+    for (int i = 0; i < kSimulatedThreads; i++) pthread_join(threads[i], NULL);
+    DTAdmissionUnregister(simulation.admission, simulation.slot);
+    DTAdmissionClose(simulation.admission);
+}
+
+int main(int argc, const char *argv[]) {
+    if (argc > 1) standin_path = argv[1];
+    signal(SIGPIPE, SIG_IGN);
+    char base[] = "/tmp/admissiontest.XXXXXX";
+    if (!mkdtemp(base)) return 1;
+    snprintf(base_directory, sizeof(base_directory), "%s", base);
+    snprintf(data_directory, sizeof(data_directory), "%s/data", base);
+    if (mkdir(data_directory, 0755) != 0 || !createFiles()) {
+        printf("[-] Can not create test files in %s.\n", base);
+        return 1;
+    }
+
+    processCase((uint16_t)(20000 + getpid() % 20000));
+    diskCase();
+
+    char command[PATH_MAX + 16];
+    snprintf(command, sizeof(command), "rm -rf %s", base);
+    if (system(command) != 0) printf("[*] Can not remove %s.\n", base);
+    printf("[%c] %u failed.\n", failures ? '-' : '+', failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,197 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "arena.h"
+
+#define kChunkSize  (64 * 1024)
+#define kAlignment  16
+
+/*
+ * Every allocation is preceded by its size, so reallocate can copy and deallocate can
+ * keep liveBytes.
+ */
+#define kHeaderSize kAlignment
+
+typedef struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;
+    size_t used;
+    uint8_t data[] __attribute__((aligned(kAlignment)));
+} arena_chunk_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    arena_chunk_t *chunks;
+    DTArenaStatistics statistics;
+} arena_t;
+
+static pthread_mutex_t process_lock = PTHREAD_MUTEX_INITIALIZER;
+static DTArenaStatistics process_statistics;
+static uint32_t process_arenas = 0;
+
+static size_t alignSize(size_t size) {
+    return (size + kAlignment - 1) & ~(size_t)(kAlignment - 1);
+}
+
+static void processAccount(int64_t allocations, int64_t requested, int64_t live, int64_t held) {
+    pthread_mutex_lock(&process_lock);
+    process_statistics.allocations += allocations;
+    process_statistics.requestedBytes += requested;
+    process_statistics.liveBytes += live;
+    process_statistics.arenaBytes += held;
+    if (process_statistics.arenaBytes > process_statistics.peakBytes)
+        process_statistics.peakBytes = process_statistics.arenaBytes;
+    pthread_mutex_unlock(&process_lock);
+}
+
+/*
+ * Called locked. Large allocations get a chunk of their own behind the current one, so
+ * the space left in it isn't wasted.
+ */
+static void *arenaAllocate(arena_t *arena, size_t size) {
+    size_t needed = kHeaderSize + alignSize(size ? size : 1);
+    arena_chunk_t *chunk = arena->chunks;
+    if (!chunk || chunk->size - chunk->used < needed) {
+        size_t chunkSize = needed > kChunkSize / 4 ? needed : kChunkSize;
+        arena_chunk_t *fresh = malloc(sizeof(arena_chunk_t) + chunkSize);
+        if (!fresh) return NULL;
+        fresh->size = chunkSize;
+        fresh->used = 0;
+        if (chunk && chunkSize != kChunkSize) {
+            fresh->next = chunk->next;
+            chunk->next = fresh;
+        } else {
+            fresh->next = chunk;
+            arena->chunks = fresh;
+        }
+        chunk = fresh;
+        arena->statistics.arenaBytes += sizeof(arena_chunk_t) + chunkSize;
+        if (arena->statistics.arenaBytes > arena->statistics.peakBytes)
+            arena->statistics.peakBytes = arena->statistics.arenaBytes;
+        processAccount(0, 0, 0, sizeof(arena_chunk_t) + chunkSize);
+    }
+    uint8_t *block = chunk->data + chunk->used;
+    chunk->used += needed;
+    *(size_t *)block = size;
+    arena->statistics.allocations++;
+    arena->statistics.requestedBytes += size;
+    arena->statistics.liveBytes += size;
+    processAccount(1, size, size, 0);
+    return block + kHeaderSize;
+}
+
+static void *allocateCallback(CFIndex size, CFOptionFlags hint, void *info) {
+    arena_t *arena = info;
+    if (size < 0) return NULL;
+    pthread_mutex_lock(&arena->lock);
+    void *pointer = arenaAllocate(arena, (size_t)size);
+    pthread_mutex_unlock(&arena->lock);
+    return pointer;
+}
+
+static void *reallocateCallback(void *pointer, CFIndex size, CFOptionFlags hint, void *info) {
+    arena_t *arena = info;
+    if (size <= 0) return NULL;
+    pthread_mutex_lock(&arena->lock);
+    void *result = NULL;
+    size_t old = *(size_t *)((uint8_t *)pointer - kHeaderSize);
+    arena_chunk_t *chunk = arena->chunks;
+    uint8_t *end = chunk ? chunk->data + chunk->used : NULL;
+    /*
+     * The latest allocation grows in place if the chunk has room.
+     */
+    if (chunk && (uint8_t *)pointer + alignSize(old ? old : 1) == end &&
+        (uint8_t *)pointer - chunk->data + alignSize((size_t)size) <= chunk->size) {
+        chunk->used = (uint8_t *)pointer - chunk->data + alignSize((size_t)size);
+        *(size_t *)((uint8_t *)pointer - kHeaderSize) = (size_t)size;
+        if ((size_t)size > old) {
+            arena->statistics.requestedBytes += size - old;
+            processAccount(0, size - old, size - old, 0);
+        } else
+            processAccount(0, 0, -(int64_t)(old - size), 0);
+        arena->statistics.liveBytes += (size_t)size - old;
+        result = pointer;
+    } else if ((result = arenaAllocate(arena, (size_t)size))) {
+        memcpy(result, pointer, old < (size_t)size ? old : (size_t)size);
+        arena->statistics.liveBytes -= old;
+        processAccount(0, 0, -(int64_t)old, 0);
+    }
+    pthread_mutex_unlock(&arena->lock);
+    return result;
+}
+
+static void deallocateCallback(void *pointer, void *info) {
+    arena_t *arena = info;
+    pthread_mutex_lock(&arena->lock);
+    size_t size = *(size_t *)((uint8_t *)pointer - kHeaderSize);
+    arena->statistics.liveBytes -= size;
+    processAccount(0, 0, -(int64_t)size, 0);
+    pthread_mutex_unlock(&arena->lock);
+}
+
+/*
+ * Runs when the last reference to the allocator goes. Every object created in the arena
+ * holds one, so the chunks are freed only after the creator and all those objects have
+ * released theirs.
+ */
+static void releaseCallback(const void *info) {
+    arena_t *arena = (arena_t *)info;
+    for (arena_chunk_t *chunk = arena->chunks, *next; chunk; chunk = next) {
+        next = chunk->next;
+        free(chunk);
+    }
+    processAccount(0, 0, -(int64_t)arena->statistics.liveBytes, -(int64_t)arena->statistics.arenaBytes);
+    pthread_mutex_lock(&process_lock);
+    process_arenas--;
+    pthread_mutex_unlock(&process_lock);
+    pthread_mutex_destroy(&arena->lock);
+    free(arena);
+}
+
+CFAllocatorRef DTArenaCreate(void) {
+    arena_t *arena = calloc(1, sizeof(arena_t));
+    if (!arena) return NULL;
+    pthread_mutex_init(&arena->lock, NULL);
+    pthread_mutex_lock(&process_lock);
+    process_arenas++;
+    pthread_mutex_unlock(&process_lock);
+
+    CFAllocatorContext context;
+    memset(&context, 0, sizeof(context));
+    context.info = arena;
+    context.release = releaseCallback;
+    context.allocate = allocateCallback;
+    context.reallocate = reallocateCallback;
+    context.deallocate = deallocateCallback;
+    CFAllocatorRef allocator = CFAllocatorCreate(kCFAllocatorDefault, &context);
+    if (!allocator) {
+        releaseCallback(arena);
+        return NULL;
+    }
+    return allocator;
+}
+
+static arena_t *arenaOf(CFAllocatorRef allocator) {
+    CFAllocatorContext context;
+    memset(&context, 0, sizeof(context));
+    CFAllocatorGetContext(allocator, &context);
+    return context.info;
+}
+
+void DTArenaDestroy(CFAllocatorRef allocator) {
+    if (allocator) CFRelease(allocator);
+}
+
+void DTArenaGetStatistics(CFAllocatorRef allocator, DTArenaStatistics *statistics) {
+    arena_t *arena = arenaOf(allocator);
+    pthread_mutex_lock(&arena->lock);
+    *statistics = arena->statistics;
+    pthread_mutex_unlock(&arena->lock);
+}
+
+void DTArenaGetProcessStatistics(DTArenaStatistics *statistics, uint32_t *arenas) {
+    pthread_mutex_lock(&process_lock);
+    *statistics = process_statistics;
+    if (arenas) *arenas = process_arenas;
+    pthread_mutex_unlock(&process_lock);
+}
@@ -0,0 +1,40 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdint.h>
+#include <CoreFoundation/CoreFoundation.h>
+
+/*
+ * CFAllocator that carves allocations out of 64 KB chunks and gives nothing back until
+ * it is freed, all chunks in one step. Deallocating an object does not make its memory
+ * reusable, so an arena is only for objects that live about as long as it does. Every
+ * object created in an arena retains the allocator, so the chunks are freed once
+ * DTArenaDestroy has run and the last of those objects has been released.
+ */
+
+typedef struct {
+    uint64_t allocations;
+    uint64_t requestedBytes;        /* Sum of all allocation sizes.                    */
+    uint64_t liveBytes;             /* Allocated and not yet deallocated.              */
+    uint64_t arenaBytes;            /* Chunk memory held.                              */
+    uint64_t peakBytes;             /* Largest arenaBytes.                             */
+} DTArenaStatistics;
+
+CFAllocatorRef DTArenaCreate(void);
+
+/*
+ * Releases the creator's reference: the memory is freed now, or when the last object
+ * still living in the arena is released.
+ */
+void DTArenaDestroy(CFAllocatorRef arena);
+
+void DTArenaGetStatistics(CFAllocatorRef arena, DTArenaStatistics *statistics);
+
+/*
+ * Over all arenas of the process: allocations and requestedBytes since launch,
+ * liveBytes and arenaBytes of the arenas not yet freed, and the peak of that.
+ * arenas receives the number of arenas not yet freed.
+ */
+void DTArenaGetProcessStatistics(DTArenaStatistics *statistics, uint32_t *arenas);
+
+#endif
@@ -0,0 +1,959 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
+#include "deltasync.h"
+#include "wirecodec.h"
+#include "workpool.h"
+
+/*
+ * Blocks are kBlockSize bytes, doubled for files that would need more than
+ * kMaximumBlocks of them. Missing blocks are requested in runs of at most
+ * kMaximumRange bytes, kPipelineDepth requests ahead of the responses.
+ */
+#define kBlockSize      (16 * 1024)
+#define kMaximumBlocks  (1u << 20)
+#define kMaximumRange   (8u << 20)
+#define kPipelineDepth  32
+#define kBlockRecord    12
+
+/*
+ * Hash lists of at most kMaximumCachedFiles files are kept, most recently used first.
+ * Further clients wait in the listen backlog while kMaximumConnections are served.
+ */
+#define kMaximumCachedFiles 1024
+#define kMaximumConnections 32
+
+enum {
+    kSyncList   = 1,
+    kSyncHashes = 2,
+    kSyncRange  = 3,
+};
+
+static const char kMagic[8] = "DTSYNC1";
+
+typedef struct {
+    uint32_t weak;
+    uint64_t strong;
+} sync_block_t;
+
+typedef struct {
+    char *path;                     /* Relative to the synced directory.               */
+    uint64_t size;
+    time_t mtime;
+} sync_file_t;
+
+typedef struct {
+    sync_file_t *files;
+    uint32_t count;
+    uint32_t capacity;
+} sync_list_t;
+
+static double monotonicTime(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+ * rsync's rolling checksum: a is the byte sum, b the sum of the running a values, both
+ * mod 2^16.
+ */
+static uint32_t weakChecksum(const uint8_t *data, size_t length) {
+    uint32_t a = 0, b = 0;
+    for (size_t i = 0; i < length; i++) {
+        a += data[i];
+        b += (uint32_t)(length - i) * data[i];
+    }
+    return (a & 0xffff) | (b << 16);
+}
+
+/*
+ * 64-bit multiply-xorshift hash. Not cryptographic: it only has to tell blocks apart
+ * once the weak checksum matched, between hosts that trust each other.
+ */
+static uint64_t strongHash(const uint8_t *data, size_t length) {
+    uint64_t hash = 0x9e3779b97f4a7c15ull ^ length;
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        word *= 0xbf58476d1ce4e5b9ull;
+        word ^= word >> 31;
+        hash = (hash ^ word) * 0x94d049bb133111ebull;
+        hash = (hash << 27) | (hash >> 37);
+    }
+    uint64_t tail = 0;
+    for (size_t shift = 0; i < length; i++, shift += 8) tail |= (uint64_t)data[i] << shift;
+    hash = (hash ^ (tail * 0xbf58476d1ce4e5b9ull)) * 0x94d049bb133111ebull;
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+static uint32_t blockSizeFor(uint64_t size) {
+    uint32_t blockSize = kBlockSize;
+    while ((size + blockSize - 1) / blockSize > kMaximumBlocks) blockSize *= 2;
+    return blockSize;
+}
+
+static uint32_t blockLength(uint64_t size, uint32_t blockSize, uint32_t block) {
+    uint64_t remaining = size - (uint64_t)block * blockSize;
+    return remaining < blockSize ? (uint32_t)remaining : blockSize;
+}
+
+static bool hasSuffix(const char *name, const char *suffix) {
+    size_t length = strlen(name), suffixLength = strlen(suffix);
+    return length >= suffixLength && !strcmp(name + length - suffixLength, suffix);
+}
+
+static void listAppend(sync_list_t *list, const char *path, const struct stat *info) {
+    if (list->count == list->capacity) {
+        uint32_t capacity = list->capacity ? list->capacity * 2 : 64;
+        sync_file_t *files = realloc(list->files, capacity * sizeof(sync_file_t));
+        if (!files) return;
+        list->files = files;
+        list->capacity = capacity;
+    }
+    char *copy = strdup(path);
+    if (!copy) return;
+    list->files[list->count++] = (sync_file_t){copy, (uint64_t)info->st_size, info->st_mtime};
+}
+
+/*
+ * Regular files below root/relative, without transfers in progress.
+ */
+static void listDirectory(const char *root, const char *relative, sync_list_t *list) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s%s%s", root, relative[0] ? "/" : "", relative);
+    DIR *directory = opendir(path);
+    if (!directory) return;
+    struct dirent *entry;
+    while ((entry = readdir(directory))) {
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) continue;
+        if (hasSuffix(entry->d_name, ".sync") || hasSuffix(entry->d_name, ".partial")) continue;
+        char child[PATH_MAX], full[PATH_MAX];
+        if (snprintf(child, sizeof(child), "%s%s%s", relative, relative[0] ? "/" : "", entry->d_name) >= (int)sizeof(child) ||
+            snprintf(full, sizeof(full), "%s/%s", root, child) >= (int)sizeof(full))
+            continue;
+        struct stat info;
+        if (lstat(full, &info) != 0) continue;
+        if (S_ISDIR(info.st_mode)) listDirectory(root, child, list);
+        else if (S_ISREG(info.st_mode)) listAppend(list, child, &info);
+    }
+    closedir(directory);
+}
+
+static void listFree(sync_list_t *list) {
+    for (uint32_t i = 0; i < list->count; i++) free(list->files[i].path);
+    free(list->files);
+    memset(list, 0, sizeof(sync_list_t));
+}
+
+static const char *baseName(const char *path) {
+    const char *slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+static void makeParents(const char *path) {
+    char buffer[PATH_MAX];
+    snprintf(buffer, sizeof(buffer), "%s", path);
+    for (char *slash = strchr(buffer + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdir(buffer, 0755);
+        *slash = '/';
+    }
+}
+
+static bool writeAll(int fd, const void *data, size_t length) {
+    const uint8_t *bytes = data;
+    while (length) {
+        ssize_t written = send(fd, bytes, length, 0);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return false;
+        bytes += written;
+        length -= written;
+    }
+    return true;
+}
+
+static bool readAll(int fd, void *data, size_t length) {
+    uint8_t *bytes = data;
+    while (length) {
+        ssize_t received = recv(fd, bytes, length, MSG_WAITALL);
+        if (received < 0 && errno == EINTR) continue;
+        if (received <= 0) return false;
+        bytes += received;
+        length -= received;
+    }
+    return true;
+}
+
+static bool readValue32(int fd, uint32_t *value) {
+    uint8_t bytes[4];
+    if (!readAll(fd, bytes, sizeof(bytes))) return false;
+    *value = DTWireLoad32(bytes);
+    return true;
+}
+
+static bool readValue64(int fd, uint64_t *value) {
+    uint8_t bytes[8];
+    if (!readAll(fd, bytes, sizeof(bytes))) return false;
+    *value = DTWireLoad64(bytes);
+    return true;
+}
+
+/*
+ * Growable response or request buffer.
+ */
+typedef struct {
+    uint8_t *data;
+    size_t length;
+    size_t capacity;
+} sync_buffer_t;
+
+static bool bufferReserve(sync_buffer_t *buffer, size_t length) {
+    if (buffer->length + length <= buffer->capacity) return true;
+    size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+    while (capacity < buffer->length + length) capacity *= 2;
+    uint8_t *data = realloc(buffer->data, capacity);
+    if (!data) return false;
+    buffer->data = data;
+    buffer->capacity = capacity;
+    return true;
+}
+
+static void bufferAppend32(sync_buffer_t *buffer, uint32_t value) {
+    if (!bufferReserve(buffer, 4)) return;
+    DTWireStore32(buffer->data + buffer->length, value);
+    buffer->length += 4;
+}
+
+static void bufferAppend64(sync_buffer_t *buffer, uint64_t value) {
+    if (!bufferReserve(buffer, 8)) return;
+    DTWireStore64(buffer->data + buffer->length, value);
+    buffer->length += 8;
+}
+
+static void bufferAppendBytes(sync_buffer_t *buffer, const void *data, size_t length) {
+    if (!bufferReserve(buffer, length)) return;
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+}
+
+/*
+ * Zero-copy file range to a socket.
+ */
+static bool sendRange(int socket, int file, uint64_t offset, uint64_t length) {
+    while (length) {
+#if defined(__linux__)
+        off_t position = (off_t)offset;
+        ssize_t sent = sendfile(socket, file, &position, length);
+        if (sent < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+        if (sent <= 0) return false;
+#else
+        /*
+         * sendfile() sets sent even when it fails; 0 bytes without an error is EOF.
+         */
+        off_t sent = (off_t)length;
+        errno = 0;
+        int status = sendfile(file, socket, (off_t)offset, &sent, NULL, 0);
+        if (status != 0 && errno != EINTR && errno != EAGAIN) return false;
+        if (sent == 0 && (status == 0 || (errno != EINTR && errno != EAGAIN))) return false;
+#endif
+        offset += sent;
+        length -= sent;
+    }
+    return true;
+}
+
+typedef struct sync_hashes {
+    char *path;
+    uint64_t size;
+    time_t mtime;
+    uint32_t blockSize;
+    uint32_t count;
+    sync_block_t *blocks;
+    struct sync_hashes *next;
+} sync_hashes_t;
+
+static const char     *server_directory = NULL;
+static int             listen_socket    = -1;
+static pthread_t       acceptor;
+static uint32_t        hash_threads     = 1;
+static sync_hashes_t  *hash_cache       = NULL;
+static pthread_mutex_t hash_lock        = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t        connection_count = 0;
+static pthread_mutex_t connection_lock  = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  connection_done  = PTHREAD_COND_INITIALIZER;
+
+typedef struct {
+    const uint8_t *data;
+    uint64_t size;
+    uint32_t blockSize;
+    sync_block_t *blocks;
+} hash_job_t;
+
+static void hashBlock(void *context, size_t index) {
+    hash_job_t *job = context;
+    const uint8_t *block = job->data + (uint64_t)index * job->blockSize;
+    uint32_t length = blockLength(job->size, job->blockSize, (uint32_t)index);
+    job->blocks[index].weak = weakChecksum(block, length);
+    job->blocks[index].strong = strongHash(block, length);
+}
+
+static void freeHashes(sync_hashes_t *hashes) {
+    free(hashes->path);
+    free(hashes->blocks);
+    free(hashes);
+}
+
+static sync_hashes_t *computeHashes(const char *relative, const struct stat *info) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", server_directory, relative);
+    sync_hashes_t *hashes = calloc(1, sizeof(sync_hashes_t));
+    if (!hashes || !(hashes->path = strdup(relative))) {
+        free(hashes);
+        return NULL;
+    }
+    hashes->size = info->st_size;
+    hashes->mtime = info->st_mtime;
+    hashes->blockSize = blockSizeFor(hashes->size);
+    hashes->count = (uint32_t)((hashes->size + hashes->blockSize - 1) / hashes->blockSize);
+    if (!hashes->count) return hashes;
+
+    hashes->blocks = malloc(hashes->count * sizeof(sync_block_t));
+    int file = open(path, O_RDONLY);
+    void *map = file >= 0 ? mmap(NULL, hashes->size, PROT_READ, MAP_PRIVATE, file, 0) : MAP_FAILED;
+    if (file >= 0) close(file);
+    if (!hashes->blocks || map == MAP_FAILED) {
+        freeHashes(hashes);
+        return NULL;
+    }
+    hash_job_t job = {map, hashes->size, hashes->blockSize, hashes->blocks};
+    DTWorkPoolApply(hashes->count, hash_threads, hashBlock, &job);
+    munmap(map, hashes->size);
+    return hashes;
+}
+
+/*
+ * Drops the lists of 'relative', of files that are gone or changed and all but the
+ * first 'limit' of the others. Called with hash_lock held.
+ */
+static void pruneHashes(const char *relative, uint32_t limit) {
+    uint32_t kept = 0;
+    for (sync_hashes_t **link = &hash_cache; *link;) {
+        sync_hashes_t *hashes = *link;
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", server_directory, hashes->path);
+        struct stat info;
+        bool current = kept < limit && strcmp(hashes->path, relative) && stat(path, &info) == 0 && S_ISREG(info.st_mode) &&
+                       hashes->size == (uint64_t)info.st_size && hashes->mtime == info.st_mtime;
+        if (current) {
+            kept++;
+            link = &hashes->next;
+        } else {
+            *link = hashes->next;
+            freeHashes(hashes);
+        }
+    }
+}
+
+/*
+ * Appends the HASHES response for a file, computing its hash list unless the cached
+ * one is still current.
+ */
+static void appendHashes(sync_buffer_t *response, const char *relative) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", server_directory, relative);
+    struct stat info;
+    if (stat(path, &info) != 0 || !S_ISREG(info.st_mode)) {
+        bufferAppend64(response, 0);
+        bufferAppend32(response, kBlockSize);
+        bufferAppend32(response, 0);
+        return;
+    }
+
+    pthread_mutex_lock(&hash_lock);
+    sync_hashes_t **link = &hash_cache;
+    while (*link && !(!strcmp((*link)->path, relative) && (*link)->size == (uint64_t)info.st_size && (*link)->mtime == info.st_mtime))
+        link = &(*link)->next;
+    sync_hashes_t *hashes = *link;
+    if (hashes && link != &hash_cache) {
+        *link = hashes->next;
+        hashes->next = hash_cache;
+        hash_cache = hashes;
+    }
+    if (!hashes) {
+        pthread_mutex_unlock(&hash_lock);
+        sync_hashes_t *computed = computeHashes(relative, &info);
+        pthread_mutex_lock(&hash_lock);
+        if (computed) {
+            pruneHashes(relative, kMaximumCachedFiles - 1);
+            computed->next = hash_cache;
+            hash_cache = computed;
+        }
+        hashes = computed;
+    }
+    if (hashes) {
+        bufferAppend64(response, hashes->size);
+        bufferAppend32(response, hashes->blockSize);
+        bufferAppend32(response, hashes->count);
+        if (bufferReserve(response, (size_t)hashes->count * kBlockRecord)) {
+            for (uint32_t i = 0; i < hashes->count; i++) {
+                DTWireStore32(response->data + response->length, hashes->blocks[i].weak);
+                DTWireStore64(response->data + response->length + 4, hashes->blocks[i].strong);
+                response->length += kBlockRecord;
+            }
+        }
+    } else {
+        bufferAppend64(response, 0);
+        bufferAppend32(response, kBlockSize);
+        bufferAppend32(response, 0);
+    }
+    pthread_mutex_unlock(&hash_lock);
+}
+
+static void *syncConnection(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    sync_list_t list = {0};
+    sync_buffer_t response = {0};
+    int file = -1;
+    uint32_t fileIndex = UINT32_MAX;
+    char magic[sizeof(kMagic)];
+    bool alive = readAll(fd, magic, sizeof(magic)) && !memcmp(magic, kMagic, sizeof(kMagic)) && writeAll(fd, kMagic, sizeof(kMagic));
+
+    while (alive) {
+        uint32_t command, index;
+        if (!readValue32(fd, &command)) break;
+        response.length = 0;
+        switch (command) {
+            case kSyncList:
+                listFree(&list);
+                listDirectory(server_directory, "", &list);
+                bufferAppend32(&response, list.count);
+                for (uint32_t i = 0; i < list.count; i++) {
+                    uint32_t length = (uint32_t)strlen(list.files[i].path);
+                    bufferAppend32(&response, length);
+                    bufferAppendBytes(&response, list.files[i].path, length);
+                    bufferAppend64(&response, list.files[i].size);
+                }
+                alive = writeAll(fd, response.data, response.length);
+                break;
+
+            case kSyncHashes:
+                if (!readValue32(fd, &index)) {
+                    alive = false;
+                    break;
+                }
+                if (index < list.count) appendHashes(&response, list.files[index].path);
+                else {
+                    bufferAppend64(&response, 0);
+                    bufferAppend32(&response, kBlockSize);
+                    bufferAppend32(&response, 0);
+                }
+                alive = writeAll(fd, response.data, response.length);
+                break;
+
+            case kSyncRange: {
+                uint64_t offset, length;
+                if (!readValue32(fd, &index) || !readValue64(fd, &offset) || !readValue64(fd, &length)) {
+                    alive = false;
+                    break;
+                }
+                if (index != fileIndex) {
+                    if (file >= 0) close(file);
+                    file = -1;
+                    fileIndex = index;
+                    if (index < list.count) {
+                        char path[PATH_MAX];
+                        snprintf(path, sizeof(path), "%s/%s", server_directory, list.files[index].path);
+                        file = open(path, O_RDONLY);
+                    }
+                }
+                struct stat info;
+                bool valid = file >= 0 && fstat(file, &info) == 0 && offset <= (uint64_t)info.st_size && length <= (uint64_t)info.st_size - offset;
+                bufferAppend64(&response, valid ? length : 0);
+                alive = writeAll(fd, response.data, response.length) && (!valid || sendRange(fd, file, offset, length));
+                break;
+            }
+
+            default:
+                alive = false;
+                break;
+        }
+    }
+    if (file >= 0) close(file);
+    listFree(&list);
+    free(response.data);
+    close(fd);
+
+    pthread_mutex_lock(&connection_lock);
+    connection_count--;
+    pthread_cond_signal(&connection_done);
+    pthread_mutex_unlock(&connection_lock);
+    return NULL;
+}
+
+static void *syncAcceptor(void *arg) {
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&connection_lock);
+        while (connection_count >= kMaximumConnections)
+            pthread_cond_wait(&connection_done, &connection_lock);
+        pthread_mutex_unlock(&connection_lock);
+
+        int fd = accept(listen_socket, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break;
+        }
+        pthread_mutex_lock(&connection_lock);
+        connection_count++;
+        pthread_mutex_unlock(&connection_lock);
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, syncConnection, (void *)(intptr_t)fd) == 0) {
+            pthread_detach(thread);
+            continue;
+        }
+        close(fd);
+        pthread_mutex_lock(&connection_lock);
+        connection_count--;
+        pthread_mutex_unlock(&connection_lock);
+    }
+    return NULL;
+}
+
+bool DTSyncServerStart(const char *directory, uint16_t port, uint32_t threads) {
+    signal(SIGPIPE, SIG_IGN);
+    server_directory = directory;
+    hash_threads = threads ? threads : 1;
+
+    listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_socket < 0) return false;
+    int enable = 1;
+    setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+
+    struct sockaddr_in address = {0};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(listen_socket, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(listen_socket, 16) != 0) {
+        close(listen_socket);
+        listen_socket = -1;
+        return false;
+    }
+    if (pthread_create(&acceptor, NULL, syncAcceptor, NULL) != 0) {
+        close(listen_socket);
+        listen_socket = -1;
+        return false;
+    }
+    return true;
+}
+
+void DTSyncServerWait(void) {
+    if (listen_socket >= 0) pthread_join(acceptor, NULL);
+}
+
+static int connectAddress(const char *host, uint16_t port) {
+    struct addrinfo hints, *addresses = NULL;
+    char service[8];
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%u", port);
+    if (getaddrinfo(host, service, &hints, &addresses) != 0) return -1;
+
+    int fd = -1;
+    for (struct addrinfo *address = addresses; address && fd < 0; address = address->ai_next) {
+        fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+        if (fd >= 0 && connect(fd, address->ai_addr, address->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+    if (fd >= 0) {
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+#ifdef SO_NOSIGPIPE
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+    }
+    return fd;
+}
+
+/*
+ * Remote paths become local ones; anything that could leave the directory is refused.
+ */
+static bool isSafePath(const char *path) {
+    if (!path[0] || path[0] == '/') return false;
+    for (const char *component = path; *component;) {
+        size_t length = strcspn(component, "/");
+        if (length == 0 || (length == 1 && component[0] == '.') || (length == 2 && !strncmp(component, "..", 2))) return false;
+        component += length;
+        if (*component == '/') component++;
+    }
+    return true;
+}
+
+/*
+ * The file at the same path, otherwise the newest one with the same name.
+ */
+static const sync_file_t *findBasis(const sync_list_t *local, const char *path) {
+    const sync_file_t *basis = NULL;
+    for (uint32_t i = 0; i < local->count; i++) {
+        if (!strcmp(local->files[i].path, path)) return &local->files[i];
+        if (!strcmp(baseName(local->files[i].path), baseName(path)) && (!basis || local->files[i].mtime > basis->mtime))
+            basis = &local->files[i];
+    }
+    return basis;
+}
+
+typedef struct {
+    int fd;
+    const char *directory;
+    const sync_list_t *local;
+    DTSyncResult *result;
+} sync_client_t;
+
+typedef enum {
+    kSyncFileChanged,
+    kSyncFileUnchanged,
+    kSyncFileFailed,
+    kSyncConnectionLost,
+} sync_file_result_t;
+
+static bool requestHashes(sync_client_t *client, uint32_t index, uint64_t *size, uint32_t *blockSize, sync_block_t **blocks, uint32_t *count) {
+    uint8_t request[8];
+    DTWireStore32(request, kSyncHashes);
+    DTWireStore32(request + 4, index);
+    if (!writeAll(client->fd, request, sizeof(request))) return false;
+    if (!readValue64(client->fd, size) || !readValue32(client->fd, blockSize) || !readValue32(client->fd, count)) return false;
+    client->result->hashBytes += 16 + (uint64_t)*count * kBlockRecord;
+    if (*count > kMaximumBlocks || *blockSize == 0 || (uint64_t)*count != (*size + *blockSize - 1) / *blockSize) return false;
+
+    *blocks = malloc((*count ? *count : 1) * sizeof(sync_block_t));
+    uint8_t *records = malloc((*count ? *count : 1) * kBlockRecord);
+    bool ok = *blocks && records && readAll(client->fd, records, (size_t)*count * kBlockRecord);
+    for (uint32_t i = 0; ok && i < *count; i++) {
+        (*blocks)[i].weak = DTWireLoad32(records + i * kBlockRecord);
+        (*blocks)[i].strong = DTWireLoad64(records + i * kBlockRecord + 4);
+    }
+    free(records);
+    return ok;
+}
+
+static bool blockMatches(const uint8_t *data, uint32_t length, const sync_block_t *block) {
+    return weakChecksum(data, length) == block->weak && strongHash(data, length) == block->strong;
+}
+
+/*
+ * Finds remote blocks in the basis: first at their own offset, then anywhere by
+ * rolling the weak checksum over the basis. found[i] receives the basis offset of
+ * block i or -1. Returns the number of blocks found.
+ */
+static uint32_t matchBlocks(const uint8_t *basis, uint64_t basisSize, uint64_t size, uint32_t blockSize, const sync_block_t *blocks, uint32_t count, int64_t *found) {
+    uint32_t matched = 0, full = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t offset = (uint64_t)i * blockSize;
+        uint32_t length = blockLength(size, blockSize, i);
+        found[i] = -1;
+        if (offset + length <= basisSize && blockMatches(basis + offset, length, &blocks[i]))
+            found[i] = offset;
+        else if (length < blockSize && length <= basisSize && blockMatches(basis + basisSize - length, length, &blocks[i]))
+            found[i] = basisSize - length;
+        if (found[i] >= 0) matched++;
+        else if (length == blockSize) full++;
+    }
+    if (!full || basisSize < blockSize) return matched;
+
+    uint32_t buckets = 1;
+    while (buckets < 2 * full) buckets <<= 1;
+    int32_t *heads = malloc(buckets * sizeof(int32_t));
+    int32_t *next = malloc(count * sizeof(int32_t));
+    if (!heads || !next) {
+        free(heads);
+        free(next);
+        return matched;
+    }
+    memset(heads, 0xff, buckets * sizeof(int32_t));
+    for (uint32_t i = 0; i < count; i++) {
+        if (found[i] >= 0 || blockLength(size, blockSize, i) != blockSize) continue;
+        uint32_t bucket = (blocks[i].weak * 0x9e3779b1u) & (buckets - 1);
+        next[i] = heads[bucket];
+        heads[bucket] = (int32_t)i;
+    }
+
+    uint64_t position = 0;
+    uint32_t a = 0, b = 0;
+    bool fresh = true;
+    while (position + blockSize <= basisSize && full) {
+        if (fresh) {
+            uint32_t weak = weakChecksum(basis + position, blockSize);
+            a = weak & 0xffff;
+            b = weak >> 16;
+            fresh = false;
+        }
+        uint32_t weak = (a & 0xffff) | (b << 16);
+        bool hit = false;
+        uint64_t strong = 0;
+        bool hashed = false;
+        for (int32_t j = heads[(weak * 0x9e3779b1u) & (buckets - 1)]; j >= 0; j = next[j]) {
+            if (found[j] >= 0 || blocks[j].weak != weak) continue;
+            if (!hashed) {
+                strong = strongHash(basis + position, blockSize);
+                hashed = true;
+            }
+            if (blocks[j].strong != strong) continue;
+            /*
+             * Every block with this content, e.g. all the zero-filled ones.
+             */
+            found[j] = position;
+            matched++;
+            full--;
+            hit = true;
+        }
+        if (hit) {
+            position += blockSize;
+            fresh = true;
+        } else {
+            if (position + blockSize >= basisSize) break;
+            uint8_t out = basis[position], in = basis[position + blockSize];
+            a = (a - out + in) & 0xffff;
+            b = (b - blockSize * out + a) & 0xffff;
+            position++;
+        }
+    }
+    free(heads);
+    free(next);
+    return matched;
+}
+
+/*
+ * Requests the missing runs of blocks, kPipelineDepth ahead, and receives them into map.
+ */
+static bool receiveMissing(sync_client_t *client, uint32_t index, uint8_t *map, uint64_t size, uint32_t blockSize, uint32_t count, const int64_t *found) {
+    typedef struct { uint64_t offset, length; } range_t;
+    range_t *ranges = malloc((count ? count : 1) * sizeof(range_t));
+    if (!ranges) return false;
+    uint32_t rangeCount = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (found[i] >= 0) continue;
+        uint64_t offset = (uint64_t)i * blockSize;
+        uint32_t length = blockLength(size, blockSize, i);
+        range_t *last = rangeCount ? &ranges[rangeCount - 1] : NULL;
+        if (last && last->offset + last->length == offset && last->length + length <= kMaximumRange)
+            last->length += length;
+        else
+            ranges[rangeCount++] = (range_t){offset, length};
+    }
+
+    bool ok = true;
+    uint32_t sent = 0;
+    for (uint32_t received = 0; ok && received < rangeCount; received++) {
+        while (ok && sent < rangeCount && sent - received < kPipelineDepth) {
+            uint8_t request[24];
+            DTWireStore32(request, kSyncRange);
+            DTWireStore32(request + 4, index);
+            DTWireStore64(request + 8, ranges[sent].offset);
+            DTWireStore64(request + 16, ranges[sent].length);
+            ok = writeAll(client->fd, request, sizeof(request));
+            sent++;
+        }
+        uint64_t length;
+        ok = ok && readValue64(client->fd, &length) && length == ranges[received].length &&
+             readAll(client->fd, map + ranges[received].offset, length);
+        if (ok) client->result->transferred += length;
+    }
+    free(ranges);
+    return ok;
+}
+
+static sync_file_result_t syncFile(sync_client_t *client, uint32_t index, const char *relative) {
+    uint64_t size;
+    uint32_t blockSize, count;
+    sync_block_t *blocks = NULL;
+    if (!requestHashes(client, index, &size, &blockSize, &blocks, &count)) {
+        free(blocks);
+        return kSyncConnectionLost;
+    }
+    client->result->bytes += size;
+
+    char target[PATH_MAX], temporary[PATH_MAX];
+    if (snprintf(target, sizeof(target), "%s/%s", client->directory, relative) >= (int)sizeof(target) ||
+        snprintf(temporary, sizeof(temporary), "%s.sync", target) >= (int)sizeof(temporary)) {
+        free(blocks);
+        return kSyncFileFailed;
+    }
+
+    const sync_file_t *basisFile = findBasis(client->local, relative);
+    uint8_t *basis = NULL;
+    uint64_t basisSize = 0;
+    if (basisFile && basisFile->size) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", client->directory, basisFile->path);
+        int file = open(path, O_RDONLY);
+        void *map = file >= 0 ? mmap(NULL, basisFile->size, PROT_READ, MAP_PRIVATE, file, 0) : MAP_FAILED;
+        if (file >= 0) close(file);
+        if (map != MAP_FAILED) {
+            basis = map;
+            basisSize = basisFile->size;
+        }
+    }
+
+    int64_t *found = malloc((count ? count : 1) * sizeof(int64_t));
+    sync_file_result_t status = kSyncFileFailed;
+    uint8_t *map = MAP_FAILED;
+    int file = -1;
+    if (!found) goto done;
+    uint32_t matched = basis ? matchBlocks(basis, basisSize, size, blockSize, blocks, count, found) : 0;
+    if (!basis) memset(found, 0xff, (count ? count : 1) * sizeof(int64_t));
+
+    bool inPlace = basisFile && !strcmp(basisFile->path, relative) && basisSize == size;
+    for (uint32_t i = 0; inPlace && i < count; i++)
+        if (found[i] != (int64_t)i * blockSize) inPlace = false;
+    if (inPlace || (basisFile && !strcmp(basisFile->path, relative) && size == 0 && basisFile->size == 0)) {
+        client->result->reused += size;
+        status = kSyncFileUnchanged;
+        goto done;
+    }
+
+    makeParents(temporary);
+    file = open(temporary, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (file < 0 || ftruncate(file, size) != 0) goto done;
+    if (size) {
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+        if (map == MAP_FAILED) goto done;
+        for (uint32_t i = 0; i < count; i++) {
+            if (found[i] < 0) continue;
+            uint32_t length = blockLength(size, blockSize, i);
+            memcpy(map + (uint64_t)i * blockSize, basis + found[i], length);
+            client->result->reused += length;
+        }
+        if (matched < count) {
+            if (!receiveMissing(client, index, map, size, blockSize, count, found)) {
+                status = kSyncConnectionLost;
+                goto done;
+            }
+            /*
+             * The file may have changed on the server since its hash list was made.
+             */
+            for (uint32_t i = 0; i < count; i++)
+                if (found[i] < 0 && !blockMatches(map + (uint64_t)i * blockSize, blockLength(size, blockSize, i), &blocks[i])) goto done;
+        }
+    }
+    if (map != MAP_FAILED) munmap(map, size);
+    map = MAP_FAILED;
+    close(file);
+    file = -1;
+    if (rename(temporary, target) == 0) status = kSyncFileChanged;
+
+done:
+    if (map != MAP_FAILED) munmap(map, size);
+    if (file >= 0) close(file);
+    if (status == kSyncFileFailed || status == kSyncConnectionLost) unlink(temporary);
+    if (basis) munmap(basis, basisSize);
+    free(found);
+    free(blocks);
+    return status;
+}
+
+bool DTSyncPull(const char *host, uint16_t port, const char *directory, DTSyncResult *result) {
+    memset(result, 0, sizeof(DTSyncResult));
+    double start = monotonicTime();
+    int fd = connectAddress(host, port);
+    if (fd < 0) return false;
+
+    char magic[sizeof(kMagic)];
+    uint8_t command[4];
+    DTWireStore32(command, kSyncList);
+    uint32_t count;
+    if (!writeAll(fd, kMagic, sizeof(kMagic)) || !readAll(fd, magic, sizeof(magic)) || memcmp(magic, kMagic, sizeof(kMagic)) ||
+        !writeAll(fd, command, sizeof(command)) || !readValue32(fd, &count)) {
+        close(fd);
+        return false;
+    }
+    sync_list_t remote = {0};
+    bool connected = true;
+    for (uint32_t i = 0; i < count && connected; i++) {
+        uint32_t length;
+        uint64_t size;
+        char path[PATH_MAX];
+        connected = readValue32(fd, &length) && length < sizeof(path) && readAll(fd, path, length);
+        if (connected) path[length] = '\0';
+        connected = connected && readValue64(fd, &size);
+        if (connected) listAppend(&remote, path, &(struct stat){.st_size = (off_t)size});
+    }
+    if (!connected || remote.count != count) {
+        listFree(&remote);
+        close(fd);
+        return false;
+    }
+
+    mkdir(directory, 0755);
+    sync_list_t local = {0};
+    listDirectory(directory, "", &local);
+    sync_client_t client = {fd, directory, &local, result};
+    result->files = count;
+
+    /*
+     * .complete markers go last, so a build only looks stored once all of it is.
+     */
+    for (uint32_t pass = 0; pass < 2 && connected; pass++) {
+        for (uint32_t i = 0; i < count && connected; i++) {
+            const char *path = remote.files[i].path;
+            bool marker = !strcmp(baseName(path), ".complete");
+            if (marker != (pass == 1)) continue;
+            if (marker && result->failed) {
+                result->failed++;
+                continue;
+            }
+            if (!isSafePath(path)) {
+                result->failed++;
+                continue;
+            }
+            switch (syncFile(&client, i, path)) {
+                case kSyncFileChanged:
+                    break;
+                case kSyncFileUnchanged:
+                    result->unchanged++;
+                    break;
+                case kSyncFileFailed:
+                    result->failed++;
+                    break;
+                case kSyncConnectionLost:
+                    result->failed++;
+                    connected = false;
+                    break;
+            }
+        }
+    }
+    listFree(&local);
+    listFree(&remote);
+    close(fd);
+    result->seconds = monotonicTime() - start;
+    return true;
+}
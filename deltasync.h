@@ -0,0 +1,64 @@
+#ifndef DELTASYNC_H
+#define DELTASYNC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Delta sync of download directories (e.g. daemon stores) between hosts.
+ *
+ * The serving host publishes every regular file below its directory together with a
+ * block hash list: fixed-size blocks, each with an rsync-style rolling checksum and a
+ * 64-bit hash. The pulling host looks for every block in a local basis file (the file
+ * at the same path, otherwise the newest file with the same name, such as the same
+ * cache of a previous build) at any offset, copies what it finds and requests only
+ * the missing ranges. Requests are pipelined on one TCP stream; the server answers
+ * them with sendfile().
+ *
+ * The protocol is big endian (wirecodec.h). The client opens with "DTSYNC1\0" and the
+ * server echoes it; then, in any number:
+ *
+ *   LIST   uint32_t 1                       -> uint32_t count,
+ *                                              count x {uint32_t length, path, uint64_t size}
+ *   HASHES uint32_t 2, uint32_t file        -> uint64_t size, uint32_t blockSize, uint32_t blocks,
+ *                                              blocks x {uint32_t weak, uint64_t strong}
+ *   RANGE  uint32_t 3, uint32_t file,       -> uint64_t length, bytes
+ *          uint64_t offset, uint64_t length
+ *
+ * file indexes the last LIST. A failed HASHES answers size 0 and no blocks, a failed
+ * RANGE length 0. Responses come in request order.
+ */
+
+typedef struct {
+    uint32_t files;
+    uint32_t unchanged;             /* Already identical, not rewritten.               */
+    uint32_t failed;
+    uint64_t bytes;                 /* Total size of the remote files.                 */
+    uint64_t reused;                /* Copied from local basis files.                  */
+    uint64_t transferred;           /* File data received.                             */
+    uint64_t hashBytes;             /* Block hash lists received.                      */
+    double   seconds;
+} DTSyncResult;
+
+/*
+ * Serves directory on port, one thread per connection for up to 32 connections; more
+ * clients wait until one closes. Hash lists are computed on 'threads' threads and kept
+ * until the file changes or goes away, for at most the 1024 most recently requested
+ * files. Returns false if the port can not be bound or the server thread not started.
+ */
+bool DTSyncServerStart(const char *directory, uint16_t port, uint32_t threads);
+
+/*
+ * Blocks until the server stops accepting connections.
+ */
+void DTSyncServerWait(void);
+
+/*
+ * Brings directory up to date with the server at host:port. Files are written to
+ * <file>.sync and renamed into place, .complete markers last and only if everything
+ * else succeeded. Local files the server doesn't have are left alone. Returns false if
+ * the server can't be reached.
+ */
+bool DTSyncPull(const char *host, uint16_t port, const char *directory, DTSyncResult *result);
+
+#endif
@@ -0,0 +1,308 @@
+#define FUSE_USE_VERSION 26
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <fuse.h>
+#include "devicefs.h"
+
+typedef enum {
+    kFSIdle = 0,
+    kFSFetching,
+    kFSDone,
+    kFSFailed,
+} fs_state_t;
+
+typedef struct {
+    int index;
+    char path[PATH_MAX];            /* Device path, always starting with '/'.          */
+    char local[PATH_MAX];           /* Cache file once complete.                       */
+    char partial[PATH_MAX];         /* Download destination.                           */
+    uint64_t size;
+    fs_state_t state;
+    uint64_t available;             /* Bytes received from the start of the file.      */
+    int fd;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} fs_file_t;
+
+typedef struct {
+    DTSessionRef session;
+    fs_file_t *files;
+    uint32_t count;
+    time_t mounted;
+} fs_t;
+
+static fs_t *fsContext(void) {
+    return fuse_get_context()->private_data;
+}
+
+static fs_file_t *fsFind(fs_t *fs, const char *path) {
+    for (uint32_t i = 0; i < fs->count; i++)
+        if (!strcmp(fs->files[i].path, path)) return &fs->files[i];
+    return NULL;
+}
+
+/*
+ * Directories aren't listed by the device; a path is one if some file lies below it.
+ * Returns the length of the prefix children start after, or -1.
+ */
+static int fsDirectoryPrefix(fs_t *fs, const char *path) {
+    if (!strcmp(path, "/")) return 1;
+    size_t length = strlen(path);
+    for (uint32_t i = 0; i < fs->count; i++)
+        if (!strncmp(fs->files[i].path, path, length) && fs->files[i].path[length] == '/') return (int)length + 1;
+    return -1;
+}
+
+static void makeParents(const char *path) {
+    char buffer[PATH_MAX];
+    snprintf(buffer, sizeof(buffer), "%s", path);
+    for (char *slash = strchr(buffer + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdir(buffer, 0755);
+        *slash = '/';
+    }
+}
+
+static void fsProgress(void *context, int index, uint64_t received, uint64_t size) {
+    fs_file_t *file = context;
+    pthread_mutex_lock(&file->lock);
+    /*
+     * A retry receives the file again from its start into the same mapping; the bytes
+     * already there are the same, so readers don't have to wait for them twice.
+     */
+    if (received > file->available) {
+        file->available = received;
+        pthread_cond_broadcast(&file->changed);
+    }
+    pthread_mutex_unlock(&file->lock);
+}
+
+static void fsCompletion(void *context, int index, const char *path, DTError error) {
+    fs_file_t *file = context;
+    if (error == kDTErrorNone && rename(file->partial, file->local) != 0) error = kDTErrorFile;
+    if (error == kDTErrorNone)
+        printf("[+] Cached %s.\n", file->path);
+    else if (error != kDTErrorCancelled)
+        printf("[-] %s: %s\n", file->path, DTErrorDescription(error));
+
+    pthread_mutex_lock(&file->lock);
+    if (error == kDTErrorNone) {
+        file->state = kFSDone;
+        file->available = file->size;
+    } else
+        file->state = kFSFailed;
+    pthread_cond_broadcast(&file->changed);
+    pthread_mutex_unlock(&file->lock);
+}
+
+static const DTFetchCallbacks fsCallbacks = {fsProgress, fsCompletion};
+
+static int fsGetattr(const char *path, struct stat *info) {
+    fs_t *fs = fsContext();
+    memset(info, 0, sizeof(struct stat));
+    info->st_uid = getuid();
+    info->st_gid = getgid();
+    info->st_mtime = info->st_ctime = info->st_atime = fs->mounted;
+
+    fs_file_t *file = fsFind(fs, path);
+    if (file) {
+        info->st_mode = S_IFREG | 0444;
+        info->st_nlink = 1;
+        info->st_size = file->size;
+        info->st_blocks = (file->size + 511) / 512;
+        return 0;
+    }
+    if (fsDirectoryPrefix(fs, path) < 0) return -ENOENT;
+    info->st_mode = S_IFDIR | 0555;
+    info->st_nlink = 2;
+    return 0;
+}
+
+static int fsReaddir(const char *path, void *buffer, fuse_fill_dir_t fill, off_t offset, struct fuse_file_info *info) {
+    fs_t *fs = fsContext();
+    int prefix = fsDirectoryPrefix(fs, path);
+    if (prefix < 0) return -ENOENT;
+
+    fill(buffer, ".", NULL, 0);
+    fill(buffer, "..", NULL, 0);
+    for (uint32_t i = 0; i < fs->count; i++) {
+        const char *name = fs->files[i].path + prefix;
+        if (prefix > 1 && strncmp(fs->files[i].path, path, prefix - 1)) continue;
+        if (prefix > 1 && fs->files[i].path[prefix - 1] != '/') continue;
+        size_t length = strcspn(name, "/");
+
+        /*
+         * Several files share each directory entry on the way down.
+         */
+        bool seen = false;
+        for (uint32_t j = 0; j < i && !seen; j++) {
+            const char *other = fs->files[j].path;
+            if ((prefix == 1 || (!strncmp(other, path, prefix - 1) && other[prefix - 1] == '/')) &&
+                !strncmp(other + prefix, name, length) && (other[prefix + length] == '/' || other[prefix + length] == '\0'))
+                seen = true;
+        }
+        if (seen) continue;
+
+        char entry[NAME_MAX + 1];
+        if (length > NAME_MAX) continue;
+        memcpy(entry, name, length);
+        entry[length] = '\0';
+        if (fill(buffer, entry, NULL, 0)) break;
+    }
+    return 0;
+}
+
+static int fsOpen(const char *path, struct fuse_file_info *info) {
+    fs_t *fs = fsContext();
+    fs_file_t *file = fsFind(fs, path);
+    if (!file) return fsDirectoryPrefix(fs, path) < 0 ? -ENOENT : -EISDIR;
+    if ((info->flags & O_ACCMODE) != O_RDONLY) return -EROFS;
+
+    pthread_mutex_lock(&file->lock);
+    if (file->state == kFSIdle || file->state == kFSFailed) {
+        makeParents(file->partial);
+        file->state = kFSFetching;
+        file->available = 0;
+        DTSessionFetchFileAsync(fs->session, file->index, file->partial, &fsCallbacks, file);
+    }
+    pthread_mutex_unlock(&file->lock);
+    info->fh = (uint64_t)(file - fs->files);
+    return 0;
+}
+
+static int fsRead(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *info) {
+    fs_t *fs = fsContext();
+    if (info->fh >= fs->count) return -EBADF;
+    fs_file_t *file = &fs->files[info->fh];
+    if (offset < 0 || (uint64_t)offset >= file->size) return 0;
+    uint64_t end = (uint64_t)offset + size < file->size ? (uint64_t)offset + size : file->size;
+
+    pthread_mutex_lock(&file->lock);
+    while (file->state == kFSFetching && file->available < end)
+        pthread_cond_wait(&file->changed, &file->lock);
+    if (file->available < end) {
+        pthread_mutex_unlock(&file->lock);
+        return -EIO;
+    }
+    /*
+     * The download writes through a shared mapping, so the partial file already holds
+     * the bytes. It keeps its inode when renamed to the cache path, which can happen
+     * between the wait above and the open.
+     */
+    if (file->fd < 0 && file->state != kFSDone) file->fd = open(file->partial, O_RDONLY);
+    if (file->fd < 0) file->fd = open(file->local, O_RDONLY);
+    int fd = file->fd;
+    pthread_mutex_unlock(&file->lock);
+    if (fd < 0) return -EIO;
+
+    ssize_t result = pread(fd, buffer, end - offset, offset);
+    return result < 0 ? -errno : (int)result;
+}
+
+static const struct fuse_operations fsOperations = {
+    .getattr = fsGetattr,
+    .readdir = fsReaddir,
+    .open    = fsOpen,
+    .read    = fsRead,
+};
+
+/*
+ * Builds the file table: device paths, sizes from the size headers, and whatever is
+ * already complete in the cache.
+ */
+static bool fsLoad(fs_t *fs, const char *cacheDirectory, uint32_t probeConnections) {
+    CFArrayRef files = DTSessionCopyFiles(fs->session);
+    if (!files) return false;
+    uint32_t count = (uint32_t)CFArrayGetCount(files);
+    uint64_t *sizes = calloc(count ? count : 1, sizeof(uint64_t));
+    DTError *errors = calloc(count ? count : 1, sizeof(DTError));
+    fs->files = calloc(count ? count : 1, sizeof(fs_file_t));
+    if (!sizes || !errors || !fs->files) {
+        free(sizes);
+        free(errors);
+        CFRelease(files);
+        return false;
+    }
+    DTSessionGetFileSizes(fs->session, count, probeConnections, sizes, errors);
+
+    uint32_t hidden = 0, cached = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        char path[PATH_MAX];
+        if (!CFStringGetCString(CFArrayGetValueAtIndex(files, i), path, sizeof(path), kCFStringEncodingUTF8)) continue;
+        /*
+         * Without a size header the file can't be given a correct size.
+         */
+        if (errors[i] != kDTErrorNone) {
+            printf("[-] Hiding %s: %s\n", path, DTErrorDescription(errors[i]));
+            hidden++;
+            continue;
+        }
+        fs_file_t *file = &fs->files[fs->count];
+        file->index = i;
+        snprintf(file->path, sizeof(file->path), "%s%s", path[0] == '/' ? "" : "/", path);
+        if (fsFind(fs, file->path)) continue;
+        snprintf(file->local, sizeof(file->local), "%s%s", cacheDirectory, file->path);
+        snprintf(file->partial, sizeof(file->partial), "%s.partial", file->local);
+        file->size = sizes[i];
+        file->fd = -1;
+        pthread_mutex_init(&file->lock, NULL);
+        pthread_cond_init(&file->changed, NULL);
+
+        struct stat info;
+        if (stat(file->local, &info) == 0 && S_ISREG(info.st_mode) && (uint64_t)info.st_size == file->size) {
+            file->state = kFSDone;
+            file->available = file->size;
+            cached++;
+        }
+        fs->count++;
+    }
+    if (hidden) printf("[*] %u files, %u already cached, %u hidden.\n", fs->count, cached, hidden);
+    else printf("[*] %u files, %u already cached.\n", fs->count, cached);
+    free(sizes);
+    free(errors);
+    CFRelease(files);
+    return true;
+}
+
+bool DTDeviceFSMount(DTSessionRef session, const char *mountpoint, const char *cacheDirectory, const char *cacheKey, uint32_t probeConnections) {
+    fs_t fs;
+    memset(&fs, 0, sizeof(fs));
+    fs.session = session;
+    fs.mounted = time(NULL);
+    char directory[PATH_MAX];
+    snprintf(directory, sizeof(directory), "%s/%s", cacheDirectory, cacheKey);
+    mkdir(cacheDirectory, 0755);
+    mkdir(directory, 0755);
+    if (!fsLoad(&fs, directory, probeConnections)) {
+        free(fs.files);
+        return false;
+    }
+
+    /*
+     * Foreground, multithreaded: a read waiting for its range doesn't hold up others.
+     */
+    char *argv[] = {"fetchsymbols", "-f", "-o", "ro,fsname=fetchsymbols", (char *)mountpoint, NULL};
+    int result = fuse_main(5, argv, &fsOperations, &fs);
+
+    /*
+     * Downloads still running refer to the table; stop them before it goes away.
+     */
+    DTSessionCancel(session);
+    DTSessionWait(session);
+    for (uint32_t i = 0; i < fs.count; i++) {
+        if (fs.files[i].fd >= 0) close(fs.files[i].fd);
+        pthread_mutex_destroy(&fs.files[i].lock);
+        pthread_cond_destroy(&fs.files[i].changed);
+    }
+    free(fs.files);
+    return result == 0;
+}
@@ -0,0 +1,29 @@
+#ifndef DEVICEFS_H
+#define DEVICEFS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "fetchsymbols.h"
+
+/*
+ * Read-only FUSE view of a session's file list. Every file appears under its device
+ * path with the size from its GetFile size header. The first open queues the download
+ * into cacheDirectory/cacheKey (at the same relative path, as <file>.partial until
+ * complete); reads block only until the requested range has arrived. Files already
+ * complete there with the probed size are served without contacting the device.
+ * cacheKey names what the files belong to, e.g. <ProductType>_<BuildVersion>, so a
+ * different build never gets another build's file of the same size.
+ *
+ * GetFile always sends a file from its start, so a range arrives after everything
+ * before it. Downloads run on the session's transfer threads
+ * (DTSessionSetMaximumTransfers).
+ *
+ * Blocks until the file system is unmounted. Returns false if the file list can't be
+ * read or mounting failed.
+ *
+ * Only built with DT_DEVICEFS against macFUSE. devicefstest.c runs the operations
+ * against standin without the FUSE loop.
+ */
+bool DTDeviceFSMount(DTSessionRef session, const char *mountpoint, const char *cacheDirectory, const char *cacheKey, uint32_t probeConnections);
+
+#endif
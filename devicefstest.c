@@ -0,0 +1,341 @@
+/*
+ * devicefstest - tests of the -M file system in devicefs.c against standin.
+ *
+ * devicefs.c is compiled into the test with fuse_main replaced by a function that runs
+ * the current case in place of the FUSE loop: it calls the mount's open and read
+ * operations the way FUSE would, so DTDeviceFSMount itself lists and probes the files
+ * of a DTSessionCreateWithAddress session and sets up the cache. The cases check that
+ * only an open starts a download, that a read waits for its own range and no longer
+ * (standin -b), that a stalled download fails the read with -EIO (standin -s), and
+ * that a later mount serves the completed file from the cache with standin gone.
+ * Only the FUSE 2.6 declarations of fuse.h are used, not libfuse, so any fuse.h will
+ * do. Build with the library and standin in the current directory:
+ *
+ *   cc standin.c -lpthread -o standin
+ *   xcrun -sdk macosx clang -D_FILE_OFFSET_BITS=64 -I/usr/local/include/fuse -F/System/Library/PrivateFrameworks -framework MobileDevice -framework CoreFoundation devicefstest.c fetchsymbols.c workpool.c wiretrace.c admission.c arena.c metrics.c -o devicefstest
+ *   ./devicefstest [path to standin]
+ */
+
+#define FUSE_USE_VERSION 26
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fuse.h>
+
+static struct fuse_context test_context;
+static const struct fuse_operations *test_operations;
+static void (*test_case)(void);
+
+/*
+ * Stand in for the FUSE library in devicefs.c below.
+ */
+static struct fuse_context *testContext(void) {
+    return &test_context;
+}
+
+static int testMain(int argc, char *argv[], const struct fuse_operations *operations, void *data) {
+    (void)argc;
+    (void)argv;
+    test_context.private_data = data;
+    test_operations = operations;
+    test_case();
+    return 0;
+}
+
+#undef fuse_main
+#define fuse_main testMain
+#define fuse_get_context testContext
+#include "devicefs.c"
+#undef fuse_get_context
+#undef fuse_main
+
+#define kFileCount 2
+#define kFileSize  (3 * 1024 * 1024 + 123)
+#define kReadSize  (64 * 1024)
+
+static const char *kFilePaths[kFileCount] = {"/lib/a.dylib", "/lib/b.dylib"};
+
+static const char *standin_path = "./standin";
+static char data_directory[PATH_MAX];
+static char cache_directory[PATH_MAX];
+static uint8_t *contents[kFileCount];
+static uint16_t next_port;
+static pid_t standin_pid = -1;
+static uint32_t failures = 0;
+
+static double monotonicTime(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+ * The files below data_directory with distinct pseudo-random contents, kept in memory
+ * to compare reads against.
+ */
+static bool createFiles(void) {
+    uint32_t state = 0x2468ace0;
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/lib", data_directory);
+    if (mkdir(path, 0755) != 0) return false;
+    for (int i = 0; i < kFileCount; i++) {
+        contents[i] = malloc(kFileSize);
+        if (!contents[i]) return false;
+        for (size_t j = 0; j < kFileSize; j++) {
+            state = state * 1664525 + 1013904223;
+            contents[i][j] = (uint8_t)(state >> 24);
+        }
+        snprintf(path, sizeof(path), "%s%s", data_directory, kFilePaths[i]);
+        FILE *file = fopen(path, "wb");
+        bool written = file && fwrite(contents[i], 1, kFileSize, file) == kFileSize;
+        if (file) written = (fclose(file) == 0) && written;
+        if (!written) return false;
+    }
+    return true;
+}
+
+/*
+ * Starts standin with the given options on a fresh port and waits until it accepts.
+ */
+static pid_t startStandin(const char *options[], uint16_t *port) {
+    *port = next_port++;
+    char portString[8];
+    snprintf(portString, sizeof(portString), "%u", *port);
+    const char *arguments[16] = {standin_path};
+    int count = 1;
+    while (options && *options && count < 12) arguments[count++] = *options++;
+    arguments[count++] = data_directory;
+    arguments[count++] = portString;
+    arguments[count] = NULL;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        if (null >= 0) dup2(null, STDOUT_FILENO);
+        execv(standin_path, (char *const *)arguments);
+        _exit(127);
+    }
+    if (pid < 0) return -1;
+
+    for (int attempt = 0; attempt < 200; attempt++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in address = {0};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(*port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        bool connected = fd >= 0 && connect(fd, (struct sockaddr *)&address, sizeof(address)) == 0;
+        if (fd >= 0) close(fd);
+        if (connected) return pid;
+        usleep(10000);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+static void stopStandin(void) {
+    if (standin_pid <= 0) return;
+    kill(standin_pid, SIGKILL);
+    waitpid(standin_pid, NULL, 0);
+    standin_pid = -1;
+}
+
+static void check(const char *name, bool passed, const char *format, ...) {
+    printf("[%c] %s", passed ? '+' : '-', name);
+    if (!passed && format) {
+        va_list args;
+        va_start(args, format);
+        printf(": ");
+        vprintf(format, args);
+        va_end(args);
+    }
+    putchar('\n');
+    if (!passed) failures++;
+}
+
+/*
+ * Mounts a standin with the given options under cache key 'key' and runs 'run' as the
+ * FUSE loop. Returns false if standin does not start or the mount fails.
+ */
+static bool runMount(const char *options[], const DTTransferPolicy *policy, const char *key, void (*run)(void)) {
+    uint16_t port;
+    standin_pid = startStandin(options, &port);
+    if (standin_pid < 0) return false;
+    DTSessionRef session = DTSessionCreateWithAddress("127.0.0.1", port);
+    bool mounted = false;
+    if (session) {
+        DTSessionSetTransferPolicy(session, policy);
+        test_case = run;
+        mounted = DTDeviceFSMount(session, "/nonexistent", cache_directory, key, 4);
+        DTSessionRelease(session);
+    }
+    stopStandin();
+    return mounted;
+}
+
+static fs_file_t *testFile(int index) {
+    fs_t *fs = test_context.private_data;
+    return fsFind(fs, kFilePaths[index]);
+}
+
+static int testOpen(int index, struct fuse_file_info *info) {
+    memset(info, 0, sizeof(*info));
+    info->flags = O_RDONLY;
+    return test_operations->open(kFilePaths[index], info);
+}
+
+/*
+ * Reads 'length' bytes at 'offset' through the mount; true if they all match.
+ */
+static bool testRead(int index, struct fuse_file_info *info, off_t offset, size_t length, int *result) {
+    static uint8_t buffer[kReadSize];
+    *result = test_operations->read(kFilePaths[index], (char *)buffer, length, offset, info);
+    return *result == (int)length && !memcmp(buffer, contents[index] + offset, length);
+}
+
+static fs_state_t testState(fs_file_t *file) {
+    pthread_mutex_lock(&file->lock);
+    fs_state_t state = file->state;
+    pthread_mutex_unlock(&file->lock);
+    return state;
+}
+
+static void waitForDownload(fs_file_t *file) {
+    pthread_mutex_lock(&file->lock);
+    while (file->state == kFSFetching) pthread_cond_wait(&file->changed, &file->lock);
+    pthread_mutex_unlock(&file->lock);
+}
+
+static bool sameAsCached(int index, const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (!file) return false;
+    uint8_t *data = malloc(kFileSize + 1);
+    bool same = data && fread(data, 1, kFileSize + 1, file) == kFileSize && !memcmp(data, contents[index], kFileSize);
+    free(data);
+    fclose(file);
+    return same;
+}
+
+/*
+ * 4 MB/s: the file takes ~0.8 s to arrive.
+ */
+static void lazyCase(void) {
+    fs_file_t *file = testFile(0), *other = testFile(1);
+    struct stat info;
+    bool found = file && other && test_operations->getattr(kFilePaths[0], &info) == 0 && info.st_size == kFileSize;
+    check("files are listed with their probed sizes", found, "getattr of %s", kFilePaths[0]);
+    if (!found) return;
+
+    bool untouched = access(file->local, F_OK) != 0 && access(file->partial, F_OK) != 0 && testState(file) == kFSIdle;
+    struct fuse_file_info handle;
+    int opened = testOpen(0, &handle);
+
+    /*
+     * The first range arrives long before the file does; the last one only with it.
+     * The download creates the partial file on a transfer thread, so it is there once
+     * the first range is.
+     */
+    int result;
+    double start = monotonicTime();
+    bool first = opened == 0 && testRead(0, &handle, 0, kReadSize, &result);
+    double firstSeconds = monotonicTime() - start;
+    bool early = testState(file) == kFSFetching;
+    bool started = first && access(file->partial, F_OK) == 0;
+    check("only an open starts a download", untouched && started && testState(other) == kFSIdle && access(other->partial, F_OK) != 0,
+          "before open %s, open %d, partial %s, other file %d", untouched ? "nothing" : "files", opened,
+          started ? "created" : "missing", other->state);
+    bool last = testRead(0, &handle, kFileSize - kReadSize, kReadSize, &result);
+    double lastSeconds = monotonicTime() - start;
+    printf("[*] First range after %.2f s, last after %.2f s.\n", firstSeconds, lastSeconds);
+    check("a read waits only for its range", first && early && last && firstSeconds < 0.3 && lastSeconds > 0.5,
+          "first %s in %.2f s%s, last %s in %.2f s (%d)", first ? "ok" : "wrong", firstSeconds, early ? "" : " after the download",
+          last ? "ok" : "wrong", lastSeconds, result);
+
+    waitForDownload(file);
+    check("the completed download becomes the cache file",
+          testState(file) == kFSDone && access(file->partial, F_OK) != 0 && sameAsCached(0, file->local),
+          "state %d, partial %s", file->state, access(file->partial, F_OK) == 0 ? "left" : "gone");
+}
+
+/*
+ * Body stalled after 1 MB, no retries: the range below it is served, the one above
+ * fails once the receive times out.
+ */
+static void stallCase(void) {
+    fs_file_t *file = testFile(1);
+    struct fuse_file_info handle;
+    if (!file || testOpen(1, &handle) != 0) {
+        check("a stalled download fails the read with -EIO", false, "can not open %s", kFilePaths[1]);
+        return;
+    }
+    int before, after;
+    bool served = testRead(1, &handle, 0, kReadSize, &before);
+    testRead(1, &handle, kFileSize - kReadSize, kReadSize, &after);
+    check("a stalled download fails the read with -EIO",
+          served && after == -EIO && testState(file) == kFSFailed && access(file->local, F_OK) != 0,
+          "first range %d, last range %d, state %d", before, after, file->state);
+}
+
+/*
+ * Same cache key as lazyCase: its file is complete and read with standin gone.
+ */
+static void cachedCase(void) {
+    fs_file_t *file = testFile(0);
+    bool cached = file && testState(file) == kFSDone;
+    stopStandin();
+
+    struct fuse_file_info handle;
+    bool same = cached && testOpen(0, &handle) == 0;
+    int result = 0;
+    for (off_t offset = 0; same && offset < kFileSize; offset += kReadSize) {
+        size_t length = kFileSize - offset < kReadSize ? (size_t)(kFileSize - offset) : kReadSize;
+        same = testRead(0, &handle, offset, length, &result);
+    }
+    check("a later mount serves the cached file without the device",
+          same && testState(file) == kFSDone && access(file->partial, F_OK) != 0,
+          "%s, read %d", cached ? "cached" : "not cached at mount", result);
+}
+
+int main(int argc, const char *argv[]) {
+    if (argc > 1) standin_path = argv[1];
+    signal(SIGPIPE, SIG_IGN);
+    next_port = 20000 + getpid() % 20000;
+    char base[] = "/tmp/devicefstest.XXXXXX";
+    if (!mkdtemp(base)) return 1;
+    snprintf(data_directory, sizeof(data_directory), "%s/data", base);
+    snprintf(cache_directory, sizeof(cache_directory), "%s/cache", base);
+    if (mkdir(data_directory, 0755) != 0 || !createFiles()) {
+        printf("[-] Can not create test files in %s.\n", base);
+        return 1;
+    }
+
+    DTTransferPolicy policy = kDTDefaultTransferPolicy;
+    policy.receiveTimeout = 1;
+    policy.minimumThroughput = 0;
+    policy.maximumReconnects = 0;
+
+    const char *rateLimited[] = {"-b", "4096", NULL};
+    if (!runMount(rateLimited, &policy, "lazy", lazyCase)) check("mount with a rate-limited standin", false, NULL);
+    const char *stalled[] = {"-s", "1048576", NULL};
+    if (!runMount(stalled, &policy, "stall", stallCase)) check("mount with a stalling standin", false, NULL);
+    if (!runMount(NULL, &policy, "lazy", cachedCase)) check("mount with a finished cache", false, NULL);
+
+    for (int i = 0; i < kFileCount; i++) free(contents[i]);
+    char command[PATH_MAX + 16];
+    snprintf(command, sizeof(command), "rm -rf %s", base);
+    if (system(command) != 0) printf("[*] Can not remove %s.\n", base);
+    printf("[%c] %u failed.\n", failures ? '-' : '+', failures);
+    return failures ? 1 : 0;
+}
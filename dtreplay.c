@@ -0,0 +1,398 @@
+/*
+ * dtreplay - serves a recorded fetchsymbols wire trace over TCP.
+ *
+ * Every accepted connection takes the first unused recorded service connection that
+ * began with the same request: the command, and for GetFile also the file index, so
+ * concurrent transfers find their own recordings whatever order they connect in.
+ * Bytes the client sent are read back, and bytes the device returned are written in
+ * the recorded chunks at the recorded times, so the transfer path of a
+ * DTSessionCreateWithAddress session sees the same sizes and gaps as on the original
+ * device. Plain POSIX; builds on Linux as well:
+ *
+ *   cc wiretrace.c dtreplay.c -lpthread -o dtreplay
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include "wirecodec.h"
+#include "wiretrace.h"
+
+typedef struct {
+    uint32_t id;
+    DTWireEvent *events;
+    uint32_t count;
+    uint32_t capacity;
+    uint8_t request[8];             /* First command, and the index for GetFile.       */
+    uint32_t requestLength;
+    bool claimed;
+} replay_connection_t;
+
+typedef struct {
+    replay_connection_t *connections;
+    uint32_t count;
+    uint64_t bytes;
+    uint32_t mismatches;
+    pthread_mutex_t lock;
+} replay_t;
+
+typedef struct {
+    replay_t *replay;
+    replay_connection_t *connection;
+    int fd;
+    uint8_t request[8];             /* Read to pick the connection, not yet replayed.  */
+    uint32_t requestLength;
+    uint32_t requestOffset;
+    bool echoed;                    /* The GetFile echo went out before the claim.     */
+} replay_job_t;
+
+static double speed = 1;
+static uint8_t zeroes[1 << 20];
+
+static uint64_t now(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000ull + time.tv_nsec;
+}
+
+static void sleepUntil(uint64_t deadline) {
+    uint64_t current = now();
+    if (current >= deadline) return;
+    struct timespec delay = {(time_t)((deadline - current) / 1000000000ull), (long)((deadline - current) % 1000000000ull)};
+    while (nanosleep(&delay, &delay) != 0 && errno == EINTR);
+}
+
+static bool writeAll(int fd, const uint8_t *data, uint64_t length) {
+    while (length) {
+        ssize_t written = send(fd, data, length, 0);
+        if (written <= 0) return false;
+        data += written;
+        length -= written;
+    }
+    return true;
+}
+
+/*
+ * Reads client bytes, starting with what was read to match the connection.
+ */
+static bool readClient(replay_job_t *job, uint8_t *buffer, size_t length) {
+    while (length && job->requestOffset < job->requestLength) {
+        *buffer++ = job->request[job->requestOffset++];
+        length--;
+    }
+    return length == 0 || recv(job->fd, buffer, length, MSG_WAITALL) == (ssize_t)length;
+}
+
+/*
+ * Writes 'length' bytes of payload, or zeroes if the trace has no payload for them.
+ */
+static bool writeChunk(int fd, const DTWireEvent *event, uint64_t length) {
+    if (event->payload && event->length >= length) return writeAll(fd, event->payload, length);
+    while (length) {
+        uint64_t part = length < sizeof(zeroes) ? length : sizeof(zeroes);
+        if (!writeAll(fd, zeroes, part)) return false;
+        length -= part;
+    }
+    return true;
+}
+
+static bool loadTrace(const char *path, replay_t *replay, DTWireTraceReader *reader) {
+    if (!DTWireTraceOpen(path, reader)) return false;
+
+    DTWireEvent event;
+    while (DTWireTraceNext(reader, &event)) {
+        replay_connection_t *connection = NULL;
+        for (uint32_t i = 0; i < replay->count && !connection; i++)
+            if (replay->connections[i].id == event.connection) connection = &replay->connections[i];
+        if (!connection) {
+            /*
+             * Service connections that failed to start can't be reproduced over TCP.
+             */
+            if (event.kind != kDTWireOpen || event.result < 0) continue;
+            replay_connection_t *connections = realloc(replay->connections, (replay->count + 1) * sizeof(replay_connection_t));
+            if (!connections) return false;
+            replay->connections = connections;
+            connection = &replay->connections[replay->count++];
+            memset(connection, 0, sizeof(replay_connection_t));
+            connection->id = event.connection;
+        }
+        if (connection->count == connection->capacity) {
+            uint32_t capacity = connection->capacity ? connection->capacity * 2 : 64;
+            DTWireEvent *events = realloc(connection->events, capacity * sizeof(DTWireEvent));
+            if (!events) return false;
+            connection->events = events;
+            connection->capacity = capacity;
+        }
+        connection->events[connection->count++] = event;
+
+        /*
+         * The request a client opens the connection with: a command, followed by the
+         * file index if it is GetFile.
+         */
+        for (uint32_t offset = 0; event.kind == kDTWireSend && event.payload && offset < event.length;) {
+            uint32_t wanted = sizeof(DTWireCommand);
+            if (connection->requestLength >= wanted &&
+                DTWireCheckEcho((const DTWireCommand *)connection->request, kDTWireCommandGetFile))
+                wanted += sizeof(DTWireIndex);
+            if (connection->requestLength >= wanted) break;
+            uint32_t part = wanted - connection->requestLength;
+            if (part > event.length - offset) part = event.length - offset;
+            memcpy(connection->request + connection->requestLength, event.payload + offset, part);
+            connection->requestLength += part;
+            offset += part;
+        }
+    }
+    return true;
+}
+
+/*
+ * Reads the client's first request and claims the first unused recorded connection
+ * that started with it, or failing that the first unused one. The client sends the
+ * GetFile index only after the echo, so that is answered here, before the recording
+ * that holds it is known.
+ */
+static replay_connection_t *claimConnection(replay_job_t *job) {
+    replay_t *replay = job->replay;
+    if (recv(job->fd, job->request, sizeof(DTWireCommand), MSG_WAITALL) != sizeof(DTWireCommand)) return NULL;
+    job->requestLength = sizeof(DTWireCommand);
+    if (DTWireCheckEcho((const DTWireCommand *)job->request, kDTWireCommandGetFile)) {
+        if (!writeAll(job->fd, job->request, sizeof(DTWireCommand))) return NULL;
+        job->echoed = true;
+        if (recv(job->fd, job->request + sizeof(DTWireCommand), sizeof(DTWireIndex), MSG_WAITALL) != sizeof(DTWireIndex)) return NULL;
+        job->requestLength += sizeof(DTWireIndex);
+    }
+
+    replay_connection_t *match = NULL, *unused = NULL;
+    pthread_mutex_lock(&replay->lock);
+    for (uint32_t i = 0; i < replay->count && !match; i++) {
+        replay_connection_t *connection = &replay->connections[i];
+        if (connection->claimed) continue;
+        if (!unused) unused = connection;
+        if (connection->requestLength == job->requestLength && !memcmp(connection->request, job->request, job->requestLength))
+            match = connection;
+    }
+    if (!match && unused) {
+        match = unused;
+        replay->mismatches++;
+    }
+    if (match) match->claimed = true;
+    pthread_mutex_unlock(&replay->lock);
+    return match;
+}
+
+static void *replayConnection(void *arg) {
+    replay_job_t *job = arg;
+    replay_connection_t *connection = job->connection = claimConnection(job);
+    uint64_t bytes = 0;
+    uint32_t mismatches = 0;
+    bool open = connection != NULL;
+
+    /*
+     * Recorded times are replayed relative to the last point both sides agree on:
+     * the accept, and then the end of every client send.
+     */
+    uint64_t recordedAnchor = open && connection->count ? connection->events[0].end : 0;
+    uint64_t anchor = now();
+
+    for (uint32_t i = 1; open && i < connection->count; i++) {
+        const DTWireEvent *event = &connection->events[i];
+        uint64_t deadline = anchor + (uint64_t)((event->end > recordedAnchor ? event->end - recordedAnchor : 0) / speed);
+
+        switch (event->kind) {
+            case kDTWireSend: {
+                uint64_t expected = event->result > 0 ? (uint64_t)event->result : 0;
+                uint8_t buffer[64];
+                while (expected && open) {
+                    size_t part = expected < sizeof(buffer) ? expected : sizeof(buffer);
+                    if (!readClient(job, buffer, part)) {
+                        open = false;
+                        break;
+                    }
+                    uint64_t offset = (uint64_t)event->result - expected;
+                    if (event->payload && offset < event->length &&
+                        memcmp(buffer, event->payload + offset, part < event->length - offset ? part : event->length - offset))
+                        mismatches++;
+                    expected -= part;
+                }
+                recordedAnchor = event->end;
+                anchor = now();
+                break;
+            }
+            case kDTWireReceive:
+            case kDTWireReceiveData:
+                if (job->echoed && event->kind == kDTWireReceive) {
+                    job->echoed = false;
+                    bytes += sizeof(DTWireCommand);
+                } else if (event->result == 0) {
+                    /*
+                     * The device closed the connection.
+                     */
+                    sleepUntil(deadline);
+                    open = false;
+                } else if (event->result < 0) {
+                    /*
+                     * The receive timed out: stay silent until the client gives up.
+                     */
+                    uint8_t buffer[64];
+                    while (recv(job->fd, buffer, sizeof(buffer), 0) > 0);
+                    open = false;
+                } else {
+                    sleepUntil(deadline);
+                    open = writeChunk(job->fd, event, (uint64_t)event->result);
+                    bytes += event->result;
+                }
+                break;
+            case kDTWireMessage:
+                sleepUntil(deadline);
+                if (event->result > 0 && event->payload) {
+                    DTWireLength length = DTWireEncodeLength(event->length);
+                    open = writeAll(job->fd, length.bytes, sizeof(length)) && writeAll(job->fd, event->payload, event->length);
+                    bytes += sizeof(length) + event->length;
+                } else
+                    open = false;
+                break;
+            case kDTWireClose:
+                open = false;
+                break;
+            default:
+                break;
+        }
+    }
+
+    /*
+     * Let the client read everything before the connection goes away.
+     */
+    shutdown(job->fd, SHUT_WR);
+    uint8_t buffer[64];
+    while (recv(job->fd, buffer, sizeof(buffer), 0) > 0);
+    close(job->fd);
+
+    pthread_mutex_lock(&job->replay->lock);
+    job->replay->bytes += bytes;
+    job->replay->mismatches += mismatches;
+    pthread_mutex_unlock(&job->replay->lock);
+    free(job);
+    return NULL;
+}
+
+/*
+ * Per connection: event counts, body chunk sizes and how long the device took.
+ */
+static void printTrace(const replay_t *replay, const DTWireTraceReader *reader) {
+    printf("[*] %u connections, file bodies %srecorded.\n", replay->count, (reader->flags & kDTWireTracePayload) ? "" : "not ");
+    for (uint32_t i = 0; i < replay->count; i++) {
+        const replay_connection_t *connection = &replay->connections[i];
+        uint64_t chunks = 0, bytes = 0, smallest = UINT64_MAX, largest = 0;
+        double messageTime = 0;
+        for (uint32_t j = 0; j < connection->count; j++) {
+            const DTWireEvent *event = &connection->events[j];
+            if (event->kind == kDTWireReceiveData && event->result > 0) {
+                chunks++;
+                bytes += event->result;
+                if ((uint64_t)event->result < smallest) smallest = event->result;
+                if ((uint64_t)event->result > largest) largest = event->result;
+            } else if (event->kind == kDTWireMessage)
+                messageTime += (event->end - event->start) / 1e9;
+        }
+        const DTWireEvent *first = &connection->events[0], *last = &connection->events[connection->count - 1];
+        double seconds = (last->end - first->start) / 1e9;
+        printf("  %u: %u events, %.3f s, open %.3f s", connection->id, connection->count, seconds, (first->end - first->start) / 1e9);
+        if (messageTime > 0) printf(", plist %.3f s", messageTime);
+        if (chunks)
+            printf(", %3.2f MB in %llu chunks (%llu..%llu, avg %llu bytes), %3.2f MB/s",
+                   (double)bytes/(1024*1024), (unsigned long long)chunks, (unsigned long long)smallest,
+                   (unsigned long long)largest, (unsigned long long)(bytes / chunks),
+                   seconds > 0 ? (double)bytes/(1024*1024)/seconds : 0);
+        printf("\n");
+    }
+}
+
+static void help(void) {
+    puts("Usage: dtreplay [-s factor] trace port");
+    puts("       dtreplay -i trace");
+    puts("");
+    puts("  -s factor    -  Replay factor times faster than recorded (default 1).");
+    puts("  -i           -  Print per-connection statistics of the trace and exit.");
+    exit(0);
+}
+
+int main(int argc, const char *argv[]) {
+    bool info = false;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (!strcmp(argv[i], "-i")) info = true;
+        else if (!strcmp(argv[i], "-s")) {
+            if ((i + 1) < argc && atof(argv[i + 1]) > 0)
+                speed = atof(argv[++i]);
+            else
+                help();
+        }
+        else
+            help();
+    }
+    if (i >= argc || (!info && i + 1 >= argc)) help();
+
+    replay_t replay;
+    DTWireTraceReader reader;
+    memset(&replay, 0, sizeof(replay));
+    pthread_mutex_init(&replay.lock, NULL);
+    if (!loadTrace(argv[i], &replay, &reader)) {
+        printf("[-] %s is not a wire trace.\n", argv[i]);
+        return 1;
+    }
+    if (info) {
+        printTrace(&replay, &reader);
+        return 0;
+    }
+
+    int port = atoi(argv[i + 1]);
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (listener < 0 || bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(listener, 16) != 0) {
+        printf("[-] Can not listen on port %u.\n", port);
+        return 1;
+    }
+    printf("[*] Replaying %u connections on port %u.\n", replay.count, port);
+
+    pthread_t threads[replay.count ? replay.count : 1];
+    uint32_t started = 0, accepted = 0;
+    uint64_t start = now();
+    while (accepted < replay.count) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) continue;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        replay_job_t *job = calloc(1, sizeof(replay_job_t));
+        if (!job) {
+            close(fd);
+            continue;
+        }
+        job->replay = &replay;
+        job->fd = fd;
+        accepted++;
+        if (pthread_create(&threads[started], NULL, replayConnection, job) == 0) started++;
+        else replayConnection(job);
+    }
+    for (uint32_t j = 0; j < started; j++)
+        pthread_join(threads[j], NULL);
+    close(listener);
+
+    double seconds = (now() - start) / 1e9;
+    printf("[+] Replayed %u connections: %3.2f MB in %.2f s.\n", replay.count, (double)replay.bytes/(1024*1024), seconds);
+    if (replay.mismatches)
+        printf("[-] %u client sends or first requests differ from the trace.\n", replay.mismatches);
+    DTWireTraceCloseReader(&reader);
+    return 0;
+}
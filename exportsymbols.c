@@ -0,0 +1,373 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <mach-o/loader.h>
+#include <mach-o/nlist.h>
+#include "sharedcache.h"
+#include "workpool.h"
+#include "exportsymbols.h"
+
+typedef struct {
+    DTImageSymbol *symbols;
+    size_t count;
+    size_t capacity;
+} symbol_list_t;
+
+typedef struct {
+    uint8_t *data;
+    size_t length;
+    size_t capacity;
+} export_buffer_t;
+
+/*
+ * Local symbols, from <cache>.symbols or from the main cache on older builds.
+ */
+typedef struct {
+    const uint8_t *data;
+    uint64_t size;
+    const struct dyld_cache_local_symbols_info *info;
+    bool wideEntries;
+} local_symbols_t;
+
+typedef struct {
+    const DTSharedCache *cache;
+    local_symbols_t locals;
+    void (*image)(void *context, const DTImageSymbols *symbols);
+    void *context;
+} enumerate_job_t;
+
+typedef struct {
+    const char *directory;
+    pthread_mutex_t lock;
+    DTExportResult *result;
+} export_job_t;
+
+static bool appendSymbol(symbol_list_t *list, uint64_t address, const char *name, uint32_t length) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 1024;
+        DTImageSymbol *symbols = realloc(list->symbols, capacity * sizeof(DTImageSymbol));
+        if (!symbols) return false;
+        list->symbols = symbols;
+        list->capacity = capacity;
+    }
+    list->symbols[list->count++] = (DTImageSymbol){address, name, length};
+    return true;
+}
+
+/*
+ * Adds the defined, non-debug symbols of an nlist table. Strings must lie in the table.
+ */
+static void collectSymbols(symbol_list_t *list, const uint8_t *nlists, uint32_t count, bool is64, const char *strings, uint64_t stringsSize) {
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t strx;
+        uint8_t type;
+        uint64_t value;
+        if (is64) {
+            struct nlist_64 entry;
+            memcpy(&entry, nlists + i * sizeof(entry), sizeof(entry));
+            strx = entry.n_un.n_strx;
+            type = entry.n_type;
+            value = entry.n_value;
+        } else {
+            struct nlist entry;
+            memcpy(&entry, nlists + i * sizeof(entry), sizeof(entry));
+            strx = entry.n_un.n_strx;
+            type = entry.n_type;
+            value = entry.n_value;
+        }
+        if ((type & N_STAB) || (type & N_TYPE) != N_SECT || strx == 0 || strx >= stringsSize) continue;
+        const char *name = strings + strx;
+        const char *end = memchr(name, 0, stringsSize - strx);
+        if (!end || end == name) continue;
+        if (!appendSymbol(list, value, name, (uint32_t)(end - name))) return;
+    }
+}
+
+static int compareSymbols(const void *a, const void *b) {
+    const DTImageSymbol *left = a, *right = b;
+    if (left->address != right->address) return left->address < right->address ? -1 : 1;
+    uint32_t length = left->length < right->length ? left->length : right->length;
+    int order = memcmp(left->name, right->name, length);
+    if (order) return order;
+    return (left->length > right->length) - (left->length < right->length);
+}
+
+static void bufferWrite(export_buffer_t *buffer, const void *bytes, size_t length) {
+    if (!buffer->data && buffer->capacity) return;
+    if (buffer->length + length > buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+        while (capacity < buffer->length + length) capacity *= 2;
+        uint8_t *data = realloc(buffer->data, capacity);
+        if (!data) {
+            free(buffer->data);
+            buffer->data = NULL;
+            buffer->capacity = 1;
+            return;
+        }
+        buffer->data = data;
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->data + buffer->length, bytes, length);
+    buffer->length += length;
+}
+
+static void bufferWriteULEB(export_buffer_t *buffer, uint64_t value) {
+    uint8_t bytes[10];
+    size_t length = 0;
+    do {
+        uint8_t byte = value & 0x7f;
+        value >>= 7;
+        bytes[length++] = byte | (value ? 0x80 : 0);
+    } while (value);
+    bufferWrite(buffer, bytes, length);
+}
+
+/*
+ * Finds the image's header, UUID and symbol table. The symbol table offsets in the
+ * cache are relative to __LINKEDIT's file offset, so they are turned into addresses.
+ */
+static void collectImageSymbols(const enumerate_job_t *job, uint32_t image, symbol_list_t *list, struct mach_header *header, uint8_t uuid[16], bool *hasUUID) {
+    const DTSharedCache *cache = job->cache;
+    uint64_t address = cache->images[image].address;
+    const uint8_t *data = DTSharedCacheResolve(cache, address, sizeof(struct mach_header_64), NULL);
+    if (!data) return;
+    memcpy(header, data, sizeof(struct mach_header));
+    bool is64 = header->magic == MH_MAGIC_64;
+    if (!is64 && header->magic != MH_MAGIC) return;
+
+    uint64_t headerSize = is64 ? sizeof(struct mach_header_64) : sizeof(struct mach_header);
+    const uint8_t *commands = DTSharedCacheResolve(cache, address, headerSize + header->sizeofcmds, NULL);
+    if (!commands) return;
+
+    struct symtab_command symtab = {0};
+    uint64_t linkeditBase = 0;
+    bool hasLinkedit = false;
+    const uint8_t *command = commands + headerSize;
+    uint64_t remaining = header->sizeofcmds;
+    for (uint32_t i = 0; i < header->ncmds && remaining >= sizeof(struct load_command); i++) {
+        struct load_command loadCommand;
+        memcpy(&loadCommand, command, sizeof(loadCommand));
+        if (loadCommand.cmdsize < sizeof(loadCommand) || loadCommand.cmdsize > remaining) break;
+        if (loadCommand.cmd == LC_UUID && loadCommand.cmdsize == sizeof(struct uuid_command)) {
+            memcpy(uuid, command + offsetof(struct uuid_command, uuid), 16);
+            *hasUUID = true;
+        } else if (loadCommand.cmd == LC_SYMTAB && loadCommand.cmdsize == sizeof(symtab)) {
+            memcpy(&symtab, command, sizeof(symtab));
+        } else if (loadCommand.cmd == LC_SEGMENT_64 && loadCommand.cmdsize >= sizeof(struct segment_command_64)) {
+            struct segment_command_64 segment;
+            memcpy(&segment, command, sizeof(segment));
+            if (!strncmp(segment.segname, "__LINKEDIT", 16)) {
+                linkeditBase = segment.vmaddr - segment.fileoff;
+                hasLinkedit = true;
+            }
+        } else if (loadCommand.cmd == LC_SEGMENT && loadCommand.cmdsize >= sizeof(struct segment_command)) {
+            struct segment_command segment;
+            memcpy(&segment, command, sizeof(segment));
+            if (!strncmp(segment.segname, "__LINKEDIT", 16)) {
+                linkeditBase = (uint64_t)segment.vmaddr - segment.fileoff;
+                hasLinkedit = true;
+            }
+        }
+        command += loadCommand.cmdsize;
+        remaining -= loadCommand.cmdsize;
+    }
+
+    size_t nlistSize = is64 ? sizeof(struct nlist_64) : sizeof(struct nlist);
+    if (hasLinkedit && symtab.nsyms) {
+        const uint8_t *nlists = DTSharedCacheResolve(cache, linkeditBase + symtab.symoff, (uint64_t)symtab.nsyms * nlistSize, NULL);
+        const char *strings = (const char *)DTSharedCacheResolve(cache, linkeditBase + symtab.stroff, symtab.strsize, NULL);
+        if (nlists && strings)
+            collectSymbols(list, nlists, symtab.nsyms, is64, strings, symtab.strsize);
+    }
+
+    /*
+     * Local symbols are stripped from the images and kept per image in the symbols file.
+     */
+    const local_symbols_t *locals = &job->locals;
+    if (locals->info) {
+        const struct dyld_cache_local_symbols_info *info = locals->info;
+        const uint8_t *base = (const uint8_t *)info;
+        uint64_t available = locals->size - (base - locals->data);
+        uint64_t dylibOffset = address - cache->files[0].mappings[0].address;
+        size_t entrySize = locals->wideEntries ? sizeof(struct dyld_cache_local_symbols_entry_64) : sizeof(struct dyld_cache_local_symbols_entry);
+        if ((uint64_t)info->entriesOffset + (uint64_t)info->entriesCount * entrySize > available ||
+            (uint64_t)info->nlistOffset + (uint64_t)info->nlistCount * nlistSize > available ||
+            (uint64_t)info->stringsOffset + info->stringsSize > available)
+            return;
+        for (uint32_t i = 0; i < info->entriesCount; i++) {
+            uint64_t offset;
+            uint32_t start, count;
+            if (locals->wideEntries) {
+                struct dyld_cache_local_symbols_entry_64 entry;
+                memcpy(&entry, base + info->entriesOffset + i * entrySize, sizeof(entry));
+                offset = entry.dylibOffset, start = entry.nlistStartIndex, count = entry.nlistCount;
+            } else {
+                struct dyld_cache_local_symbols_entry entry;
+                memcpy(&entry, base + info->entriesOffset + i * entrySize, sizeof(entry));
+                offset = entry.dylibOffset, start = entry.nlistStartIndex, count = entry.nlistCount;
+            }
+            if (offset != dylibOffset) continue;
+            if ((uint64_t)start + count <= info->nlistCount)
+                collectSymbols(list, base + info->nlistOffset + start * nlistSize, count, is64, (const char *)base + info->stringsOffset, info->stringsSize);
+            break;
+        }
+    }
+}
+
+static void enumerateImage(void *context, size_t index) {
+    enumerate_job_t *job = context;
+    const DTSharedCache *cache = job->cache;
+    symbol_list_t list = {0};
+    struct mach_header header = {0};
+    DTImageSymbols symbols = {0};
+    bool hasUUID = false;
+
+    collectImageSymbols(job, (uint32_t)index, &list, &header, symbols.uuid, &hasUUID);
+    if (!hasUUID) {
+        free(list.symbols);
+        return;
+    }
+
+    qsort(list.symbols, list.count, sizeof(DTImageSymbol), compareSymbols);
+
+    /*
+     * The symbol table and the local symbols can both carry a symbol; keep one.
+     */
+    size_t unique = 0;
+    for (size_t i = 0; i < list.count; i++)
+        if (i == 0 || compareSymbols(&list.symbols[i - 1], &list.symbols[i]))
+            list.symbols[unique++] = list.symbols[i];
+
+    symbols.index = (uint32_t)index;
+    symbols.cputype = header.cputype;
+    symbols.cpusubtype = header.cpusubtype;
+    symbols.address = cache->images[index].address;
+    symbols.path = DTSharedCacheImagePath(cache, (uint32_t)index);
+    if (!symbols.path) symbols.path = "";
+    symbols.symbols = list.symbols;
+    symbols.count = unique;
+    job->image(job->context, &symbols);
+    free(list.symbols);
+}
+
+static void exportImage(void *context, const DTImageSymbols *symbols) {
+    export_job_t *job = context;
+    export_buffer_t buffer = {0};
+    uint32_t cpu[2] = {(uint32_t)symbols->cputype, (uint32_t)symbols->cpusubtype};
+    bufferWrite(&buffer, "DTSYM1\0\0", 8);
+    bufferWrite(&buffer, symbols->uuid, 16);
+    bufferWrite(&buffer, cpu, sizeof(cpu));
+    bufferWriteULEB(&buffer, strlen(symbols->path));
+    bufferWrite(&buffer, symbols->path, strlen(symbols->path));
+
+    /*
+     * Symbols are sorted by address; the ones below the image header have no delta to
+     * encode and are left out rather than moved.
+     */
+    size_t first = 0;
+    while (first < symbols->count && symbols->symbols[first].address < symbols->address) first++;
+    bufferWriteULEB(&buffer, symbols->count - first);
+
+    uint64_t previous = symbols->address;
+    for (size_t i = first; i < symbols->count; i++) {
+        const DTImageSymbol *symbol = &symbols->symbols[i];
+        bufferWriteULEB(&buffer, symbol->address - previous);
+        bufferWriteULEB(&buffer, symbol->length);
+        bufferWrite(&buffer, symbol->name, symbol->length);
+        previous = symbol->address;
+    }
+
+    char path[PATH_MAX];
+    const uint8_t *u = symbols->uuid;
+    snprintf(path, sizeof(path), "%s/%02X%02X%02X%02X-%02X%02X-%02X%02X-%02X%02X-%02X%02X%02X%02X%02X%02X.sym", job->directory,
+             u[0], u[1], u[2], u[3], u[4], u[5], u[6], u[7], u[8], u[9], u[10], u[11], u[12], u[13], u[14], u[15]);
+    bool written = false;
+    FILE *file = buffer.data ? fopen(path, "wb") : NULL;
+    if (file) {
+        written = fwrite(buffer.data, 1, buffer.length, file) == buffer.length;
+        written = (fclose(file) == 0) && written;
+    }
+    free(buffer.data);
+
+    if (written) {
+        pthread_mutex_lock(&job->lock);
+        job->result->exported++;
+        job->result->symbols += symbols->count - first;
+        job->result->outputBytes += buffer.length;
+        pthread_mutex_unlock(&job->lock);
+    }
+}
+
+static double monotonicSeconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+bool DTEnumerateCacheSymbols(const char *cachePath, uint32_t threads, void (*image)(void *context, const DTImageSymbols *symbols), void *context, uint32_t *images, uint64_t *inputBytes) {
+    DTSharedCache *cache = calloc(1, sizeof(DTSharedCache));
+    if (!cache) return false;
+    if (!DTSharedCacheOpen(cachePath, cache)) {
+        free(cache);
+        return false;
+    }
+
+    enumerate_job_t job = {cache, {0}, image, context};
+    uint64_t bytes = 0;
+    for (uint32_t i = 0; i < cache->fileCount; i++)
+        bytes += cache->files[i].size;
+
+    /*
+     * Local symbols live in <cache>.symbols on split caches and in the main file before.
+     */
+    char symbolsPath[PATH_MAX];
+    snprintf(symbolsPath, sizeof(symbolsPath), "%s.symbols", cachePath);
+    const uint8_t *symbolsData = DTMapFile(symbolsPath, &job.locals.size);
+    const uint8_t *localsFile = symbolsData;
+    if (symbolsData && DTSharedCacheIsCache(symbolsData, job.locals.size))
+        bytes += job.locals.size;
+    else {
+        if (symbolsData) munmap((void *)symbolsData, job.locals.size);
+        symbolsData = NULL;
+        localsFile = cache->files[0].data;
+        job.locals.size = cache->files[0].size;
+    }
+    const struct dyld_cache_header *localsHeader = (const struct dyld_cache_header *)localsFile;
+    if (localsHeader->localSymbolsOffset && localsHeader->localSymbolsOffset + sizeof(struct dyld_cache_local_symbols_info) <= job.locals.size) {
+        job.locals.data = localsFile;
+        job.locals.info = (const struct dyld_cache_local_symbols_info *)(localsFile + localsHeader->localSymbolsOffset);
+        job.locals.wideEntries = localsHeader->mappingOffset >= offsetof(struct dyld_cache_header, symbolFileUUID);
+    }
+
+    if (images) *images = cache->imageCount;
+    if (inputBytes) *inputBytes = bytes;
+    DTWorkPoolApply(cache->imageCount, threads, enumerateImage, &job);
+
+    if (symbolsData) munmap((void *)symbolsData, job.locals.size);
+    DTSharedCacheClose(cache);
+    free(cache);
+    return true;
+}
+
+bool DTExportSymbols(const char *cachePath, const char *directory, uint32_t threads, DTExportResult *result) {
+    memset(result, 0, sizeof(DTExportResult));
+    double start = monotonicSeconds();
+
+    export_job_t job = {directory, PTHREAD_MUTEX_INITIALIZER, result};
+    uint64_t size = 0;
+    const uint8_t *data = DTMapFile(cachePath, &size);
+    bool isCache = data && DTSharedCacheIsCache(data, size);
+    if (data) munmap((void *)data, size);
+    if (!isCache) return false;
+    if (mkdir(directory, 0755) != 0 && errno != EEXIST) return false;
+    bool enumerated = DTEnumerateCacheSymbols(cachePath, threads, exportImage, &job, &result->images, &result->inputBytes);
+    pthread_mutex_destroy(&job.lock);
+    result->seconds = monotonicSeconds() - start;
+    return enumerated;
+}
@@ -0,0 +1,69 @@
+#ifndef EXPORTSYMBOLS_H
+#define EXPORTSYMBOLS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Compact per-image symbol files from a fetched dyld shared cache.
+ *
+ * For every image of the cache (subcaches and <cache>.symbols are picked up from the
+ * same directory) the defined symbols of its symbol table and its local symbols are
+ * collected, sorted by address and written to <directory>/<UUID>.sym:
+ *
+ *   "DTSYM1\0\0"                 magic
+ *   uint8_t[16]                  image UUID
+ *   uint32_t, uint32_t           cputype, cpusubtype (little endian)
+ *   uleb128 n, n bytes           install name
+ *   uleb128                      symbol count
+ *   per symbol, ascending:
+ *     uleb128                    address delta (first one relative to the image header)
+ *     uleb128 n, n bytes         name
+ *
+ * Symbols below the image header's address have no delta and are not exported. Images
+ * are exported on 'threads' threads.
+ */
+typedef struct {
+    uint32_t images;
+    uint32_t exported;
+    uint64_t symbols;
+    uint64_t inputBytes;
+    uint64_t outputBytes;
+    double   seconds;
+} DTExportResult;
+
+/*
+ * Returns false if cachePath is not a dyld shared cache or directory can not be created.
+ */
+bool DTExportSymbols(const char *cachePath, const char *directory, uint32_t threads, DTExportResult *result);
+
+/*
+ * The symbols of one image as they are exported: sorted by address and name, without
+ * duplicates. Names point into the mapped cache, are not NUL-terminated and are only
+ * valid during the callback.
+ */
+typedef struct {
+    uint64_t address;
+    const char *name;
+    uint32_t length;
+} DTImageSymbol;
+
+typedef struct {
+    uint32_t index;
+    uint8_t uuid[16];
+    int32_t cputype;
+    int32_t cpusubtype;
+    uint64_t address;               /* Unslid address of the image header.             */
+    const char *path;               /* Install name, "" if unknown.                    */
+    const DTImageSymbol *symbols;
+    size_t count;
+} DTImageSymbols;
+
+/*
+ * Calls image() for every image of the cache that has a UUID, on 'threads' threads at
+ * once. images and inputBytes (both optional) receive the cache's image count and the
+ * size of the files read. Returns false if cachePath is not a dyld shared cache.
+ */
+bool DTEnumerateCacheSymbols(const char *cachePath, uint32_t threads, void (*image)(void *context, const DTImageSymbols *symbols), void *context, uint32_t *images, uint64_t *inputBytes);
+
+#endif
@@ -0,0 +1,1046 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include "arena.h"
+#include "fetchsymbols.h"
+#include "metrics.h"
+#include "wirecodec.h"
+#include "workpool.h"
+
+/*
+ * Upper bound for a plist message read from a TCP connection.
+ */
+static const uint32_t kMaximumMessageSize = 64 * 1024 * 1024;
+
+const DTTransferPolicy kDTDefaultTransferPolicy = {
+    .receiveTimeout    = 30,
+    .minimumThroughput = 64 * 1024,
+    .stallWindow       = 30,
+    .maximumReconnects = 5,
+    .initialBackoff    = 1,
+    .maximumBackoff    = 30,
+};
+
+typedef struct dt_request {
+    int index;
+    char *path;
+    int fileBytes;                  /* {file} series, resolved when queued.            */
+    const DTFetchCallbacks *callbacks;
+    void *context;
+    struct dt_request *next;
+} dt_request_t;
+
+/*
+ * A service connection: a MobileDevice one, or a plain TCP socket for sessions created
+ * with DTSessionCreateWithAddress. id numbers the connection in the wire trace.
+ */
+typedef struct {
+    AMDServiceConnectionRef service;
+    int fd;
+    uint32_t id;
+} dt_connection_t;
+
+struct dt_session {
+    AMDeviceRef device;
+    char *host;
+    uint16_t port;
+
+    /*
+     * Arena for the file list, which lives as long as the session: the listing reply is
+     * decoded into it, and only the dictionary around the list is dropped early. Per-call
+     * objects use the default allocator: the arena would not reuse their memory.
+     */
+    CFAllocatorRef allocator;
+    CFArrayRef files;
+    DTWireTraceRef trace;
+    DTAdmissionRef admission;
+    int admission_slot;
+
+    /*
+     * Serializes Lockdown session handling and the file list cache. services counts
+     * the open service connections of the device, lockdown the holders of the
+     * Lockdown session (see lockdownRetain).
+     */
+    pthread_mutex_t connect_lock;
+    uint32_t services;
+    uint32_t lockdown;
+
+    /*
+     * Set once the service has closed a connection after one GetFile: size probes
+     * stop sending several requests per connection.
+     */
+    bool single_request;
+
+    /*
+     * Transfer queue.
+     */
+    pthread_mutex_t lock;
+    pthread_cond_t idle;
+    dt_request_t *head;
+    dt_request_t *tail;
+    uint32_t running;
+    uint32_t maximum_transfers;
+    bool cancelled;
+    DTTransferPolicy policy;
+    DTSessionStatistics statistics;
+
+    /*
+     * Metric series, looked up once; -1 while metrics are off.
+     */
+    struct {
+        int deviceBytes;
+        int handshake;
+        int list;
+        int active;
+        int flush;
+    } metrics;
+};
+
+static double monotonicTime(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static DTSessionRef sessionCreate(void) {
+    DTSessionRef session = calloc(1, sizeof(struct dt_session));
+    if (!session) return NULL;
+    session->maximum_transfers = 1;
+    session->admission_slot = -1;
+    session->policy = kDTDefaultTransferPolicy;
+    if (!(session->allocator = DTArenaCreate())) {
+        free(session);
+        return NULL;
+    }
+    pthread_mutex_init(&session->connect_lock, NULL);
+    pthread_mutex_init(&session->lock, NULL);
+    pthread_cond_init(&session->idle, NULL);
+    session->metrics.handshake = DTMetricsSeries(kDTMetricHandshakeSeconds, NULL);
+    session->metrics.list = DTMetricsSeries(kDTMetricListSeconds, NULL);
+    session->metrics.active = DTMetricsSeries(kDTMetricActiveTransfers, NULL);
+    session->metrics.flush = DTMetricsSeries(kDTMetricFlushSeconds, NULL);
+    return session;
+}
+
+DTSessionRef DTSessionCreate(AMDeviceRef device) {
+    DTSessionRef session = sessionCreate();
+    if (!session) return NULL;
+    AMDeviceRetain(device);
+    session->device = device;
+
+    char udid[128] = "unknown";
+    CFStringRef identifier = AMDeviceCopyDeviceIdentifier(device);
+    if (identifier) {
+        CFStringGetCString(identifier, udid, sizeof(udid), kCFStringEncodingUTF8);
+        CFRelease(identifier);
+    }
+    session->metrics.deviceBytes = DTMetricsSeries(kDTMetricDeviceBytes, udid);
+    return session;
+}
+
+DTSessionRef DTSessionCreateWithAddress(const char *host, uint16_t port) {
+    DTSessionRef session = sessionCreate();
+    if (!session) return NULL;
+    session->host = strdup(host);
+    session->port = port;
+    if (!session->host) {
+        DTSessionRelease(session);
+        return NULL;
+    }
+    char address[300];
+    snprintf(address, sizeof(address), "%s:%u", host, port);
+    session->metrics.deviceBytes = DTMetricsSeries(kDTMetricDeviceBytes, address);
+    return session;
+}
+
+void DTSessionRelease(DTSessionRef session) {
+    if (!session) return;
+    DTSessionWait(session);
+    if (session->admission) DTAdmissionUnregister(session->admission, session->admission_slot);
+    if (session->files) CFRelease(session->files);
+    DTArenaDestroy(session->allocator);
+    if (session->device) AMDeviceRelease(session->device);
+    free(session->host);
+    pthread_cond_destroy(&session->idle);
+    pthread_mutex_destroy(&session->lock);
+    pthread_mutex_destroy(&session->connect_lock);
+    free(session);
+}
+
+AMDeviceRef DTSessionGetDevice(DTSessionRef session) {
+    return session->device;
+}
+
+static uint64_t traceNow(DTSessionRef session) {
+    return session->trace ? DTWireTraceNow(session->trace) : 0;
+}
+
+static void traceEvent(DTSessionRef session, const dt_connection_t *connection, DTWireEventKind kind, uint64_t start, uint64_t requested, int64_t result, const void *payload, uint32_t length) {
+    if (!session->trace) return;
+    DTWireEvent event = {kind, connection->id, start, DTWireTraceNow(session->trace), requested, result, payload, length};
+    DTWireTraceRecord(session->trace, &event);
+}
+
+static int connectAddress(const char *host, uint16_t port) {
+    struct addrinfo hints, *addresses = NULL;
+    char service[8];
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%u", port);
+    if (getaddrinfo(host, service, &hints, &addresses) != 0) return -1;
+
+    int fd = -1;
+    for (struct addrinfo *address = addresses; address && fd < 0; address = address->ai_next) {
+        fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+        if (fd >= 0 && connect(fd, address->ai_addr, address->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+    if (fd >= 0) {
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+#ifdef SO_NOSIGPIPE
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+    }
+    return fd;
+}
+
+/*
+ * The Lockdown session is only needed to start services. Starting one costs a TLS
+ * handshake with lockdownd, so a batch of connections (DTSessionGetFileSizes) holds
+ * one session for all of them; the last holder stops it.
+ */
+static void lockdownRetain(DTSessionRef session) {
+    if (!session->device) return;
+    pthread_mutex_lock(&session->connect_lock);
+    if (session->lockdown++ == 0) AMDeviceStartSession(session->device);
+    pthread_mutex_unlock(&session->connect_lock);
+}
+
+static void lockdownRelease(DTSessionRef session) {
+    if (!session->device) return;
+    pthread_mutex_lock(&session->connect_lock);
+    if (--session->lockdown == 0) AMDeviceStopSession(session->device);
+    pthread_mutex_unlock(&session->connect_lock);
+}
+
+/*
+ * Starts a fetchsymbols service connection. connect_lock only covers the service start
+ * itself; the Lockdown session is shared with other holders.
+ */
+static bool DTSessionConnect(DTSessionRef session, dt_connection_t *connection) {
+    uint64_t start = traceNow(session);
+    double handshake = monotonicTime();
+    connection->service = NULL;
+    connection->fd = -1;
+    connection->id = session->trace ? DTWireTraceNewConnection(session->trace) : 0;
+
+    if (session->device) {
+        lockdownRetain(session);
+        pthread_mutex_lock(&session->connect_lock);
+        /*
+         * Only the service start: not the wait for connect_lock or the Lockdown session.
+         */
+        handshake = monotonicTime();
+        if (AMDeviceSecureStartService(session->device, AMSVC_DT_FETCH_SYMBOLS, NULL, &connection->service) != MDERR_OK)
+            connection->service = NULL;
+        handshake = monotonicTime() - handshake;
+        if (connection->service) session->services++;
+        pthread_mutex_unlock(&session->connect_lock);
+        lockdownRelease(session);
+    } else {
+        connection->fd = connectAddress(session->host, session->port);
+        handshake = monotonicTime() - handshake;
+    }
+
+    bool connected = connection->service || connection->fd >= 0;
+    traceEvent(session, connection, kDTWireOpen, start, 0, connected ? 0 : -1, NULL, 0);
+    if (connected) DTMetricsObserve(session->metrics.handshake, handshake);
+
+    /*
+     * Bound every receive so a sleeping device or a bad cable can't block forever.
+     */
+    if (connected && session->policy.receiveTimeout > 0) {
+        int fd = connection->service ? AMDServiceConnectionGetSocket(connection->service) : connection->fd;
+        struct timeval timeout;
+        timeout.tv_sec = (time_t)session->policy.receiveTimeout;
+        timeout.tv_usec = (suseconds_t)((session->policy.receiveTimeout - timeout.tv_sec) * 1e6);
+        if (fd >= 0) setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    }
+
+    return connected;
+}
+
+static void connectionInvalidate(DTSessionRef session, dt_connection_t *connection) {
+    uint64_t start = traceNow(session);
+    if (connection->service) {
+        AMDServiceConnectionInvalidate(connection->service);
+        pthread_mutex_lock(&session->connect_lock);
+        session->services--;
+        pthread_mutex_unlock(&session->connect_lock);
+    } else
+        close(connection->fd);
+    traceEvent(session, connection, kDTWireClose, start, 0, 0, NULL, 0);
+}
+
+static uint64_t connectionSend(DTSessionRef session, dt_connection_t *connection, const void *buffer, size_t length) {
+    uint64_t start = traceNow(session);
+    uint64_t sent = 0;
+    if (connection->service)
+        sent = AMDServiceConnectionSend(connection->service, buffer, length);
+    else {
+        while (sent < length) {
+            ssize_t chunk = send(connection->fd, (const char *)buffer + sent, length - sent, 0);
+            if (chunk <= 0) break;
+            sent += chunk;
+        }
+    }
+    traceEvent(session, connection, kDTWireSend, start, length, (int64_t)sent, buffer, (uint32_t)length);
+    return sent;
+}
+
+/*
+ * body - the buffer is part of a file body; a receive may return less than size.
+ * Command echoes and size headers are read in full from TCP connections.
+ */
+static uint64_t connectionReceive(DTSessionRef session, dt_connection_t *connection, void *buffer, size_t size, bool body) {
+    uint64_t start = traceNow(session);
+    uint64_t received;
+    if (connection->service)
+        received = AMDServiceConnectionReceive(connection->service, buffer, size);
+    else {
+        ssize_t chunk = recv(connection->fd, buffer, size, body ? 0 : MSG_WAITALL);
+        received = chunk < 0 ? (uint64_t)-1 : (uint64_t)chunk;
+    }
+    traceEvent(session, connection, body ? kDTWireReceiveData : kDTWireReceive, start, size, (int64_t)received,
+               buffer, received <= size ? (uint32_t)received : 0);
+    return received;
+}
+
+/*
+ * Reads exactly size bytes without tracing them: they are traced as one message.
+ */
+static bool receiveMessageBytes(dt_connection_t *connection, void *buffer, size_t size) {
+    size_t received = 0;
+    while (received < size) {
+        ssize_t chunk;
+        if (connection->service)
+            chunk = (ssize_t)AMDServiceConnectionReceive(connection->service, (char *)buffer + received, size - received);
+        else
+            chunk = recv(connection->fd, (char *)buffer + received, size - received, MSG_WAITALL);
+        if (chunk <= 0) return false;
+        received += (size_t)chunk;
+    }
+    return true;
+}
+
+/*
+ * Returns the next plist message created in allocator, or NULL. Both kinds of connection
+ * carry it the way Lockdown does: a big endian 32-bit length followed by the serialized
+ * plist. It is read raw rather than with AMDServiceConnectionReceiveMessage so it is
+ * decoded once, straight into the allocator the caller keeps it in.
+ */
+static CFPropertyListRef connectionReceiveMessage(DTSessionRef session, dt_connection_t *connection, CFAllocatorRef allocator) {
+    uint64_t start = traceNow(session);
+    CFPropertyListRef message = NULL;
+    CFDataRef data = NULL;
+    DTWireLength field;
+    uint32_t length = 0;
+
+    if (receiveMessageBytes(connection, &field, sizeof(field)) &&
+        (length = DTWireDecodeLength(&field)) > 0 && length <= kMaximumMessageSize) {
+        UInt8 *bytes = malloc(length);
+        if (bytes && receiveMessageBytes(connection, bytes, length))
+            data = CFDataCreate(kCFAllocatorDefault, bytes, length);
+        free(bytes);
+        if (data) message = CFPropertyListCreateWithData(allocator, data, kCFPropertyListImmutable, NULL, NULL);
+    }
+
+    traceEvent(session, connection, kDTWireMessage, start, 0, message ? CFDataGetLength(data) : -1,
+               data ? CFDataGetBytePtr(data) : NULL, data ? (uint32_t)CFDataGetLength(data) : 0);
+    if (data) CFRelease(data);
+    return message;
+}
+
+/*
+ * Prepares a retry after a failed transfer, which always gets a new service connection.
+ * The device connection is dropped and re-established too, but only while no other
+ * service connection or Lockdown session of the session is open: cycling it would break
+ * transfers that are still receiving.
+ */
+static void DTSessionReconnect(DTSessionRef session) {
+    if (session->device) {
+        pthread_mutex_lock(&session->connect_lock);
+        if (session->services == 0 && session->lockdown == 0) {
+            AMDeviceDisconnect(session->device);
+            AMDeviceConnect(session->device);
+        }
+        pthread_mutex_unlock(&session->connect_lock);
+    }
+
+    pthread_mutex_lock(&session->lock);
+    session->statistics.reconnects++;
+    pthread_mutex_unlock(&session->lock);
+}
+
+static CFArrayRef listFilesPlistCommand(DTSessionRef session) {
+    dt_connection_t connection;
+    CFPropertyListRef response = NULL;
+    CFArrayRef files = NULL;
+    double start = monotonicTime();
+
+    if (DTSessionConnect(session, &connection)) {
+        DTWireCommand command = DTWireEncodeCommand(kDTWireCommandListFilesPlist), echo;
+        if (connectionSend(session, &connection, &command, sizeof(command)) == sizeof(command) &&
+            connectionReceive(session, &connection, &echo, sizeof(echo), false) == sizeof(echo) &&
+            DTWireCheckEcho(&echo, kDTWireCommandListFilesPlist))
+            response = connectionReceiveMessage(session, &connection, session->allocator);
+        connectionInvalidate(session, &connection);
+    }
+
+    if (response) {
+        if (CFGetTypeID(response) == CFDictionaryGetTypeID()) {
+            files = CFDictionaryGetValue(response, CFSTR("files"));
+            if (files && (CFGetTypeID(files) == CFArrayGetTypeID())) CFRetain(files);
+            else files = NULL;
+        }
+        CFRelease(response);
+    }
+    if (files) DTMetricsObserve(session->metrics.list, monotonicTime() - start);
+    else DTMetricsAdd(DTMetricsSeries(kDTMetricErrors, "list"), 1);
+    return files;
+}
+
+CFArrayRef DTSessionCopyFiles(DTSessionRef session) {
+    pthread_mutex_lock(&session->connect_lock);
+    bool cached = session->files != NULL;
+    pthread_mutex_unlock(&session->connect_lock);
+
+    if (!cached) {
+        CFArrayRef files = listFilesPlistCommand(session);
+        pthread_mutex_lock(&session->connect_lock);
+        if (!session->files) session->files = files;
+        else if (files) CFRelease(files);
+        pthread_mutex_unlock(&session->connect_lock);
+    }
+
+    pthread_mutex_lock(&session->connect_lock);
+    CFArrayRef files = session->files ? CFRetain(session->files) : NULL;
+    pthread_mutex_unlock(&session->connect_lock);
+    return files;
+}
+
+bool DTSessionGetFilePath(DTSessionRef session, int index, char *buffer, size_t size) {
+    CFArrayRef files = DTSessionCopyFiles(session);
+    bool found = files && (index >= 0) && (index < CFArrayGetCount(files)) &&
+                 CFStringGetCString(CFArrayGetValueAtIndex(files, index), buffer, size, kCFStringEncodingUTF8);
+    if (files) CFRelease(files);
+    return found;
+}
+
+int DTSessionGetDyldIndex(DTSessionRef session) {
+    int index = -1;
+    CFArrayRef filesList = DTSessionCopyFiles(session);
+
+    if (filesList != NULL) {
+        for (CFIndex i = 0; i < CFArrayGetCount(filesList); i++) {
+            if (CFEqual(CFArrayGetValueAtIndex(filesList, i), CFSTR("/usr/lib/dyld"))) {
+                index = (int)i;
+                break;
+            }
+        }
+        CFRelease(filesList);
+    }
+
+    return index;
+}
+
+int DTSessionGetSharedCacheIndex(DTSessionRef session, CFStringRef architecture) {
+    int index = -1;
+    CFArrayRef filesList = DTSessionCopyFiles(session);
+    CFStringRef sharedCachePath = CFSTR("/System/Library/Caches/com.apple.dyld/dyld_shared_cache_");
+
+    if (filesList != NULL) {
+        if (architecture) {
+            sharedCachePath = CFStringCreateWithFormat(kCFAllocatorDefault, NULL, CFSTR("%@%@"), sharedCachePath, architecture);
+            if (!sharedCachePath) {
+                CFRelease(filesList);
+                return -1;
+            }
+        }
+
+        for (CFIndex i = 0; i < CFArrayGetCount(filesList); i++) {
+            bool match;
+            if (architecture) match = CFEqual(CFArrayGetValueAtIndex(filesList, i), sharedCachePath);
+            else match = CFStringFind(CFArrayGetValueAtIndex(filesList, i), sharedCachePath, 0).length != 0;
+            if (match) {
+                index = (int)i;
+                break;
+            }
+        }
+
+        if (architecture) CFRelease(sharedCachePath);
+        CFRelease(filesList);
+    }
+
+    return index;
+}
+
+static bool DTSessionIsCancelled(DTSessionRef session) {
+    pthread_mutex_lock(&session->lock);
+    bool cancelled = session->cancelled;
+    pthread_mutex_unlock(&session->lock);
+    return cancelled;
+}
+
+/*
+ * Receives the file body straight into a shared mapping of the destination file.
+ */
+static DTError receiveFile(DTSessionRef session, dt_connection_t *connection, int index, const char *path, uint64_t size, int fileBytes, const DTFetchCallbacks *callbacks, void *context) {
+    int file = 0;
+    if (access(path, F_OK) == -1) {
+        file = open(path, O_RDWR | O_CREAT, S_IROTH | S_IRGRP | S_IWUSR | S_IRUSR);
+    }
+    else
+        file = open(path, O_RDWR);
+    if (file < 0) return kDTErrorFile;
+
+    /*
+     * Set file size.
+     */
+    if (ftruncate(file, size) != 0) {
+        close(file);
+        return kDTErrorFile;
+    }
+
+    void *map = mmap(0, size, PROT_WRITE | PROT_READ, MAP_SHARED, file, 0);
+    close(file);
+    if (map == MAP_FAILED) return kDTErrorMap;
+
+    DTError error = kDTErrorNone;
+    const DTTransferPolicy *policy = &session->policy;
+    uint64_t rsize = 0;
+    uint64_t windowSize = 0;
+    double windowStart = monotonicTime();
+    if (callbacks && callbacks->progress) callbacks->progress(context, index, 0, size);
+    while (rsize < size) {
+        if (DTSessionIsCancelled(session)) {
+            error = kDTErrorCancelled;
+            break;
+        }
+        double receiveStart = monotonicTime();
+        uint64_t chunk = connectionReceive(session, connection, (void *)((char *)map + rsize), size-rsize, true);
+        double now = monotonicTime();
+        /*
+         * Zero or (uint64_t)-1 means the connection is gone or the receive timed out;
+         * don't spin on it.
+         */
+        if (chunk == 0 || chunk > size - rsize) {
+            error = (policy->receiveTimeout > 0 && now - receiveStart >= policy->receiveTimeout) ? kDTErrorStalled : kDTErrorConnectionLost;
+            break;
+        }
+        rsize += chunk;
+        if (session->admission) DTAdmissionAddBytes(session->admission, session->admission_slot, chunk);
+        DTMetricsAdd(session->metrics.deviceBytes, (int64_t)chunk);
+        DTMetricsAdd(fileBytes, (int64_t)chunk);
+        if (callbacks && callbacks->progress) callbacks->progress(context, index, rsize, size);
+
+        /*
+         * Throughput watchdog over fixed windows.
+         */
+        if (policy->minimumThroughput && policy->stallWindow > 0 && now - windowStart >= policy->stallWindow) {
+            if ((double)(rsize - windowSize) / (now - windowStart) < (double)policy->minimumThroughput) {
+                error = kDTErrorStalled;
+                break;
+            }
+            windowStart = now;
+            windowSize = rsize;
+        }
+    }
+    /*
+     * Write the file back before it is reported complete; munmap alone leaves that to
+     * the kernel.
+     */
+    if (error == kDTErrorNone) {
+        double flushStart = monotonicTime();
+        if (msync(map, size, MS_SYNC) != 0) error = kDTErrorFile;
+        else {
+            double flushSeconds = monotonicTime() - flushStart;
+            DTMetricsObserve(session->metrics.flush, flushSeconds);
+            if (session->admission) DTAdmissionAddFlush(session->admission, size, flushSeconds);
+        }
+    }
+    munmap(map, size);
+    if (error == kDTErrorStalled) {
+        pthread_mutex_lock(&session->lock);
+        session->statistics.stalls++;
+        pthread_mutex_unlock(&session->lock);
+    }
+    return error;
+}
+
+/*
+ * Opens a service connection and runs GetFile up to the 64-bit size header. On success
+ * the file body follows on the connection; the caller invalidates it either way.
+ */
+static DTError requestFile(DTSessionRef session, dt_connection_t *connection, int index, uint64_t *size) {
+    if (!DTSessionConnect(session, connection)) return kDTErrorServiceConnection;
+
+    DTWireCommand command = DTWireEncodeCommand(kDTWireCommandGetFile);
+    if (connectionSend(session, connection, &command, sizeof(command)) != sizeof(command)) return kDTErrorSend;
+
+    /*
+     * Command confirmation. Sent for all commands.
+     */
+    DTWireCommand echo;
+    if (connectionReceive(session, connection, &echo, sizeof(echo), false) != sizeof(echo) ||
+        !DTWireCheckEcho(&echo, kDTWireCommandGetFile))
+        return kDTErrorConfirmation;
+
+    DTWireIndex request;
+    if (!DTWireEncodeIndex(index, &request)) return kDTErrorIndex;
+    if (connectionSend(session, connection, &request, sizeof(request)) != sizeof(request)) return kDTErrorRequestSize;
+
+    DTWireSize header;
+    if (connectionReceive(session, connection, &header, sizeof(header), false) != sizeof(header))
+        return kDTErrorConnectionLost;
+    if (!DTWireDecodeSize(&header, size)) return *size ? kDTErrorBadSize : kDTErrorZeroSize;
+    return kDTErrorNone;
+}
+
+static const char *errorKind(DTError error) {
+    switch (error) {
+        case kDTErrorServiceConnection: return "service_connection";
+        case kDTErrorList:              return "list";
+        case kDTErrorIndex:             return "index";
+        case kDTErrorSend:              return "send";
+        case kDTErrorConfirmation:      return "confirmation";
+        case kDTErrorRequestSize:       return "request_size";
+        case kDTErrorZeroSize:          return "zero_size";
+        case kDTErrorFile:              return "file";
+        case kDTErrorMap:               return "map";
+        case kDTErrorConnectionLost:    return "connection_lost";
+        case kDTErrorCancelled:         return "cancelled";
+        case kDTErrorStalled:           return "stalled";
+        case kDTErrorBadSize:           return "bad_size";
+        default:                        return "unknown";
+    }
+}
+
+static void countError(DTError error) {
+    if (error != kDTErrorNone) DTMetricsAdd(DTMetricsSeries(kDTMetricErrors, errorKind(error)), 1);
+}
+
+static bool admissionCancelled(void *context) {
+    return DTSessionIsCancelled(context);
+}
+
+/*
+ * One GetFile exchange on a fresh service connection, once the host admits it.
+ */
+static DTError getFileAttempt(DTSessionRef session, int index, const char *path, int fileBytes, const DTFetchCallbacks *callbacks, void *context) {
+    if (session->admission && !DTAdmissionAcquire(session->admission, session->admission_slot, admissionCancelled, session))
+        return kDTErrorCancelled;
+    DTMetricsAdd(session->metrics.active, 1);
+    dt_connection_t connection;
+    uint64_t size = 0;
+    DTError error = requestFile(session, &connection, index, &size);
+    if (error == kDTErrorNone)
+        error = receiveFile(session, &connection, index, path, size, fileBytes, callbacks, context);
+    if (error != kDTErrorServiceConnection) connectionInvalidate(session, &connection);
+    DTMetricsAdd(session->metrics.active, -1);
+    if (session->admission) DTAdmissionRelease(session->admission, session->admission_slot);
+    countError(error);
+    return error;
+}
+
+static bool isRetryable(DTError error) {
+    switch (error) {
+        case kDTErrorServiceConnection:
+        case kDTErrorSend:
+        case kDTErrorConfirmation:
+        case kDTErrorRequestSize:
+        case kDTErrorConnectionLost:
+        case kDTErrorStalled:
+        case kDTErrorBadSize:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/*
+ * Sleeps in short steps so a cancelled session doesn't wait out the whole backoff.
+ */
+static void backoff(DTSessionRef session, double seconds) {
+    double deadline = monotonicTime() + seconds;
+    while (!DTSessionIsCancelled(session) && monotonicTime() < deadline)
+        usleep(100000);
+}
+
+/*
+ * index - the index of file in an array returned by ListFiles or ListFilesPlist command.
+ *  path - where to save the file on the host machine.
+ * Failed attempts are retried on a new device connection with exponential backoff.
+ */
+static DTError getFileCommand(DTSessionRef session, int index, const char *path, int fileBytes, const DTFetchCallbacks *callbacks, void *context) {
+    CFArrayRef files = DTSessionCopyFiles(session);
+    bool exists = files && (index >= 0) && (CFArrayGetCount(files) > index);
+    if (files) CFRelease(files);
+    if (!files) return kDTErrorList;
+    if (!exists) return kDTErrorIndex;
+
+    double delay = session->policy.initialBackoff;
+    for (uint32_t attempt = 0;; attempt++) {
+        if (DTSessionIsCancelled(session)) return kDTErrorCancelled;
+        DTError error = getFileAttempt(session, index, path, fileBytes, callbacks, context);
+        if (!isRetryable(error) || attempt >= session->policy.maximumReconnects) return error;
+
+        backoff(session, delay);
+        delay = delay * 2 < session->policy.maximumBackoff ? delay * 2 : session->policy.maximumBackoff;
+        if (DTSessionIsCancelled(session)) return kDTErrorCancelled;
+        DTSessionReconnect(session);
+    }
+}
+
+DTError DTSessionGetFileSize(DTSessionRef session, int index, uint64_t *size) {
+    *size = 0;
+    CFArrayRef files = DTSessionCopyFiles(session);
+    bool exists = files && (index >= 0) && (CFArrayGetCount(files) > index);
+    if (files) CFRelease(files);
+    if (!files) return kDTErrorList;
+    if (!exists) return kDTErrorIndex;
+
+    dt_connection_t connection;
+    DTError error = requestFile(session, &connection, index, size);
+    if (error != kDTErrorServiceConnection) connectionInvalidate(session, &connection);
+    countError(error);
+    return error;
+}
+
+/*
+ * Size probes send up to kProbeDepth GetFile requests back-to-back on one connection.
+ * The service streams every body right after its size header, so a body is read and
+ * dropped when that is cheaper than a new connection (a service start takes ~10 ms,
+ * in which USB carries ~256 KB); after a bigger one the connection is replaced.
+ */
+static const uint32_t kProbeDepth = 8;
+static const uint64_t kMaximumDrainedBody = 256 * 1024;
+
+typedef struct {
+    DTSessionRef session;
+    uint64_t *sizes;
+    DTError *errors;
+    pthread_mutex_t lock;
+    uint32_t next;
+    uint32_t count;
+} size_probe_t;
+
+static void setProbe(size_probe_t *probe, uint32_t index, uint64_t size, DTError error) {
+    probe->sizes[index] = size;
+    if (probe->errors) probe->errors[index] = error;
+    countError(error);
+}
+
+static uint32_t takeProbes(size_probe_t *probe, uint32_t *first) {
+    pthread_mutex_lock(&probe->lock);
+    uint32_t taken = probe->count - probe->next < kProbeDepth ? probe->count - probe->next : kProbeDepth;
+    *first = probe->next;
+    probe->next += taken;
+    pthread_mutex_unlock(&probe->lock);
+    return taken;
+}
+
+static bool isSingleRequest(DTSessionRef session) {
+    pthread_mutex_lock(&session->connect_lock);
+    bool single = session->single_request;
+    pthread_mutex_unlock(&session->connect_lock);
+    return single;
+}
+
+static void setSingleRequest(DTSessionRef session) {
+    pthread_mutex_lock(&session->connect_lock);
+    session->single_request = true;
+    pthread_mutex_unlock(&session->connect_lock);
+}
+
+/*
+ * GetFile for indexes first..first+count-1 in one send, without waiting for the echoes.
+ */
+static bool sendProbes(DTSessionRef session, dt_connection_t *connection, uint32_t first, uint32_t count) {
+    struct {
+        DTWireCommand command;
+        DTWireIndex index;
+    } requests[kProbeDepth];
+    for (uint32_t i = 0; i < count; i++) {
+        requests[i].command = DTWireEncodeCommand(kDTWireCommandGetFile);
+        if (!DTWireEncodeIndex((int)(first + i), &requests[i].index)) return false;
+    }
+    return connectionSend(session, connection, requests, count * sizeof(requests[0])) == count * sizeof(requests[0]);
+}
+
+/*
+ * The response to a GetFile sent earlier, up to the size header.
+ */
+static DTError receiveSize(DTSessionRef session, dt_connection_t *connection, uint64_t *size) {
+    DTWireCommand echo;
+    if (connectionReceive(session, connection, &echo, sizeof(echo), false) != sizeof(echo) ||
+        !DTWireCheckEcho(&echo, kDTWireCommandGetFile))
+        return kDTErrorConfirmation;
+    DTWireSize header;
+    if (connectionReceive(session, connection, &header, sizeof(header), false) != sizeof(header))
+        return kDTErrorConnectionLost;
+    if (!DTWireDecodeSize(&header, size)) return *size ? kDTErrorBadSize : kDTErrorZeroSize;
+    return kDTErrorNone;
+}
+
+static bool drainBody(DTSessionRef session, dt_connection_t *connection, uint64_t size) {
+    uint8_t buffer[16 * 1024];
+    while (size) {
+        uint64_t received = connectionReceive(session, connection, buffer, size < sizeof(buffer) ? (size_t)size : sizeof(buffer), true);
+        if (received == 0 || received > size) return false;
+        size -= received;
+    }
+    return true;
+}
+
+/*
+ * One probe connection. A connection that has answered a GetFile and then fails on
+ * the next echo was closed by the service: the session falls back to one GetFile per
+ * connection and the unanswered requests are sent again.
+ */
+static void probeConnection(void *context, size_t worker) {
+    size_probe_t *probe = context;
+    DTSessionRef session = probe->session;
+    dt_connection_t connection;
+    bool connected = false, served = false;
+    uint32_t first, count;
+    (void)worker;
+
+    while ((count = takeProbes(probe, &first))) {
+        while (count) {
+            if (!connected) {
+                served = false;
+                if (!(connected = DTSessionConnect(session, &connection))) {
+                    setProbe(probe, first++, 0, kDTErrorServiceConnection);
+                    count--;
+                    continue;
+                }
+            }
+
+            bool single = isSingleRequest(session);
+            uint32_t depth = single ? 1 : count, answered = 0;
+            bool keep = sendProbes(session, &connection, first, depth);
+            if (!keep && served)
+                setSingleRequest(session);
+            else if (!keep)
+                setProbe(probe, first + answered++, 0, kDTErrorSend);
+            while (keep && answered < depth) {
+                uint64_t size = 0;
+                DTError error = receiveSize(session, &connection, &size);
+                if (error == kDTErrorConfirmation && served) {
+                    setSingleRequest(session);
+                    keep = false;
+                    break;
+                }
+                setProbe(probe, first + answered++, size, error);
+                served = true;
+                keep = error == kDTErrorZeroSize ||
+                       (error == kDTErrorNone && !single && size <= kMaximumDrainedBody && drainBody(session, &connection, size));
+            }
+
+            first += answered;
+            count -= answered;
+            if (!keep) {
+                connectionInvalidate(session, &connection);
+                connected = false;
+            }
+        }
+    }
+    if (connected) connectionInvalidate(session, &connection);
+}
+
+void DTSessionGetFileSizes(DTSessionRef session, uint32_t count, uint32_t connections, uint64_t *sizes, DTError *errors) {
+    CFArrayRef files = DTSessionCopyFiles(session);
+    uint32_t listed = files ? (uint32_t)CFArrayGetCount(files) : 0;
+    DTError missing = files ? kDTErrorIndex : kDTErrorList;
+    if (files) CFRelease(files);
+    size_probe_t probe = {session, sizes, errors, PTHREAD_MUTEX_INITIALIZER, 0, listed < count ? listed : count};
+    for (uint32_t i = probe.count; i < count; i++)
+        setProbe(&probe, i, 0, missing);
+
+    if (!connections) connections = 1;
+    if (connections > probe.count) connections = probe.count;
+    lockdownRetain(session);
+    if (connections) DTWorkPoolApply(connections, connections, probeConnection, &probe);
+    lockdownRelease(session);
+    pthread_mutex_destroy(&probe.lock);
+}
+
+/*
+ * The {file} byte counter of a fetch. Looking it up goes through the file list and a
+ * CFString conversion, so it is done once per request rather than per attempt.
+ */
+static int fileSeries(DTSessionRef session, int index) {
+    char devicePath[1024];
+    if (session->metrics.deviceBytes < 0 || !DTSessionGetFilePath(session, index, devicePath, sizeof(devicePath))) return -1;
+    return DTMetricsSeries(kDTMetricFileBytes, devicePath);
+}
+
+static DTError fetchFile(DTSessionRef session, int index, const char *path, int fileBytes, const DTFetchCallbacks *callbacks, void *context) {
+    double start = monotonicTime();
+    DTError error = getFileCommand(session, index, path, fileBytes, callbacks, context);
+    DTMetricsObserve(DTMetricsSeries(kDTMetricTransferSeconds, error == kDTErrorNone ? "ok" : errorKind(error)), monotonicTime() - start);
+    if (callbacks && callbacks->completion) callbacks->completion(context, index, path, error);
+    return error;
+}
+
+DTError DTSessionFetchFile(DTSessionRef session, int index, const char *path, const DTFetchCallbacks *callbacks, void *context) {
+    return fetchFile(session, index, path, fileSeries(session, index), callbacks, context);
+}
+
+static void *DTSessionTransferThread(void *arg) {
+    DTSessionRef session = arg;
+
+    pthread_mutex_lock(&session->lock);
+    while (session->head) {
+        dt_request_t *request = session->head;
+        session->head = request->next;
+        if (!session->head) session->tail = NULL;
+        bool cancelled = session->cancelled;
+        pthread_mutex_unlock(&session->lock);
+
+        if (cancelled) {
+            if (request->callbacks && request->callbacks->completion)
+                request->callbacks->completion(request->context, request->index, request->path, kDTErrorCancelled);
+        } else
+            fetchFile(session, request->index, request->path, request->fileBytes, request->callbacks, request->context);
+        free(request->path);
+        free(request);
+
+        pthread_mutex_lock(&session->lock);
+    }
+    session->running--;
+    pthread_cond_broadcast(&session->idle);
+    pthread_mutex_unlock(&session->lock);
+    return NULL;
+}
+
+/*
+ * Starts transfer threads for queued requests. Called with session->lock held.
+ */
+static void DTSessionScheduleTransfers(DTSessionRef session) {
+    uint32_t queued = 0;
+    for (dt_request_t *request = session->head; request && queued < session->maximum_transfers; request = request->next)
+        queued++;
+    while (session->running < session->maximum_transfers && session->running < queued) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, DTSessionTransferThread, session) != 0) break;
+        pthread_detach(thread);
+        session->running++;
+    }
+}
+
+void DTSessionFetchFileAsync(DTSessionRef session, int index, const char *path, const DTFetchCallbacks *callbacks, void *context) {
+    dt_request_t *request = calloc(1, sizeof(dt_request_t));
+    char *pathCopy = strdup(path);
+    if (!request || !pathCopy) {
+        free(request);
+        free(pathCopy);
+        if (callbacks && callbacks->completion) callbacks->completion(context, index, path, kDTErrorFile);
+        return;
+    }
+    request->index = index;
+    request->path = pathCopy;
+    request->fileBytes = fileSeries(session, index);
+    request->callbacks = callbacks;
+    request->context = context;
+
+    pthread_mutex_lock(&session->lock);
+    if (session->tail) session->tail->next = request;
+    else session->head = request;
+    session->tail = request;
+    DTSessionScheduleTransfers(session);
+    pthread_mutex_unlock(&session->lock);
+}
+
+void DTSessionSetMaximumTransfers(DTSessionRef session, uint32_t transfers) {
+    pthread_mutex_lock(&session->lock);
+    session->maximum_transfers = transfers ? transfers : 1;
+    DTSessionScheduleTransfers(session);
+    pthread_mutex_unlock(&session->lock);
+}
+
+void DTSessionSetTransferPolicy(DTSessionRef session, const DTTransferPolicy *policy) {
+    session->policy = *policy;
+}
+
+void DTSessionSetWireTrace(DTSessionRef session, DTWireTraceRef trace) {
+    session->trace = trace;
+}
+
+void DTSessionSetAdmission(DTSessionRef session, DTAdmissionRef admission, const char *name) {
+    if (session->admission) DTAdmissionUnregister(session->admission, session->admission_slot);
+    session->admission = admission;
+    session->admission_slot = admission ? DTAdmissionRegister(admission, name) : -1;
+}
+
+bool DTSessionGetAdmissionStatus(DTSessionRef session, DTAdmissionStatus *status) {
+    if (!session->admission) return false;
+    DTAdmissionGetStatus(session->admission, session->admission_slot, status);
+    return true;
+}
+
+void DTSessionGetMemoryStatistics(DTSessionRef session, DTArenaStatistics *statistics) {
+    DTArenaGetStatistics(session->allocator, statistics);
+}
+
+void DTSessionGetStatistics(DTSessionRef session, DTSessionStatistics *statistics) {
+    pthread_mutex_lock(&session->lock);
+    *statistics = session->statistics;
+    pthread_mutex_unlock(&session->lock);
+}
+
+void DTSessionWait(DTSessionRef session) {
+    pthread_mutex_lock(&session->lock);
+    while (session->head || session->running)
+        pthread_cond_wait(&session->idle, &session->lock);
+    pthread_mutex_unlock(&session->lock);
+}
+
+void DTSessionCancel(DTSessionRef session) {
+    pthread_mutex_lock(&session->lock);
+    session->cancelled = true;
+    pthread_mutex_unlock(&session->lock);
+}
+
+const char *DTErrorDescription(DTError error) {
+    switch (error) {
+        case kDTErrorNone:              return "No error.";
+        case kDTErrorServiceConnection: return "Can not connect to com.apple.dt.fetchsymbols service.";
+        case kDTErrorList:              return "Can not get list of files.";
+        case kDTErrorIndex:             return "Index does not exist.";
+        case kDTErrorSend:              return "Can not send message to com.apple.dt.fetchsymbols service. Size mismatch.";
+        case kDTErrorConfirmation:      return "com.apple.dt.fetchsymbols service internal error.";
+        case kDTErrorRequestSize:       return "Failed to request file size.";
+        case kDTErrorZeroSize:          return "File size is zero.";
+        case kDTErrorFile:              return "File can not be opened.";
+        case kDTErrorMap:               return "File can not be mapped.";
+        case kDTErrorConnectionLost:    return "Connection lost.";
+        case kDTErrorCancelled:         return "Cancelled.";
+        case kDTErrorStalled:           return "Transfer stalled.";
+        case kDTErrorBadSize:           return "The service reported an impossible file size.";
+    }
+    return "Unknown error.";
+}
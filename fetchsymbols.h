@@ -0,0 +1,190 @@
+#ifndef FETCHSYMBOLS_H
+#define FETCHSYMBOLS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "MobileDevice.h"
+#include "admission.h"
+#include "arena.h"
+#include "wiretrace.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * com.apple.dt.fetchsymbols client library.
+ *
+ * A session wraps one connected device (AMDeviceConnect must have succeeded). The file
+ * list is requested once per session and cached. Transfers either run on the calling
+ * thread (DTSessionFetchFile) or are queued on the session's transfer threads
+ * (DTSessionFetchFileAsync), reporting through DTFetchCallbacks.
+ *
+ * DTSessionCreateWithAddress talks the same protocol over plain TCP instead, e.g. to a
+ * dtreplay server reproducing a recorded wire trace.
+ */
+
+typedef struct dt_session *DTSessionRef;
+
+typedef enum {
+    kDTErrorNone = 0,
+    kDTErrorServiceConnection,      /* Can not start com.apple.dt.fetchsymbols.        */
+    kDTErrorList,                   /* The service did not return a file list.         */
+    kDTErrorIndex,                  /* No file with such index.                        */
+    kDTErrorSend,                   /* Command was not sent completely.                */
+    kDTErrorConfirmation,           /* Command echo does not match the command.        */
+    kDTErrorRequestSize,            /* File index was not sent completely.             */
+    kDTErrorZeroSize,               /* The service reported an empty file.             */
+    kDTErrorFile,                   /* Destination file can not be opened or resized.  */
+    kDTErrorMap,                    /* Destination file can not be mapped.             */
+    kDTErrorConnectionLost,         /* The connection closed before the file arrived.  */
+    kDTErrorCancelled,              /* DTSessionCancel was called.                     */
+    kDTErrorStalled,                /* Throughput stayed below the policy minimum.     */
+    kDTErrorBadSize,                /* Size header above kDTWireMaximumFileSize.       */
+} DTError;
+
+/*
+ * How a transfer reacts to a slow or dead connection.
+ *   receiveTimeout     - seconds a single receive may block (0 - forever).
+ *   minimumThroughput  - bytes per second averaged over stallWindow seconds; a transfer
+ *                        below it is considered stalled (0 - no watchdog).
+ *   maximumReconnects  - how many times a failed or stalled transfer is retried on a new
+ *                        device connection. The file is requested again from the start.
+ *   initialBackoff, maximumBackoff - seconds to wait before a reconnect; doubled each time.
+ */
+typedef struct {
+    double   receiveTimeout;
+    uint64_t minimumThroughput;
+    double   stallWindow;
+    uint32_t maximumReconnects;
+    double   initialBackoff;
+    double   maximumBackoff;
+} DTTransferPolicy;
+
+extern const DTTransferPolicy kDTDefaultTransferPolicy;
+
+typedef struct {
+    uint32_t stalls;
+    uint32_t reconnects;
+} DTSessionStatistics;
+
+/*
+ * All callbacks are optional and are called on the thread doing the transfer.
+ *   progress   - called with received == 0 once the size is known, then after every chunk.
+ *   completion - called exactly once per fetch.
+ */
+typedef struct {
+    void (*progress)(void *context, int index, uint64_t received, uint64_t size);
+    void (*completion)(void *context, int index, const char *path, DTError error);
+} DTFetchCallbacks;
+
+DTSessionRef DTSessionCreate(AMDeviceRef device);
+DTSessionRef DTSessionCreateWithAddress(const char *host, uint16_t port);
+
+/*
+ * Waits for queued transfers and frees the session.
+ */
+void DTSessionRelease(DTSessionRef session);
+
+/*
+ * NULL for sessions created with DTSessionCreateWithAddress.
+ */
+AMDeviceRef DTSessionGetDevice(DTSessionRef session);
+
+/*
+ * Returns the cached list of file paths on the device, or NULL. Caller releases it.
+ * The list lives in the session's arena, which stays allocated while it is held, even
+ * past DTSessionRelease.
+ */
+CFArrayRef DTSessionCopyFiles(DTSessionRef session);
+
+/*
+ * Copies the device path of the file at index into buffer. Returns false if there is none.
+ */
+bool DTSessionGetFilePath(DTSessionRef session, int index, char *buffer, size_t size);
+
+/*
+ * Index lookups against the file list. Return -1 if nothing matches.
+ * architecture may be NULL to take the first dyld shared cache.
+ */
+int DTSessionGetDyldIndex(DTSessionRef session);
+int DTSessionGetSharedCacheIndex(DTSessionRef session, CFStringRef architecture);
+
+/*
+ * Size of the file at index, read from the GetFile size header. The connection is
+ * dropped before the body is transferred.
+ */
+DTError DTSessionGetFileSize(DTSessionRef session, int index, uint64_t *size);
+
+/*
+ * Probes files 0..count-1 over 'connections' parallel connections. sizes[i] is 0 and
+ * errors[i] (errors may be NULL) tells why if a probe failed. One Lockdown session
+ * serves the whole batch and each connection carries several GetFile requests, reading
+ * small bodies and reconnecting after big ones. If the service closes a connection
+ * after one GetFile, the rest of the session's probes use a connection each.
+ */
+void DTSessionGetFileSizes(DTSessionRef session, uint32_t count, uint32_t connections, uint64_t *sizes, DTError *errors);
+
+/*
+ * Downloads the file at index to path on the calling thread.
+ */
+DTError DTSessionFetchFile(DTSessionRef session, int index, const char *path, const DTFetchCallbacks *callbacks, void *context);
+
+/*
+ * Queues a download. path is copied; callbacks must stay valid until completion.
+ */
+void DTSessionFetchFileAsync(DTSessionRef session, int index, const char *path, const DTFetchCallbacks *callbacks, void *context);
+
+/*
+ * Number of transfer threads used for queued downloads (default 1).
+ */
+void DTSessionSetMaximumTransfers(DTSessionRef session, uint32_t transfers);
+
+void DTSessionSetTransferPolicy(DTSessionRef session, const DTTransferPolicy *policy);
+
+/*
+ * Records every send and receive of the session's connections to trace (NULL stops).
+ * Set it before the first transfer; the trace must outlive the session.
+ */
+void DTSessionSetWireTrace(DTSessionRef session, DTWireTraceRef trace);
+
+/*
+ * Makes every transfer of the session wait for host-wide admission (NULL stops). The
+ * session takes a slot named 'name' until it is released. Set it before the first
+ * transfer; admission must outlive the session.
+ */
+void DTSessionSetAdmission(DTSessionRef session, DTAdmissionRef admission, const char *name);
+
+/*
+ * False if the session has no admission control.
+ */
+bool DTSessionGetAdmissionStatus(DTSessionRef session, DTAdmissionStatus *status);
+
+/*
+ * Allocations of the session's file list, which lives in a per-session arena freed once
+ * DTSessionRelease has run and no caller holds the list.
+ */
+void DTSessionGetMemoryStatistics(DTSessionRef session, DTArenaStatistics *statistics);
+
+/*
+ * Stall and reconnect counts of all transfers of the session so far.
+ */
+void DTSessionGetStatistics(DTSessionRef session, DTSessionStatistics *statistics);
+
+/*
+ * Blocks until every queued download has completed.
+ */
+void DTSessionWait(DTSessionRef session);
+
+/*
+ * Fails queued downloads and stops running ones with kDTErrorCancelled.
+ */
+void DTSessionCancel(DTSessionRef session);
+
+const char *DTErrorDescription(DTError error);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,260 +1,885 @@
 #include <stdio.h>
-#include <sys/socket.h>
-#include <sys/mman.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <dirent.h>
 #include <sys/stat.h>
-#include "MobileDevice.h"
+#include "deltasync.h"
+#include "devicefs.h"
+#include "exportsymbols.h"
+#include "fetchsymbols.h"
+#include "metrics.h"
+#include "symboldb.h"
+#include "symbolserver.h"
+#include "verify.h"
+#include "workpool.h"
 
 AMDeviceNotificationRef notification;
-AMDeviceRef device;
-const char *shared_cache_path = NULL;
-const char *shared_cache_arch = NULL;
+DTSessionRef session;
+#define kMaximumReplayAddresses 16   /* -A */
+/*
+ * -c and -C requests. arch is empty for -c (first dyld shared cache). directory is the
+ * -C directory for several architectures, created when the fetch starts.
+ */
+#define kMaximumCacheRequests 16
+typedef struct {
+    char arch[32];
+    char path[PATH_MAX];
+    const char *directory;
+} cache_request_t;
+cache_request_t cache_requests[kMaximumCacheRequests];
+uint32_t    cache_request_count = 0;
 const char *dyld_path         = NULL;
 uint32_t    file_index        = 0;
 const char *file_path         = NULL;
 bool        list_files        = false;
+bool        list_sizes        = false;
+bool        list_json         = false;
+uint32_t    probe_connections = 4;
+bool        verify_files      = false;
+const char *daemon_store      = NULL;
+uint32_t    host_jobs         = 2;
+uint32_t    device_jobs       = 1;
+bool        device_jobs_set   = false;
+DTTransferPolicy transfer_policy;
+const char *export_cache      = NULL;
+const char *export_directory  = NULL;
+const char *symbol_db_path    = NULL;
+DTSymbolDBRef symbol_db       = NULL;
+const char *ingest_name       = NULL;
+const char *ingest_cache      = NULL;
+const char *query_name        = NULL;
+uint64_t    query_address     = 0;
+const char *server_path       = NULL;
+uint16_t    server_port       = 0;
+const char *server_address    = NULL;
+uint32_t    server_threads    = 4;
+const char *sync_path         = NULL;
+uint16_t    sync_port         = 0;
+const char *sync_host         = NULL;
+uint16_t    sync_host_port    = 0;
+const char *sync_directory    = NULL;
+DTWireTraceRef wire_trace     = NULL;
+const char *trace_path        = NULL;
+bool        trace_bodies      = false;
+const char *replay_hosts[kMaximumReplayAddresses];
+uint16_t    replay_ports[kMaximumReplayAddresses];
+uint32_t    replay_count      = 0;
+const char *target_udid       = NULL;
+double      launch_time       = 0;
+double      attach_time       = 0;
+double      first_byte_time   = 0;
+const char *mount_point       = NULL;
+const char *mount_cache       = NULL;
+const char *admission_path    = NULL;
+DTAdmissionRef admission      = NULL;
+uint16_t    metrics_port      = 0;
+const char *metrics_path      = NULL;
 
-CFStringRef AMDCopyErrorText(void);
+void help(void);
 
-const uint32_t kCommand_ListFilesPlist = 0x30303030;
-const uint32_t kCommand_ListFiles      = 0;
-const uint32_t kCommand_GetFile        = 0x01000000;
+static void writeMetricsAtExit(void) {
+    DTMetricsWriteTextfile(metrics_path);
+}
 
-static inline unsigned short bswap_16(unsigned short x) {
-    return (x>>8) | (x<<8);
+/*
+ * CFShow for a format string. The temporary string is released afterwards.
+ */
+static void showFormat(CFStringRef format, ...) {
+    va_list args;
+    va_start(args, format);
+    CFStringRef message = CFStringCreateWithFormatAndArguments(kCFAllocatorDefault, NULL, format, args);
+    va_end(args);
+    if (message) {
+        CFShow(message);
+        CFRelease(message);
+    }
 }
 
-static inline unsigned int bswap_32(unsigned int x) {
-    return (bswap_16(x&0xffff)<<16) | (bswap_16(x>>16));
+static double monotonicTime(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
 }
 
-static inline unsigned long long bswap_64(unsigned long long x) {
-    return (((unsigned long long)bswap_32(x&0xffffffffull))<<32) |
-    (bswap_32(x>>32));
+/*
+ * Transfer threads race to report the first byte; only the earliest time is kept.
+ */
+static void markFirstByte(void) {
+    double current;
+    __atomic_load(&first_byte_time, &current, __ATOMIC_RELAXED);
+    if (current != 0) return;
+    double expected = 0, time = monotonicTime();
+    __atomic_compare_exchange(&first_byte_time, &expected, &time, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
 }
 
-CFDictionaryRef listFilesPlistCommand(void);
-void getFileCommand(int index, const char *path);
-void help(void);
+/*
+ * Console reporting for interactive downloads. context is the DTSessionRef.
+ */
+static void printProgress(void *context, int index, uint64_t received, uint64_t size) {
+    if (received == 0) {
+        char path[PATH_MAX];
+        if (DTSessionGetFilePath(context, index, path, sizeof(path)))
+            printf("[*] Receiving %s...\n", path);
+    } else {
+        markFirstByte();
+        printf("[*] Received %3.2f MB of %3.2f MB (%llu%%).\n\e[1A", (double)received/(1024*1024), (double)size/(1024*1024),(uint64_t)((double)received/(double)size*100));
+    }
+}
 
-#define DTPathToFileAtIndex(files, idx) CFStringGetCStringPtr(CFArrayGetValueAtIndex(files, (CFIndex)idx), CFStringGetSystemEncoding())
-
-int getDyldIndex() {
-    int index = 0;
-    CFDictionaryRef response = listFilesPlistCommand();
-    
-    if (response != NULL) {
-        CFArrayRef filesList;
-        filesList = CFDictionaryGetValue(response, CFSTR("files"));
-        if (filesList != NULL) {
-            for (CFIndex i = 0; i < CFArrayGetCount(filesList); i++) {
-                if (CFEqual(CFArrayGetValueAtIndex(filesList, i), CFSTR("/usr/lib/dyld"))) {
-                    index = (int)i;
-					break;
-                }
-            }
-            CFRelease(filesList);
+/*
+ * Post-fetch validation. Returns true if every image present is well-formed.
+ */
+static bool verifyFetchedFile(const char *path) {
+    DTVerifyResult result;
+    if (!DTVerifyFile(path, DTWorkPoolDefaultThreads(), &result)) {
+        printf("[-] %s is not a Mach-O file or dyld shared cache.\n", path);
+        return false;
+    }
+    printf("[%c] Verified %u images in %s: %u malformed, %u in missing subcaches. UUIDs written to %s.uuids.\n",
+           result.invalid ? '-' : '+', result.images, path, result.invalid, result.missing, path);
+    return result.invalid == 0;
+}
+
+static void printCompletion(void *context, int index, const char *path, DTError error) {
+    char remote[PATH_MAX];
+    if (!DTSessionGetFilePath(context, index, remote, sizeof(remote)))
+        strcpy(remote, "file");
+    if (error == kDTErrorNone) {
+        printf("\n[+] Done receiving %s.\n", remote);
+        if (verify_files) verifyFetchedFile(path);
+    }
+    else if (error == kDTErrorFile)
+        printf("[-] File \"%s\" can not be opened.\n", path);
+    else if (error == kDTErrorConnectionLost)
+        printf("\n[-] Connection lost while receiving %s.\n", remote);
+    else
+        printf("[-] %s\n", DTErrorDescription(error));
+}
+
+static const DTFetchCallbacks consoleCallbacks = {printProgress, printCompletion};
+
+static void printStatistics(DTSessionRef statisticsSession) {
+    DTSessionStatistics statistics;
+    DTSessionGetStatistics(statisticsSession, &statistics);
+    printf("[*] Transfer stalls: %u, reconnects: %u.\n", statistics.stalls, statistics.reconnects);
+    DTArenaStatistics memory;
+    DTSessionGetMemoryStatistics(statisticsSession, &memory);
+    printf("[*] Session memory: %llu allocations, %.1f KB allocated, %.1f KB peak.\n",
+           (unsigned long long)memory.allocations, (double)memory.requestedBytes/1024, (double)memory.peakBytes/1024);
+    DTAdmissionStatus status;
+    if (DTSessionGetAdmissionStatus(statisticsSession, &status))
+        printf("[*] Host admission: limit %u, %u running, %u waiting, %u clients; %3.2f MB/s host, %3.2f MB/s this device, %3.2f MB/s disk writes.\n",
+               status.limit, status.running, status.waiting, status.clients,
+               status.throughput/(1024*1024), status.clientThroughput/(1024*1024), status.writeThroughput/(1024*1024));
+}
+
+/*
+ * Daemon mode: CF memory of all sessions, printed after each one is released so a long
+ * run shows whether it stays flat.
+ */
+static void printProcessMemory(void) {
+    DTArenaStatistics memory;
+    uint32_t arenas;
+    DTArenaGetProcessStatistics(&memory, &arenas);
+    printf("[*] Session memory: %u sessions open, %.1f KB held (peak %.1f KB), %llu allocations since launch.\n",
+           arenas, (double)memory.arenaBytes/1024, (double)memory.peakBytes/1024, (unsigned long long)memory.allocations);
+}
+
+/*
+ * Startup latency of interactive runs: launch to session, and launch to the first
+ * byte of a file (or to the file list if nothing is downloaded).
+ */
+static void printTiming(void) {
+    if (first_byte_time && !list_json)
+        printf("[*] Launch to device: %.3f s, to first byte: %.3f s.\n", attach_time - launch_time, first_byte_time - launch_time);
+}
+
+/*
+ * -u filter. Looks at the UDID only, so other devices are never connected to.
+ */
+static bool isTargetDevice(AMDeviceRef dev) {
+    if (!target_udid || !strcmp(target_udid, "any")) return true;
+    char udid[128];
+    CFStringRef identifier = AMDeviceCopyDeviceIdentifier(dev);
+    bool match = identifier && CFStringGetCString(identifier, udid, sizeof(udid), kCFStringEncodingUTF8) && !strcasecmp(udid, target_udid);
+    if (identifier) CFRelease(identifier);
+    return match;
+}
+
+static bool ingestCache(const char *build, const char *cachePath) {
+    DTSymbolDBIngestResult result;
+    if (DTSymbolDBContains(symbol_db, build)) {
+        printf("[*] %s is already in the symbol database.\n", build);
+        return true;
+    }
+    if (!DTSymbolDBIngest(symbol_db, build, cachePath, DTWorkPoolDefaultThreads(), &result)) {
+        printf("[-] Can not add %s to the symbol database.\n", cachePath);
+        return false;
+    }
+    printf("[+] Added %s: %u images, %llu symbols, %llu new / %llu shared strings in %.2f s.\n",
+           build, result.images, (unsigned long long)result.symbols, (unsigned long long)result.newStrings,
+           (unsigned long long)result.sharedStrings, result.seconds);
+    printf("[*] Symbol database: %3.2f MB, lookup %.2f us.\n", (double)result.databaseBytes/(1024*1024), result.lookupMicroseconds);
+    return true;
+}
+
+static bool copyDeviceString(AMDeviceRef dev, CFStringRef key, char *buffer, CFIndex size) {
+    CFStringRef value = AMDeviceCopyValue(dev, NULL, key);
+    bool ok = value && (CFGetTypeID(value) == CFStringGetTypeID()) && CFStringGetCString(value, buffer, size, kCFStringEncodingUTF8);
+    if (value) CFRelease(value);
+    return ok;
+}
+
+/*
+ * -H: the session's transfers wait for host-wide admission under the device's UDID
+ * (or host:port for -A).
+ */
+static void setAdmission(DTSessionRef target, AMDeviceRef dev, const char *host, uint16_t port) {
+    if (!admission) return;
+    char name[128] = "";
+    if (dev) {
+        CFStringRef identifier = AMDeviceCopyDeviceIdentifier(dev);
+        if (identifier) {
+            CFStringGetCString(identifier, name, sizeof(name), kCFStringEncodingUTF8);
+            CFRelease(identifier);
         }
+    } else
+        snprintf(name, sizeof(name), "%s:%u", host, port);
+    DTSessionSetAdmission(target, admission, name);
+}
+
+/*
+ * Daemon mode.
+ * Every connected device whose build is not in daemon_store yet takes part in fetching
+ * dyld and all dyld shared cache files of that build to
+ * daemon_store/<ProductType>_<BuildVersion>/. Devices running the same build form a
+ * swarm: the build's files are handed out one at a time to whichever device has a free
+ * transfer, and files of a device that disconnects or fails go back to the others.
+ * At most host_jobs devices are served at once, each with at most device_jobs transfers.
+ * A build is considered stored once its directory contains the .complete marker.
+ * With -A the stand-in servers take the place of devices and form one swarm for the
+ * build "replay"; the daemon then exits once it is done.
+ */
+typedef enum {
+    kFilePending,
+    kFileRunning,
+    kFileDone,
+} daemon_file_state_t;
+
+typedef struct {
+    int index;
+    char local[PATH_MAX];
+    daemon_file_state_t state;
+} daemon_file_t;
+
+typedef struct daemon_build {
+    char build[128];
+    char directory[PATH_MAX];
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    daemon_file_t *files;
+    uint32_t fileCount;
+    uint32_t remaining;
+    bool listed;
+    bool failed;
+    bool finishing;
+    uint32_t devices;
+    uint32_t contributors;
+    uint64_t bytes;
+    double start;
+    struct daemon_build *next;
+} daemon_build_t;
+
+typedef struct daemon_device {
+    AMDeviceRef device;             /* NULL for a stand-in server at host:port.        */
+    const char *host;
+    uint16_t port;
+    DTSessionRef session;
+    daemon_build_t *build;
+    bool disconnected;
+    bool broken;
+    pthread_mutex_t lock;
+    struct daemon_device *next;
+} daemon_device_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint32_t available;
+} limiter_t;
+
+static limiter_t host_limiter = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0};
+static pthread_mutex_t daemon_jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static daemon_build_t *daemon_builds = NULL;
+static daemon_device_t *daemon_devices = NULL;
+static uint32_t daemon_threads = 0;
+static pthread_cond_t daemon_idle = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t daemon_finished = PTHREAD_COND_INITIALIZER;
+
+static void limiterAcquire(limiter_t *limiter) {
+    pthread_mutex_lock(&limiter->lock);
+    while (limiter->available == 0)
+        pthread_cond_wait(&limiter->cond, &limiter->lock);
+    limiter->available--;
+    pthread_mutex_unlock(&limiter->lock);
+}
+
+static void limiterRelease(limiter_t *limiter) {
+    pthread_mutex_lock(&limiter->lock);
+    limiter->available++;
+    pthread_cond_signal(&limiter->cond);
+    pthread_mutex_unlock(&limiter->lock);
+}
+
+static bool daemonDeviceCancelled(daemon_device_t *member) {
+    pthread_mutex_lock(&member->lock);
+    bool cancelled = member->disconnected;
+    pthread_mutex_unlock(&member->lock);
+    return cancelled;
+}
+
+/*
+ * Fills the build's file set from the first member that gets a file list.
+ */
+static bool daemonListBuild(daemon_build_t *build, DTSessionRef memberSession) {
+    pthread_mutex_lock(&build->lock);
+    bool listed = build->listed;
+    pthread_mutex_unlock(&build->lock);
+    if (listed) return true;
+    
+    CFArrayRef files = DTSessionCopyFiles(memberSession);
+    if (!files) {
+        printf("[-] %s: Can not get list of files.\n", build->build);
+        return false;
+    }
+    
+    daemon_file_t *buildFiles = calloc(CFArrayGetCount(files) ? CFArrayGetCount(files) : 1, sizeof(daemon_file_t));
+    uint32_t count = 0;
+    for (CFIndex i = 0; buildFiles && i < CFArrayGetCount(files); i++) {
+        CFStringRef file = CFArrayGetValueAtIndex(files, i);
+        char remote[PATH_MAX];
+        if (!CFEqual(file, CFSTR("/usr/lib/dyld")) && (CFStringFind(file, CFSTR("/dyld_shared_cache_"), 0).length == 0))
+            continue;
+        if (!CFStringGetCString(file, remote, sizeof(remote), kCFStringEncodingUTF8))
+            continue;
+        const char *name = strrchr(remote, '/');
+        buildFiles[count].index = (int)i;
+        snprintf(buildFiles[count].local, sizeof(buildFiles[count].local), "%s/%s", build->directory, name ? name + 1 : remote);
+        count++;
     }
+    CFRelease(files);
+    if (!buildFiles) return false;
     
-    return index;
+    pthread_mutex_lock(&build->lock);
+    if (!build->listed) {
+        build->files = buildFiles;
+        build->fileCount = build->remaining = count;
+        build->listed = true;
+        build->start = monotonicTime();
+        mkdir(build->directory, 0755);
+        printf("[*] Fetching build %s (%u files).\n", build->build, count);
+    } else
+        free(buildFiles);
+    pthread_cond_broadcast(&build->changed);
+    pthread_mutex_unlock(&build->lock);
+    return true;
 }
 
-int getDyldSharedCacheIndex(CFStringRef architecture) {
-    int32_t index = -1;
-    CFDictionaryRef response = listFilesPlistCommand();
-	CFStringRef sharedCachePath = CFSTR("/System/Library/Caches/com.apple.dyld/dyld_shared_cache_");
+/*
+ * Takes pending files of the build until none are left or the device drops out.
+ */
+static void *daemonTransferThread(void *arg) {
+    daemon_device_t *member = arg;
+    daemon_build_t *build = member->build;
     
-    if (response != NULL) {
-        CFArrayRef filesList;
-        filesList = CFDictionaryGetValue(response, CFSTR("files"));
-		
-		if (architecture) {
-			CFStringRef strings[] = {sharedCachePath, architecture};
-			CFArrayRef stringsArray = CFArrayCreate(kCFAllocatorDefault, (const void **)strings, 2, &kCFTypeArrayCallBacks);
-			if (stringsArray) {
-				sharedCachePath = CFStringCreateByCombiningStrings(kCFAllocatorDefault, stringsArray, CFSTR(""));
-			} else {
-				puts("[!] Unexpected CoreFoundation error.");
-				architecture = NULL;
-			}
-			CFRelease(stringsArray);
-		}
-		
-		if (filesList != NULL) {
-			bool match;
-            for (CFIndex i = 0; i < CFArrayGetCount(filesList); i++) {
-				if (architecture) match = CFEqual(CFArrayGetValueAtIndex(filesList, i), sharedCachePath);
-				else match = CFStringFind(CFArrayGetValueAtIndex(filesList, i), sharedCachePath, 0).length != 0;
-                if (match) {
-                    index = (int)i;
-					break;
-                }
-            }
-			if (!match) {
-				if (architecture) {
-					CFStringRef message = CFStringCreateWithFormat(kCFAllocatorDefault, 0, CFSTR("[-] Can't find dyld shared cache for architecture %@."), architecture);
-					if (message) {
-						CFShow(message);
-						CFRelease(message);
-					} else
-						puts("[-] Can't find dyld shared cache for the given architecture.");
-				}
-				else
-					puts("[-] Can't find dyld shared cache.");
-			}
-            CFRelease(filesList);
-        }
-		
-		if (architecture) {
-			CFRelease(sharedCachePath);
-		}
+    pthread_mutex_lock(&build->lock);
+    for (;;) {
+        if (build->remaining == 0 || member->broken || daemonDeviceCancelled(member)) break;
+        
+        daemon_file_t *file = NULL;
+        for (uint32_t i = 0; i < build->fileCount && !file; i++)
+            if (build->files[i].state == kFilePending) file = &build->files[i];
+        if (!file) {
+            pthread_cond_wait(&build->changed, &build->lock);
+            continue;
+        }
+        file->state = kFileRunning;
+        pthread_mutex_unlock(&build->lock);
+        
+        DTError error = DTSessionFetchFile(member->session, file->index, file->local, NULL, NULL);
+        struct stat info;
+        
+        pthread_mutex_lock(&build->lock);
+        if (error == kDTErrorNone) {
+            file->state = kFileDone;
+            build->remaining--;
+            if (stat(file->local, &info) == 0) build->bytes += info.st_size;
+            printf("[+] %s: received %s.\n", build->build, file->local);
+        } else if (error == kDTErrorFile || error == kDTErrorMap) {
+            /*
+             * Host-side failure; another device would not do better.
+             */
+            file->state = kFileDone;
+            build->remaining--;
+            build->failed = true;
+            printf("[-] %s: %s (%s)\n", build->build, DTErrorDescription(error), file->local);
+        } else {
+            /*
+             * Hand the file back to the swarm and stop using this device.
+             */
+            file->state = kFilePending;
+            member->broken = true;
+            if (error != kDTErrorCancelled)
+                printf("[-] %s: %s (%s). Reassigning.\n", build->build, DTErrorDescription(error), file->local);
+        }
+        pthread_cond_broadcast(&build->changed);
+    }
+    pthread_mutex_unlock(&build->lock);
+    return NULL;
+}
+
+/*
+ * Called once the last device has left the build. The build stays in daemon_builds,
+ * marked finishing, until its .complete marker is written or known not to be, so a
+ * device of the same build connecting meanwhile waits for the outcome.
+ */
+static void daemonFinishBuild(daemon_build_t *build) {
+    bool complete = build->listed && build->fileCount && build->remaining == 0 && !build->failed;
+    
+    /*
+     * Verify dyld and the main cache files (subcaches are checked through them).
+     * A malformed build is not marked complete, so it is fetched again next time.
+     */
+    DIR *directory = (verify_files && complete) ? opendir(build->directory) : NULL;
+    struct dirent *entry;
+    while (directory && (entry = readdir(directory))) {
+        bool isCache = !strncmp(entry->d_name, "dyld_shared_cache_", 18) && !strchr(entry->d_name, '.');
+        if (isCache || !strcmp(entry->d_name, "dyld")) {
+            char local[PATH_MAX];
+            snprintf(local, sizeof(local), "%s/%s", build->directory, entry->d_name);
+            if (!verifyFetchedFile(local)) complete = false;
+        }
     }
+    if (directory) closedir(directory);
     
-    return index;
+    if (complete) {
+        char marker[PATH_MAX];
+        snprintf(marker, sizeof(marker), "%s/.complete", build->directory);
+        int fd = open(marker, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        if (fd >= 0) close(fd);
+        double elapsed = monotonicTime() - build->start;
+        printf("[+] Build %s stored in %s: %3.2f MB in %.1f s (%3.2f MB/s) from %u device(s).\n",
+               build->build, build->directory, (double)build->bytes/(1024*1024), elapsed,
+               elapsed > 0 ? (double)build->bytes/(1024*1024)/elapsed : 0, build->contributors);
+        
+        /*
+         * Each main cache goes into the symbol database as <build>_<arch>.
+         */
+        directory = symbol_db ? opendir(build->directory) : NULL;
+        while (directory && (entry = readdir(directory))) {
+            if (strncmp(entry->d_name, "dyld_shared_cache_", 18) || strchr(entry->d_name, '.')) continue;
+            char local[PATH_MAX], name[256];
+            snprintf(local, sizeof(local), "%s/%s", build->directory, entry->d_name);
+            snprintf(name, sizeof(name), "%s_%s", build->build, entry->d_name + 18);
+            ingestCache(name, local);
+        }
+        if (directory) closedir(directory);
+    } else if (build->listed && build->remaining)
+        printf("[-] Build %s incomplete: %u of %u files missing.\n", build->build, build->remaining, build->fileCount);
+    else
+        printf("[-] Failed to fetch build %s.\n", build->build);
+    
+    pthread_mutex_lock(&daemon_jobs_lock);
+    for (daemon_build_t **link = &daemon_builds; *link; link = &(*link)->next) {
+        if (*link == build) {
+            *link = build->next;
+            break;
+        }
+    }
+    pthread_cond_broadcast(&daemon_finished);
+    pthread_mutex_unlock(&daemon_jobs_lock);
+    
+    free(build->files);
+    pthread_cond_destroy(&build->changed);
+    pthread_mutex_destroy(&build->lock);
+    free(build);
 }
 
-CFDictionaryRef listFilesPlistCommand() {
-    mach_error_t ret = 0;
-    AMDServiceConnectionRef serviceConnection = NULL;
-    CFDictionaryRef response = NULL;
+static void *daemonDeviceThread(void *arg) {
+    daemon_device_t *member = arg;
+    daemon_build_t *build = member->build;
     
-    AMDeviceStartSession(device);
+    limiterAcquire(&host_limiter);
+    DTSessionRef memberSession = member->device ? DTSessionCreate(member->device)
+                                                : DTSessionCreateWithAddress(member->host, member->port);
+    if (memberSession) {
+        DTSessionSetTransferPolicy(memberSession, &transfer_policy);
+        DTSessionSetWireTrace(memberSession, wire_trace);
+        setAdmission(memberSession, member->device, member->host, member->port);
+    }
+    pthread_mutex_lock(&member->lock);
+    member->session = memberSession;
+    if (member->disconnected && memberSession) DTSessionCancel(memberSession);
+    pthread_mutex_unlock(&member->lock);
     
-    ret = AMDeviceSecureStartService(device, AMSVC_DT_FETCH_SYMBOLS, NULL, &serviceConnection);
-    if (ret == MDERR_OK) {
-        uint32_t commandConfirmationBuffer = 0;
-        AMDServiceConnectionSend(serviceConnection, &kCommand_ListFilesPlist, sizeof(uint32_t));
-        AMDServiceConnectionReceive(serviceConnection, &commandConfirmationBuffer, sizeof(uint32_t));
-        if (commandConfirmationBuffer == kCommand_ListFilesPlist) {
-            CFPropertyListFormat format;
-            AMDServiceConnectionReceiveMessage(serviceConnection, &response, &format);
+    if (memberSession && !daemonDeviceCancelled(member) && daemonListBuild(build, memberSession)) {
+        pthread_t threads[device_jobs];
+        uint32_t started = 0;
+        for (uint32_t i = 0; i < device_jobs; i++)
+            if (pthread_create(&threads[started], NULL, daemonTransferThread, member) == 0) started++;
+        for (uint32_t i = 0; i < started; i++)
+            pthread_join(threads[i], NULL);
+        
+        DTSessionStatistics statistics;
+        DTSessionGetStatistics(memberSession, &statistics);
+        printf("[*] %s: device done, transfer stalls: %u, reconnects: %u.\n", build->build, statistics.stalls, statistics.reconnects);
+    }
+    limiterRelease(&host_limiter);
+    
+    pthread_mutex_lock(&daemon_jobs_lock);
+    for (daemon_device_t **link = &daemon_devices; *link; link = &(*link)->next) {
+        if (*link == member) {
+            *link = member->next;
+            break;
         }
-        AMDServiceConnectionInvalidate(serviceConnection);
     }
+    pthread_mutex_lock(&build->lock);
+    bool last = --build->devices == 0;
+    if (last) build->finishing = true;
+    pthread_mutex_unlock(&build->lock);
+    pthread_mutex_unlock(&daemon_jobs_lock);
+    if (last) daemonFinishBuild(build);
+    
+    pthread_mutex_lock(&member->lock);
+    member->session = NULL;
+    pthread_mutex_unlock(&member->lock);
+    DTSessionRelease(memberSession);
+    printProcessMemory();
+    if (member->device) {
+        AMDeviceDisconnect(member->device);
+        AMDeviceRelease(member->device);
+    }
+    pthread_mutex_destroy(&member->lock);
+    free(member);
     
-    AMDeviceStopSession(device);
-    return response;
+    pthread_mutex_lock(&daemon_jobs_lock);
+    if (--daemon_threads == 0) pthread_cond_broadcast(&daemon_idle);
+    pthread_mutex_unlock(&daemon_jobs_lock);
+    return NULL;
 }
 
 /*
- * index - the index of file in an array returned by ListFiles or ListFilesPlist command.
- *  path - where to save the file on the host machine.
+ * Adds a device (or, with dev NULL, the stand-in at host:port) to the swarm of build
+ * 'key' and starts its thread. Returns false if it does not take part; the caller
+ * still owns the device connection then.
  */
-void getFileCommand(int index, const char *path) {
-	if (index < 0) return;
-	
-    mach_error_t ret = MDERR_OK;
-    AMDServiceConnectionRef serviceConnection = NULL;
+static bool daemonJoinBuild(AMDeviceRef dev, const char *host, uint16_t port, const char *key) {
+    char marker[PATH_MAX];
+    snprintf(marker, sizeof(marker), "%s/%s/.complete", daemon_store, key);
+    daemon_device_t *member = calloc(1, sizeof(daemon_device_t));
+    if (!member) return false;
     
-    AMDeviceStartSession(device);
-    ret = AMDeviceSecureStartService(device, AMSVC_DT_FETCH_SYMBOLS, NULL, &serviceConnection);
-    if (ret != MDERR_OK) {
-        puts("[-] Can not connect to com.apple.dt.fetchsymbols service.");
-    } else {
-        CFDictionaryRef imageList = (CFDictionaryRef)listFilesPlistCommand();
-        if (imageList && (CFGetTypeID(imageList) == CFDictionaryGetTypeID())) {
-            CFArrayRef files = CFDictionaryGetValue(imageList, CFSTR("files"));
-            if (files && (CFGetTypeID(files) == CFArrayGetTypeID()) && (CFArrayGetCount(files) > index)) {
-                uint64_t rsize = 0;
-                rsize = AMDServiceConnectionSend(serviceConnection, &kCommand_GetFile, sizeof(uint32_t));
-                if (rsize != sizeof(uint32_t)) {
-                    puts("[-] Can not send message to com.apple.dt.fetchsymbols service. Size mismatch.");
-                } else {
-                    uint32_t commandConfirmation = 0;
-                    AMDServiceConnectionReceive(serviceConnection, &commandConfirmation, sizeof(uint32_t));
-                    /*
-                     * Command confirmation. Sent for all commands.
-                     */
-                    if (commandConfirmation != kCommand_GetFile) {
-                        puts("[!] com.apple.dt.fetchsymbols service internal error.");
-                    } else {
-                        uint32_t bsindex = bswap_32(index);
-                        rsize = AMDServiceConnectionSend(serviceConnection, &bsindex, sizeof(uint32_t));
-                        if (rsize != sizeof(uint32_t)) {
-                            puts("[-] Failed to request file size.");
-                        } else {
-                            uint64_t size = 0;
-                            AMDServiceConnectionReceive(serviceConnection, &size, sizeof(uint64_t));
-                            size = bswap_64(size);
-                            if (size != 0) {
-                                int file = 0;
-                                if (access(path, F_OK) == -1) {
-                                    file = open(path, O_RDWR | O_CREAT);
-                                    chmod(path, S_IROTH | S_IRGRP | S_IWUSR | S_IRUSR);
-                                }
-                                else
-                                    file = open(path, O_RDWR);
-                                
-                                if (file >= 0) {
-                                    /*
-                                     * Set file size.
-                                     */
-                                    lseek(file, size-1, SEEK_SET);
-                                    write(file, "", 1);
-                                    
-                                    void *map = mmap(0, size, PROT_WRITE | PROT_READ, MAP_SHARED, file, 0);
-                                    if (map != MAP_FAILED) {
-                                        printf("[*] Receiving %s...\n", DTPathToFileAtIndex(files, index));
-                                        rsize = AMDServiceConnectionReceive(serviceConnection, map, size);
-                                        while (rsize < size) {
-                                            rsize += AMDServiceConnectionReceive(serviceConnection, (void *)(map + rsize), size-rsize);
-                                            if (rsize <= 0) {
-                                                puts("Error");
-                                            }
-                                            printf("[*] Received %3.2f MB of %3.2f MB (%llu%%).\n\e[1A", (double)rsize/(1024*1024), (double)size/(1024*1024),(uint64_t)((double)rsize/(double)size*100));
-                                        }
-                                        if (rsize == size) printf("\n[+] Done receiving %s.\n", DTPathToFileAtIndex(files, index));
-                                        munmap(map, size);
-                                    } else puts("[-] Error. Please restart the program.");
-                                    close(file);
-                                } else printf("[-] File \"%s\" can not be opened.\n", path);
-                            } else puts("[-] Error. File size is zero.");
-                        }
-                    }
-                }
+    /*
+     * The marker is only written by daemonFinishBuild while the build is still listed
+     * as finishing; checking it under daemon_jobs_lock once no such build is left means
+     * a build is never fetched twice.
+     */
+    pthread_mutex_lock(&daemon_jobs_lock);
+    daemon_build_t *build;
+    for (;;) {
+        build = daemon_builds;
+        while (build && strcmp(build->build, key))
+            build = build->next;
+        if (!build || !build->finishing) break;
+        pthread_cond_wait(&daemon_finished, &daemon_jobs_lock);
+    }
+    if (!build && access(marker, F_OK) == 0) {
+        pthread_mutex_unlock(&daemon_jobs_lock);
+        free(member);
+        printf("[*] Build %s is already stored.\n", key);
+        return false;
+    }
+    if (!build && (build = calloc(1, sizeof(daemon_build_t)))) {
+        snprintf(build->build, sizeof(build->build), "%s", key);
+        snprintf(build->directory, sizeof(build->directory), "%s/%s", daemon_store, key);
+        pthread_mutex_init(&build->lock, NULL);
+        pthread_cond_init(&build->changed, NULL);
+        build->next = daemon_builds;
+        daemon_builds = build;
+    }
+    if (!build) {
+        pthread_mutex_unlock(&daemon_jobs_lock);
+        free(member);
+        return false;
+    }
+    pthread_mutex_lock(&build->lock);
+    uint32_t devices = ++build->devices;
+    build->contributors++;
+    pthread_mutex_unlock(&build->lock);
+    
+    if (dev) AMDeviceRetain(dev);
+    member->device = dev;
+    member->host = host;
+    member->port = port;
+    member->build = build;
+    pthread_mutex_init(&member->lock, NULL);
+    member->next = daemon_devices;
+    daemon_devices = member;
+    daemon_threads++;
+    pthread_mutex_unlock(&daemon_jobs_lock);
+    
+    if (devices > 1)
+        printf("[*] Device joins build %s (%u devices).\n", key, devices);
+    
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, daemonDeviceThread, member) == 0)
+        pthread_detach(thread);
+    else
+        daemonDeviceThread(member);
+    return true;
+}
+
+static void daemonDeviceConnected(AMDeviceRef dev) {
+    if (AMDeviceConnect(dev) != MDERR_OK) {
+        puts("[!] Connection error. Please reconnect your device.");
+        return;
+    }
+    
+    char type[64], version[64], buildVersion[64];
+    if (!copyDeviceString(dev, CFSTR("ProductType"), type, sizeof(type)) ||
+        !copyDeviceString(dev, CFSTR("ProductVersion"), version, sizeof(version)) ||
+        !copyDeviceString(dev, CFSTR("BuildVersion"), buildVersion, sizeof(buildVersion))) {
+        puts("[-] Can not read device build.");
+        AMDeviceDisconnect(dev);
+        return;
+    }
+    printf("[+] Device connected: %s, iOS %s (%s).\n", type, version, buildVersion);
+    
+    char key[128];
+    snprintf(key, sizeof(key), "%s_%s", type, buildVersion);
+    if (!daemonJoinBuild(dev, NULL, 0, key))
+        AMDeviceDisconnect(dev);
+}
+
+static void daemonDeviceDisconnected(AMDeviceRef dev) {
+    pthread_mutex_lock(&daemon_jobs_lock);
+    for (daemon_device_t *member = daemon_devices; member; member = member->next) {
+        if (member->device == dev) {
+            pthread_mutex_lock(&member->lock);
+            member->disconnected = true;
+            if (member->session) DTSessionCancel(member->session);
+            pthread_mutex_unlock(&member->lock);
+            
+            pthread_mutex_lock(&member->build->lock);
+            pthread_cond_broadcast(&member->build->changed);
+            pthread_mutex_unlock(&member->build->lock);
+        }
+    }
+    pthread_mutex_unlock(&daemon_jobs_lock);
+}
+
+static void printJSONString(const char *string) {
+    putchar('"');
+    for (; *string; string++) {
+        if (*string == '"' || *string == '\\') printf("\\%c", *string);
+        else if ((unsigned char)*string < 0x20) printf("\\u%04x", *string);
+        else putchar(*string);
+    }
+    putchar('"');
+}
+
+/*
+ * -l --sizes / --json: probes every file's size header over probe_connections
+ * connections and prints a table or JSON with the total.
+ */
+static void listFileSizes(CFArrayRef files) {
+    uint32_t count = (uint32_t)CFArrayGetCount(files);
+    uint64_t *sizes = calloc(count ? count : 1, sizeof(uint64_t));
+    DTError *errors = calloc(count ? count : 1, sizeof(DTError));
+    if (!sizes || !errors) {
+        free(sizes);
+        free(errors);
+        return;
+    }
+    
+    double start = monotonicTime();
+    DTSessionGetFileSizes(session, count, probe_connections, sizes, errors);
+    double elapsed = monotonicTime() - start;
+    
+    uint64_t total = 0;
+    uint32_t failed = 0;
+    if (list_json) printf("{\"files\":[");
+    for (uint32_t i = 0; i < count; i++) {
+        char path[PATH_MAX];
+        if (!CFStringGetCString(CFArrayGetValueAtIndex(files, i), path, sizeof(path), kCFStringEncodingUTF8))
+            strcpy(path, "?");
+        total += sizes[i];
+        if (errors[i] != kDTErrorNone) failed++;
+        if (list_json) {
+            printf("%s{\"index\":%u,\"path\":", i ? "," : "", i);
+            printJSONString(path);
+            if (errors[i] == kDTErrorNone) printf(",\"size\":%llu}", (unsigned long long)sizes[i]);
+            else printf(",\"size\":null,\"error\":\"%s\"}", DTErrorDescription(errors[i]));
+        } else if (errors[i] == kDTErrorNone)
+            printf("  %3u: %14llu  %s\n", i, (unsigned long long)sizes[i], path);
+        else
+            printf("  %3u: %14s  %s (%s)\n", i, "?", path, DTErrorDescription(errors[i]));
+    }
+    if (list_json)
+        printf("],\"total\":%llu,\"failed\":%u,\"seconds\":%.3f}\n", (unsigned long long)total, failed, elapsed);
+    else
+        printf("[*] %u files, %llu bytes (%3.2f MB), %u unknown. Probed in %.3f s.\n",
+               count, (unsigned long long)total, (double)total/(1024*1024), failed, elapsed);
+    free(sizes);
+    free(errors);
+}
+
+/*
+ * Progress for concurrent transfers: one line when a file starts, no per-chunk lines.
+ */
+static void printStart(void *context, int index, uint64_t received, uint64_t size) {
+    if (received == 0) printProgress(context, index, received, size);
+    else markFirstByte();
+}
+
+static const DTFetchCallbacks concurrentCallbacks = {printStart, printCompletion};
+
+/*
+ * Resolves every -c/-C request once against the session's file list, then transfers
+ * them together, at most device_jobs at once (all of them unless -J is given).
+ */
+static void fetchCaches(void) {
+    int indexes[kMaximumCacheRequests];
+    uint32_t found = 0;
+    for (uint32_t i = 0; i < cache_request_count; i++)
+        if (cache_requests[i].directory) mkdir(cache_requests[i].directory, 0755);
+    for (uint32_t i = 0; i < cache_request_count; i++) {
+        CFStringRef architecture = NULL;
+        if (cache_requests[i].arch[0])
+            architecture = CFStringCreateWithCStringNoCopy(kCFAllocatorDefault, cache_requests[i].arch, CFStringGetSystemEncoding(), kCFAllocatorNull);
+        indexes[i] = DTSessionGetSharedCacheIndex(session, architecture);
+        if (indexes[i] >= 0)
+            found++;
+        else if (architecture)
+            showFormat(CFSTR("[-] Can't find dyld shared cache for architecture %@."), architecture);
+        else
+            puts("[-] Can't find dyld shared cache.");
+        if (architecture) CFRelease(architecture);
+    }
+    
+    if (found == 1) {
+        for (uint32_t i = 0; i < cache_request_count; i++)
+            if (indexes[i] >= 0) DTSessionFetchFile(session, indexes[i], cache_requests[i].path, &consoleCallbacks, session);
+    } else if (found) {
+        DTSessionSetMaximumTransfers(session, device_jobs_set ? device_jobs : found);
+        for (uint32_t i = 0; i < cache_request_count; i++)
+            if (indexes[i] >= 0) DTSessionFetchFileAsync(session, indexes[i], cache_requests[i].path, &concurrentCallbacks, session);
+        DTSessionWait(session);
+    }
+}
+
+/*
+ * -C arch[,arch...] path. With one architecture path is the destination file; with
+ * several it is a directory receiving dyld_shared_cache_<arch> for each of them.
+ */
+static bool addCacheRequests(const char *architectures, const char *path) {
+    bool several = strchr(architectures, ',') != NULL;
+    while (*architectures) {
+        size_t length = strcspn(architectures, ",");
+        if (length && length < sizeof(cache_requests[0].arch)) {
+            if (cache_request_count == kMaximumCacheRequests) return false;
+            cache_request_t *request = &cache_requests[cache_request_count++];
+            memcpy(request->arch, architectures, length);
+            request->arch[length] = '\0';
+            request->directory = several ? path : NULL;
+            if (several) snprintf(request->path, sizeof(request->path), "%s/dyld_shared_cache_%s", path, request->arch);
+            else snprintf(request->path, sizeof(request->path), "%s", path);
+        } else if (length)
+            return false;
+        architectures += length;
+        if (*architectures == ',') architectures++;
+    }
+    return true;
+}
+
+/*
+ * Runs the single-device requests (-l, -f, -c, -C, -d) on the global session.
+ */
+static void runRequests(void) {
+    if (list_files) {
+        CFArrayRef files = DTSessionCopyFiles(session);
+        markFirstByte();
+        if (files && (list_sizes || list_json))
+            listFileSizes(files);
+        else if (files) {
+            for (CFIndex i = 0; i < CFArrayGetCount(files); i++) {
+                showFormat(CFSTR("  %li: %@"), i, CFArrayGetValueAtIndex(files, i));
             }
-        } else puts("[-] Index does not exist.");
-        AMDServiceConnectionInvalidate(serviceConnection);
-        if (imageList) CFRelease(imageList);
+        } else puts("[-] Can not get list of files.");
+        if (files) CFRelease(files);
     }
-    AMDeviceStopSession(device);
+    
+    if (file_path) DTSessionFetchFile(session, file_index, file_path, &consoleCallbacks, session);
+    
+    if (cache_request_count) fetchCaches();
+    
+    if (dyld_path) {
+        int index = DTSessionGetDyldIndex(session);
+        if (index >= 0)
+            DTSessionFetchFile(session, index, dyld_path, &consoleCallbacks, session);
+        else
+            puts("[-] Can't find dyld.");
+    }
+    
+#ifdef DT_DEVICEFS
+    if (mount_point) {
+        /*
+         * Cached files are kept per build (per server for -A), like the daemon store.
+         */
+        AMDeviceRef dev = DTSessionGetDevice(session);
+        char key[160] = "", type[64], buildVersion[64];
+        if (!dev)
+            snprintf(key, sizeof(key), "%s_%u", replay_hosts[0], replay_ports[0]);
+        else if (copyDeviceString(dev, CFSTR("ProductType"), type, sizeof(type)) &&
+                 copyDeviceString(dev, CFSTR("BuildVersion"), buildVersion, sizeof(buildVersion)))
+            snprintf(key, sizeof(key), "%s_%s", type, buildVersion);
+        DTSessionSetMaximumTransfers(session, device_jobs_set ? device_jobs : 2);
+        if (!key[0])
+            puts("[-] Can not read device build.");
+        else {
+            printf("[*] Mounting device files at %s (cache %s/%s). Unmount to exit.\n", mount_point, mount_cache, key);
+            if (!DTDeviceFSMount(session, mount_point, mount_cache, key, probe_connections))
+                printf("[-] Can not mount %s.\n", mount_point);
+        }
+    }
+#endif
+    
+    if (file_path || cache_request_count || dyld_path) printStatistics(session);
+    printTiming();
 }
 
 void device_notification_callback(struct am_device_notification_callback_info *info, int cookie) {
     switch (info->msg) {
         case ADNCI_MSG_CONNECTED:
-            if (!device) {
-                if (AMDeviceConnect(info->dev) == MDERR_OK) {
-                    device = info->dev;
-                    CFShow(CFStringCreateWithFormat(CFAllocatorGetDefault(), NULL, CFSTR("\e[1A[+] Device connected: %@, iOS %@."), AMDeviceCopyValue(device, NULL, CFSTR("ProductType")), AMDeviceCopyValue(device, NULL, CFSTR("ProductVersion"))));
-                    
-					if (list_files) {
-                        CFDictionaryRef response = listFilesPlistCommand();
-                        if (response) {
-                        CFArrayRef files = CFDictionaryGetValue(response, CFSTR("files"));
-                            if (files) {
-                                for (CFIndex i = 0; i < CFArrayGetCount(files); i++) {
-                                    CFShow(CFStringCreateWithFormat(CFAllocatorGetDefault(), 0, CFSTR("  %li: %@"), i, CFArrayGetValueAtIndex(files, i)));
-                                }
-                            } else puts("[-] Can not get list of files.");
-                        }
-                    }
-                    
-                    if (file_path) getFileCommand(file_index, file_path);
-                    
-					if (shared_cache_path) {
-						CFStringRef architecture = NULL;
-						if (shared_cache_arch) {
-							architecture = CFStringCreateWithCStringNoCopy(kCFAllocatorDefault, shared_cache_arch, CFStringGetSystemEncoding(), kCFAllocatorNull);
-						}
-						getFileCommand(getDyldSharedCacheIndex(architecture), shared_cache_path);
-						if (architecture) {
-							CFRelease(architecture);
-						}
-					}
-                    
-                    if (dyld_path) getFileCommand(getDyldIndex(), dyld_path);
+            if (!isTargetDevice(info->dev)) break;
+            if (daemon_store) {
+                daemonDeviceConnected(info->dev);
+            } else if (!session) {
+                if (AMDeviceConnect(info->dev) == MDERR_OK && (session = DTSessionCreate(info->dev))) {
+                    attach_time = monotonicTime();
+                    DTSessionSetTransferPolicy(session, &transfer_policy);
+                    DTSessionSetWireTrace(session, wire_trace);
+                    setAdmission(session, info->dev, NULL, 0);
+                    CFStringRef productType = AMDeviceCopyValue(info->dev, NULL, CFSTR("ProductType"));
+                    CFStringRef productVersion = AMDeviceCopyValue(info->dev, NULL, CFSTR("ProductVersion"));
+                    showFormat(CFSTR("\e[1A[+] Device connected: %@, iOS %@."), productType, productVersion);
+                    if (productType) CFRelease(productType);
+                    if (productVersion) CFRelease(productVersion);
                     
+                    runRequests();
                     CFRunLoopStop(CFRunLoopGetMain());
                 } else
                     puts("[!] Connection error. Please reconnect your device.");
@@ -262,13 +887,21 @@ void device_notification_callback(struct am_device_notification_callback_info *i
             break;
             
         case ADNCI_MSG_DISCONNECTED:
-            if (info->dev == device) {
+            if (daemon_store) {
+                daemonDeviceDisconnected(info->dev);
+                puts("[*] Device disconnected.");
+            } else if (session && info->dev == DTSessionGetDevice(session)) {
                 puts("[*] Device disconnected.");
             }
             break;
             
         case ADNCI_MSG_UNSUBSCRIBED:
-            puts("[-] Unsubscribed from device connection notifications.\n    Please restart the program.");
+            if (daemon_store) {
+                puts("[*] Unsubscribed from device connection notifications. Subscribing again.");
+                if (AMDeviceNotificationSubscribe(&device_notification_callback, 0, 0, 0, &notification) != MDERR_OK)
+                    puts("[-] Failed to subscribe for device connection notifications.");
+            } else
+                puts("[-] Unsubscribed from device connection notifications.\n    Please restart the program.");
             break;
             
         default:
@@ -276,21 +909,48 @@ void device_notification_callback(struct am_device_notification_callback_info *i
     }
 }
 
+/*
+ * What the process does after the one-shot steps (-g, -q, -E, -y), which run first in
+ * any mode: exit, serve until killed, run the daemon or wait for a device.
+ */
+typedef enum {
+    kModeLocal,                     /* Only one-shot steps; exit after them.           */
+    kModeSyncServer,                /* -Y                                              */
+    kModeSymbolServer,              /* -S, with -Y started alongside                   */
+    kModeDevice,                    /* -l, -f, -c, -C, -d, -M or nothing at all        */
+    kModeDaemon,                    /* -D                                              */
+} run_mode_t;
+
+static run_mode_t runMode(void) {
+    if (daemon_store) return kModeDaemon;
+    if (list_files || file_path || cache_request_count || dyld_path || mount_point) return kModeDevice;
+    if (server_path) return kModeSymbolServer;
+    if (sync_path) return kModeSyncServer;
+    if (ingest_name || query_name || export_cache || sync_host) return kModeLocal;
+    return kModeDevice;
+}
+
 int main(int argc, const char * argv[]) {
+    launch_time = monotonicTime();
+    transfer_policy = kDTDefaultTransferPolicy;
     if (argc == 1) help();
     for (int i = 1; i < argc; i++) {
         if (!strcmp(argv[i], "-l")) list_files = true;
+        else if (!strcmp(argv[i], "--sizes")) list_sizes = true;
+        else if (!strcmp(argv[i], "--json")) list_json = true;
+        else if (!strcmp(argv[i], "-V")) verify_files = true;
         else if (!strcmp(argv[i], "-c")) {
-            if ((i + 1) < argc)
-                shared_cache_path = argv[++i];
-            else
+            if ((i + 1) < argc && cache_request_count < kMaximumCacheRequests) {
+                snprintf(cache_requests[cache_request_count].path, PATH_MAX, "%s", argv[++i]);
+                cache_requests[cache_request_count].directory = NULL;
+                cache_requests[cache_request_count++].arch[0] = '\0';
+            } else
                 help();
 		}
 		else if (!strcmp(argv[i], "-C")) {
-			if ((i + 2) < argc) {
-				shared_cache_arch = argv[++i];
-				shared_cache_path = argv[++i];
-			} else
+			if ((i + 2) < argc && addCacheRequests(argv[i + 1], argv[i + 2]))
+				i += 2;
+			else
 				help();
 		}
         else if (!strcmp(argv[i], "-d")) {
@@ -299,6 +959,150 @@ int main(int argc, const char * argv[]) {
             else
                 help();
         }
+        else if (!strcmp(argv[i], "-D")) {
+            if ((i + 1) < argc)
+                daemon_store = argv[++i];
+            else
+                help();
+        }
+        else if (!strcmp(argv[i], "-j")) {
+            if ((i + 1) < argc && atoi(argv[i + 1]) > 0)
+                host_jobs = atoi(argv[++i]);
+            else
+                help();
+        }
+        else if (!strcmp(argv[i], "-J")) {
+            if ((i + 1) < argc && atoi(argv[i + 1]) > 0)
+                device_jobs = atoi(argv[++i]), device_jobs_set = true;
+            else
+                help();
+        }
+        else if (!strcmp(argv[i], "-t")) {
+            if ((i + 1) < argc && atof(argv[i + 1]) >= 0)
+                transfer_policy.receiveTimeout = atof(argv[++i]);
+            else
+                help();
+        }
+        else if (!strcmp(argv[i], "-m")) {
+            if ((i + 1) < argc && atof(argv[i + 1]) >= 0)
+                transfer_policy.minimumThroughput = (uint64_t)(atof(argv[++i]) * 1024);
+            else
+                help();
+        }
+        else if (!strcmp(argv[i], "-r")) {
+            if ((i + 1) < argc && atoi(argv[i + 1]) >= 0)
+                transfer_policy.maximumReconnects = atoi(argv[++i]);
+            else
+                help();
+        }
+        else if (!strcmp(argv[i], "-E")) {
+            if ((i + 2) < argc) {
+                export_cache = argv[++i];
+                export_directory = argv[++i];
+            } else
+                help();
+        }
+        else if (!strcmp(argv[i], "-G")) {
+            if ((i + 1) < argc)
+                symbol_db_path = argv[++i];
+            else
+                help();
+        }
+        else if (!strcmp(argv[i], "-g")) {
+            if ((i + 2) < argc) {
+                ingest_name = argv[++i];
+                ingest_cache = argv[++i];
+            } else
+                help();
+        }
+        else if (!strcmp(argv[i], "-q")) {
+            if ((i + 2) < argc) {
+                query_name = argv[++i];
+                query_address = strtoull(argv[++i], NULL, 0);
+            } else
+                help();
+        }
+        else if (!strcmp(argv[i], "-S")) {
+            if ((i + 2) < argc && atoi(argv[i + 2]) > 0 && atoi(argv[i + 2]) < 65536) {
+                server_path = argv[++i];
+                server_port = atoi(argv[++i]);
+            } else
+                help();
+        }
+        else if (!strcmp(argv[i], "-Y")) {
+            if ((i + 2) < argc && atoi(argv[i + 2]) > 0 && atoi(argv[i + 2]) < 65536) {
+                sync_path = argv[++i];
+                sync_port = atoi(argv[++i]);
+            } else
+                help();
+        }
+        else if (!strcmp(argv[i], "-y")) {
+            if ((i + 3) < argc && atoi(argv[i + 2]) > 0 && atoi(argv[i + 2]) < 65536) {
+                sync_host = argv[++i];
+                sync_host_port = atoi(argv[++i]);
+                sync_directory = argv[++i];
+            } else
+                help();
+        }
+        else if (!strcmp(argv[i], "-L")) {
+            if ((i + 1) < argc)
+                server_address = argv[++i];
+            else
+                help();
+        }
+        else if (!strcmp(argv[i], "-T")) {
+            if ((i + 1) < argc && atoi(argv[i + 1]) > 0)
+                server_threads = atoi(argv[++i]);
+            else
+                help();
+        }
+        else if (!strcmp(argv[i], "-u")) {
+            if ((i + 1) < argc)
+                target_udid = argv[++i];
+            else
+                help();
+        }
+        else if (!strcmp(argv[i], "-R")) {
+            if ((i + 1) < argc)
+                trace_path = argv[++i];
+            else
+                help();
+        }
+        else if (!strcmp(argv[i], "-B")) trace_bodies = true;
+        else if (!strcmp(argv[i], "-H")) {
+            if ((i + 1) < argc)
+                admission_path = argv[++i];
+            else
+                help();
+        }
+        else if (!strcmp(argv[i], "-P")) {
+            if ((i + 1) < argc && atoi(argv[i + 1]) > 0 && atoi(argv[i + 1]) < 65536)
+                metrics_port = atoi(argv[++i]);
+            else
+                help();
+        }
+        else if (!strcmp(argv[i], "-Q")) {
+            if ((i + 1) < argc)
+                metrics_path = argv[++i];
+            else
+                help();
+        }
+        else if (!strcmp(argv[i], "-A")) {
+            if ((i + 2) < argc && atoi(argv[i + 2]) > 0 && atoi(argv[i + 2]) < 65536 && replay_count < kMaximumReplayAddresses) {
+                replay_hosts[replay_count] = argv[++i];
+                replay_ports[replay_count++] = atoi(argv[++i]);
+            } else
+                help();
+        }
+#ifdef DT_DEVICEFS
+        else if (!strcmp(argv[i], "-M")) {
+            if ((i + 2) < argc) {
+                mount_point = argv[++i];
+                mount_cache = argv[++i];
+            } else
+                help();
+        }
+#endif
         else if (!strcmp(argv[i], "-f")) {
             if ((i + 2) < argc) {
                 file_index = atoi(argv[++i]);
@@ -311,13 +1115,157 @@ int main(int argc, const char * argv[]) {
             help();
     }
     
+    if ((ingest_name || query_name) && !symbol_db_path) help();
+    if (replay_count > 1 && !daemon_store) help();
+    run_mode_t mode = runMode();
+    int status = 0;
+    if (symbol_db_path && !(symbol_db = DTSymbolDBOpen(symbol_db_path))) {
+        printf("[-] Can not open symbol database %s.\n", symbol_db_path);
+        return 1;
+    }
+    if (ingest_name && !ingestCache(ingest_name, ingest_cache)) return 1;
+    if (query_name) {
+        DTSymbolDBMatch match;
+        if (DTSymbolDBLookup(symbol_db, query_name, query_address, &match))
+            printf("0x%llx %s + %llu (%s)\n", (unsigned long long)query_address, match.symbol, (unsigned long long)match.offset, match.image);
+        else
+            printf("[-] 0x%llx not found in %s.\n", (unsigned long long)query_address, query_name);
+    }
+    if (export_cache) {
+        DTExportResult result;
+        if (!DTExportSymbols(export_cache, export_directory, DTWorkPoolDefaultThreads(), &result)) {
+            printf("[-] %s is not a dyld shared cache.\n", export_cache);
+            return 1;
+        }
+        printf("[+] Exported %llu symbols of %u/%u images to %s in %.2f s.\n",
+               (unsigned long long)result.symbols, result.exported, result.images, export_directory, result.seconds);
+        printf("[*] %3.2f MB of symbol files from %3.2f MB of cache (%.2f%%).\n",
+               (double)result.outputBytes/(1024*1024), (double)result.inputBytes/(1024*1024),
+               result.inputBytes ? (double)result.outputBytes/(double)result.inputBytes*100 : 0);
+    }
+    
+    if (sync_host) {
+        DTSyncResult result;
+        if (!DTSyncPull(sync_host, sync_host_port, sync_directory, &result)) {
+            printf("[-] Can not sync with %s:%u.\n", sync_host, sync_host_port);
+            return 1;
+        }
+        printf("[+] Synced %u files from %s:%u to %s in %.2f s: %u unchanged, %u failed.\n",
+               result.files, sync_host, sync_host_port, sync_directory, result.seconds, result.unchanged, result.failed);
+        printf("[*] %3.2f MB of files: %3.2f MB reused from local files, %3.2f MB transferred (%.2f%%) plus %3.2f MB of block hashes.\n",
+               (double)result.bytes/(1024*1024), (double)result.reused/(1024*1024), (double)result.transferred/(1024*1024),
+               result.bytes ? (double)result.transferred/(double)result.bytes*100 : 0, (double)result.hashBytes/(1024*1024));
+        if (result.failed) status = 1;
+    }
+    
+    if (mode == kModeLocal) {
+        DTSymbolDBClose(symbol_db);
+        return status;
+    }
+    
+    if (sync_path) {
+        if (!DTSyncServerStart(sync_path, sync_port, DTWorkPoolDefaultThreads())) {
+            printf("[-] Can not listen on port %u.\n", sync_port);
+            return 1;
+        }
+        printf("[*] Serving %s for sync on port %u.\n", sync_path, sync_port);
+        if (mode == kModeSyncServer) {
+            DTSyncServerWait();
+            return 0;
+        }
+    }
+    
+    if (server_path) {
+        const char *address = server_address ? server_address : "127.0.0.1";
+        if (!DTSymbolServerStart(server_path, address, server_port, server_threads)) {
+            printf("[-] Can not listen on %s:%u.\n", address, server_port);
+            return 1;
+        }
+        printf("[*] Serving %s on %s:%u.\n", server_path, address, server_port);
+        if (mode == kModeSymbolServer) {
+            DTSymbolServerWait();
+            return 0;
+        }
+    }
+    
+    if (trace_path && !(wire_trace = DTWireTraceCreate(trace_path, trace_bodies))) {
+        printf("[-] Can not create %s.\n", trace_path);
+        return 1;
+    }
+    
+    if (admission_path && !(admission = DTAdmissionOpen(admission_path))) {
+        printf("[-] Can not open %s.\n", admission_path);
+        return 1;
+    }
+    
+    /*
+     * Before any session is created: sessions look their series up once.
+     */
+    if (metrics_port || metrics_path) DTMetricsEnable();
+    if (metrics_port) {
+        if (!DTMetricsServe(metrics_port)) {
+            printf("[-] Can not listen on port %u.\n", metrics_port);
+            return 1;
+        }
+        printf("[*] Serving metrics on 127.0.0.1:%u/metrics.\n", metrics_port);
+    }
+    if (metrics_path) {
+        if (!DTMetricsStartTextfile(metrics_path, 15)) {
+            printf("[-] Can not write %s.\n", metrics_path);
+            return 1;
+        }
+        atexit(writeMetricsAtExit);
+    }
+    
+    if (mode == kModeDaemon) {
+        mkdir(daemon_store, 0755);
+        host_limiter.available = host_jobs;
+    }
+    
+    if (mode == kModeDaemon && replay_count) {
+        for (uint32_t i = 0; i < replay_count; i++) {
+            printf("[+] Stand-in connected: %s:%u.\n", replay_hosts[i], replay_ports[i]);
+            daemonJoinBuild(NULL, replay_hosts[i], replay_ports[i], "replay");
+        }
+        pthread_mutex_lock(&daemon_jobs_lock);
+        while (daemon_threads)
+            pthread_cond_wait(&daemon_idle, &daemon_jobs_lock);
+        pthread_mutex_unlock(&daemon_jobs_lock);
+        DTWireTraceClose(wire_trace);
+        DTAdmissionClose(admission);
+        DTSymbolDBClose(symbol_db);
+        return 0;
+    }
+    
+    if (replay_count) {
+        if ((session = DTSessionCreateWithAddress(replay_hosts[0], replay_ports[0]))) {
+            attach_time = monotonicTime();
+            DTSessionSetTransferPolicy(session, &transfer_policy);
+            DTSessionSetWireTrace(session, wire_trace);
+            setAdmission(session, NULL, replay_hosts[0], replay_ports[0]);
+            printf("[*] Using %s:%u instead of a device.\n", replay_hosts[0], replay_ports[0]);
+            runRequests();
+            DTSessionRelease(session);
+        }
+        DTWireTraceClose(wire_trace);
+        DTAdmissionClose(admission);
+        return 0;
+    }
+    
     mach_error_t ret = MDERR_OK;
     ret = AMDeviceNotificationSubscribe(&device_notification_callback, 0, 0, 0, &notification);
     if (ret == MDERR_OK) {
-        puts("[*] Waiting for device.");
+        if (target_udid && strcmp(target_udid, "any"))
+            printf("[*] Waiting for device %s.\n", target_udid);
+        else
+            puts("[*] Waiting for device.");
         CFRunLoopRun();
     } else
         puts("[-] Failed to subscribe for device connection notifications.");
+    DTSessionRelease(session);
+    DTWireTraceClose(wire_trace);
+    DTAdmissionClose(admission);
+    DTSymbolDBClose(symbol_db);
     return 0;
 }
 
@@ -327,10 +1275,63 @@ void help() {
     puts(" use this tool.\n");
     puts(" Options:");
     puts("  -l           -  List available files.");
+    puts("  --sizes      -  With -l: probe and print the size of every file and the total.");
+    puts("  --json       -  With -l: print the listing with sizes as JSON.");
     puts("  -f n path    -  Download file with index n to path 'path'.");
 	puts("  -c path      -  Download dyld shared cache to path 'path'.");
 	puts("  -C arch path -  Download dyld shared cache for architecture 'arch' to path 'path'.");
+    puts("                  Repeatable. 'arch' may be a comma-separated list (e.g.");
+    puts("                  arm64,arm64e); 'path' is then a directory. The caches are");
+    puts("                  transferred concurrently in one session.");
     puts("  -d path      -  Download /usr/lib/dyld to path 'path'.");
+    puts("  -V           -  Validate fetched Mach-O files and dyld shared caches and write");
+    puts("                  their UUID -> (file, offset, arch) map to 'path'.uuids.");
+    puts("  -t seconds   -  Receive timeout (default 30, 0 - none).");
+    puts("  -m KB/s      -  Minimum throughput over 30 s before a transfer counts as stalled");
+    puts("                  (default 64, 0 - no watchdog).");
+    puts("  -r n         -  Reconnect and retry a failed or stalled transfer n times (default 5).");
+    puts("  -E cache dir -  Export compact per-image symbol files (<UUID>.sym) of a fetched");
+    puts("                  dyld shared cache to directory 'dir'.");
+    puts("  -G db        -  Symbol database directory shared by all builds. In daemon mode");
+    puts("                  every stored build's caches are added as <build>_<arch>.");
+    puts("  -g name path -  Add the fetched dyld shared cache at 'path' to the database");
+    puts("                  as build 'name'.");
+    puts("  -q name addr -  Look up an unslid address of build 'name' in the database.");
+    puts("  -D path      -  Daemon mode. Fetch dyld and dyld shared caches of every new");
+    puts("                  build connected to the store directory 'path'. Devices running");
+    puts("                  the same build split its files between them.");
+    puts("  -j n         -  Daemon mode: serve at most n devices at once (default 2).");
+    puts("  -J n         -  At most n concurrent transfers per device (daemon mode default 1,");
+    puts("                  -C default all).");
+    puts("  -S path port -  Serve directory 'path' (e.g. the daemon store) over HTTP on 'port'.");
+    puts("                  GET / lists files by device build.");
+    puts("  -L address   -  Server: listen on this IPv4 address (default 127.0.0.1, 0.0.0.0 -");
+    puts("                  all interfaces).");
+    puts("  -T n         -  Server: use n connection threads (default 4).");
+    puts("  -Y path port -  Serve directory 'path' to -y on other hosts on 'port'.");
+    puts("  -y host port path");
+    puts("               -  Sync directory 'path' with the -Y server at host:port. Only");
+    puts("                  blocks not found in local files (e.g. the same cache of an");
+    puts("                  earlier build) are transferred.");
+    puts("  -u UDID      -  Use the device with this UDID ('any' - the first one) and ignore");
+    puts("                  all others. In daemon mode only this device is served.");
+    puts("  -R path      -  Record a wire trace of every send and receive to 'path'.");
+    puts("  -B           -  Include file bodies in the wire trace.");
+    puts("  -A host port -  Talk to a dtreplay server instead of a device. Repeatable with -D:");
+    puts("                  the servers then fetch the build together like devices would.");
+    puts("  -H path      -  Share transfers with every fetchsymbols process using state file");
+    puts("                  'path' (e.g. /tmp/fetchsymbols.admission). New transfers start");
+    puts("                  only while the host's total throughput keeps rising and its");
+    puts("                  disk keeps up with the writes.");
+    puts("  -P port      -  Serve Prometheus metrics on 127.0.0.1:'port'/metrics.");
+    puts("  -Q path      -  Write Prometheus metrics to 'path' every 15 s and at exit");
+    puts("                  (for the node_exporter textfile collector).");
+#ifdef DT_DEVICEFS
+    puts("  -M dir cache -  Mount the device's files read-only at 'dir'. A file is fetched");
+    puts("                  into 'cache'/<ProductType>_<BuildVersion> when first opened;");
+    puts("                  reads wait only for their range. Files complete there are not");
+    puts("                  fetched again.");
+#endif
     puts("  -h           -  Display this message.");
     exit(0);
 }
@@ -0,0 +1,399 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "metrics.h"
+
+/*
+ * Counter slots per thread. A counter or gauge series takes one slot, a histogram one
+ * per bucket plus count and sum (in nanoseconds).
+ */
+#define kMaximumSlots   8192
+#define kMaximumSeries  2048
+#define kMaximumLabel   256
+
+/*
+ * A scrape connection gets this long to send its request and take the response.
+ */
+#define kScrapeTimeout  2
+
+typedef enum {
+    kMetricCounter,
+    kMetricGauge,
+    kMetricHistogram,
+} metric_type_t;
+
+typedef struct {
+    const char *name;
+    const char *help;
+    metric_type_t type;
+    const char *label;
+    const double *buckets;
+    uint32_t bucketCount;
+} metric_t;
+
+static const double kLatencyBuckets[] = {0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+static const double kTransferBuckets[] = {0.1, 0.5, 1, 5, 10, 30, 60, 120, 300, 600, 1800};
+static const double kFlushBuckets[] = {0.0001, 0.001, 0.01, 0.1, 1, 10};
+
+#define BUCKETS(list) list, sizeof(list) / sizeof(list[0])
+
+static const metric_t kMetrics[kDTMetricCount] = {
+    [kDTMetricDeviceBytes]      = {"dt_fetch_device_received_bytes_total", "File body bytes received, by device.", kMetricCounter, "device", NULL, 0},
+    [kDTMetricFileBytes]        = {"dt_fetch_file_received_bytes_total", "File body bytes received, by device path.", kMetricCounter, "file", NULL, 0},
+    [kDTMetricTransferSeconds]  = {"dt_fetch_transfer_duration_seconds", "Time to fetch a file, including retries.", kMetricHistogram, "result", BUCKETS(kTransferBuckets)},
+    [kDTMetricHandshakeSeconds] = {"dt_fetch_handshake_duration_seconds", "Time to start a fetchsymbols service connection, without waiting for the Lockdown session.", kMetricHistogram, NULL, BUCKETS(kLatencyBuckets)},
+    [kDTMetricListSeconds]      = {"dt_fetch_list_duration_seconds", "Time to get the file list.", kMetricHistogram, NULL, BUCKETS(kLatencyBuckets)},
+    [kDTMetricErrors]           = {"dt_fetch_errors_total", "Failed service connections and transfer attempts, by kind.", kMetricCounter, "kind", NULL, 0},
+    [kDTMetricActiveTransfers]  = {"dt_fetch_active_transfers", "GetFile attempts in progress.", kMetricGauge, NULL, NULL, 0},
+    [kDTMetricFlushSeconds]     = {"dt_fetch_disk_flush_duration_seconds", "Time to write a received file to disk (msync) before unmapping it.", kMetricHistogram, NULL, BUCKETS(kFlushBuckets)},
+};
+
+typedef struct {
+    DTMetric metric;
+    char label[kMaximumLabel];
+    uint32_t slot;
+} series_t;
+
+typedef struct metrics_shard {
+    uint64_t values[kMaximumSlots];
+    struct metrics_shard *next;         /* All shards.                                 */
+    struct metrics_shard *free;         /* Shards of exited threads.                   */
+} metrics_shard_t;
+
+static bool            metrics_enabled = false;
+static pthread_mutex_t registry_lock   = PTHREAD_MUTEX_INITIALIZER;
+static series_t        series_table[kMaximumSeries];
+static uint32_t        series_count    = 0;
+static uint32_t        slot_count      = 0;
+static uint64_t        series_dropped  = 0;
+static uint8_t         slot_metric[kMaximumSlots];      /* Metric + 1 at a series' first slot. */
+static metrics_shard_t *shards         = NULL;
+static metrics_shard_t *free_shards    = NULL;
+static pthread_key_t   shard_key;
+static pthread_once_t  shard_once      = PTHREAD_ONCE_INIT;
+
+static void releaseShard(void *value) {
+    metrics_shard_t *shard = value;
+    pthread_mutex_lock(&registry_lock);
+    shard->free = free_shards;
+    free_shards = shard;
+    pthread_mutex_unlock(&registry_lock);
+}
+
+static void createShardKey(void) {
+    pthread_key_create(&shard_key, releaseShard);
+}
+
+static metrics_shard_t *currentShard(void) {
+    metrics_shard_t *shard = pthread_getspecific(shard_key);
+    if (shard) return shard;
+    pthread_mutex_lock(&registry_lock);
+    if ((shard = free_shards))
+        free_shards = shard->free;
+    else if ((shard = calloc(1, sizeof(metrics_shard_t)))) {
+        shard->next = shards;
+        /*
+         * Scrapes walk the list without the lock; publish the shard once it's zeroed.
+         */
+        __atomic_store_n(&shards, shard, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&registry_lock);
+    if (shard) pthread_setspecific(shard_key, shard);
+    return shard;
+}
+
+void DTMetricsEnable(void) {
+    pthread_once(&shard_once, createShardKey);
+    metrics_enabled = true;
+}
+
+static uint32_t slotsOf(DTMetric metric) {
+    return kMetrics[metric].type == kMetricHistogram ? kMetrics[metric].bucketCount + 2 : 1;
+}
+
+int DTMetricsSeries(DTMetric metric, const char *label) {
+    if (!metrics_enabled || metric >= kDTMetricCount) return -1;
+    if (!kMetrics[metric].label) label = "";
+    else if (!label) label = "unknown";
+
+    int result = -1;
+    pthread_mutex_lock(&registry_lock);
+    for (uint32_t i = 0; i < series_count && result < 0; i++)
+        if (series_table[i].metric == metric && !strcmp(series_table[i].label, label)) result = (int)series_table[i].slot;
+    if (result < 0) {
+        if (series_count < kMaximumSeries && slot_count + slotsOf(metric) <= kMaximumSlots) {
+            series_t *series = &series_table[series_count];
+            series->metric = metric;
+            snprintf(series->label, sizeof(series->label), "%s", label);
+            series->slot = slot_count;
+            slot_count += slotsOf(metric);
+            result = (int)series->slot;
+            __atomic_store_n(&slot_metric[series->slot], (uint8_t)(metric + 1), __ATOMIC_RELEASE);
+            series_count++;
+        } else
+            series_dropped++;
+    }
+    pthread_mutex_unlock(&registry_lock);
+    return result;
+}
+
+void DTMetricsAdd(int series, int64_t value) {
+    if (series < 0) return;
+    metrics_shard_t *shard = currentShard();
+    if (shard) __atomic_fetch_add(&shard->values[series], (uint64_t)value, __ATOMIC_RELAXED);
+}
+
+/*
+ * Series index is the histogram's first slot: bucketCount non-cumulative buckets
+ * (observations above the last bound are only in count), then count, then the sum.
+ */
+void DTMetricsObserve(int series, double seconds) {
+    if (series < 0 || series >= kMaximumSlots) return;
+    uint8_t index = __atomic_load_n(&slot_metric[series], __ATOMIC_ACQUIRE);
+    if (!index || kMetrics[index - 1].type != kMetricHistogram) return;
+    const metric_t *metric = &kMetrics[index - 1];
+    metrics_shard_t *shard = currentShard();
+    if (!shard) return;
+
+    uint32_t bucket = 0;
+    while (bucket < metric->bucketCount && seconds > metric->buckets[bucket]) bucket++;
+    if (bucket < metric->bucketCount) __atomic_fetch_add(&shard->values[series + bucket], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&shard->values[series + metric->bucketCount], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&shard->values[series + metric->bucketCount + 1], (uint64_t)(seconds > 0 ? seconds * 1e9 : 0), __ATOMIC_RELAXED);
+}
+
+static uint64_t sumSlot(uint32_t slot) {
+    uint64_t sum = 0;
+    for (metrics_shard_t *shard = __atomic_load_n(&shards, __ATOMIC_ACQUIRE); shard; shard = shard->next)
+        sum += __atomic_load_n(&shard->values[slot], __ATOMIC_RELAXED);
+    return sum;
+}
+
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+} text_t;
+
+static void textAppend(text_t *text, const char *format, ...) {
+    va_list args;
+    for (;;) {
+        size_t available = text->capacity - text->length;
+        va_start(args, format);
+        int length = vsnprintf(text->data ? text->data + text->length : NULL, available, format, args);
+        va_end(args);
+        if (length < 0) return;
+        if ((size_t)length < available) {
+            text->length += length;
+            return;
+        }
+        size_t capacity = text->capacity ? text->capacity * 2 : 16384;
+        while (capacity - text->length <= (size_t)length) capacity *= 2;
+        char *data = realloc(text->data, capacity);
+        if (!data) return;
+        text->data = data;
+        text->capacity = capacity;
+    }
+}
+
+/*
+ * Label values may contain anything; the format wants \\, \" and \n escaped.
+ */
+static void escapeLabel(const char *value, char *buffer, size_t size) {
+    size_t length = 0;
+    for (; *value && length + 2 < size; value++) {
+        if (*value == '\\' || *value == '"') buffer[length++] = '\\';
+        if (*value == '\n') {
+            buffer[length++] = '\\';
+            buffer[length++] = 'n';
+        } else
+            buffer[length++] = *value;
+    }
+    buffer[length] = '\0';
+}
+
+char *DTMetricsCopyText(size_t *length) {
+    text_t text = {0};
+    pthread_mutex_lock(&registry_lock);
+    for (uint32_t metric = 0; metric < kDTMetricCount; metric++) {
+        const metric_t *definition = &kMetrics[metric];
+        static const char *types[] = {"counter", "gauge", "histogram"};
+        textAppend(&text, "# HELP %s %s\n# TYPE %s %s\n", definition->name, definition->help, definition->name, types[definition->type]);
+
+        for (uint32_t i = 0; i < series_count; i++) {
+            const series_t *series = &series_table[i];
+            if (series->metric != metric) continue;
+            char label[2 * kMaximumLabel + 32] = "";
+            if (definition->label) {
+                char escaped[2 * kMaximumLabel];
+                escapeLabel(series->label, escaped, sizeof(escaped));
+                snprintf(label, sizeof(label), "%s=\"%s\"", definition->label, escaped);
+            }
+
+            if (definition->type == kMetricHistogram) {
+                uint64_t cumulative = 0;
+                for (uint32_t bucket = 0; bucket < definition->bucketCount; bucket++) {
+                    cumulative += sumSlot(series->slot + bucket);
+                    textAppend(&text, "%s_bucket{%s%sle=\"%g\"} %llu\n", definition->name, label, label[0] ? "," : "",
+                               definition->buckets[bucket], (unsigned long long)cumulative);
+                }
+                uint64_t count = sumSlot(series->slot + definition->bucketCount);
+                double sum = sumSlot(series->slot + definition->bucketCount + 1) / 1e9;
+                textAppend(&text, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", definition->name, label, label[0] ? "," : "", (unsigned long long)count);
+                textAppend(&text, "%s_sum%s%s%s %.9f\n", definition->name, label[0] ? "{" : "", label, label[0] ? "}" : "", sum);
+                textAppend(&text, "%s_count%s%s%s %llu\n", definition->name, label[0] ? "{" : "", label, label[0] ? "}" : "", (unsigned long long)count);
+            } else if (definition->type == kMetricGauge)
+                textAppend(&text, "%s%s%s%s %lld\n", definition->name, label[0] ? "{" : "", label, label[0] ? "}" : "", (long long)sumSlot(series->slot));
+            else
+                textAppend(&text, "%s%s%s%s %llu\n", definition->name, label[0] ? "{" : "", label, label[0] ? "}" : "", (unsigned long long)sumSlot(series->slot));
+        }
+    }
+    textAppend(&text, "# HELP dt_fetch_metrics_dropped_series_total Series not recorded because the table was full.\n"
+                      "# TYPE dt_fetch_metrics_dropped_series_total counter\n"
+                      "dt_fetch_metrics_dropped_series_total %llu\n", (unsigned long long)series_dropped);
+    pthread_mutex_unlock(&registry_lock);
+    if (length) *length = text.length;
+    return text.data;
+}
+
+static bool writeAll(int fd, const char *data, size_t length) {
+    while (length) {
+        ssize_t written = write(fd, data, length);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return false;
+        data += written;
+        length -= written;
+    }
+    return true;
+}
+
+static int metrics_socket = -1;
+static pthread_t metrics_thread;
+
+static double monotonicTime(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+ * One request per connection; scrapes are rare and tiny. They are served on a single
+ * thread, so a client that connects and sends nothing (or reads nothing) only holds it
+ * for kScrapeTimeout.
+ */
+static void *metricsServerThread(void *arg) {
+    for (;;) {
+        int fd = accept(metrics_socket, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break;
+        }
+        struct timeval timeout = {kScrapeTimeout, 0};
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        char request[2048];
+        size_t received = 0;
+        double deadline = monotonicTime() + kScrapeTimeout;
+        while (received < sizeof(request) - 1) {
+            struct pollfd peer = {fd, POLLIN, 0};
+            int remaining = (int)((deadline - monotonicTime()) * 1000);
+            if (remaining <= 0 || poll(&peer, 1, remaining) <= 0) break;
+            ssize_t result = recv(fd, request + received, sizeof(request) - 1 - received, 0);
+            if (result <= 0) break;
+            received += result;
+            request[received] = '\0';
+            if (strstr(request, "\r\n\r\n")) break;
+        }
+        request[received] = '\0';
+
+        char header[256];
+        if (!strncmp(request, "GET /metrics ", 13) || !strncmp(request, "GET / ", 6)) {
+            size_t length = 0;
+            char *body = DTMetricsCopyText(&length);
+            int headerLength = snprintf(header, sizeof(header),
+                                        "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", length);
+            if (writeAll(fd, header, headerLength) && body) writeAll(fd, body, length);
+            free(body);
+        } else {
+            int headerLength = snprintf(header, sizeof(header), "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+            writeAll(fd, header, headerLength);
+        }
+        close(fd);
+    }
+    return NULL;
+}
+
+bool DTMetricsServe(uint16_t port) {
+    signal(SIGPIPE, SIG_IGN);
+    metrics_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (metrics_socket < 0) return false;
+    int enable = 1;
+    setsockopt(metrics_socket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+
+    struct sockaddr_in address = {0};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(metrics_socket, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(metrics_socket, 16) != 0 ||
+        pthread_create(&metrics_thread, NULL, metricsServerThread, NULL) != 0) {
+        close(metrics_socket);
+        metrics_socket = -1;
+        return false;
+    }
+    pthread_detach(metrics_thread);
+    return true;
+}
+
+bool DTMetricsWriteTextfile(const char *path) {
+    char temporary[1024];
+    snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+    size_t length = 0;
+    char *text = DTMetricsCopyText(&length);
+    FILE *file = text ? fopen(temporary, "w") : NULL;
+    bool written = file && fwrite(text, 1, length, file) == length;
+    if (file && fclose(file) != 0) written = false;
+    free(text);
+    if (written && rename(temporary, path) == 0) return true;
+    unlink(temporary);
+    return false;
+}
+
+typedef struct {
+    char *path;
+    double seconds;
+} textfile_job_t;
+
+static void *textfileThread(void *arg) {
+    textfile_job_t *job = arg;
+    for (;;) {
+        usleep((useconds_t)(job->seconds * 1e6));
+        DTMetricsWriteTextfile(job->path);
+    }
+    return NULL;
+}
+
+bool DTMetricsStartTextfile(const char *path, double seconds) {
+    textfile_job_t *job = calloc(1, sizeof(textfile_job_t));
+    if (!job || !(job->path = strdup(path))) {
+        free(job);
+        return false;
+    }
+    job->seconds = seconds > 0 ? seconds : 15;
+    pthread_t thread;
+    if (!DTMetricsWriteTextfile(path) || pthread_create(&thread, NULL, textfileThread, job) != 0) {
+        free(job->path);
+        free(job);
+        return false;
+    }
+    pthread_detach(thread);
+    return true;
+}
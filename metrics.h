@@ -0,0 +1,70 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Prometheus metrics of fetches, in the text exposition format (version 0.0.4).
+ *
+ * Every thread that records gets its own block of counters and updates it with plain
+ * relaxed atomic adds; nothing is shared or locked on the transfer path. A scrape sums
+ * the blocks of all threads, including those of threads that have exited (their
+ * blocks are handed to new threads). A series (metric plus label value) is registered
+ * once under a lock; callers keep the returned index for the hot path.
+ *
+ * Until DTMetricsEnable is called, DTMetricsSeries returns -1 and recording is a no-op.
+ */
+typedef enum {
+    kDTMetricDeviceBytes = 0,       /* counter   {device} file body bytes received     */
+    kDTMetricFileBytes,             /* counter   {file}   file body bytes received     */
+    kDTMetricTransferSeconds,       /* histogram {result} whole fetch incl. retries    */
+    kDTMetricHandshakeSeconds,      /* histogram          service connection start     */
+    kDTMetricListSeconds,           /* histogram          ListFilesPlist round trip    */
+    kDTMetricErrors,                /* counter   {kind}   failed attempts by DTError   */
+    kDTMetricActiveTransfers,       /* gauge              GetFile attempts running     */
+    kDTMetricFlushSeconds,          /* histogram          msync of a received file     */
+    kDTMetricCount
+} DTMetric;
+
+void DTMetricsEnable(void);
+
+/*
+ * Index of the series of metric with the given label value (NULL for metrics without
+ * a label), or -1 if metrics are off or the series table is full.
+ */
+int DTMetricsSeries(DTMetric metric, const char *label);
+
+/*
+ * Counters and gauges. Gauges take negative values.
+ */
+void DTMetricsAdd(int series, int64_t value);
+
+/*
+ * Histograms.
+ */
+void DTMetricsObserve(int series, double seconds);
+
+/*
+ * Returns the current values as exposition text in a malloc'ed buffer.
+ */
+char *DTMetricsCopyText(size_t *length);
+
+/*
+ * Serves GET /metrics on 127.0.0.1:port from a background thread.
+ */
+bool DTMetricsServe(uint16_t port);
+
+/*
+ * Writes the exposition text to path (through path.tmp and rename, as the
+ * node_exporter textfile collector expects).
+ */
+bool DTMetricsWriteTextfile(const char *path);
+
+/*
+ * Rewrites path every 'seconds' from a background thread.
+ */
+bool DTMetricsStartTextfile(const char *path, double seconds);
+
+#endif
@@ -0,0 +1,288 @@
+/*
+ * metricstest - tests of the Prometheus exposition in metrics.c.
+ *
+ * Two batches of threads record into a counter with a label that needs escaping, the
+ * flush histogram and the active transfers gauge, the first batch exiting before the
+ * second starts. The text from DTMetricsCopyText is parsed back: every sample must
+ * follow the HELP and TYPE lines of its metric, the escaped label must round-trip, the
+ * histogram buckets must be cumulative with an inclusive upper bound and the values
+ * must include what the exited threads recorded. The second batch must run on the
+ * shards the first left behind. The textfile must appear through its rename with the
+ * same text and no .tmp left, and a scrape must be answered after a client that sends
+ * nothing. Plain POSIX; builds on Linux as well:
+ *
+ *   cc metricstest.c -lpthread -o metricstest
+ *   ./metricstest
+ *
+ * metrics.c is compiled into the test, so it is not listed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <math.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include "metrics.c"
+
+#define kThreads       8
+#define kBatches       2
+#define kAdds          1000
+#define kObservations  100
+
+static const char kDeviceLabel[] = "a\"b\\c\nd";
+static const char kEscapedLabel[] = "a\\\"b\\\\c\\nd";
+
+/*
+ * One of each bucket's cases: below the first bound, on a bound (buckets are
+ * inclusive), between two bounds and above the last one.
+ */
+static const double kFlushValues[] = {0.00005, 0.001, 0.05, 20};
+
+static uint32_t failures = 0;
+static int device_series, flush_series, active_series;
+
+/*
+ * Holds every thread of a batch until all of them have a shard.
+ */
+static pthread_mutex_t gate_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gate_changed = PTHREAD_COND_INITIALIZER;
+static uint32_t gate_count = 0;
+
+static void check(const char *name, bool passed, const char *format, ...) {
+    printf("[%c] %s", passed ? '+' : '-', name);
+    if (!passed && format) {
+        va_list args;
+        va_start(args, format);
+        printf(": ");
+        vprintf(format, args);
+        va_end(args);
+    }
+    putchar('\n');
+    if (!passed) failures++;
+}
+
+static void waitAtGate(void) {
+    pthread_mutex_lock(&gate_lock);
+    gate_count++;
+    pthread_cond_broadcast(&gate_changed);
+    while (gate_count % kThreads) pthread_cond_wait(&gate_changed, &gate_lock);
+    pthread_mutex_unlock(&gate_lock);
+}
+
+/*
+ * Each thread adds 3 per counter add; the gauge goes down 2 in the first batch and up
+ * 1 in the second.
+ */
+static void *recordThread(void *arg) {
+    int batch = (int)(intptr_t)arg;
+    DTMetricsAdd(active_series, batch == 0 ? -2 : 1);
+    waitAtGate();
+    for (int i = 0; i < kAdds; i++) DTMetricsAdd(device_series, 3);
+    for (int i = 0; i < kObservations; i++)
+        for (size_t j = 0; j < sizeof(kFlushValues) / sizeof(kFlushValues[0]); j++) DTMetricsObserve(flush_series, kFlushValues[j]);
+    return NULL;
+}
+
+static uint32_t shardCount(void) {
+    uint32_t count = 0;
+    for (metrics_shard_t *shard = __atomic_load_n(&shards, __ATOMIC_ACQUIRE); shard; shard = shard->next) count++;
+    return count;
+}
+
+/*
+ * Value of the sample named exactly 'name' (with its labels), or NAN.
+ */
+static double sampleValue(const char *text, const char *name) {
+    size_t length = strlen(name);
+    for (const char *line = text; line && *line; line = strchr(line, '\n') ? strchr(line, '\n') + 1 : NULL)
+        if (!strncmp(line, name, length) && line[length] == ' ') return strtod(line + length + 1, NULL);
+    return NAN;
+}
+
+/*
+ * Every sample belongs to the metric of the # TYPE line before it; histogram samples
+ * carry _bucket, _sum or _count on its name. Returns the number of samples, or -1.
+ */
+static int parseText(const char *text, char *error, size_t size) {
+    char metric[128] = "", type[16] = "";
+    int samples = 0;
+    bool help = false;
+    for (const char *line = text; *line;) {
+        const char *end = strchr(line, '\n');
+        if (!end) {
+            snprintf(error, size, "unterminated line");
+            return -1;
+        }
+        if (!strncmp(line, "# HELP ", 7)) {
+            help = true;
+        } else if (!strncmp(line, "# TYPE ", 7)) {
+            if (!help || sscanf(line + 7, "%127s %15s", metric, type) != 2) {
+                snprintf(error, size, "TYPE without HELP: %.*s", (int)(end - line), line);
+                return -1;
+            }
+            help = false;
+        } else {
+            size_t name = strcspn(line, "{ ");
+            size_t base = strlen(metric);
+            bool matches = name >= base && !strncmp(line, metric, base);
+            const char *suffix = line + base;
+            if (matches && name > base)
+                matches = !strcmp(type, "histogram") && (!strncmp(suffix, "_bucket", name - base) ||
+                                                         !strncmp(suffix, "_sum", name - base) || !strncmp(suffix, "_count", name - base));
+            char *number = NULL;
+            const char *value = memchr(line, ' ', end - line);
+            if (!matches || !value || (strtod(value + 1, &number), number != end)) {
+                snprintf(error, size, "sample outside %s: %.*s", metric, (int)(end - line), line);
+                return -1;
+            }
+            samples++;
+        }
+        line = end + 1;
+    }
+    return samples;
+}
+
+static char *readFile(const char *path, size_t *length) {
+    FILE *file = fopen(path, "rb");
+    if (!file) return NULL;
+    struct stat info;
+    char *data = fstat(fileno(file), &info) == 0 ? malloc(info.st_size + 1) : NULL;
+    if (data && fread(data, 1, info.st_size, file) != (size_t)info.st_size) {
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+    if (data) {
+        data[info.st_size] = '\0';
+        *length = info.st_size;
+    }
+    return data;
+}
+
+/*
+ * GET /metrics on 127.0.0.1:port; returns the body.
+ */
+static char *scrape(uint16_t port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address = {0};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    static const char request[] = "GET /metrics HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    if (fd < 0 || connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0 || !writeAll(fd, request, sizeof(request) - 1)) {
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
+    text_t response = {0};
+    char buffer[4096];
+    ssize_t received;
+    while ((received = recv(fd, buffer, sizeof(buffer), 0)) > 0) textAppend(&response, "%.*s", (int)received, buffer);
+    close(fd);
+    char *body = response.data ? strstr(response.data, "\r\n\r\n") : NULL;
+    char *copy = body && !strncmp(response.data, "HTTP/1.1 200 ", 13) ? strdup(body + 4) : NULL;
+    free(response.data);
+    return copy;
+}
+
+int main(void) {
+    DTMetricsEnable();
+    device_series = DTMetricsSeries(kDTMetricDeviceBytes, kDeviceLabel);
+    flush_series = DTMetricsSeries(kDTMetricFlushSeconds, NULL);
+    active_series = DTMetricsSeries(kDTMetricActiveTransfers, NULL);
+    if (device_series < 0 || flush_series < 0 || active_series < 0) {
+        puts("[-] Can not register the series.");
+        return 1;
+    }
+
+    uint32_t shardsAfter[kBatches];
+    for (int batch = 0; batch < kBatches; batch++) {
+        pthread_t threads[kThreads];
+        for (int i = 0; i < kThreads; i++) pthread_create(&threads[i], NULL, recordThread, (void *)(intptr_t)batch);
+        for (int i = 0; i < kThreads; i++) pthread_join(threads[i], NULL);
+        shardsAfter[batch] = shardCount();
+    }
+    check("threads of a later batch reuse the shards of exited ones", shardsAfter[0] == kThreads && shardsAfter[1] == kThreads,
+          "%u shards after the first batch, %u after the second", shardsAfter[0], shardsAfter[1]);
+
+    size_t length = 0;
+    char *text = DTMetricsCopyText(&length);
+    char error[256] = "";
+    int samples = text ? parseText(text, error, sizeof(error)) : -1;
+    check("the exposition text parses", samples > 0 && length == strlen(text), "%s", text ? error : "no text");
+    if (samples <= 0) return 1;
+
+    char name[256];
+    snprintf(name, sizeof(name), "dt_fetch_device_received_bytes_total{device=\"%s\"}", kEscapedLabel);
+    double bytes = sampleValue(text, name);
+    check("labels are escaped and counters summed over all threads", bytes == kBatches * kThreads * kAdds * 3,
+          "%s is %.0f", name, bytes);
+
+    double gauge = sampleValue(text, "dt_fetch_active_transfers");
+    check("gauges go negative", gauge == -kThreads, "dt_fetch_active_transfers is %.0f", gauge);
+
+    /*
+     * Cumulative counts per bound: the bucket of each value and all above it.
+     */
+    static const double bounds[] = {0.0001, 0.001, 0.01, 0.1, 1, 10};
+    double each = kBatches * kThreads * kObservations, expected[] = {each, 2 * each, 2 * each, 3 * each, 3 * each, 3 * each};
+    bool cumulative = true;
+    for (size_t i = 0; i < sizeof(bounds) / sizeof(bounds[0]); i++) {
+        snprintf(name, sizeof(name), "dt_fetch_disk_flush_duration_seconds_bucket{le=\"%g\"}", bounds[i]);
+        double value = sampleValue(text, name);
+        if (value != expected[i]) {
+            check("histogram buckets are cumulative", false, "%s is %.0f, not %.0f", name, value, expected[i]);
+            cumulative = false;
+        }
+    }
+    double infinite = sampleValue(text, "dt_fetch_disk_flush_duration_seconds_bucket{le=\"+Inf\"}");
+    double count = sampleValue(text, "dt_fetch_disk_flush_duration_seconds_count");
+    double sum = sampleValue(text, "dt_fetch_disk_flush_duration_seconds_sum");
+    double expectedSum = each * (kFlushValues[0] + kFlushValues[1] + kFlushValues[2] + kFlushValues[3]);
+    if (cumulative)
+        check("histogram buckets are cumulative", infinite == 4 * each && count == 4 * each && fabs(sum - expectedSum) < 1e-3,
+              "+Inf %.0f, count %.0f, sum %.6f instead of %.6f", infinite, count, sum, expectedSum);
+
+    /*
+     * Textfile: written beside the target and renamed over it.
+     */
+    char directory[] = "/tmp/metricstest.XXXXXX";
+    if (!mkdtemp(directory)) return 1;
+    char path[PATH_MAX], temporary[PATH_MAX + 8], missing[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/fetchsymbols.prom", directory);
+    snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+    snprintf(missing, sizeof(missing), "%s/missing/fetchsymbols.prom", directory);
+    size_t written = 0;
+    bool wrote = DTMetricsWriteTextfile(path);
+    char *file = wrote ? readFile(path, &written) : NULL;
+    check("the textfile is renamed into place", file && written == length && !memcmp(file, text, length) && access(temporary, F_OK) != 0,
+          "%s, %zu bytes of %zu, .tmp %s", wrote ? "written" : "not written", written, length, access(temporary, F_OK) == 0 ? "left" : "gone");
+    free(file);
+    check("a textfile that can't be written is reported", !DTMetricsWriteTextfile(missing) && access(missing, F_OK) != 0, NULL);
+
+    /*
+     * A client that sends nothing holds the scrape thread for kScrapeTimeout, no longer.
+     */
+    uint16_t port = (uint16_t)(20000 + getpid() % 20000);
+    int silent = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address = {0};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bool serving = DTMetricsServe(port) && silent >= 0 && connect(silent, (struct sockaddr *)&address, sizeof(address)) == 0;
+    double start = monotonicTime();
+    char *body = serving ? scrape(port) : NULL;
+    double seconds = monotonicTime() - start;
+    check("a scrape is served after a silent client", body && !strcmp(body, text) && seconds < kScrapeTimeout + 1,
+          "%s after %.1f s", body ? "different text" : "no response", seconds);
+    free(body);
+    if (silent >= 0) close(silent);
+
+    free(text);
+    char command[64];
+    snprintf(command, sizeof(command), "rm -rf %s", directory);
+    if (system(command) != 0) printf("[*] Can not remove %s.\n", directory);
+    printf("[%c] %u failed.\n", failures ? '-' : '+', failures);
+    return failures ? 1 : 0;
+}
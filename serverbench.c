@@ -0,0 +1,178 @@
+/*
+ * serverbench - load test for the -S symbol server.
+ *
+ * Opens 'connections' keep-alive connections, each on its own thread, and requests
+ * 'path' over and over for 'seconds', optionally only the byte range 'first-last'.
+ * Reports requests/s and GB/s of response bodies. Plain POSIX; builds on Linux as
+ * well:
+ *
+ *   cc serverbench.c -lpthread -o serverbench
+ *   fetchsymbols -S store 8080 &
+ *   serverbench 127.0.0.1 8080 /build/dyld 16 10
+ *   serverbench 127.0.0.1 8080 /build/dyld 16 10 0-4095
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+typedef struct {
+    pthread_t thread;
+    uint64_t requests;
+    uint64_t bytes;
+    uint64_t errors;
+} client_t;
+
+static const char *host;
+static const char *port;
+static char request[1024];
+static size_t request_length;
+static double deadline;
+
+static double monotonicTime(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static int connectServer(void) {
+    struct addrinfo hints, *addresses = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &addresses) != 0) return -1;
+    int fd = -1;
+    for (struct addrinfo *address = addresses; address && fd < 0; address = address->ai_next) {
+        fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+        if (fd >= 0 && connect(fd, address->ai_addr, address->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+    if (fd >= 0) {
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+    return fd;
+}
+
+/*
+ * Sends one request and reads its response. Returns the body length, or -1 if the
+ * connection has to be reopened.
+ */
+static long long exchange(int fd, char *buffer, size_t size) {
+    for (size_t sent = 0; sent < request_length;) {
+        ssize_t result = send(fd, request + sent, request_length - sent, 0);
+        if (result <= 0) return -1;
+        sent += result;
+    }
+
+    size_t length = 0;
+    char *end = NULL;
+    while (!end) {
+        if (length == size - 1) return -1;
+        ssize_t result = recv(fd, buffer + length, size - 1 - length, 0);
+        if (result <= 0) return -1;
+        length += result;
+        buffer[length] = '\0';
+        end = strstr(buffer, "\r\n\r\n");
+    }
+    if (strncmp(buffer, "HTTP/1.1 200", 12) && strncmp(buffer, "HTTP/1.1 206", 12)) return -1;
+    const char *field = strstr(buffer, "\r\nContent-Length:");
+    if (!field || field > end) return -1;
+    long long body = strtoll(field + 17, NULL, 10);
+    bool closing = strstr(buffer, "\r\nConnection: close") != NULL;
+
+    long long received = (long long)(length - (end + 4 - buffer));
+    while (received < body) {
+        ssize_t result = recv(fd, buffer, size, 0);
+        if (result <= 0) return -1;
+        received += result;
+    }
+    return closing ? -1 - body : body;
+}
+
+static void *clientThread(void *arg) {
+    client_t *client = arg;
+    size_t size = 1 << 20;
+    char *buffer = malloc(size);
+    int fd = -1;
+    while (buffer && monotonicTime() < deadline) {
+        if (fd < 0 && (fd = connectServer()) < 0) {
+            client->errors++;
+            usleep(10000);
+            continue;
+        }
+        long long body = exchange(fd, buffer, size);
+        if (body < -1) {
+            /*
+             * Complete response on a connection the server closes.
+             */
+            client->requests++;
+            client->bytes += -1 - body;
+        } else if (body >= 0) {
+            client->requests++;
+            client->bytes += body;
+            continue;
+        } else
+            client->errors++;
+        close(fd);
+        fd = -1;
+    }
+    if (fd >= 0) close(fd);
+    free(buffer);
+    return NULL;
+}
+
+static void help(void) {
+    puts("serverbench host port path [connections] [seconds] [first-last]");
+    puts("  Requests 'path' from a -S server on 'connections' keep-alive connections");
+    puts("  (default 8) for 'seconds' (default 10), optionally only a byte range.");
+    exit(0);
+}
+
+int main(int argc, const char *argv[]) {
+    if (argc < 4) help();
+    host = argv[1];
+    port = argv[2];
+    int connections = argc > 4 ? atoi(argv[4]) : 8;
+    double seconds = argc > 5 ? atof(argv[5]) : 10;
+    if (connections <= 0 || seconds <= 0) help();
+    int length = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: %s\r\n%s%s%s\r\n", argv[3], host,
+                          argc > 6 ? "Range: bytes=" : "", argc > 6 ? argv[6] : "", argc > 6 ? "\r\n" : "");
+    if (length < 0 || length >= (int)sizeof(request)) help();
+    request_length = (size_t)length;
+
+    client_t *clients = calloc(connections, sizeof(client_t));
+    if (!clients) return 1;
+    double start = monotonicTime();
+    deadline = start + seconds;
+    for (int i = 0; i < connections; i++)
+        if (pthread_create(&clients[i].thread, NULL, clientThread, &clients[i]) != 0) {
+            printf("[-] Can not start client %d.\n", i);
+            return 1;
+        }
+
+    client_t total = {0};
+    for (int i = 0; i < connections; i++) {
+        pthread_join(clients[i].thread, NULL);
+        total.requests += clients[i].requests;
+        total.bytes += clients[i].bytes;
+        total.errors += clients[i].errors;
+    }
+    double elapsed = monotonicTime() - start;
+    printf("[+] %llu requests in %.2f s on %d connections: %.0f requests/s, %.3f GB/s, %llu errors.\n",
+           (unsigned long long)total.requests, elapsed, connections, total.requests / elapsed,
+           total.bytes / elapsed / 1e9, (unsigned long long)total.errors);
+    free(clients);
+    return total.requests ? 0 : 1;
+}
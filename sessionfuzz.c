@@ -0,0 +1,283 @@
+/*
+ * sessionfuzz - libFuzzer target for the receive path of fetchsymbols.c.
+ *
+ * A fake device on a loopback port answers each connection with bytes from the input:
+ * ListFilesPlist with a fixed one-file listing (or, if the first input byte is odd, with
+ * a fuzzed reply), GetFile with the rest of the input as echo, size header and body. A
+ * DTSessionCreateWithAddress session then lists the files and fetches file 0, going
+ * through connectionReceiveMessage, the echo check, the size header and receiveFile's
+ * ftruncate, mmap and receive loop. Every mmap of receiveFile is recorded; the target
+ * aborts if one is made without a size header DTWireDecodeSize accepted, or with any
+ * other length, and if a complete body is not written to the file byte for byte.
+ *
+ *   clang -g -O1 -fsanitize=fuzzer,address,undefined -F/System/Library/PrivateFrameworks -framework MobileDevice -framework CoreFoundation sessionfuzz.c workpool.c wiretrace.c admission.c arena.c metrics.c -o sessionfuzz
+ *   ./sessionfuzz corpus/
+ *
+ * fetchsymbols.c is compiled into the target, so it is not listed. Without libFuzzer,
+ * build it the same way with -DDT_FUZZ_MAIN instead of -fsanitize=fuzzer: the driver
+ * runs the files given on the command line, or else edge cases, every truncation of a
+ * well-formed reply and 20000 pseudo-random mutations of one.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/mman.h>
+
+typedef struct {
+    uint32_t count;
+    size_t length;
+} mapping_record_t;
+
+static mapping_record_t mappings;
+
+/*
+ * Stands in for mmap in fetchsymbols.c below.
+ */
+static void *recordMapping(void *address, size_t length, int protection, int flags, int fd, off_t offset) {
+    mappings.count++;
+    mappings.length = length;
+    return mmap(address, length, protection, flags, fd, offset);
+}
+
+#define mmap recordMapping
+#include "fetchsymbols.c"
+#undef mmap
+
+static const char kListing[] = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                               "<plist version=\"1.0\">\n<dict>\n<key>files</key>\n<array>\n"
+                               "<string>/usr/lib/dyld</string>\n</array>\n</dict>\n</plist>\n";
+
+static pthread_once_t device_once = PTHREAD_ONCE_INIT;
+static int device_socket = -1;
+static uint16_t device_port = 0;
+static char output_path[64];
+
+/*
+ * Replies of the fake device for the current input.
+ */
+static pthread_mutex_t reply_lock = PTHREAD_MUTEX_INITIALIZER;
+static const uint8_t *list_reply, *file_reply;
+static size_t list_length, file_length;
+
+static void require(bool condition, const char *what) {
+    if (condition) return;
+    fprintf(stderr, "[-] sessionfuzz: %s\n", what);
+    abort();
+}
+
+static void sendReply(int fd, const uint8_t *reply, size_t length) {
+    while (length) {
+        ssize_t sent = send(fd, reply, length, 0);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) return;
+        reply += sent;
+        length -= (size_t)sent;
+    }
+}
+
+/*
+ * Serves one connection at a time: the command picks the reply, then the device
+ * closes its side and waits for the session to close its own.
+ */
+static void *deviceThread(void *arg) {
+    (void)arg;
+    for (;;) {
+        int fd = accept(device_socket, NULL, NULL);
+        if (fd < 0) continue;
+        DTWireCommand command;
+        if (recv(fd, &command, sizeof(command), MSG_WAITALL) == sizeof(command)) {
+            pthread_mutex_lock(&reply_lock);
+            if (DTWireCheckEcho(&command, kDTWireCommandListFilesPlist)) sendReply(fd, list_reply, list_length);
+            else sendReply(fd, file_reply, file_length);
+            pthread_mutex_unlock(&reply_lock);
+        }
+        shutdown(fd, SHUT_WR);
+        char drain[4096];
+        while (recv(fd, drain, sizeof(drain), 0) > 0) {}
+        close(fd);
+    }
+    return NULL;
+}
+
+static void startDevice(void) {
+    signal(SIGPIPE, SIG_IGN);
+    snprintf(output_path, sizeof(output_path), "/tmp/sessionfuzz.%d", (int)getpid());
+    device_socket = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address = {0};
+    socklen_t length = sizeof(address);
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    pthread_t thread;
+    require(device_socket >= 0 && bind(device_socket, (struct sockaddr *)&address, sizeof(address)) == 0 &&
+                listen(device_socket, 4) == 0 && getsockname(device_socket, (struct sockaddr *)&address, &length) == 0 &&
+                pthread_create(&thread, NULL, deviceThread, NULL) == 0,
+            "can not start the fake device");
+    device_port = ntohs(address.sin_port);
+}
+
+static bool sameFile(const char *path, const uint8_t *body, uint64_t size) {
+    FILE *file = fopen(path, "rb");
+    if (!file) return false;
+    uint8_t buffer[4096];
+    uint64_t offset = 0;
+    bool same = true;
+    size_t length;
+    while (same && (length = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        same = offset + length <= size && !memcmp(buffer, body + offset, length);
+        offset += length;
+    }
+    fclose(file);
+    return same && offset == size;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    pthread_once(&device_once, startDevice);
+
+    /*
+     * [flags] [list length, 2 bytes] [list reply] GetFile reply
+     */
+    uint8_t canned[sizeof(DTWireCommand) + sizeof(DTWireLength) + sizeof(kListing)];
+    DTWireCommand listEcho = DTWireEncodeCommand(kDTWireCommandListFilesPlist);
+    DTWireLength cannedLength = DTWireEncodeLength(sizeof(kListing) - 1);
+    memcpy(canned, &listEcho, sizeof(listEcho));
+    memcpy(canned + sizeof(listEcho), &cannedLength, sizeof(cannedLength));
+    memcpy(canned + sizeof(listEcho) + sizeof(cannedLength), kListing, sizeof(kListing) - 1);
+
+    pthread_mutex_lock(&reply_lock);
+    list_reply = canned;
+    list_length = sizeof(canned) - 1;
+    if (size && (data[0] & 1) && size >= 3) {
+        size_t length = (size_t)data[1] << 8 | data[2];
+        list_reply = data + 3;
+        list_length = length < size - 3 ? length : size - 3;
+        data += 3 + list_length;
+        size -= 3 + list_length;
+    } else if (size) {
+        data++;
+        size--;
+    }
+    file_reply = data;
+    file_length = size;
+    pthread_mutex_unlock(&reply_lock);
+
+    DTSessionRef session = DTSessionCreateWithAddress("127.0.0.1", device_port);
+    require(session != NULL, "DTSessionCreateWithAddress");
+    DTTransferPolicy policy = kDTDefaultTransferPolicy;
+    policy.receiveTimeout = 2;
+    policy.minimumThroughput = 0;
+    policy.maximumReconnects = 0;
+    DTSessionSetTransferPolicy(session, &policy);
+
+    CFArrayRef files = DTSessionCopyFiles(session);
+    bool listed = files && CFArrayGetCount(files) > 0;
+    if (files) CFRelease(files);
+
+    unlink(output_path);
+    mappings.count = 0;
+    DTError error = DTSessionFetchFile(session, 0, output_path, NULL, NULL);
+    DTSessionRelease(session);
+
+    /*
+     * The size receiveFile may map: the one in a header that follows a GetFile echo.
+     */
+    DTWireCommand echo, fileEcho = DTWireEncodeCommand(kDTWireCommandGetFile);
+    DTWireSize header;
+    uint64_t validated = 0;
+    bool framed = size >= sizeof(echo) + sizeof(header);
+    if (framed) {
+        memcpy(&echo, data, sizeof(echo));
+        memcpy(&header, data + sizeof(echo), sizeof(header));
+        framed = !memcmp(&echo, &fileEcho, sizeof(echo)) && DTWireDecodeSize(&header, &validated);
+    }
+    const uint8_t *body = data + sizeof(echo) + sizeof(header);
+    bool complete = framed && size - sizeof(echo) - sizeof(header) >= validated;
+
+    if (!listed) {
+        require(error == kDTErrorList || error == kDTErrorIndex, "fetch without a listing");
+        require(mappings.count == 0, "mapping without a listing");
+    } else {
+        require(mappings.count <= 1, "more than one mapping");
+        require(!mappings.count || framed, "mapping without a validated size header");
+        require(!mappings.count || mappings.length == validated, "mapping larger or smaller than the validated size");
+        if (error == kDTErrorNone) require(complete && sameFile(output_path, body, validated), "received file differs from the body");
+        if (complete && mappings.count) require(error == kDTErrorNone, "complete body reported as failed");
+    }
+    unlink(output_path);
+    return 0;
+}
+
+#ifdef DT_FUZZ_MAIN
+
+static void runFile(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        printf("[-] Can not read %s.\n", path);
+        exit(1);
+    }
+    uint8_t buffer[65536];
+    size_t length = fread(buffer, 1, sizeof(buffer), file);
+    fclose(file);
+    LLVMFuzzerTestOneInput(buffer, length);
+}
+
+/*
+ * flags 0, then a GetFile echo, a size header and 'body' bytes of body.
+ */
+static size_t wellFormed(uint8_t *input, uint64_t fileSize, size_t body) {
+    DTWireCommand echo = DTWireEncodeCommand(kDTWireCommandGetFile);
+    input[0] = 0;
+    memcpy(input + 1, &echo, sizeof(echo));
+    DTWireStore64(input + 1 + sizeof(echo), fileSize);
+    for (size_t i = 0; i < body; i++) input[1 + sizeof(echo) + sizeof(DTWireSize) + i] = (uint8_t)(i * 7 + 1);
+    return 1 + sizeof(echo) + sizeof(DTWireSize) + body;
+}
+
+int main(int argc, const char *argv[]) {
+    if (argc > 1) {
+        for (int i = 1; i < argc; i++) runFile(argv[i]);
+        printf("[+] %d inputs passed.\n", argc - 1);
+        return 0;
+    }
+
+    /*
+     * Sizes around the bounds with short, exact and long bodies, and every truncation
+     * of a well-formed reply.
+     */
+    static const uint64_t sizes[] = {0, 1, 100, kDTWireMaximumFileSize, kDTWireMaximumFileSize + 1, UINT64_MAX};
+    static uint8_t input[4096];
+    uint32_t runs = 0;
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        size_t bodies[] = {0, 99, 100, 101};
+        for (size_t j = 0; j < sizeof(bodies) / sizeof(bodies[0]); j++, runs++)
+            LLVMFuzzerTestOneInput(input, wellFormed(input, sizes[i], bodies[j]));
+    }
+    size_t length = wellFormed(input, 100, 100);
+    for (size_t cut = 0; cut <= length; cut++, runs++) LLVMFuzzerTestOneInput(input, cut);
+
+    uint64_t state = 0x9e3779b97f4a7c15ull;
+    for (uint32_t i = 0; i < 20000; i++, runs++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        length = wellFormed(input, state % 300, (size_t)(state >> 16) % 300);
+        /*
+         * A few flipped bytes, mostly in the echo and the size header; every 8th input
+         * also gets a random listing reply.
+         */
+        for (uint32_t flips = (uint32_t)(state >> 32) % 4; flips; flips--) {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            input[1 + (state >> 8) % (flips == 1 ? length - 1 : 12)] ^= (uint8_t)(1u << (state % 8));
+        }
+        if (i % 8 == 0) input[0] = (uint8_t)(state | 1);
+        LLVMFuzzerTestOneInput(input, length);
+    }
+    printf("[+] %u inputs passed.\n", runs);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,383 @@
+/*
+ * sessiontest - transfer tests of the fetchsymbols library against standin.
+ *
+ * Each case starts standin on a generated file set with a fault (a dropped or stalled
+ * connection, a link below the minimum throughput), fetches through a
+ * DTSessionCreateWithAddress session and checks the result, the received bytes and
+ * the stall and reconnect counts. Size probes run against a listing as long as a split
+ * cache build's, with connection starts as slow as a device's. A file list kept past
+ * DTSessionRelease must stay readable and keep its arena until it is released. Build
+ * with the library and standin in the current directory:
+ *
+ *   cc standin.c -lpthread -o standin
+ *   xcrun -sdk macosx clang -F/System/Library/PrivateFrameworks -framework MobileDevice -framework CoreFoundation sessiontest.c fetchsymbols.c workpool.c wiretrace.c admission.c arena.c metrics.c -o sessiontest
+ *   ./sessiontest [path to standin]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "fetchsymbols.h"
+
+#define kFileCount  6
+#define kFileSize   (3 * 1024 * 1024 + 123)
+#define kProbeCount 100
+
+static const char *standin_path = "./standin";
+static char data_directory[PATH_MAX];
+static char probe_directory[PATH_MAX];
+static char output_directory[PATH_MAX];
+static uint16_t next_port;
+static uint32_t failures = 0;
+
+static double monotonicTime(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+ * Files 0..kFileCount-1 with distinct pseudo-random contents, listed by standin as
+ * /file<n> in this order.
+ */
+static bool createFiles(void) {
+    uint8_t *buffer = malloc(kFileSize);
+    if (!buffer) return false;
+    uint32_t state = 0x12345678;
+    for (int i = 0; i < kFileCount; i++) {
+        for (size_t j = 0; j < kFileSize; j++) {
+            state = state * 1664525 + 1013904223;
+            buffer[j] = (uint8_t)(state >> 24);
+        }
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/file%d", data_directory, i);
+        FILE *file = fopen(path, "wb");
+        bool written = file && fwrite(buffer, 1, kFileSize, file) == kFileSize;
+        if (file) written = (fclose(file) == 0) && written;
+        if (!written) {
+            free(buffer);
+            return false;
+        }
+    }
+    free(buffer);
+    return true;
+}
+
+/*
+ * Size of probe file n: mostly small dylibs, every 25th bigger than a probe reads to
+ * keep its connection.
+ */
+static uint64_t probeSize(int index) {
+    return index % 25 == 24 ? 2 * 1024 * 1024 + index : 1000 + index * 2011;
+}
+
+/*
+ * Files listed by standin as /probe000../probe099; their contents don't matter.
+ */
+static bool createProbeFiles(void) {
+    for (int i = 0; i < kProbeCount; i++) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/probe%03d", probe_directory, i);
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        bool written = fd >= 0 && ftruncate(fd, (off_t)probeSize(i)) == 0;
+        if (fd >= 0) written = (close(fd) == 0) && written;
+        if (!written) return false;
+    }
+    return true;
+}
+
+static bool sameContents(int index, const char *path) {
+    char original[PATH_MAX];
+    snprintf(original, sizeof(original), "%s/file%d", data_directory, index);
+    FILE *a = fopen(original, "rb"), *b = fopen(path, "rb");
+    bool same = a && b;
+    static uint8_t x[65536], y[65536];
+    while (same) {
+        size_t n = fread(x, 1, sizeof(x), a), m = fread(y, 1, sizeof(y), b);
+        if (n != m || memcmp(x, y, n)) same = false;
+        if (n == 0) break;
+    }
+    if (a) fclose(a);
+    if (b) fclose(b);
+    return same;
+}
+
+/*
+ * Starts standin with the given options on a fresh port and waits until it accepts.
+ */
+static pid_t startStandin(const char *options[], const char *directory, uint16_t *port) {
+    *port = next_port++;
+    char portString[8];
+    snprintf(portString, sizeof(portString), "%u", *port);
+    const char *arguments[16] = {standin_path};
+    int count = 1;
+    while (options && *options && count < 12) arguments[count++] = *options++;
+    arguments[count++] = directory;
+    arguments[count++] = portString;
+    arguments[count] = NULL;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        if (null >= 0) dup2(null, STDOUT_FILENO);
+        execv(standin_path, (char *const *)arguments);
+        _exit(127);
+    }
+    if (pid < 0) return -1;
+
+    for (int attempt = 0; attempt < 200; attempt++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in address = {0};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(*port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        bool connected = fd >= 0 && connect(fd, (struct sockaddr *)&address, sizeof(address)) == 0;
+        if (fd >= 0) close(fd);
+        if (connected) return pid;
+        usleep(10000);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+static void stopStandin(pid_t pid) {
+    if (pid <= 0) return;
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+}
+
+static void check(const char *name, bool passed, const char *format, ...) {
+    printf("[%c] %s", passed ? '+' : '-', name);
+    if (!passed && format) {
+        va_list args;
+        va_start(args, format);
+        printf(": ");
+        vprintf(format, args);
+        va_end(args);
+    }
+    putchar('\n');
+    if (!passed) failures++;
+}
+
+static DTTransferPolicy testPolicy(void) {
+    DTTransferPolicy policy = kDTDefaultTransferPolicy;
+    policy.receiveTimeout = 1;
+    policy.initialBackoff = 0.05;
+    policy.maximumBackoff = 0.2;
+    policy.maximumReconnects = 3;
+    return policy;
+}
+
+typedef struct {
+    DTError error;
+    DTSessionStatistics statistics;
+    double seconds;
+    bool same;
+} fetch_result_t;
+
+/*
+ * Fetches file 'index' (or all files concurrently if index < 0) from a standin with
+ * the given options.
+ */
+static bool runFetch(const char *options[], const DTTransferPolicy *policy, int index, fetch_result_t *result) {
+    memset(result, 0, sizeof(*result));
+    uint16_t port;
+    pid_t pid = startStandin(options, data_directory, &port);
+    if (pid < 0) return false;
+    DTSessionRef session = DTSessionCreateWithAddress("127.0.0.1", port);
+    if (!session) {
+        stopStandin(pid);
+        return false;
+    }
+    DTSessionSetTransferPolicy(session, policy);
+
+    double start = monotonicTime();
+    char path[PATH_MAX];
+    result->same = true;
+    if (index >= 0) {
+        snprintf(path, sizeof(path), "%s/out%d", output_directory, index);
+        unlink(path);
+        result->error = DTSessionFetchFile(session, index, path, NULL, NULL);
+        result->same = result->error == kDTErrorNone && sameContents(index, path);
+    } else {
+        DTSessionSetMaximumTransfers(session, kFileCount);
+        for (int i = 0; i < kFileCount; i++) {
+            snprintf(path, sizeof(path), "%s/out%d", output_directory, i);
+            unlink(path);
+            DTSessionFetchFileAsync(session, i, path, NULL, NULL);
+        }
+        DTSessionWait(session);
+        for (int i = 0; i < kFileCount; i++) {
+            snprintf(path, sizeof(path), "%s/out%d", output_directory, i);
+            if (!sameContents(i, path)) result->same = false;
+        }
+    }
+    result->seconds = monotonicTime() - start;
+    DTSessionGetStatistics(session, &result->statistics);
+    DTSessionRelease(session);
+    stopStandin(pid);
+    return true;
+}
+
+/*
+ * Probes the sizes of all probe files over four connections. Returns false if standin
+ * does not start; *correct tells whether every size matched.
+ */
+static bool runProbe(const char *options[], double *seconds, bool *correct) {
+    uint16_t port;
+    pid_t pid = startStandin(options, probe_directory, &port);
+    if (pid < 0) return false;
+    DTSessionRef session = DTSessionCreateWithAddress("127.0.0.1", port);
+    uint64_t sizes[kProbeCount];
+    DTError errors[kProbeCount];
+    *correct = false;
+    if (session) {
+        CFArrayRef files = DTSessionCopyFiles(session);
+        if (files) CFRelease(files);
+        double start = monotonicTime();
+        DTSessionGetFileSizes(session, kProbeCount, 4, sizes, errors);
+        *seconds = monotonicTime() - start;
+        *correct = files != NULL;
+        for (int i = 0; i < kProbeCount; i++)
+            if (errors[i] != kDTErrorNone || sizes[i] != probeSize(i)) *correct = false;
+        DTSessionRelease(session);
+    }
+    stopStandin(pid);
+    return session != NULL;
+}
+
+/*
+ * Keeps the file list past DTSessionRelease: its arena must stay allocated until the
+ * list is released, then be freed.
+ */
+static bool runListing(bool *readable, uint32_t *heldArenas, uint32_t *freedArenas) {
+    uint16_t port;
+    pid_t pid = startStandin(NULL, probe_directory, &port);
+    if (pid < 0) return false;
+    DTArenaStatistics statistics;
+    uint32_t before = 0;
+    DTArenaGetProcessStatistics(&statistics, &before);
+    DTSessionRef session = DTSessionCreateWithAddress("127.0.0.1", port);
+    *readable = false;
+    if (session) {
+        CFArrayRef files = DTSessionCopyFiles(session);
+        DTSessionRelease(session);
+        DTArenaGetProcessStatistics(&statistics, heldArenas);
+        *heldArenas -= before;
+        if (files) {
+            *readable = CFArrayGetCount(files) == kProbeCount;
+            for (CFIndex i = 0; *readable && i < kProbeCount; i++) {
+                char path[PATH_MAX];
+                CFStringRef file = CFArrayGetValueAtIndex(files, i);
+                *readable = CFGetTypeID(file) == CFStringGetTypeID() && CFStringGetCString(file, path, sizeof(path), kCFStringEncodingUTF8);
+            }
+            CFRelease(files);
+        }
+        DTArenaGetProcessStatistics(&statistics, freedArenas);
+        *freedArenas -= before;
+    }
+    stopStandin(pid);
+    return session != NULL;
+}
+
+int main(int argc, const char *argv[]) {
+    if (argc > 1) standin_path = argv[1];
+    signal(SIGPIPE, SIG_IGN);
+    next_port = 20000 + getpid() % 20000;
+    char base[] = "/tmp/sessiontest.XXXXXX";
+    if (!mkdtemp(base)) return 1;
+    snprintf(data_directory, sizeof(data_directory), "%s/data", base);
+    snprintf(probe_directory, sizeof(probe_directory), "%s/probe", base);
+    snprintf(output_directory, sizeof(output_directory), "%s/out", base);
+    if (mkdir(data_directory, 0755) != 0 || mkdir(probe_directory, 0755) != 0 || mkdir(output_directory, 0755) != 0 ||
+        !createFiles() || !createProbeFiles()) {
+        printf("[-] Can not create test files in %s.\n", base);
+        return 1;
+    }
+
+    DTTransferPolicy policy = testPolicy();
+    fetch_result_t result;
+
+    if (runFetch(NULL, &policy, 2, &result))
+        check("clean fetch", result.error == kDTErrorNone && result.same && result.statistics.reconnects == 0,
+              "%s, reconnects %u", DTErrorDescription(result.error), result.statistics.reconnects);
+    else
+        check("clean fetch", false, "standin did not start");
+
+    const char *dropOnce[] = {"-d", "1000000", "-n", "1", NULL};
+    if (runFetch(dropOnce, &policy, 1, &result))
+        check("dropped connection is retried", result.error == kDTErrorNone && result.same && result.statistics.reconnects == 1,
+              "%s, reconnects %u", DTErrorDescription(result.error), result.statistics.reconnects);
+
+    const char *stallOnce[] = {"-s", "1000000", "-n", "1", NULL};
+    if (runFetch(stallOnce, &policy, 0, &result))
+        check("stalled connection times out and is retried",
+              result.error == kDTErrorNone && result.same && result.statistics.stalls == 1 && result.statistics.reconnects == 1 && result.seconds < 5,
+              "%s, stalls %u, reconnects %u, %.1f s", DTErrorDescription(result.error), result.statistics.stalls,
+              result.statistics.reconnects, result.seconds);
+
+    const char *dropAlways[] = {"-d", "100000", NULL};
+    if (runFetch(dropAlways, &policy, 3, &result))
+        check("reconnects are bounded", result.error == kDTErrorConnectionLost && result.statistics.reconnects == policy.maximumReconnects,
+              "%s, reconnects %u", DTErrorDescription(result.error), result.statistics.reconnects);
+
+    /*
+     * 16 KB/s against a 64 KB/s minimum over a 1 s window.
+     */
+    DTTransferPolicy watchdog = policy;
+    watchdog.minimumThroughput = 64 * 1024;
+    watchdog.stallWindow = 1;
+    watchdog.maximumReconnects = 1;
+    const char *slow[] = {"-b", "16", NULL};
+    if (runFetch(slow, &watchdog, 4, &result))
+        check("slow link trips the throughput watchdog", result.error == kDTErrorStalled && result.statistics.stalls == 2,
+              "%s, stalls %u", DTErrorDescription(result.error), result.statistics.stalls);
+
+    /*
+     * One of six concurrent transfers is dropped; the others must not notice.
+     */
+    if (runFetch(dropOnce, &policy, -1, &result))
+        check("drop during concurrent transfers", result.same && result.statistics.reconnects == 1,
+              "contents %s, reconnects %u", result.same ? "ok" : "differ", result.statistics.reconnects);
+
+    /*
+     * 10 ms per connection start, one at a time: a connection per probe takes more
+     * than 1 s for the listing.
+     */
+    double seconds = 0;
+    bool correct = false;
+    const char *slowStart[] = {"-c", "10", NULL};
+    if (runProbe(slowStart, &seconds, &correct)) {
+        printf("[*] %u sizes probed in %.2f s.\n", kProbeCount, seconds);
+        check("size probes share connections", correct && seconds < 0.5, "sizes %s, %.2f s", correct ? "ok" : "wrong", seconds);
+    }
+
+    const char *oneCommand[] = {"-c", "10", "-r", "1", NULL};
+    if (runProbe(oneCommand, &seconds, &correct))
+        check("size probes fall back to a connection each", correct, "sizes wrong after %.2f s", seconds);
+
+    bool readable = false;
+    uint32_t heldArenas = 0, freedArenas = 0;
+    if (runListing(&readable, &heldArenas, &freedArenas))
+        check("file list outlives the session", readable && heldArenas == 1 && freedArenas == 0,
+              "list %s, arena %s after DTSessionRelease, %s after the list", readable ? "ok" : "unreadable",
+              heldArenas ? "kept" : "freed", freedArenas ? "kept" : "freed");
+
+    char command[PATH_MAX + 16];
+    snprintf(command, sizeof(command), "rm -rf %s", base);
+    if (system(command) != 0) printf("[*] Can not remove %s.\n", base);
+    printf("[%c] %u failed.\n", failures ? '-' : '+', failures);
+    return failures ? 1 : 0;
+}
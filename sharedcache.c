@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "sharedcache.h"
+
+const uint8_t *DTMapFile(const char *path, uint64_t *size) {
+    struct stat info;
+    int file = open(path, O_RDONLY);
+    if (file < 0) return NULL;
+    if (fstat(file, &info) != 0 || info.st_size == 0) {
+        close(file);
+        return NULL;
+    }
+    void *data = mmap(0, info.st_size, PROT_READ, MAP_SHARED, file, 0);
+    close(file);
+    if (data == MAP_FAILED) return NULL;
+    *size = info.st_size;
+    return data;
+}
+
+bool DTSharedCacheIsCache(const uint8_t *data, uint64_t size) {
+    return size >= sizeof(struct dyld_cache_header) && !strncmp((const char *)data, "dyld_v1", 7);
+}
+
+/*
+ * Maps one cache file and checks its mapping table.
+ */
+static bool openCacheFile(const char *path, DTCacheFile *file) {
+    memset(file, 0, sizeof(DTCacheFile));
+    file->data = DTMapFile(path, &file->size);
+    if (!file->data) return false;
+
+    file->header = (const struct dyld_cache_header *)file->data;
+    if (!DTSharedCacheIsCache(file->data, file->size) ||
+        (uint64_t)file->header->mappingOffset + (uint64_t)file->header->mappingCount * sizeof(struct dyld_cache_mapping_info) > file->size) {
+        munmap((void *)file->data, file->size);
+        memset(file, 0, sizeof(DTCacheFile));
+        return false;
+    }
+    snprintf(file->path, sizeof(file->path), "%s", path);
+    file->mappings = (const struct dyld_cache_mapping_info *)(file->data + file->header->mappingOffset);
+    file->mappingCount = file->header->mappingCount;
+    return true;
+}
+
+bool DTSharedCacheOpen(const char *path, DTSharedCache *cache) {
+    memset(cache, 0, sizeof(DTSharedCache));
+    if (!openCacheFile(path, &cache->files[0])) return false;
+    cache->fileCount = 1;
+
+    /*
+     * Newer headers carry imagesOffset/imagesCount; older ones use the first pair.
+     */
+    const DTCacheFile *main = &cache->files[0];
+    uint64_t offset = main->header->imagesOffsetOld, count = main->header->imagesCountOld;
+    if (main->header->mappingOffset >= offsetof(struct dyld_cache_header, imagesCount) + sizeof(uint32_t)) {
+        offset = main->header->imagesOffset;
+        count = main->header->imagesCount;
+    }
+    if (offset + count * sizeof(struct dyld_cache_image_info) <= main->size) {
+        cache->images = (const struct dyld_cache_image_info *)(main->data + offset);
+        cache->imageCount = (uint32_t)count;
+    }
+
+    /*
+     * Split caches keep their subcaches in numbered sibling files.
+     */
+    for (uint32_t i = 1; cache->fileCount < kDTMaximumCacheFiles; i++) {
+        char subcache[PATH_MAX];
+        snprintf(subcache, sizeof(subcache), "%s.%u", path, i);
+        if (openCacheFile(subcache, &cache->files[cache->fileCount])) {
+            cache->fileCount++;
+            continue;
+        }
+        snprintf(subcache, sizeof(subcache), "%s.%02u", path, i);
+        if (openCacheFile(subcache, &cache->files[cache->fileCount])) {
+            cache->fileCount++;
+            continue;
+        }
+        break;
+    }
+    return true;
+}
+
+void DTSharedCacheClose(DTSharedCache *cache) {
+    for (uint32_t i = 0; i < cache->fileCount; i++)
+        munmap((void *)cache->files[i].data, cache->files[i].size);
+    memset(cache, 0, sizeof(DTSharedCache));
+}
+
+const uint8_t *DTSharedCacheResolve(const DTSharedCache *cache, uint64_t address, uint64_t length, const DTCacheFile **file) {
+    for (uint32_t i = 0; i < cache->fileCount; i++) {
+        const DTCacheFile *candidate = &cache->files[i];
+        for (uint32_t j = 0; j < candidate->mappingCount; j++) {
+            const struct dyld_cache_mapping_info *mapping = &candidate->mappings[j];
+            if (address < mapping->address || address - mapping->address > mapping->size ||
+                length > mapping->size - (address - mapping->address))
+                continue;
+            uint64_t fileOffset = mapping->fileOffset + (address - mapping->address);
+            if (fileOffset > candidate->size || length > candidate->size - fileOffset)
+                return NULL;
+            if (file) *file = candidate;
+            return candidate->data + fileOffset;
+        }
+    }
+    return NULL;
+}
+
+const char *DTSharedCacheImagePath(const DTSharedCache *cache, uint32_t image) {
+    const DTCacheFile *main = &cache->files[0];
+    uint64_t offset = cache->images[image].pathFileOffset;
+    if (offset >= main->size || !memchr(main->data + offset, 0, main->size - offset))
+        return NULL;
+    return (const char *)main->data + offset;
+}
@@ -0,0 +1,167 @@
+#ifndef SHAREDCACHE_H
+#define SHAREDCACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+
+/*
+ * dyld shared cache on-disk structures. Only the fields read by this tool are named;
+ * the layout follows dyld's dyld_cache_format.h.
+ */
+struct dyld_cache_header {
+    char     magic[16];
+    uint32_t mappingOffset;
+    uint32_t mappingCount;
+    uint32_t imagesOffsetOld;
+    uint32_t imagesCountOld;
+    uint64_t dyldBaseAddress;
+    uint64_t codeSignatureOffset;
+    uint64_t codeSignatureSize;
+    uint64_t slideInfoOffsetUnused;
+    uint64_t slideInfoSizeUnused;
+    uint64_t localSymbolsOffset;
+    uint64_t localSymbolsSize;
+    uint8_t  uuid[16];
+    uint64_t cacheType;
+    uint32_t branchPoolsOffset;
+    uint32_t branchPoolsCount;
+    uint64_t dyldInCacheMH;
+    uint64_t dyldInCacheEntry;
+    uint64_t imagesTextOffset;
+    uint64_t imagesTextCount;
+    uint64_t patchInfoAddr;
+    uint64_t patchInfoSize;
+    uint64_t otherImageGroupAddrUnused;
+    uint64_t otherImageGroupSizeUnused;
+    uint64_t progClosuresAddr;
+    uint64_t progClosuresSize;
+    uint64_t progClosuresTrieAddr;
+    uint64_t progClosuresTrieSize;
+    uint32_t platform;
+    uint32_t formatVersionAndFlags;
+    uint64_t sharedRegionStart;
+    uint64_t sharedRegionSize;
+    uint64_t maxSlide;
+    uint64_t dylibsImageArrayAddr;
+    uint64_t dylibsImageArraySize;
+    uint64_t dylibsTrieAddr;
+    uint64_t dylibsTrieSize;
+    uint64_t otherImageArrayAddr;
+    uint64_t otherImageArraySize;
+    uint64_t otherTrieAddr;
+    uint64_t otherTrieSize;
+    uint32_t mappingWithSlideOffset;
+    uint32_t mappingWithSlideCount;
+    uint64_t dylibsPBLStateArrayAddrUnused;
+    uint64_t dylibsPBLSetAddr;
+    uint64_t programsPBLSetPoolAddr;
+    uint64_t programsPBLSetPoolSize;
+    uint64_t programTrieAddr;
+    uint32_t programTrieSize;
+    uint32_t osVersion;
+    uint32_t altPlatform;
+    uint32_t altOsVersion;
+    uint64_t swiftOptsOffset;
+    uint64_t swiftOptsSize;
+    uint32_t subCacheArrayOffset;
+    uint32_t subCacheArrayCount;
+    uint8_t  symbolFileUUID[16];
+    uint64_t rosettaReadOnlyAddr;
+    uint64_t rosettaReadOnlySize;
+    uint64_t rosettaReadWriteAddr;
+    uint64_t rosettaReadWriteSize;
+    uint32_t imagesOffset;
+    uint32_t imagesCount;
+};
+
+struct dyld_cache_mapping_info {
+    uint64_t address;
+    uint64_t size;
+    uint64_t fileOffset;
+    uint32_t maxProt;
+    uint32_t initProt;
+};
+
+struct dyld_cache_image_info {
+    uint64_t address;
+    uint64_t modTime;
+    uint64_t inode;
+    uint32_t pathFileOffset;
+    uint32_t pad;
+};
+
+struct dyld_cache_local_symbols_info {
+    uint32_t nlistOffset;
+    uint32_t nlistCount;
+    uint32_t stringsOffset;
+    uint32_t stringsSize;
+    uint32_t entriesOffset;
+    uint32_t entriesCount;
+};
+
+struct dyld_cache_local_symbols_entry {
+    uint32_t dylibOffset;
+    uint32_t nlistStartIndex;
+    uint32_t nlistCount;
+};
+
+struct dyld_cache_local_symbols_entry_64 {
+    uint64_t dylibOffset;
+    uint32_t nlistStartIndex;
+    uint32_t nlistCount;
+};
+
+#define kDTMaximumCacheFiles 64
+
+/*
+ * One mapped file of a (possibly split) cache.
+ */
+typedef struct {
+    char path[PATH_MAX];
+    const uint8_t *data;
+    uint64_t size;
+    const struct dyld_cache_header *header;
+    const struct dyld_cache_mapping_info *mappings;
+    uint32_t mappingCount;
+} DTCacheFile;
+
+/*
+ * files[0] is the main cache, followed by the subcaches found next to it
+ * (<path>.1, <path>.2, ... or <path>.01, <path>.02, ...).
+ */
+typedef struct {
+    DTCacheFile files[kDTMaximumCacheFiles];
+    uint32_t fileCount;
+    const struct dyld_cache_image_info *images;
+    uint32_t imageCount;
+} DTSharedCache;
+
+/*
+ * Maps path read-only. Returns NULL on failure; unmap with munmap(data, size).
+ */
+const uint8_t *DTMapFile(const char *path, uint64_t *size);
+
+/*
+ * True if the bytes start with a dyld shared cache header.
+ */
+bool DTSharedCacheIsCache(const uint8_t *data, uint64_t size);
+
+/*
+ * Maps the cache at path and its subcaches. Returns false if path is not a cache.
+ */
+bool DTSharedCacheOpen(const char *path, DTSharedCache *cache);
+void DTSharedCacheClose(DTSharedCache *cache);
+
+/*
+ * Returns a pointer to 'length' bytes at the unslid address, or NULL if no mapped file
+ * holds them. file (optional) receives the file that does.
+ */
+const uint8_t *DTSharedCacheResolve(const DTSharedCache *cache, uint64_t address, uint64_t length, const DTCacheFile **file);
+
+/*
+ * Install name of the image, or NULL if the path offset is bad.
+ */
+const char *DTSharedCacheImagePath(const DTSharedCache *cache, uint32_t image);
+
+#endif
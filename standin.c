@@ -0,0 +1,323 @@
+/*
+ * standin - serves a directory as a fetchsymbols device over TCP.
+ *
+ * Every regular file below 'directory' is listed as /<relative path>, in sorted order,
+ * and GetFile returns it with its size header. fetchsymbols -A 127.0.0.1 port (and
+ * DTSessionCreateWithAddress) talk to it like to a device, so transfers can be tested
+ * and measured without one:
+ *
+ *   -b KB/s    - limit each connection to this rate (a USB link is ~30-40 MB/s).
+ *   -t KB/s    - limit all connections together to this rate, like a shared hub or disk.
+ *   -s bytes   - stall file bodies after 'bytes': keep the connection open, send nothing.
+ *   -d bytes   - drop the connection after 'bytes' of a file body.
+ *   -n count   - only the first 'count' GetFile connections stall or drop (default all).
+ *   -c ms      - start each connection 'ms' after the one before, like the service starts
+ *                of a device, which run one at a time.
+ *   -r count   - close connections after 'count' commands.
+ *
+ * Plain POSIX; builds on Linux as well:
+ *
+ *   cc standin.c -lpthread -o standin
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include "wirecodec.h"
+
+typedef struct {
+    char path[PATH_MAX];            /* Device path.                                    */
+    char local[PATH_MAX];
+    uint64_t size;
+} standin_file_t;
+
+static standin_file_t *files = NULL;
+static uint32_t file_count = 0;
+static uint32_t file_capacity = 0;
+static char *listing = NULL;
+static uint32_t listing_length = 0;
+
+static double   rate = 0;           /* Bytes/s per connection, 0 - unlimited.          */
+static double   total_rate = 0;     /* Bytes/s of all connections, 0 - unlimited.      */
+static double   total_due = 0;      /* When the bytes sent so far are paid for.        */
+static pthread_mutex_t total_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t stall_after = 0;
+static uint64_t drop_after = 0;
+static int      faulty = -1;        /* GetFile connections left to misbehave, -1 - all. */
+static pthread_mutex_t faulty_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t start_delay = 0;    /* Microseconds per connection start.              */
+static int      commands = 0;       /* Commands per connection, 0 - unlimited.         */
+static pthread_mutex_t start_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double monotonicTime(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static bool addFile(const char *path, const char *local, uint64_t size) {
+    if (file_count == file_capacity) {
+        uint32_t capacity = file_capacity ? file_capacity * 2 : 64;
+        standin_file_t *grown = realloc(files, capacity * sizeof(standin_file_t));
+        if (!grown) return false;
+        files = grown;
+        file_capacity = capacity;
+    }
+    snprintf(files[file_count].path, PATH_MAX, "%s", path);
+    snprintf(files[file_count].local, PATH_MAX, "%s", local);
+    files[file_count].size = size;
+    file_count++;
+    return true;
+}
+
+static bool scanDirectory(const char *local, const char *path) {
+    DIR *directory = opendir(local);
+    if (!directory) return false;
+    struct dirent *entry;
+    bool scanned = true;
+    while (scanned && (entry = readdir(directory))) {
+        if (entry->d_name[0] == '.') continue;
+        char childLocal[PATH_MAX], childPath[PATH_MAX];
+        snprintf(childLocal, sizeof(childLocal), "%s/%s", local, entry->d_name);
+        snprintf(childPath, sizeof(childPath), "%s/%s", path, entry->d_name);
+        struct stat info;
+        if (stat(childLocal, &info) != 0) continue;
+        if (S_ISDIR(info.st_mode)) scanned = scanDirectory(childLocal, childPath);
+        else if (S_ISREG(info.st_mode) && info.st_size > 0) scanned = addFile(childPath, childLocal, info.st_size);
+    }
+    closedir(directory);
+    return scanned;
+}
+
+static int compareFiles(const void *a, const void *b) {
+    return strcmp(((const standin_file_t *)a)->path, ((const standin_file_t *)b)->path);
+}
+
+static void listingAppend(const char *text, size_t length) {
+    char *grown = realloc(listing, listing_length + length + 1);
+    if (!grown) exit(1);
+    listing = grown;
+    memcpy(listing + listing_length, text, length);
+    listing_length += (uint32_t)length;
+    listing[listing_length] = '\0';
+}
+
+/*
+ * The ListFilesPlist response: { files = [ path, ... ] } as an XML plist.
+ */
+static void buildListing(void) {
+    static const char header[] = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                                 "<!DOCTYPE plist PUBLIC \"-//Apple//DTD PLIST 1.0//EN\" \"http://www.apple.com/DTDs/PropertyList-1.0.dtd\">\n"
+                                 "<plist version=\"1.0\">\n<dict>\n<key>files</key>\n<array>\n";
+    static const char footer[] = "</array>\n</dict>\n</plist>\n";
+    listingAppend(header, sizeof(header) - 1);
+    for (uint32_t i = 0; i < file_count; i++) {
+        listingAppend("<string>", 8);
+        for (const char *c = files[i].path; *c; c++) {
+            if (*c == '&') listingAppend("&amp;", 5);
+            else if (*c == '<') listingAppend("&lt;", 4);
+            else if (*c == '>') listingAppend("&gt;", 4);
+            else listingAppend(c, 1);
+        }
+        listingAppend("</string>\n", 10);
+    }
+    listingAppend(footer, sizeof(footer) - 1);
+}
+
+static bool sendAll(int fd, const void *buffer, size_t length) {
+    while (length) {
+        ssize_t sent = send(fd, buffer, length, 0);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) return false;
+        buffer = (const char *)buffer + sent;
+        length -= sent;
+    }
+    return true;
+}
+
+static bool receiveAll(int fd, void *buffer, size_t length) {
+    return recv(fd, buffer, length, MSG_WAITALL) == (ssize_t)length;
+}
+
+static bool takeFault(void) {
+    pthread_mutex_lock(&faulty_lock);
+    bool fault = faulty != 0;
+    if (faulty > 0) faulty--;
+    pthread_mutex_unlock(&faulty_lock);
+    return fault;
+}
+
+/*
+ * Sends the body in 64 KB chunks, paced to 'rate' and 'total_rate'. Returns false when the connection
+ * has to be closed.
+ */
+static bool sendFile(int fd, const standin_file_t *file) {
+    int local = open(file->local, O_RDONLY);
+    if (local < 0) return false;
+    bool fault = (stall_after || drop_after) && takeFault();
+    static const size_t kChunk = 64 * 1024;
+    char *buffer = malloc(kChunk);
+    uint64_t sent = 0;
+    double start = monotonicTime();
+    bool alive = buffer != NULL;
+    while (alive && sent < file->size) {
+        if (fault && drop_after && sent >= drop_after) {
+            alive = false;
+            break;
+        }
+        if (fault && stall_after && sent >= stall_after) {
+            /*
+             * Hold the connection until the client gives up on it.
+             */
+            struct pollfd peer = {fd, POLLIN, 0};
+            char byte;
+            while (poll(&peer, 1, -1) >= 0 && recv(fd, &byte, 1, MSG_PEEK) > 0)
+                usleep(100000);
+            alive = false;
+            break;
+        }
+        size_t length = file->size - sent < kChunk ? (size_t)(file->size - sent) : kChunk;
+        if (fault && drop_after && sent + length > drop_after) length = (size_t)(drop_after - sent);
+        if (fault && stall_after && sent + length > stall_after) length = (size_t)(stall_after - sent);
+        ssize_t result = pread(local, buffer, length, (off_t)sent);
+        if (result <= 0 || !sendAll(fd, buffer, (size_t)result)) {
+            alive = false;
+            break;
+        }
+        sent += result;
+        if (rate > 0) {
+            double due = start + sent / rate - monotonicTime();
+            if (due > 0) usleep((useconds_t)(due * 1e6));
+        }
+        if (total_rate > 0) {
+            /*
+             * All connections share one schedule: a chunk waits until the chunks sent
+             * before it on any connection are paid for.
+             */
+            pthread_mutex_lock(&total_lock);
+            double now = monotonicTime();
+            if (total_due < now) total_due = now;
+            total_due += result / total_rate;
+            double due = total_due - now;
+            pthread_mutex_unlock(&total_lock);
+            if (due > 0) usleep((useconds_t)(due * 1e6));
+        }
+    }
+    free(buffer);
+    close(local);
+    return alive;
+}
+
+static void *connectionThread(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    if (start_delay) {
+        pthread_mutex_lock(&start_lock);
+        usleep(start_delay);
+        pthread_mutex_unlock(&start_lock);
+    }
+    DTWireCommand command;
+    int served = 0;
+    while ((!commands || served++ < commands) && receiveAll(fd, &command, sizeof(command))) {
+        if (!sendAll(fd, &command, sizeof(command))) break;
+        if (DTWireCheckEcho(&command, kDTWireCommandListFilesPlist)) {
+            DTWireLength length = DTWireEncodeLength(listing_length);
+            if (!sendAll(fd, &length, sizeof(length)) || !sendAll(fd, listing, listing_length)) break;
+        } else if (DTWireCheckEcho(&command, kDTWireCommandGetFile)) {
+            DTWireIndex request;
+            if (!receiveAll(fd, &request, sizeof(request))) break;
+            uint32_t index = DTWireDecodeIndex(&request);
+            DTWireSize header;
+            DTWireStore64(header.bytes, index < file_count ? files[index].size : 0);
+            if (!sendAll(fd, &header, sizeof(header))) break;
+            if (index >= file_count || !sendFile(fd, &files[index])) break;
+        } else
+            break;
+    }
+    close(fd);
+    return NULL;
+}
+
+static void help(void) {
+    puts("standin [-b KB/s] [-t KB/s] [-s bytes] [-d bytes] [-n count] [-c ms] [-r count] directory port");
+    puts("  Serves the files below 'directory' as a fetchsymbols device on 127.0.0.1:'port'.");
+    puts("  -b KB/s  -  Limit each connection to this rate.");
+    puts("  -t KB/s  -  Limit all connections together to this rate.");
+    puts("  -s bytes -  Stall file bodies after 'bytes'.");
+    puts("  -d bytes -  Drop connections after 'bytes' of a file body.");
+    puts("  -n count -  Only the first 'count' GetFile connections stall or drop.");
+    puts("  -c ms    -  Start connections one at a time, 'ms' each.");
+    puts("  -r count -  Close connections after 'count' commands.");
+    exit(0);
+}
+
+int main(int argc, const char *argv[]) {
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if ((i + 1) >= argc) help();
+        if (!strcmp(argv[i], "-b")) rate = atof(argv[++i]) * 1024;
+        else if (!strcmp(argv[i], "-t")) total_rate = atof(argv[++i]) * 1024;
+        else if (!strcmp(argv[i], "-s")) stall_after = strtoull(argv[++i], NULL, 0);
+        else if (!strcmp(argv[i], "-d")) drop_after = strtoull(argv[++i], NULL, 0);
+        else if (!strcmp(argv[i], "-n")) faulty = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-c")) start_delay = (uint32_t)(atof(argv[++i]) * 1000);
+        else if (!strcmp(argv[i], "-r")) commands = atoi(argv[++i]);
+        else help();
+    }
+    if (i + 1 >= argc) help();
+    signal(SIGPIPE, SIG_IGN);
+
+    if (!scanDirectory(argv[i], "")) {
+        printf("[-] Can not read %s.\n", argv[i]);
+        return 1;
+    }
+    qsort(files, file_count, sizeof(standin_file_t), compareFiles);
+    buildListing();
+
+    int port = atoi(argv[i + 1]);
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (listener < 0 || bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(listener, 64) != 0) {
+        printf("[-] Can not listen on port %u.\n", port);
+        return 1;
+    }
+    printf("[*] Serving %u files of %s on port %u.\n", file_count, argv[i], port);
+    fflush(stdout);
+
+    for (;;) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno == EMFILE || errno == ENFILE) {
+                usleep(100000);
+                continue;
+            }
+            break;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, connectionThread, (void *)(intptr_t)fd) == 0)
+            pthread_detach(thread);
+        else
+            close(fd);
+    }
+    return 0;
+}
@@ -0,0 +1,156 @@
+/*
+ * symbolbench - growth benchmark for the symbol database in symboldb.c.
+ *
+ * Ingests 'builds' synthetic builds into a fresh database, each with the same images
+ * and mostly the same names: every build renames about 2% of the previous build's
+ * symbols, as an OS update does. The shared cache reader is replaced by a generator
+ * that calls ingestImage on 'threads' threads like DTEnumerateCacheSymbols, so the real
+ * ingest, merge, write and lookup code runs. Every tenth build (and the last) prints
+ * the ingest time, the database size and the mean lookup latency from stats.tsv's
+ * columns, and at the end the total ingest time and whether sampled lookups in the
+ * first, middle and last build find the names they were generated with:
+ *
+ *   cc -O2 symbolbench.c workpool.c -lpthread -o symbolbench
+ *   ./symbolbench [builds [images [symbols per image [threads]]]]
+ *
+ * symboldb.c is compiled into the benchmark, so it is not listed. Defaults: 200 builds
+ * of 300 images with 400 symbols each, one thread per CPU.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "exportsymbols.h"
+#include "workpool.h"
+
+bool syntheticCache(const char *cachePath, uint32_t threads, void (*image)(void *context, const DTImageSymbols *symbols), void *context, uint32_t *images, uint64_t *inputBytes);
+
+#define DTEnumerateCacheSymbols syntheticCache
+#include "symboldb.c"
+#undef DTEnumerateCacheSymbols
+
+#define kRenamedPercent 2
+
+static uint32_t current_build = 0;
+static uint32_t image_count = 300;
+static uint32_t symbol_count = 400;
+
+typedef struct {
+    void (*image)(void *context, const DTImageSymbols *symbols);
+    void *context;
+} synthetic_job_t;
+
+/*
+ * Generation of the name of symbol k of image i: each one moves to a new name every
+ * 100 / kRenamedPercent builds, at its own phase.
+ */
+static uint32_t generation(uint32_t image, uint32_t symbol, uint32_t build) {
+    uint64_t hash = (uint64_t)image * 2654435761u ^ (uint64_t)symbol * 0x9e3779b97f4a7c15ull;
+    hash ^= hash >> 29;
+    hash *= 0xbf58476d1ce4e5b9ull;
+    hash ^= hash >> 32;
+    return (uint32_t)((build + hash % (100 / kRenamedPercent)) / (100 / kRenamedPercent));
+}
+
+static void syntheticImage(void *context, size_t index) {
+    synthetic_job_t *job = context;
+    DTImageSymbol *symbols = malloc(symbol_count * sizeof(DTImageSymbol));
+    char *names = malloc((size_t)symbol_count * 64);
+    char path[128];
+    if (!symbols || !names) {
+        free(symbols);
+        free(names);
+        return;
+    }
+    snprintf(path, sizeof(path), "/System/Library/PrivateFrameworks/Synthetic%u.framework/Synthetic%u", (uint32_t)index, (uint32_t)index);
+    for (uint32_t k = 0; k < symbol_count; k++) {
+        char *name = names + (size_t)k * 64;
+        int length = snprintf(name, 64, "_$s9Synthetic%uC6method%u_%uyyF", (uint32_t)index, k, generation((uint32_t)index, k, current_build));
+        symbols[k] = (DTImageSymbol){0x180000000ull + index * 0x100000 + k * 64, name, (uint32_t)length};
+    }
+    DTImageSymbols image = {(uint32_t)index, {0}, 0x0100000c, 2, 0x180000000ull + index * 0x100000, path, symbols, symbol_count};
+    memcpy(image.uuid, &index, sizeof(index));
+    memcpy(image.uuid + 8, &current_build, sizeof(current_build));
+    job->image(job->context, &image);
+    free(symbols);
+    free(names);
+}
+
+bool syntheticCache(const char *cachePath, uint32_t threads, void (*image)(void *context, const DTImageSymbols *symbols), void *context, uint32_t *images, uint64_t *inputBytes) {
+    (void)cachePath;
+    synthetic_job_t job = {image, context};
+    DTWorkPoolApply(image_count, threads, syntheticImage, &job);
+    if (images) *images = image_count;
+    if (inputBytes) *inputBytes = 0;
+    return true;
+}
+
+int main(int argc, const char *argv[]) {
+    uint32_t builds = argc > 1 ? (uint32_t)atoi(argv[1]) : 200;
+    if (argc > 2) image_count = (uint32_t)atoi(argv[2]);
+    if (argc > 3) symbol_count = (uint32_t)atoi(argv[3]);
+    uint32_t threads = argc > 4 ? (uint32_t)atoi(argv[4]) : DTWorkPoolDefaultThreads();
+    if (!builds || !image_count || !symbol_count || !threads) {
+        puts("symbolbench [builds [images [symbols per image [threads]]]]");
+        return 1;
+    }
+
+    char directory[] = "/tmp/symbolbench.XXXXXX";
+    if (!mkdtemp(directory)) return 1;
+    DTSymbolDBRef db = DTSymbolDBOpen(directory);
+    if (!db) {
+        printf("[-] Can not create a database in %s.\n", directory);
+        return 1;
+    }
+    printf("[*] %u builds of %u images x %u symbols, %u threads.\n", builds, image_count, symbol_count, threads);
+    printf("build\tingest_s\tnew_strings\tdb_bytes\tlookup_us\n");
+
+    double total = 0;
+    int status = 0;
+    for (current_build = 0; current_build < builds; current_build++) {
+        char name[32];
+        snprintf(name, sizeof(name), "build%u", current_build);
+        DTSymbolDBIngestResult result;
+        if (!DTSymbolDBIngest(db, name, "synthetic", threads, &result)) {
+            printf("[-] Can not ingest %s.\n", name);
+            status = 1;
+            break;
+        }
+        total += result.seconds;
+        if (current_build % 10 == 0 || current_build + 1 == builds)
+            printf("%u\t%.3f\t%llu\t%llu\t%.3f\n", current_build + 1, result.seconds, (unsigned long long)result.newStrings,
+                   (unsigned long long)result.databaseBytes, result.lookupMicroseconds);
+    }
+    if (!status) printf("[+] %u builds ingested in %.2f s.\n", builds, total);
+
+    /*
+     * Lookups in the first, middle and last build find the names they were built with.
+     */
+    uint32_t checked = 0, wrong = 0;
+    for (uint32_t i = 0; !status && i < 3; i++) {
+        uint32_t build = i * (builds - 1) / 2;
+        char name[32], expected[64];
+        snprintf(name, sizeof(name), "build%u", build);
+        for (uint32_t j = 0; j < 1000; j++, checked++) {
+            uint32_t image = (j * 7919) % image_count, symbol = (j * 104729) % symbol_count;
+            snprintf(expected, sizeof(expected), "_$s9Synthetic%uC6method%u_%uyyF", image, symbol, generation(image, symbol, build));
+            DTSymbolDBMatch match;
+            if (!DTSymbolDBLookup(db, name, 0x180000000ull + image * 0x100000 + symbol * 64 + 3, &match) ||
+                strcmp(match.symbol, expected) || match.offset != 3)
+                wrong++;
+        }
+    }
+    if (wrong) {
+        printf("[-] %u of %u lookups returned the wrong symbol.\n", wrong, checked);
+        status = 1;
+    } else if (!status)
+        printf("[+] %u lookups returned the right symbol.\n", checked);
+    DTSymbolDBClose(db);
+
+    char command[64];
+    snprintf(command, sizeof(command), "rm -rf %s", directory);
+    if (system(command) != 0) printf("[*] Can not remove %s.\n", directory);
+    return status;
+}
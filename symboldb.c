@@ -0,0 +1,630 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "exportsymbols.h"
+#include "symboldb.h"
+
+static const char kStringsMagic[8] = "DTSTR1\0";
+static const char kBuildMagic[8]   = "DTSDB1\0";
+
+/*
+ * Number of lookups timed after each ingest.
+ */
+#define kLookupSamples 1000
+
+typedef struct {
+    char magic[8];
+    uint32_t imageCount;
+    uint32_t reserved;
+    uint64_t symbolCount;
+} db_build_header_t;
+
+typedef struct {
+    uint8_t uuid[16];
+    uint64_t address;
+    uint64_t firstSymbol;
+    uint32_t symbolCount;
+    uint32_t path;
+    int32_t cputype;
+    int32_t cpusubtype;
+} db_image_t;
+
+typedef struct {
+    uint32_t offset;
+    uint32_t name;
+} db_symbol_t;
+
+typedef struct db_build {
+    char name[NAME_MAX];
+    const uint8_t *data;
+    uint64_t size;
+    struct db_build *next;
+} db_build_t;
+
+struct dt_symbol_db {
+    char directory[PATH_MAX];
+
+    /*
+     * lock guards the strings and mapped builds; ingests run one at a time. The
+     * strings table only changes in an ingest, so the ingest reads it without lock.
+     */
+    pthread_mutex_t lock;
+    pthread_mutex_t ingest_lock;
+
+    /*
+     * The strings file is mapped; strings of a running ingest are collected in
+     * 'pending' and appended when the ingest finishes. ids past poolSize are pending.
+     */
+    int strings;
+    const uint8_t *pool;
+    uint64_t poolSize;
+    uint8_t *pending;
+    uint64_t pendingSize;
+    uint64_t pendingCapacity;
+
+    /*
+     * Open addressing table of string ids; 0 is empty (offset 0 is the magic).
+     */
+    uint32_t *table;
+    uint64_t tableCapacity;
+    uint64_t tableCount;
+
+    db_build_t *builds;
+};
+
+/*
+ * An image read during an ingest. Names the database already had are resolved while
+ * the image is read; new ones are copied to 'strings' and the symbols (listed in
+ * 'fixups') and the path (if newPath) hold their offsets there until mergeStrings.
+ */
+typedef struct {
+    db_image_t image;
+    db_symbol_t *symbols;
+    char *strings;
+    uint64_t stringsSize;
+    uint64_t stringsCapacity;
+    uint32_t *fixups;
+    uint32_t fixupCount;
+    bool newPath;
+    uint64_t sharedStrings;
+} ingest_image_t;
+
+typedef struct {
+    DTSymbolDBRef db;
+    pthread_mutex_t lock;
+    ingest_image_t *images;
+    uint32_t count;
+    uint32_t capacity;
+    bool failed;
+    DTSymbolDBIngestResult *result;
+} ingest_job_t;
+
+static double monotonicSeconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static uint64_t hashString(const char *string, size_t length) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (uint8_t)string[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+static const char *stringAt(DTSymbolDBRef db, uint32_t id) {
+    if (id < db->poolSize) return (const char *)db->pool + id;
+    if (id - db->poolSize < db->pendingSize) return (const char *)db->pending + (id - db->poolSize);
+    return NULL;
+}
+
+static void tableInsert(uint32_t *table, uint64_t capacity, uint64_t hash, uint32_t id) {
+    uint64_t slot = hash & (capacity - 1);
+    while (table[slot]) slot = (slot + 1) & (capacity - 1);
+    table[slot] = id;
+}
+
+static bool tableGrow(DTSymbolDBRef db, uint64_t capacity) {
+    uint32_t *table = calloc(capacity, sizeof(uint32_t));
+    if (!table) return false;
+    for (uint64_t i = 0; i < db->tableCapacity; i++) {
+        if (!db->table[i]) continue;
+        const char *string = stringAt(db, db->table[i]);
+        tableInsert(table, capacity, hashString(string, strlen(string)), db->table[i]);
+    }
+    free(db->table);
+    db->table = table;
+    db->tableCapacity = capacity;
+    return true;
+}
+
+/*
+ * Returns the id of the string, or 0 if the database doesn't have it. Ingests only
+ * change the table in mergeStrings, so images read it without db->lock.
+ */
+static uint32_t findString(DTSymbolDBRef db, const char *string, size_t length) {
+    uint64_t slot = hashString(string, length) & (db->tableCapacity - 1);
+    while (db->table[slot]) {
+        const char *existing = stringAt(db, db->table[slot]);
+        if (!memcmp(existing, string, length) && existing[length] == '\0') return db->table[slot];
+        slot = (slot + 1) & (db->tableCapacity - 1);
+    }
+    return 0;
+}
+
+/*
+ * Returns the id of the string, adding it if it is new, or 0 if the strings file would
+ * outgrow 32-bit ids. Called with db->lock held, from mergeStrings.
+ */
+static uint32_t internString(DTSymbolDBRef db, const char *string, size_t length, bool *added) {
+    *added = false;
+    if ((db->tableCount + 1) * 2 > db->tableCapacity && !tableGrow(db, db->tableCapacity * 2)) return 0;
+
+    uint64_t hash = hashString(string, length);
+    uint64_t slot = hash & (db->tableCapacity - 1);
+    while (db->table[slot]) {
+        const char *existing = stringAt(db, db->table[slot]);
+        if (!memcmp(existing, string, length) && existing[length] == '\0') return db->table[slot];
+        slot = (slot + 1) & (db->tableCapacity - 1);
+    }
+
+    uint64_t id = db->poolSize + db->pendingSize;
+    if (id + length + 1 > UINT32_MAX) return 0;
+    if (db->pendingSize + length + 1 > db->pendingCapacity) {
+        uint64_t capacity = db->pendingCapacity ? db->pendingCapacity : 1 << 20;
+        while (capacity < db->pendingSize + length + 1) capacity *= 2;
+        uint8_t *pending = realloc(db->pending, capacity);
+        if (!pending) return 0;
+        db->pending = pending;
+        db->pendingCapacity = capacity;
+    }
+    memcpy(db->pending + db->pendingSize, string, length);
+    db->pending[db->pendingSize + length] = '\0';
+    db->pendingSize += length + 1;
+    db->table[slot] = (uint32_t)id;
+    db->tableCount++;
+    *added = true;
+    return (uint32_t)id;
+}
+
+static bool mapStrings(DTSymbolDBRef db) {
+    if (db->pool) munmap((void *)db->pool, db->poolSize);
+    db->pool = NULL;
+    struct stat info;
+    if (fstat(db->strings, &info) != 0) return false;
+    void *pool = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, db->strings, 0);
+    if (pool == MAP_FAILED) return false;
+    db->pool = pool;
+    db->poolSize = info.st_size;
+    return true;
+}
+
+DTSymbolDBRef DTSymbolDBOpen(const char *directory) {
+    DTSymbolDBRef db = calloc(1, sizeof(struct dt_symbol_db));
+    if (!db) return NULL;
+    snprintf(db->directory, sizeof(db->directory), "%s", directory);
+    db->strings = -1;
+    pthread_mutex_init(&db->lock, NULL);
+    pthread_mutex_init(&db->ingest_lock, NULL);
+
+    char path[PATH_MAX];
+    mkdir(directory, 0755);
+    snprintf(path, sizeof(path), "%s/builds", directory);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/strings", directory);
+    db->strings = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (db->strings < 0) {
+        DTSymbolDBClose(db);
+        return NULL;
+    }
+    if (lseek(db->strings, 0, SEEK_END) == 0 && write(db->strings, kStringsMagic, sizeof(kStringsMagic)) != sizeof(kStringsMagic)) {
+        DTSymbolDBClose(db);
+        return NULL;
+    }
+    if (!mapStrings(db) || db->poolSize < sizeof(kStringsMagic) || memcmp(db->pool, kStringsMagic, sizeof(kStringsMagic))) {
+        DTSymbolDBClose(db);
+        return NULL;
+    }
+
+    /*
+     * An ingest that died while appending leaves a partial string; drop it.
+     */
+    uint64_t end = db->poolSize;
+    while (end > sizeof(kStringsMagic) && db->pool[end - 1] != '\0') end--;
+    if (end != db->poolSize && (ftruncate(db->strings, end) != 0 || !mapStrings(db))) {
+        DTSymbolDBClose(db);
+        return NULL;
+    }
+
+    uint64_t count = 0;
+    for (uint64_t i = sizeof(kStringsMagic); i < db->poolSize; i++)
+        if (db->pool[i] == '\0') count++;
+    uint64_t capacity = 1024;
+    while (capacity < count * 2 + 2) capacity *= 2;
+    if (!(db->table = calloc(capacity, sizeof(uint32_t)))) {
+        DTSymbolDBClose(db);
+        return NULL;
+    }
+    db->tableCapacity = capacity;
+    for (uint64_t offset = sizeof(kStringsMagic); offset < db->poolSize;) {
+        const char *string = (const char *)db->pool + offset;
+        size_t length = strlen(string);
+        tableInsert(db->table, capacity, hashString(string, length), (uint32_t)offset);
+        db->tableCount++;
+        offset += length + 1;
+    }
+    return db;
+}
+
+void DTSymbolDBClose(DTSymbolDBRef db) {
+    if (!db) return;
+    while (db->builds) {
+        db_build_t *build = db->builds;
+        db->builds = build->next;
+        munmap((void *)build->data, build->size);
+        free(build);
+    }
+    if (db->pool) munmap((void *)db->pool, db->poolSize);
+    if (db->strings >= 0) close(db->strings);
+    free(db->pending);
+    free(db->table);
+    pthread_mutex_destroy(&db->ingest_lock);
+    pthread_mutex_destroy(&db->lock);
+    free(db);
+}
+
+static bool buildPath(DTSymbolDBRef db, const char *build, char *path, size_t size) {
+    if (!build[0] || build[0] == '.' || strchr(build, '/') || strlen(build) >= NAME_MAX - 4) return false;
+    snprintf(path, size, "%s/builds/%s.db", db->directory, build);
+    return true;
+}
+
+bool DTSymbolDBContains(DTSymbolDBRef db, const char *build) {
+    char path[PATH_MAX];
+    return buildPath(db, build, path, sizeof(path)) && access(path, F_OK) == 0;
+}
+
+/*
+ * Resolves a name against the database, or copies it to the image's new strings.
+ * Returns the id or the offset in entry->strings, 0 on failure.
+ */
+static uint32_t resolveString(DTSymbolDBRef db, ingest_image_t *entry, const char *string, size_t length, bool *added) {
+    uint32_t id = findString(db, string, length);
+    *added = !id;
+    if (id) {
+        entry->sharedStrings++;
+        return id;
+    }
+    if (entry->stringsSize + length + 1 > UINT32_MAX) return 0;
+    if (entry->stringsSize + length + 1 > entry->stringsCapacity) {
+        uint64_t capacity = entry->stringsCapacity ? entry->stringsCapacity : 4096;
+        while (capacity < entry->stringsSize + length + 1) capacity *= 2;
+        char *strings = realloc(entry->strings, capacity);
+        if (!strings) return 0;
+        entry->strings = strings;
+        entry->stringsCapacity = capacity;
+    }
+    /*
+     * Offset 0 is kept free so 0 can mean failure.
+     */
+    if (!entry->stringsSize) entry->strings[entry->stringsSize++] = '\0';
+    uint32_t offset = (uint32_t)entry->stringsSize;
+    memcpy(entry->strings + offset, string, length);
+    entry->strings[offset + length] = '\0';
+    entry->stringsSize += length + 1;
+    return offset;
+}
+
+static void freeImage(ingest_image_t *entry) {
+    free(entry->symbols);
+    free(entry->strings);
+    free(entry->fixups);
+}
+
+/*
+ * Called on the enumeration threads. Only adding the finished image to the job takes
+ * a lock; the strings table is left to mergeStrings.
+ */
+static void ingestImage(void *context, const DTImageSymbols *symbols) {
+    ingest_job_t *job = context;
+    DTSymbolDBRef db = job->db;
+    ingest_image_t entry;
+    memset(&entry, 0, sizeof(entry));
+    size_t count = symbols->count ? symbols->count : 1;
+    entry.symbols = malloc(count * sizeof(db_symbol_t));
+    entry.fixups = malloc(count * sizeof(uint32_t));
+    memcpy(entry.image.uuid, symbols->uuid, sizeof(entry.image.uuid));
+    entry.image.address = symbols->address;
+    entry.image.cputype = symbols->cputype;
+    entry.image.cpusubtype = symbols->cpusubtype;
+
+    bool added, resolved = entry.symbols && entry.fixups;
+    if (resolved) {
+        entry.image.path = resolveString(db, &entry, symbols->path, strlen(symbols->path), &entry.newPath);
+        resolved = entry.image.path != 0;
+    }
+    for (size_t i = 0; resolved && i < symbols->count; i++) {
+        const DTImageSymbol *symbol = &symbols->symbols[i];
+        if (symbol->address < symbols->address || symbol->address - symbols->address > UINT32_MAX) continue;
+        uint32_t name = resolveString(db, &entry, symbol->name, symbol->length, &added);
+        if (!name) {
+            resolved = false;
+            break;
+        }
+        if (added) entry.fixups[entry.fixupCount++] = entry.image.symbolCount;
+        entry.symbols[entry.image.symbolCount++] = (db_symbol_t){(uint32_t)(symbol->address - symbols->address), name};
+    }
+
+    pthread_mutex_lock(&job->lock);
+    if (resolved && job->count == job->capacity) {
+        uint32_t capacity = job->capacity ? job->capacity * 2 : 256;
+        ingest_image_t *images = realloc(job->images, capacity * sizeof(ingest_image_t));
+        if (images) {
+            job->images = images;
+            job->capacity = capacity;
+        }
+    }
+    if (resolved && !job->failed && job->count < job->capacity) {
+        job->images[job->count++] = entry;
+        job->result->symbols += entry.image.symbolCount;
+        job->result->sharedStrings += entry.sharedStrings;
+    } else {
+        job->failed = true;
+        freeImage(&entry);
+    }
+    pthread_mutex_unlock(&job->lock);
+}
+
+/*
+ * Interns the new strings of all images, in address order, and replaces their offsets
+ * with ids. Called with db->lock held, once per ingest.
+ */
+static bool mergeStrings(DTSymbolDBRef db, ingest_job_t *job) {
+    bool added;
+    for (uint32_t i = 0; i < job->count; i++) {
+        ingest_image_t *entry = &job->images[i];
+        if (entry->newPath) {
+            const char *path = entry->strings + entry->image.path;
+            if (!(entry->image.path = internString(db, path, strlen(path), &added))) return false;
+            if (added) job->result->newStrings++;
+            else job->result->sharedStrings++;
+        }
+        for (uint32_t j = 0; j < entry->fixupCount; j++) {
+            db_symbol_t *symbol = &entry->symbols[entry->fixups[j]];
+            const char *name = entry->strings + symbol->name;
+            if (!(symbol->name = internString(db, name, strlen(name), &added))) return false;
+            if (added) job->result->newStrings++;
+            else job->result->sharedStrings++;
+        }
+        free(entry->strings);
+        entry->strings = NULL;
+    }
+    return true;
+}
+
+static int compareImages(const void *a, const void *b) {
+    const ingest_image_t *left = a, *right = b;
+    if (left->image.address != right->image.address) return left->image.address < right->image.address ? -1 : 1;
+    return 0;
+}
+
+/*
+ * Appends the strings of the finished ingest and remaps the strings file. A short
+ * write is cut off again, so the file keeps ending at poolSize for the next ingest.
+ */
+static bool commitStrings(DTSymbolDBRef db) {
+    uint64_t written = 0;
+    if (lseek(db->strings, 0, SEEK_END) != (off_t)db->poolSize) return false;
+    while (written < db->pendingSize) {
+        ssize_t chunk = write(db->strings, db->pending + written, db->pendingSize - written);
+        if (chunk <= 0) break;
+        written += chunk;
+    }
+    if (written < db->pendingSize) {
+        ftruncate(db->strings, (off_t)db->poolSize);
+        return false;
+    }
+    db->pendingSize = 0;
+    return mapStrings(db);
+}
+
+static bool writeBuild(const char *path, ingest_job_t *job) {
+    char temporary[PATH_MAX];
+    snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+    FILE *file = fopen(temporary, "wb");
+    if (!file) return false;
+
+    db_build_header_t header = {{0}, job->count, 0, job->result->symbols};
+    memcpy(header.magic, kBuildMagic, sizeof(kBuildMagic));
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1;
+    uint64_t first = 0;
+    for (uint32_t i = 0; written && i < job->count; i++) {
+        job->images[i].image.firstSymbol = first;
+        first += job->images[i].image.symbolCount;
+        written = fwrite(&job->images[i].image, sizeof(db_image_t), 1, file) == 1;
+    }
+    for (uint32_t i = 0; written && i < job->count; i++)
+        written = fwrite(job->images[i].symbols, sizeof(db_symbol_t), job->images[i].image.symbolCount, file) == job->images[i].image.symbolCount;
+    written = (fclose(file) == 0) && written;
+    if (written && rename(temporary, path) == 0) return true;
+    unlink(temporary);
+    return false;
+}
+
+static uint64_t databaseBytes(DTSymbolDBRef db) {
+    uint64_t bytes = db->poolSize;
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/builds", db->directory);
+    DIR *directory = opendir(path);
+    struct dirent *entry;
+    while (directory && (entry = readdir(directory))) {
+        struct stat info;
+        char file[PATH_MAX];
+        snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+        if (entry->d_name[0] != '.' && stat(file, &info) == 0) bytes += info.st_size;
+    }
+    if (directory) closedir(directory);
+    return bytes;
+}
+
+static void appendStatistics(DTSymbolDBRef db, const char *build, const DTSymbolDBIngestResult *result) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/stats.tsv", db->directory);
+    bool created = access(path, F_OK) != 0;
+    FILE *file = fopen(path, "a");
+    if (!file) return;
+    if (created) fprintf(file, "build\timages\tsymbols\tnew_strings\treused_strings\tingest_s\tdb_bytes\tlookup_us\n");
+    fprintf(file, "%s\t%u\t%llu\t%llu\t%llu\t%.3f\t%llu\t%.3f\n", build, result->images,
+            (unsigned long long)result->symbols, (unsigned long long)result->newStrings,
+            (unsigned long long)result->sharedStrings, result->seconds,
+            (unsigned long long)result->databaseBytes, result->lookupMicroseconds);
+    fclose(file);
+}
+
+bool DTSymbolDBIngest(DTSymbolDBRef db, const char *build, const char *cachePath, uint32_t threads, DTSymbolDBIngestResult *result) {
+    memset(result, 0, sizeof(DTSymbolDBIngestResult));
+    char path[PATH_MAX];
+    if (!buildPath(db, build, path, sizeof(path))) return false;
+    pthread_mutex_lock(&db->ingest_lock);
+    if (access(path, F_OK) == 0) {
+        pthread_mutex_unlock(&db->ingest_lock);
+        return false;
+    }
+    double start = monotonicSeconds();
+
+    ingest_job_t job = {db, PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, false, result};
+    bool ingested = DTEnumerateCacheSymbols(cachePath, threads, ingestImage, &job, NULL, NULL) && !job.failed;
+    if (ingested) {
+        qsort(job.images, job.count, sizeof(ingest_image_t), compareImages);
+        result->images = job.count;
+        pthread_mutex_lock(&db->lock);
+        ingested = mergeStrings(db, &job) && commitStrings(db);
+        pthread_mutex_unlock(&db->lock);
+        ingested = ingested && writeBuild(path, &job);
+    }
+    if (!ingested) {
+        /*
+         * Forget strings that were never written; ones already appended stay harmless.
+         */
+        pthread_mutex_lock(&db->lock);
+        if (db->pendingSize) {
+            db->pendingSize = 0;
+            for (uint64_t i = 0; i < db->tableCapacity; i++)
+                if (db->table[i] >= db->poolSize) db->table[i] = 0, db->tableCount--;
+            tableGrow(db, db->tableCapacity);
+        }
+        pthread_mutex_unlock(&db->lock);
+    }
+    result->seconds = monotonicSeconds() - start;
+
+    if (ingested) {
+        /*
+         * Lookup latency against the new build, over symbols spread across it.
+         */
+        uint64_t step = result->symbols / kLookupSamples + 1, samples = 0;
+        double lookupStart = monotonicSeconds();
+        for (uint32_t i = 0; i < job.count; i++) {
+            for (uint64_t j = 0; j < job.images[i].image.symbolCount; j += step) {
+                DTSymbolDBMatch match;
+                DTSymbolDBLookup(db, build, job.images[i].image.address + job.images[i].symbols[j].offset, &match);
+                samples++;
+            }
+        }
+        if (samples) result->lookupMicroseconds = (monotonicSeconds() - lookupStart) / samples * 1e6;
+        result->databaseBytes = databaseBytes(db);
+        appendStatistics(db, build, result);
+    }
+
+    pthread_mutex_unlock(&db->ingest_lock);
+
+    for (uint32_t i = 0; i < job.count; i++)
+        freeImage(&job.images[i]);
+    free(job.images);
+    pthread_mutex_destroy(&job.lock);
+    return ingested;
+}
+
+/*
+ * Maps a build file on first use. Called with db->lock held.
+ */
+static db_build_t *loadBuild(DTSymbolDBRef db, const char *name) {
+    for (db_build_t *build = db->builds; build; build = build->next)
+        if (!strcmp(build->name, name)) return build;
+
+    char path[PATH_MAX];
+    if (!buildPath(db, name, path, sizeof(path))) return NULL;
+    int file = open(path, O_RDONLY);
+    if (file < 0) return NULL;
+    struct stat info;
+    void *data = MAP_FAILED;
+    if (fstat(file, &info) == 0 && info.st_size >= (off_t)sizeof(db_build_header_t))
+        data = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, file, 0);
+    close(file);
+    if (data == MAP_FAILED) return NULL;
+
+    const db_build_header_t *header = data;
+    uint64_t expected = sizeof(db_build_header_t) + (uint64_t)header->imageCount * sizeof(db_image_t) + header->symbolCount * sizeof(db_symbol_t);
+    db_build_t *build = calloc(1, sizeof(db_build_t));
+    if (!build || memcmp(header->magic, kBuildMagic, sizeof(kBuildMagic)) || header->symbolCount > (uint64_t)info.st_size || expected != (uint64_t)info.st_size) {
+        free(build);
+        munmap(data, info.st_size);
+        return NULL;
+    }
+    snprintf(build->name, sizeof(build->name), "%s", name);
+    build->data = data;
+    build->size = info.st_size;
+    build->next = db->builds;
+    db->builds = build;
+    return build;
+}
+
+bool DTSymbolDBLookup(DTSymbolDBRef db, const char *name, uint64_t address, DTSymbolDBMatch *match) {
+    pthread_mutex_lock(&db->lock);
+    db_build_t *build = loadBuild(db, name);
+    bool found = false;
+    if (build) {
+        const db_build_header_t *header = (const db_build_header_t *)build->data;
+        const db_image_t *images = (const db_image_t *)(header + 1);
+        const db_symbol_t *symbols = (const db_symbol_t *)(images + header->imageCount);
+
+        /*
+         * Last image starting at or before the address, then its last symbol at or
+         * before it.
+         */
+        uint32_t low = 0, high = header->imageCount;
+        while (low < high) {
+            uint32_t middle = low + (high - low) / 2;
+            if (images[middle].address <= address) low = middle + 1;
+            else high = middle;
+        }
+        const db_image_t *image = low ? &images[low - 1] : NULL;
+        if (image && image->firstSymbol + image->symbolCount <= header->symbolCount && image->symbolCount) {
+            const db_symbol_t *table = symbols + image->firstSymbol;
+            uint64_t offset = address - image->address;
+            uint32_t first = 0, last = image->symbolCount;
+            while (first < last) {
+                uint32_t middle = first + (last - first) / 2;
+                if (table[middle].offset <= offset) first = middle + 1;
+                else last = middle;
+            }
+            if (first) {
+                match->symbol = stringAt(db, table[first - 1].name);
+                match->image = stringAt(db, image->path);
+                match->offset = offset - table[first - 1].offset;
+                found = match->symbol && match->image;
+            }
+        }
+    }
+    pthread_mutex_unlock(&db->lock);
+    return found;
+}
@@ -0,0 +1,69 @@
+#ifndef SYMBOLDB_H
+#define SYMBOLDB_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Symbol database shared by every fetched build. A directory holding
+ *
+ *   strings                "DTSTR1\0\0" followed by NUL-terminated strings. A string's id
+ *                          is its offset. Symbol names and install names of all builds
+ *                          are stored once; a new build only appends the ones not seen.
+ *   builds/<name>.db       per-build address tables, written once per build:
+ *                            "DTSDB1\0\0", uint32_t images, uint32_t reserved,
+ *                            uint64_t symbols
+ *                            images x {uuid[16], uint64_t address, uint64_t firstSymbol,
+ *                                      uint32_t symbolCount, uint32_t path,
+ *                                      int32_t cputype, int32_t cpusubtype}
+ *                                      ascending address
+ *                            symbols x {uint32_t offset from the image, uint32_t name}
+ *                                      ascending offset per image
+ *                          (host byte order).
+ *   stats.tsv              one line per ingest: build, images, symbols, new strings,
+ *                          reused strings, ingest seconds, database bytes, mean lookup
+ *                          latency in microseconds.
+ *
+ * Ingesting only appends: the strings file grows and one build file is added.
+ */
+typedef struct dt_symbol_db *DTSymbolDBRef;
+
+typedef struct {
+    uint32_t images;
+    uint64_t symbols;
+    uint64_t newStrings;
+    uint64_t sharedStrings;
+    uint64_t databaseBytes;
+    double   seconds;
+    double   lookupMicroseconds;
+} DTSymbolDBIngestResult;
+
+/*
+ * Pointers into the database; valid until the next ingest or DTSymbolDBClose.
+ */
+typedef struct {
+    const char *symbol;
+    const char *image;
+    uint64_t offset;                /* Address minus the symbol's address.             */
+} DTSymbolDBMatch;
+
+/*
+ * Opens the database in directory, creating it if needed.
+ */
+DTSymbolDBRef DTSymbolDBOpen(const char *directory);
+void DTSymbolDBClose(DTSymbolDBRef db);
+
+bool DTSymbolDBContains(DTSymbolDBRef db, const char *build);
+
+/*
+ * Adds the images of the dyld shared cache at cachePath as build 'build'. Returns false
+ * if the build is already present, cachePath is not a cache or writing failed.
+ */
+bool DTSymbolDBIngest(DTSymbolDBRef db, const char *build, const char *cachePath, uint32_t threads, DTSymbolDBIngestResult *result);
+
+/*
+ * Finds the symbol at or before an unslid address of build 'build'.
+ */
+bool DTSymbolDBLookup(DTSymbolDBRef db, const char *build, uint64_t address, DTSymbolDBMatch *match);
+
+#endif
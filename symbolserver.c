@@ -0,0 +1,500 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "symbolserver.h"
+
+#define kMaxConnectionsPerThread 256
+#define kRequestBufferSize       8192
+
+typedef struct {
+    int fd;
+    char request[kRequestBufferSize];
+    size_t request_length;
+    /*
+     * Response in progress: header, then either a generated body or a file range.
+     */
+    char header[512];
+    size_t header_length;
+    size_t header_sent;
+    char *body;
+    size_t body_length;
+    size_t body_sent;
+    int file;
+    off_t offset;
+    off_t remaining;
+    bool sending;
+    bool keep_alive;
+} connection_t;
+
+typedef struct {
+    pthread_t thread;
+    int wake[2];
+    struct pollfd fds[kMaxConnectionsPerThread + 1];
+    connection_t *connections[kMaxConnectionsPerThread];
+    uint32_t count;
+} worker_t;
+
+static const char *server_directory = NULL;
+static int         listen_socket    = -1;
+static pthread_t   acceptor;
+static worker_t   *workers          = NULL;
+static uint32_t    worker_count     = 0;
+
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+} buffer_t;
+
+static void bufferAppend(buffer_t *buffer, const char *format, ...) {
+    va_list args;
+    for (;;) {
+        size_t available = buffer->capacity - buffer->length;
+        va_start(args, format);
+        int length = vsnprintf(buffer->data ? buffer->data + buffer->length : NULL, available, format, args);
+        va_end(args);
+        if (length < 0) return;
+        if ((size_t)length < available) {
+            buffer->length += length;
+            return;
+        }
+        size_t capacity = buffer->capacity ? buffer->capacity * 2 : 4096;
+        while (capacity - buffer->length <= (size_t)length) capacity *= 2;
+        char *data = realloc(buffer->data, capacity);
+        if (!data) return;
+        buffer->data = data;
+        buffer->capacity = capacity;
+    }
+}
+
+/*
+ * {"builds":{"<build>":{"complete":true,"files":[{"name":"dyld","size":123},...]},...}}
+ */
+static void buildIndex(buffer_t *index) {
+    bufferAppend(index, "{\"builds\":{");
+    DIR *root = opendir(server_directory);
+    bool firstBuild = true;
+    struct dirent *build;
+    while (root && (build = readdir(root))) {
+        if (build->d_name[0] == '.' || strpbrk(build->d_name, "\"\\")) continue;
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", server_directory, build->d_name);
+        DIR *directory = opendir(path);
+        if (!directory) continue;
+
+        snprintf(path, sizeof(path), "%s/%s/.complete", server_directory, build->d_name);
+        bufferAppend(index, "%s\"%s\":{\"complete\":%s,\"files\":[", firstBuild ? "" : ",", build->d_name, access(path, F_OK) == 0 ? "true" : "false");
+        firstBuild = false;
+
+        bool firstFile = true;
+        struct dirent *file;
+        while ((file = readdir(directory))) {
+            struct stat info;
+            if (file->d_name[0] == '.' || strpbrk(file->d_name, "\"\\")) continue;
+            snprintf(path, sizeof(path), "%s/%s/%s", server_directory, build->d_name, file->d_name);
+            if (stat(path, &info) != 0 || !S_ISREG(info.st_mode)) continue;
+            bufferAppend(index, "%s{\"name\":\"%s\",\"size\":%lld}", firstFile ? "" : ",", file->d_name, (long long)info.st_size);
+            firstFile = false;
+        }
+        bufferAppend(index, "]}");
+        closedir(directory);
+    }
+    if (root) closedir(root);
+    bufferAppend(index, "}}\n");
+}
+
+/*
+ * Finds header 'name' in a request and copies its value. Returns false if absent.
+ */
+static bool findHeader(const char *request, size_t length, const char *name, char *value, size_t size) {
+    size_t nameLength = strlen(name);
+    const char *line = strstr(request, "\r\n");
+    while (line && (size_t)(line - request) < length) {
+        line += 2;
+        if (!strncmp(line, "\r\n", 2)) break;
+        const char *next = strstr(line, "\r\n");
+        if (!next) break;
+        if (!strncasecmp(line, name, nameLength) && line[nameLength] == ':') {
+            const char *start = line + nameLength + 1;
+            while (*start == ' ' || *start == '\t') start++;
+            size_t valueLength = next - start;
+            if (valueLength >= size) valueLength = size - 1;
+            memcpy(value, start, valueLength);
+            value[valueLength] = 0;
+            return true;
+        }
+        line = next;
+    }
+    return false;
+}
+
+/*
+ * Returns 1 for a satisfiable single range, 0 if the header should be ignored and
+ * -1 if the range can not be satisfied.
+ */
+static int parseRange(const char *value, off_t size, off_t *start, off_t *end) {
+    if (strncmp(value, "bytes=", 6) || strchr(value, ',')) return 0;
+    value += 6;
+    char *tail = NULL;
+    if (*value == '-') {
+        long long suffix = strtoll(value + 1, &tail, 10);
+        if (tail == value + 1 || *tail) return 0;
+        if (suffix <= 0 || size == 0) return -1;
+        *start = suffix < size ? size - suffix : 0;
+        *end = size - 1;
+        return 1;
+    }
+    long long first = strtoll(value, &tail, 10);
+    if (tail == value || *tail != '-' || first < 0) return 0;
+    value = tail + 1;
+    long long last = size - 1;
+    if (*value) {
+        last = strtoll(value, &tail, 10);
+        if (*tail || last < first) return 0;
+        if (last >= size) last = size - 1;
+    }
+    if (first >= size) return -1;
+    *start = first;
+    *end = last;
+    return 1;
+}
+
+static void setResponseHeader(connection_t *connection, int status, const char *reason, const char *fields, off_t length) {
+    int headerLength = snprintf(connection->header, sizeof(connection->header),
+                                "HTTP/1.1 %d %s\r\nServer: fetchsymbols\r\nAccept-Ranges: bytes\r\nContent-Length: %lld\r\nConnection: %s\r\n%s\r\n",
+                                status, reason, (long long)length, connection->keep_alive ? "keep-alive" : "close", fields ? fields : "");
+    connection->header_length = headerLength < (int)sizeof(connection->header) ? (size_t)headerLength : (size_t)(sizeof(connection->header) - 1);
+    connection->header_sent = 0;
+    connection->sending = true;
+}
+
+static void setErrorResponse(connection_t *connection, int status, const char *reason, bool head) {
+    buffer_t body = {0};
+    bufferAppend(&body, "%d %s\n", status, reason);
+    setResponseHeader(connection, status, reason, "Content-Type: text/plain\r\n", body.length);
+    if (head) free(body.data);
+    else {
+        connection->body = body.data;
+        connection->body_length = body.length;
+    }
+}
+
+static void handleFile(connection_t *connection, const char *target, const char *range, bool head) {
+    /*
+     * Only <build>/<file> style paths below the served directory. Hidden components
+     * (".", "..", ".complete") are refused.
+     */
+    for (const char *component = target; component; component = strchr(component + 1, '/')) {
+        if (component[1] == '.' || component[1] == '/' || component[1] == 0) {
+            setErrorResponse(connection, 404, "Not Found", head);
+            return;
+        }
+    }
+
+    char path[PATH_MAX];
+    struct stat info;
+    snprintf(path, sizeof(path), "%s%s", server_directory, target);
+    int file = open(path, O_RDONLY);
+    if (file < 0 || fstat(file, &info) != 0 || !S_ISREG(info.st_mode)) {
+        if (file >= 0) close(file);
+        setErrorResponse(connection, 404, "Not Found", head);
+        return;
+    }
+
+    off_t start = 0, end = info.st_size - 1;
+    int ranged = range ? parseRange(range, info.st_size, &start, &end) : 0;
+    if (ranged < 0) {
+        close(file);
+        char fields[128];
+        snprintf(fields, sizeof(fields), "Content-Range: bytes */%lld\r\n", (long long)info.st_size);
+        setResponseHeader(connection, 416, "Range Not Satisfiable", fields, 0);
+        return;
+    }
+
+    char fields[192];
+    off_t length = info.st_size;
+    if (ranged) {
+        length = end - start + 1;
+        snprintf(fields, sizeof(fields), "Content-Type: application/octet-stream\r\nContent-Range: bytes %lld-%lld/%lld\r\n", (long long)start, (long long)end, (long long)info.st_size);
+        setResponseHeader(connection, 206, "Partial Content", fields, length);
+    } else {
+        setResponseHeader(connection, 200, "OK", "Content-Type: application/octet-stream\r\n", length);
+    }
+
+    if (head || length == 0) {
+        close(file);
+    } else {
+        connection->file = file;
+        connection->offset = start;
+        connection->remaining = length;
+    }
+}
+
+/*
+ * Parses the request occupying the first 'length' bytes of the buffer and prepares the response.
+ */
+static void handleRequest(connection_t *connection, size_t length) {
+    char method[16], target[1024], value[256];
+    int major = 0, minor = 0;
+
+    connection->request[length - 2] = 0;
+    bool valid = sscanf(connection->request, "%15s %1023s HTTP/%d.%d", method, target, &major, &minor) == 4 && target[0] == '/';
+
+    connection->keep_alive = false;
+    if (valid && findHeader(connection->request, length, "Connection", value, sizeof(value)))
+        connection->keep_alive = !strcasecmp(value, "keep-alive") || (strcasecmp(value, "close") && (major > 1 || minor >= 1));
+    else if (valid)
+        connection->keep_alive = major > 1 || minor >= 1;
+
+    bool head = valid && !strcmp(method, "HEAD");
+    char *query = strchr(target, '?');
+    if (valid && query) *query = 0;
+
+    if (!valid) {
+        connection->keep_alive = false;
+        setErrorResponse(connection, 400, "Bad Request", false);
+    } else if (strcmp(method, "GET") && !head) {
+        connection->keep_alive = false;
+        setErrorResponse(connection, 405, "Method Not Allowed", false);
+    } else if (!strcmp(target, "/") || !strcmp(target, "/index.json")) {
+        buffer_t index = {0};
+        buildIndex(&index);
+        setResponseHeader(connection, 200, "OK", "Content-Type: application/json\r\n", index.length);
+        if (head) free(index.data);
+        else {
+            connection->body = index.data;
+            connection->body_length = index.length;
+        }
+    } else {
+        bool ranged = findHeader(connection->request, length, "Range", value, sizeof(value));
+        handleFile(connection, target, ranged ? value : NULL, head);
+    }
+
+    /*
+     * Keep pipelined requests for later.
+     */
+    memmove(connection->request, connection->request + length, connection->request_length - length);
+    connection->request_length -= length;
+    connection->request[connection->request_length] = 0;
+}
+
+static void finishResponse(connection_t *connection) {
+    free(connection->body);
+    connection->body = NULL;
+    connection->body_length = connection->body_sent = 0;
+    if (connection->file >= 0) close(connection->file);
+    connection->file = -1;
+    connection->remaining = 0;
+    connection->sending = false;
+}
+
+/*
+ * Returns 1 when the response is complete, 0 if the socket would block and -1 on error.
+ */
+static int sendResponse(connection_t *connection) {
+    while (connection->header_sent < connection->header_length) {
+        ssize_t sent = send(connection->fd, connection->header + connection->header_sent, connection->header_length - connection->header_sent, 0);
+        if (sent < 0) return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+        connection->header_sent += sent;
+    }
+    while (connection->body_sent < connection->body_length) {
+        ssize_t sent = send(connection->fd, connection->body + connection->body_sent, connection->body_length - connection->body_sent, 0);
+        if (sent < 0) return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+        connection->body_sent += sent;
+    }
+    while (connection->remaining > 0) {
+        off_t length = connection->remaining;
+        int result = sendfile(connection->file, connection->fd, connection->offset, &length, NULL, 0);
+        connection->offset += length;
+        connection->remaining -= length;
+        if (result < 0) {
+            if (errno != EAGAIN && errno != EINTR) return -1;
+            if (errno == EAGAIN && length == 0) return 0;
+        } else if (length == 0 && connection->remaining > 0) {
+            /*
+             * The file got shorter than advertised.
+             */
+            return -1;
+        }
+    }
+    finishResponse(connection);
+    return 1;
+}
+
+/*
+ * Drives the connection as far as possible. Returns false if it should be closed.
+ */
+static bool processConnection(connection_t *connection) {
+    for (;;) {
+        if (connection->sending) {
+            int state = sendResponse(connection);
+            if (state < 0) return false;
+            if (state == 0) return true;
+            if (!connection->keep_alive) return false;
+        }
+        char *end = strstr(connection->request, "\r\n\r\n");
+        if (!end) return connection->request_length < sizeof(connection->request) - 1;
+        handleRequest(connection, end + 4 - connection->request);
+    }
+}
+
+static void closeConnection(worker_t *worker, uint32_t slot) {
+    connection_t *connection = worker->connections[slot];
+    finishResponse(connection);
+    close(connection->fd);
+    free(connection);
+    worker->count--;
+    worker->connections[slot] = worker->connections[worker->count];
+}
+
+static void *workerThread(void *arg) {
+    worker_t *worker = arg;
+    for (;;) {
+        worker->fds[0].fd = worker->wake[0];
+        worker->fds[0].events = POLLIN;
+        for (uint32_t i = 0; i < worker->count; i++) {
+            worker->fds[i + 1].fd = worker->connections[i]->fd;
+            worker->fds[i + 1].events = worker->connections[i]->sending ? POLLOUT : POLLIN;
+            worker->fds[i + 1].revents = 0;
+        }
+        uint32_t polled = worker->count;
+        if (poll(worker->fds, polled + 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        /*
+         * Walk backwards so closing a slot only moves already handled connections.
+         */
+        for (uint32_t i = polled; i > 0; i--) {
+            short events = worker->fds[i].revents;
+            connection_t *connection = worker->connections[i - 1];
+            if (!events) continue;
+            bool alive = !(events & (POLLERR | POLLNVAL));
+            if (alive && (events & (POLLIN | POLLHUP)) && !connection->sending) {
+                ssize_t received = recv(connection->fd, connection->request + connection->request_length, sizeof(connection->request) - connection->request_length - 1, 0);
+                if (received > 0) {
+                    connection->request_length += received;
+                    connection->request[connection->request_length] = 0;
+                } else if (received == 0 || (errno != EAGAIN && errno != EINTR))
+                    alive = false;
+            }
+            if (alive) alive = processConnection(connection);
+            if (!alive) closeConnection(worker, i - 1);
+        }
+
+        if (worker->fds[0].revents & (POLLIN | POLLHUP)) {
+            int fd;
+            ssize_t length;
+            while ((length = read(worker->wake[0], &fd, sizeof(fd))) == sizeof(fd)) {
+                connection_t *connection = worker->count < kMaxConnectionsPerThread ? calloc(1, sizeof(connection_t)) : NULL;
+                if (!connection) {
+                    close(fd);
+                    continue;
+                }
+                connection->fd = fd;
+                connection->file = -1;
+                worker->connections[worker->count++] = connection;
+            }
+            /*
+             * Write end closed: the server is shutting down.
+             */
+            if (length == 0) break;
+        }
+    }
+    while (worker->count) closeConnection(worker, worker->count - 1);
+    return NULL;
+}
+
+static void *acceptorThread(void *arg) {
+    uint32_t next = 0;
+    for (;;) {
+        int fd = accept(listen_socket, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            /*
+             * Out of descriptors: the pending connection stays in the backlog, so accept
+             * would fail again right away. Wait for connections to close.
+             */
+            if (errno == EMFILE || errno == ENFILE) {
+                usleep(100000);
+                continue;
+            }
+            break;
+        }
+        int enable = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        if (write(workers[next].wake[1], &fd, sizeof(fd)) != sizeof(fd)) close(fd);
+        next = (next + 1) % worker_count;
+    }
+    return NULL;
+}
+
+bool DTSymbolServerStart(const char *directory, const char *address, uint16_t port, uint32_t threads) {
+    signal(SIGPIPE, SIG_IGN);
+    server_directory = directory;
+
+    struct sockaddr_in local = {0};
+    local.sin_family = AF_INET;
+    local.sin_port = htons(port);
+    if (inet_pton(AF_INET, address ? address : "127.0.0.1", &local.sin_addr) != 1) return false;
+
+    listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_socket < 0) return false;
+    int enable = 1;
+    setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+    if (bind(listen_socket, (struct sockaddr *)&local, sizeof(local)) != 0 || listen(listen_socket, 128) != 0) {
+        close(listen_socket);
+        listen_socket = -1;
+        return false;
+    }
+
+    worker_count = threads ? threads : 1;
+    workers = calloc(worker_count, sizeof(worker_t));
+    uint32_t pipes = 0, started = 0;
+    if (workers) {
+        while (pipes < worker_count && pipe(workers[pipes].wake) == 0) {
+            fcntl(workers[pipes].wake[0], F_SETFL, O_NONBLOCK);
+            pipes++;
+        }
+        while (pipes == worker_count && started < worker_count &&
+               pthread_create(&workers[started].thread, NULL, workerThread, &workers[started]) == 0)
+            started++;
+    }
+    if (workers && started == worker_count && pthread_create(&acceptor, NULL, acceptorThread, NULL) == 0)
+        return true;
+
+    /*
+     * Closing a wake pipe's write end stops its worker.
+     */
+    for (uint32_t i = 0; i < pipes; i++) close(workers[i].wake[1]);
+    for (uint32_t i = 0; i < started; i++) pthread_join(workers[i].thread, NULL);
+    for (uint32_t i = 0; i < pipes; i++) close(workers[i].wake[0]);
+    free(workers);
+    workers = NULL;
+    worker_count = 0;
+    close(listen_socket);
+    listen_socket = -1;
+    return false;
+}
+
+void DTSymbolServerWait(void) {
+    if (listen_socket >= 0) pthread_join(acceptor, NULL);
+}
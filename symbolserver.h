@@ -0,0 +1,25 @@
+#ifndef SYMBOLSERVER_H
+#define SYMBOLSERVER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * HTTP/1.1 server publishing a download directory laid out as <directory>/<build>/<file>
+ * (the daemon store). Supports GET and HEAD, single byte ranges and keep-alive.
+ *
+ *   /            - JSON index of files by device build.
+ *   /build/file  - file contents, sent with sendfile().
+ *
+ * The server listens on the IPv4 'address' (NULL - 127.0.0.1; "0.0.0.0" for all
+ * interfaces). Connections are spread over 'threads' poll() loops. Returns false if
+ * the address is invalid or can not be bound.
+ */
+bool DTSymbolServerStart(const char *directory, const char *address, uint16_t port, uint32_t threads);
+
+/*
+ * Blocks until the server stops accepting connections.
+ */
+void DTSymbolServerWait(void);
+
+#endif
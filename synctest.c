@@ -0,0 +1,233 @@
+/*
+ * synctest - delta sync tests of deltasync.c over loopback.
+ *
+ * A child process serves a temporary directory with DTSyncServerStart; the test pulls
+ * it with DTSyncPull into a second directory after changing the served files (a block
+ * rewritten in place, bytes inserted in front, a new build next to the old one, a
+ * file removed) and checks the synced contents and how many bytes were reused from
+ * local basis files and how many transferred. Plain POSIX; builds on Linux as well:
+ *
+ *   cc synctest.c deltasync.c workpool.c -lpthread -o synctest
+ *   ./synctest
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include "deltasync.h"
+
+/*
+ * deltasync.c's block size for files below 16 GB.
+ */
+#define kBlockSize (16 * 1024)
+#define kCacheSize (128 * kBlockSize + 100)
+#define kDyldSize  (18 * kBlockSize + 13288)
+
+static char server_directory[PATH_MAX];
+static char client_directory[PATH_MAX];
+static uint16_t port;
+static uint32_t failures = 0;
+static time_t next_mtime;
+
+static void fillRandom(uint8_t *buffer, size_t length, uint32_t seed) {
+    for (size_t i = 0; i < length; i++) {
+        seed = seed * 1664525 + 1013904223;
+        buffer[i] = (uint8_t)(seed >> 24);
+    }
+}
+
+/*
+ * Writes a served file. The server keeps hash lists by size and mtime in seconds, so
+ * every write gets an mtime of its own.
+ */
+static bool writeFile(const char *relative, const uint8_t *data, size_t length) {
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/%s", server_directory, relative) >= (int)sizeof(path)) return false;
+    char *slash = strrchr(path, '/');
+    *slash = '\0';
+    mkdir(path, 0755);
+    *slash = '/';
+    FILE *file = fopen(path, "wb");
+    bool written = file && (!length || fwrite(data, 1, length, file) == length);
+    if (file) written = (fclose(file) == 0) && written;
+    struct timeval times[2] = {{next_mtime, 0}, {next_mtime, 0}};
+    next_mtime++;
+    return written && utimes(path, times) == 0;
+}
+
+static uint8_t *readFile(const char *directory, const char *relative, size_t *length) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", directory, relative);
+    FILE *file = fopen(path, "rb");
+    if (!file) return NULL;
+    struct stat info;
+    uint8_t *data = fstat(fileno(file), &info) == 0 ? malloc(info.st_size + 1) : NULL;
+    if (data && fread(data, 1, info.st_size, file) != (size_t)info.st_size) {
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+    if (data) *length = info.st_size;
+    return data;
+}
+
+/*
+ * The pulled file is byte for byte the served one.
+ */
+static bool sameFile(const char *relative) {
+    size_t a = 0, b = 0;
+    uint8_t *served = readFile(server_directory, relative, &a), *pulled = readFile(client_directory, relative, &b);
+    bool same = served && pulled && a == b && !memcmp(served, pulled, a);
+    free(served);
+    free(pulled);
+    return same;
+}
+
+static void check(const char *name, bool passed, const char *format, ...) {
+    printf("[%c] %s", passed ? '+' : '-', name);
+    if (!passed && format) {
+        va_list args;
+        va_start(args, format);
+        printf(": ");
+        vprintf(format, args);
+        va_end(args);
+    }
+    putchar('\n');
+    if (!passed) failures++;
+}
+
+/*
+ * Starts the server in a child process and waits until it accepts.
+ */
+static pid_t startServer(void) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (!DTSyncServerStart(server_directory, port, 2)) _exit(1);
+        DTSyncServerWait();
+        _exit(0);
+    }
+    if (pid < 0) return -1;
+
+    for (int attempt = 0; attempt < 200; attempt++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in address = {0};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        bool connected = fd >= 0 && connect(fd, (struct sockaddr *)&address, sizeof(address)) == 0;
+        if (fd >= 0) close(fd);
+        if (connected) return pid;
+        usleep(10000);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+static bool pull(DTSyncResult *result) {
+    return DTSyncPull("127.0.0.1", port, client_directory, result);
+}
+
+int main(void) {
+    signal(SIGPIPE, SIG_IGN);
+    port = 20000 + getpid() % 20000;
+    next_mtime = time(NULL) - 3600;
+    char base[] = "/tmp/synctest.XXXXXX";
+    if (!mkdtemp(base)) return 1;
+    snprintf(server_directory, sizeof(server_directory), "%s/server", base);
+    snprintf(client_directory, sizeof(client_directory), "%s/client", base);
+
+    uint8_t *cache = malloc(kCacheSize), *dyld = malloc(kDyldSize + 1000);
+    if (!cache || !dyld || mkdir(server_directory, 0755) != 0) return 1;
+    fillRandom(cache, kCacheSize, 0x12345678);
+    fillRandom(dyld, kDyldSize, 0x9abcdef0);
+    if (!writeFile("b1/cache", cache, kCacheSize) || !writeFile("b1/dyld", dyld, kDyldSize) || !writeFile("b1/.complete", NULL, 0)) {
+        printf("[-] Can not create test files in %s.\n", base);
+        return 1;
+    }
+    pid_t server = startServer();
+    if (server < 0) {
+        printf("[-] Can not serve %s on port %u.\n", server_directory, port);
+        return 1;
+    }
+
+    DTSyncResult result;
+    bool pulled = pull(&result);
+    check("initial pull transfers everything",
+          pulled && result.files == 3 && result.failed == 0 && result.reused == 0 && result.transferred == kCacheSize + kDyldSize &&
+              sameFile("b1/cache") && sameFile("b1/dyld") && sameFile("b1/.complete"),
+          "files %u, failed %u, reused %llu, transferred %llu", result.files, result.failed,
+          (unsigned long long)result.reused, (unsigned long long)result.transferred);
+
+    pulled = pull(&result);
+    check("unchanged files are not transferred",
+          pulled && result.unchanged == 3 && result.transferred == 0 && result.reused == kCacheSize + kDyldSize,
+          "unchanged %u, reused %llu, transferred %llu", result.unchanged, (unsigned long long)result.reused,
+          (unsigned long long)result.transferred);
+
+    /*
+     * 100 bytes inside block 5: only that block travels.
+     */
+    memset(cache + 5 * kBlockSize + 10, 0x5a, 100);
+    pulled = writeFile("b1/cache", cache, kCacheSize) && pull(&result);
+    check("a rewritten block is the only one transferred",
+          pulled && result.failed == 0 && result.unchanged == 2 && result.transferred == kBlockSize &&
+              result.reused == kCacheSize + kDyldSize - kBlockSize && sameFile("b1/cache"),
+          "unchanged %u, reused %llu, transferred %llu", result.unchanged, (unsigned long long)result.reused,
+          (unsigned long long)result.transferred);
+
+    /*
+     * 1000 bytes in front of dyld shift every block; the rolling checksum finds them
+     * and only the first block, which holds the new bytes, travels.
+     */
+    memmove(dyld + 1000, dyld, kDyldSize);
+    fillRandom(dyld, 1000, 0x0badcafe);
+    pulled = writeFile("b1/dyld", dyld, kDyldSize + 1000) && pull(&result);
+    check("shifted blocks are found at their new offsets",
+          pulled && result.failed == 0 && result.transferred == kBlockSize &&
+              result.reused == kCacheSize + kDyldSize + 1000 - kBlockSize && sameFile("b1/dyld"),
+          "reused %llu, transferred %llu", (unsigned long long)result.reused, (unsigned long long)result.transferred);
+
+    /*
+     * A new build whose cache differs from b1's in its last block (the short one): the
+     * local b1/cache is the basis.
+     */
+    memset(cache + kCacheSize - 50, 0xa5, 50);
+    pulled = writeFile("b2/cache", cache, kCacheSize) && writeFile("b2/.complete", NULL, 0) && pull(&result);
+    check("a new build reuses the previous one",
+          pulled && result.files == 5 && result.failed == 0 && result.unchanged == 3 && result.transferred == 100 &&
+              result.reused == 2 * kCacheSize + kDyldSize + 1000 - 100 && sameFile("b2/cache") && sameFile("b2/.complete"),
+          "files %u, unchanged %u, reused %llu, transferred %llu", result.files, result.unchanged,
+          (unsigned long long)result.reused, (unsigned long long)result.transferred);
+
+    /*
+     * Local files the server no longer has stay; its cached hash list goes.
+     */
+    char removed[PATH_MAX + 16];
+    snprintf(removed, sizeof(removed), "%s/b1/dyld", server_directory);
+    unlink(removed);
+    pulled = pull(&result);
+    snprintf(removed, sizeof(removed), "%s/b1/dyld", client_directory);
+    check("a removed file is left alone", pulled && result.files == 4 && result.failed == 0 && result.transferred == 0 && access(removed, F_OK) == 0,
+          "files %u, failed %u, transferred %llu", result.files, result.failed, (unsigned long long)result.transferred);
+
+    kill(server, SIGKILL);
+    waitpid(server, NULL, 0);
+    free(cache);
+    free(dyld);
+    char command[PATH_MAX + 16];
+    snprintf(command, sizeof(command), "rm -rf %s", base);
+    if (system(command) != 0) printf("[*] Can not remove %s.\n", base);
+    printf("[%c] %u failed.\n", failures ? '-' : '+', failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,276 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <mach-o/loader.h>
+#include <mach-o/fat.h>
+#include "sharedcache.h"
+#include "workpool.h"
+#include "verify.h"
+
+typedef struct {
+    uint8_t uuid[16];
+    const char *file;
+    uint64_t offset;
+    cpu_type_t cputype;
+    cpu_subtype_t cpusubtype;
+    const char *image;
+    const char *problem;
+    bool present;
+} image_record_t;
+
+typedef struct {
+    const DTSharedCache *cache;
+    image_record_t *records;
+} cache_job_t;
+
+typedef struct {
+    const char *path;
+    const uint8_t *data;
+    uint64_t size;
+    const struct fat_arch *slices;
+    image_record_t *records;
+} file_job_t;
+
+static const char *archName(cpu_type_t cputype, cpu_subtype_t cpusubtype) {
+    cpu_subtype_t subtype = cpusubtype & ~CPU_SUBTYPE_MASK;
+    switch (cputype) {
+        case CPU_TYPE_ARM64:    return subtype == CPU_SUBTYPE_ARM64E ? "arm64e" : "arm64";
+        case CPU_TYPE_ARM64_32: return "arm64_32";
+        case CPU_TYPE_ARM:
+            if (subtype == CPU_SUBTYPE_ARM_V7S) return "armv7s";
+            if (subtype == CPU_SUBTYPE_ARM_V7K) return "armv7k";
+            return "armv7";
+        case CPU_TYPE_X86_64:   return "x86_64";
+        case CPU_TYPE_I386:     return "i386";
+    }
+    return "unknown";
+}
+
+/*
+ * Standalone files: the segment's file range must lie inside the slice.
+ * Cache images: the segment must lie inside the shared region.
+ */
+static const char *checkSegment(uint64_t vmaddr, uint64_t vmsize, uint64_t fileoff, uint64_t filesize, uint64_t available, uint64_t regionStart, uint64_t regionSize) {
+    if (vmaddr + vmsize < vmaddr) return "segment address range overflows";
+    if (regionSize) {
+        if (vmsize && (vmaddr < regionStart || vmaddr + vmsize > regionStart + regionSize))
+            return "segment outside the shared region";
+    } else if (fileoff > available || filesize > available - fileoff)
+        return "segment exceeds file";
+    return NULL;
+}
+
+static const char *checkSection(uint64_t addr, uint64_t size, uint32_t flags, uint64_t vmaddr, uint64_t vmsize) {
+    if ((flags & SECTION_TYPE) == S_ZEROFILL && size == 0) return NULL;
+    if (addr < vmaddr || addr - vmaddr > vmsize || size > vmsize - (addr - vmaddr))
+        return "section outside its segment";
+    return NULL;
+}
+
+/*
+ * Checks a Mach-O header and its load commands. 'available' is the number of readable
+ * bytes starting at data. Returns NULL if the image is well-formed.
+ */
+static const char *validateMachO(const uint8_t *data, uint64_t available, uint64_t regionStart, uint64_t regionSize, image_record_t *record) {
+    struct mach_header header;
+    if (available < sizeof(header)) return "truncated header";
+    memcpy(&header, data, sizeof(header));
+
+    bool is64 = header.magic == MH_MAGIC_64;
+    if (!is64 && header.magic != MH_MAGIC) return "bad magic";
+    uint64_t headerSize = is64 ? sizeof(struct mach_header_64) : sizeof(struct mach_header);
+    if (available < headerSize || header.sizeofcmds > available - headerSize) return "load commands exceed file";
+    record->cputype = header.cputype;
+    record->cpusubtype = header.cpusubtype;
+
+    const uint8_t *command = data + headerSize;
+    uint64_t remaining = header.sizeofcmds;
+    uint32_t alignment = is64 ? 8 : 4;
+    bool hasUUID = false;
+    for (uint32_t i = 0; i < header.ncmds; i++) {
+        struct load_command loadCommand;
+        if (remaining < sizeof(loadCommand)) return "ncmds exceeds sizeofcmds";
+        memcpy(&loadCommand, command, sizeof(loadCommand));
+        if (loadCommand.cmdsize < sizeof(loadCommand) || loadCommand.cmdsize > remaining) return "bad load command size";
+        if (loadCommand.cmdsize % alignment) return "misaligned load command";
+
+        const char *problem = NULL;
+        switch (loadCommand.cmd) {
+            case LC_SEGMENT_64: {
+                struct segment_command_64 segment;
+                if (loadCommand.cmdsize < sizeof(segment)) return "bad LC_SEGMENT_64 size";
+                memcpy(&segment, command, sizeof(segment));
+                if ((loadCommand.cmdsize - sizeof(segment)) / sizeof(struct section_64) != segment.nsects ||
+                    (loadCommand.cmdsize - sizeof(segment)) % sizeof(struct section_64))
+                    return "bad LC_SEGMENT_64 section count";
+                problem = checkSegment(segment.vmaddr, segment.vmsize, segment.fileoff, segment.filesize, available, regionStart, regionSize);
+                for (uint32_t j = 0; !problem && j < segment.nsects; j++) {
+                    struct section_64 section;
+                    memcpy(&section, command + sizeof(segment) + j * sizeof(section), sizeof(section));
+                    problem = checkSection(section.addr, section.size, section.flags, segment.vmaddr, segment.vmsize);
+                }
+                break;
+            }
+            case LC_SEGMENT: {
+                struct segment_command segment;
+                if (loadCommand.cmdsize < sizeof(segment)) return "bad LC_SEGMENT size";
+                memcpy(&segment, command, sizeof(segment));
+                if ((loadCommand.cmdsize - sizeof(segment)) / sizeof(struct section) != segment.nsects ||
+                    (loadCommand.cmdsize - sizeof(segment)) % sizeof(struct section))
+                    return "bad LC_SEGMENT section count";
+                problem = checkSegment(segment.vmaddr, segment.vmsize, segment.fileoff, segment.filesize, available, regionStart, regionSize);
+                for (uint32_t j = 0; !problem && j < segment.nsects; j++) {
+                    struct section section;
+                    memcpy(&section, command + sizeof(segment) + j * sizeof(section), sizeof(section));
+                    problem = checkSection(section.addr, section.size, section.flags, segment.vmaddr, segment.vmsize);
+                }
+                break;
+            }
+            case LC_UUID: {
+                struct uuid_command uuid;
+                if (loadCommand.cmdsize != sizeof(uuid)) return "bad LC_UUID size";
+                if (hasUUID) return "duplicate LC_UUID";
+                memcpy(&uuid, command, sizeof(uuid));
+                memcpy(record->uuid, uuid.uuid, sizeof(record->uuid));
+                hasUUID = true;
+                break;
+            }
+            case LC_SYMTAB:
+                if (loadCommand.cmdsize != sizeof(struct symtab_command)) return "bad LC_SYMTAB size";
+                break;
+            case LC_ID_DYLIB:
+            case LC_LOAD_DYLIB: {
+                struct dylib_command dylib;
+                if (loadCommand.cmdsize < sizeof(dylib)) return "bad dylib command size";
+                memcpy(&dylib, command, sizeof(dylib));
+                if (dylib.dylib.name.offset >= loadCommand.cmdsize ||
+                    !memchr(command + dylib.dylib.name.offset, 0, loadCommand.cmdsize - dylib.dylib.name.offset))
+                    return "bad dylib name";
+                break;
+            }
+        }
+        if (problem) return problem;
+
+        command += loadCommand.cmdsize;
+        remaining -= loadCommand.cmdsize;
+    }
+    if (!hasUUID) return "no LC_UUID";
+    return NULL;
+}
+
+static void verifyCacheImage(void *context, size_t index) {
+    cache_job_t *job = context;
+    const DTSharedCache *cache = job->cache;
+    const struct dyld_cache_header *header = cache->files[0].header;
+    image_record_t *record = &job->records[index];
+    const DTCacheFile *file = NULL;
+
+    record->image = DTSharedCacheImagePath(cache, (uint32_t)index);
+    const uint8_t *data = DTSharedCacheResolve(cache, cache->images[index].address, sizeof(struct mach_header_64), &file);
+    if (!data) return;
+    record->present = true;
+    record->file = file->path;
+    record->offset = data - file->data;
+
+    /*
+     * Load commands must be contiguous with the header inside one mapping.
+     */
+    uint64_t available = sizeof(struct mach_header_64) + ((const struct mach_header *)data)->sizeofcmds;
+    if (!DTSharedCacheResolve(cache, cache->images[index].address, available, NULL))
+        available = file->size - record->offset;
+    record->problem = validateMachO(data, available, header->sharedRegionStart, header->sharedRegionSize, record);
+}
+
+static void verifySlice(void *context, size_t index) {
+    file_job_t *job = context;
+    image_record_t *record = &job->records[index];
+    uint64_t offset = 0, size = job->size;
+    if (job->slices) {
+        offset = ntohl(job->slices[index].offset);
+        size = ntohl(job->slices[index].size);
+    }
+    record->file = job->path;
+    record->offset = offset;
+    record->present = true;
+    if (offset > job->size || size > job->size - offset)
+        record->problem = "fat slice exceeds file";
+    else
+        record->problem = validateMachO(job->data + offset, size, 0, 0, record);
+}
+
+static bool writeRecords(const char *path, image_record_t *records, uint32_t count, DTVerifyResult *result) {
+    char mapPath[PATH_MAX];
+    snprintf(mapPath, sizeof(mapPath), "%s.uuids", path);
+    FILE *map = fopen(mapPath, "w");
+    if (!map) return false;
+
+    for (uint32_t i = 0; i < count; i++) {
+        image_record_t *record = &records[i];
+        const char *name = record->image ? record->image : "-";
+        if (!record->present) {
+            result->missing++;
+            continue;
+        }
+        if (record->problem) {
+            printf("[-] %s (%s): %s.\n", name, record->file, record->problem);
+            result->invalid++;
+            continue;
+        }
+        const uint8_t *u = record->uuid;
+        fprintf(map, "%02X%02X%02X%02X-%02X%02X-%02X%02X-%02X%02X-%02X%02X%02X%02X%02X%02X\t%s\t0x%llx\t%s\t%s\n",
+                u[0], u[1], u[2], u[3], u[4], u[5], u[6], u[7], u[8], u[9], u[10], u[11], u[12], u[13], u[14], u[15],
+                record->file, (unsigned long long)record->offset, archName(record->cputype, record->cpusubtype), name);
+    }
+    result->images = count;
+    return fclose(map) == 0;
+}
+
+bool DTVerifyFile(const char *path, uint32_t threads, DTVerifyResult *result) {
+    memset(result, 0, sizeof(DTVerifyResult));
+
+    DTSharedCache *cache = calloc(1, sizeof(DTSharedCache));
+    if (cache && DTSharedCacheOpen(path, cache)) {
+        image_record_t *records = calloc(cache->imageCount ? cache->imageCount : 1, sizeof(image_record_t));
+        bool written = false;
+        if (records) {
+            cache_job_t job = {cache, records};
+            DTWorkPoolApply(cache->imageCount, threads, verifyCacheImage, &job);
+            written = writeRecords(path, records, cache->imageCount, result);
+            free(records);
+        }
+        DTSharedCacheClose(cache);
+        free(cache);
+        return written;
+    }
+    free(cache);
+
+    uint64_t size = 0;
+    const uint8_t *data = DTMapFile(path, &size);
+    if (!data) return false;
+
+    file_job_t job = {path, data, size, NULL, NULL};
+    uint32_t count = 1;
+    if (size >= sizeof(struct fat_header) && ntohl(((const struct fat_header *)data)->magic) == FAT_MAGIC) {
+        count = ntohl(((const struct fat_header *)data)->nfat_arch);
+        if (count == 0 || count > (size - sizeof(struct fat_header)) / sizeof(struct fat_arch)) {
+            munmap((void *)data, size);
+            return false;
+        }
+        job.slices = (const struct fat_arch *)(data + sizeof(struct fat_header));
+    } else if (size < sizeof(uint32_t) || (*(const uint32_t *)data != MH_MAGIC_64 && *(const uint32_t *)data != MH_MAGIC)) {
+        munmap((void *)data, size);
+        return false;
+    }
+
+    bool written = false;
+    job.records = calloc(count, sizeof(image_record_t));
+    if (job.records) {
+        DTWorkPoolApply(count, threads, verifySlice, &job);
+        written = writeRecords(path, job.records, count, result);
+        free(job.records);
+    }
+    munmap((void *)data, size);
+    return written;
+}
@@ -0,0 +1,32 @@
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Post-fetch validation of a Mach-O file (thin or fat, e.g. dyld) or a dyld shared
+ * cache with its subcaches next to it.
+ *
+ * Every image's header and load commands are checked on 'threads' threads and the
+ * UUID -> (file, offset, arch) map of the well-formed images is written to
+ * <path>.uuids, one image per line:
+ *
+ *   <UUID> <tab> <file> <tab> 0x<offset> <tab> <arch> <tab> <install name or ->
+ *
+ * Malformed images are printed with the reason. Images living in subcaches that are
+ * not next to the main cache are counted as missing.
+ */
+typedef struct {
+    uint32_t images;
+    uint32_t missing;
+    uint32_t invalid;
+} DTVerifyResult;
+
+/*
+ * Returns false if path is neither a Mach-O nor a dyld shared cache, or the map
+ * can not be written.
+ */
+bool DTVerifyFile(const char *path, uint32_t threads, DTVerifyResult *result);
+
+#endif
@@ -0,0 +1,117 @@
+#ifndef WIRECODEC_H
+#define WIRECODEC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Fixed-size fields of the fetchsymbols protocol. Everything on the wire is big endian:
+ *
+ *   client -> device   command          uint32_t (ListFilesPlist 0x30303030, GetFile 1)
+ *   device -> client   command echo     uint32_t, the same command
+ *   client -> device   file index       uint32_t (GetFile)
+ *   device -> client   file size        uint64_t (GetFile), followed by the body
+ *   device -> client   plist length     uint32_t (ListFilesPlist, TCP transport)
+ *
+ * Fields are kept as byte arrays so a buffer can't be used without going through the
+ * codec. The byte order is fixed at compile time; on little endian hosts a load or
+ * store is a single bswap.
+ */
+
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+#define DT_WIRE_HOST_BIG_ENDIAN 1
+#else
+#define DT_WIRE_HOST_BIG_ENDIAN 0
+#endif
+
+enum {
+    kDTWireCommandListFiles      = 0,
+    kDTWireCommandGetFile        = 1,
+    kDTWireCommandListFilesPlist = 0x30303030,
+};
+
+/*
+ * Largest file size accepted from a size header. Anything above is a framing error,
+ * not a file to map.
+ */
+#define kDTWireMaximumFileSize (32ull << 30)
+
+typedef struct { uint8_t bytes[4]; } DTWireCommand;
+typedef struct { uint8_t bytes[4]; } DTWireIndex;
+typedef struct { uint8_t bytes[8]; } DTWireSize;
+typedef struct { uint8_t bytes[4]; } DTWireLength;
+
+static inline uint32_t DTWireLoad32(const uint8_t *bytes) {
+    uint32_t value;
+    memcpy(&value, bytes, sizeof(value));
+#if DT_WIRE_HOST_BIG_ENDIAN
+    return value;
+#else
+    return __builtin_bswap32(value);
+#endif
+}
+
+static inline uint64_t DTWireLoad64(const uint8_t *bytes) {
+    uint64_t value;
+    memcpy(&value, bytes, sizeof(value));
+#if DT_WIRE_HOST_BIG_ENDIAN
+    return value;
+#else
+    return __builtin_bswap64(value);
+#endif
+}
+
+static inline void DTWireStore32(uint8_t *bytes, uint32_t value) {
+#if !DT_WIRE_HOST_BIG_ENDIAN
+    value = __builtin_bswap32(value);
+#endif
+    memcpy(bytes, &value, sizeof(value));
+}
+
+static inline void DTWireStore64(uint8_t *bytes, uint64_t value) {
+#if !DT_WIRE_HOST_BIG_ENDIAN
+    value = __builtin_bswap64(value);
+#endif
+    memcpy(bytes, &value, sizeof(value));
+}
+
+static inline DTWireCommand DTWireEncodeCommand(uint32_t command) {
+    DTWireCommand field;
+    DTWireStore32(field.bytes, command);
+    return field;
+}
+
+static inline bool DTWireCheckEcho(const DTWireCommand *echo, uint32_t command) {
+    return DTWireLoad32(echo->bytes) == command;
+}
+
+static inline bool DTWireEncodeIndex(int index, DTWireIndex *field) {
+    if (index < 0) return false;
+    DTWireStore32(field->bytes, (uint32_t)index);
+    return true;
+}
+
+static inline uint32_t DTWireDecodeIndex(const DTWireIndex *field) {
+    return DTWireLoad32(field->bytes);
+}
+
+/*
+ * False for an empty file or a size beyond kDTWireMaximumFileSize or size_t.
+ */
+static inline bool DTWireDecodeSize(const DTWireSize *field, uint64_t *size) {
+    *size = DTWireLoad64(field->bytes);
+    return *size != 0 && *size <= kDTWireMaximumFileSize && *size <= (uint64_t)SIZE_MAX;
+}
+
+static inline DTWireLength DTWireEncodeLength(uint32_t length) {
+    DTWireLength field;
+    DTWireStore32(field.bytes, length);
+    return field;
+}
+
+static inline uint32_t DTWireDecodeLength(const DTWireLength *field) {
+    return DTWireLoad32(field->bytes);
+}
+
+#endif
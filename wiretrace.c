@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "wiretrace.h"
+
+#define kHeaderSize 16
+#define kRecordSize 48
+
+static const char kMagic[8] = "DTWIRE1";
+
+struct dt_wire_trace {
+    FILE *file;
+    bool payload;
+    uint64_t origin;
+    uint32_t connections;
+    pthread_mutex_t lock;
+};
+
+static uint64_t monotonicNanoseconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+static void putLE32(uint8_t *p, uint32_t value) {
+    for (int i = 0; i < 4; i++) p[i] = (uint8_t)(value >> (8 * i));
+}
+
+static void putLE64(uint8_t *p, uint64_t value) {
+    for (int i = 0; i < 8; i++) p[i] = (uint8_t)(value >> (8 * i));
+}
+
+static uint32_t getLE32(const uint8_t *p) {
+    uint32_t value = 0;
+    for (int i = 3; i >= 0; i--) value = (value << 8) | p[i];
+    return value;
+}
+
+static uint64_t getLE64(const uint8_t *p) {
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; i--) value = (value << 8) | p[i];
+    return value;
+}
+
+DTWireTraceRef DTWireTraceCreate(const char *path, bool payload) {
+    DTWireTraceRef trace = calloc(1, sizeof(struct dt_wire_trace));
+    if (!trace) return NULL;
+    trace->file = fopen(path, "wb");
+    if (!trace->file) {
+        free(trace);
+        return NULL;
+    }
+    /*
+     * Events are small and frequent; let stdio batch them.
+     */
+    setvbuf(trace->file, NULL, _IOFBF, 1 << 20);
+    trace->payload = payload;
+    trace->origin = monotonicNanoseconds();
+    pthread_mutex_init(&trace->lock, NULL);
+
+    uint8_t header[kHeaderSize] = {0};
+    memcpy(header, kMagic, sizeof(kMagic));
+    putLE32(header + 8, payload ? kDTWireTracePayload : 0);
+    fwrite(header, 1, sizeof(header), trace->file);
+    return trace;
+}
+
+void DTWireTraceClose(DTWireTraceRef trace) {
+    if (!trace) return;
+    fclose(trace->file);
+    pthread_mutex_destroy(&trace->lock);
+    free(trace);
+}
+
+uint32_t DTWireTraceNewConnection(DTWireTraceRef trace) {
+    pthread_mutex_lock(&trace->lock);
+    uint32_t connection = ++trace->connections;
+    pthread_mutex_unlock(&trace->lock);
+    return connection;
+}
+
+uint64_t DTWireTraceNow(DTWireTraceRef trace) {
+    return monotonicNanoseconds() - trace->origin;
+}
+
+void DTWireTraceRecord(DTWireTraceRef trace, const DTWireEvent *event) {
+    uint32_t length = event->payload ? event->length : 0;
+    if (event->kind == kDTWireReceiveData && !trace->payload) length = 0;
+
+    uint8_t record[kRecordSize] = {0};
+    record[0] = (uint8_t)event->kind;
+    putLE32(record + 4, event->connection);
+    putLE64(record + 8, event->start);
+    putLE64(record + 16, event->end);
+    putLE64(record + 24, event->requested);
+    putLE64(record + 32, (uint64_t)event->result);
+    putLE32(record + 40, length);
+
+    pthread_mutex_lock(&trace->lock);
+    fwrite(record, 1, sizeof(record), trace->file);
+    if (length) fwrite(event->payload, 1, length, trace->file);
+    pthread_mutex_unlock(&trace->lock);
+}
+
+bool DTWireTraceOpen(const char *path, DTWireTraceReader *reader) {
+    memset(reader, 0, sizeof(DTWireTraceReader));
+    int file = open(path, O_RDONLY);
+    if (file < 0) return false;
+    struct stat info;
+    if (fstat(file, &info) != 0 || info.st_size < kHeaderSize) {
+        close(file);
+        return false;
+    }
+    void *data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+    close(file);
+    if (data == MAP_FAILED) return false;
+    if (memcmp(data, kMagic, sizeof(kMagic))) {
+        munmap(data, info.st_size);
+        return false;
+    }
+    reader->data = data;
+    reader->size = info.st_size;
+    reader->offset = kHeaderSize;
+    reader->flags = getLE32(reader->data + 8);
+    return true;
+}
+
+bool DTWireTraceNext(DTWireTraceReader *reader, DTWireEvent *event) {
+    if (reader->size - reader->offset < kRecordSize) return false;
+    const uint8_t *record = reader->data + reader->offset;
+    uint32_t length = getLE32(record + 40);
+    if (reader->size - reader->offset - kRecordSize < length) return false;
+
+    event->kind = record[0];
+    event->connection = getLE32(record + 4);
+    event->start = getLE64(record + 8);
+    event->end = getLE64(record + 16);
+    event->requested = getLE64(record + 24);
+    event->result = (int64_t)getLE64(record + 32);
+    event->length = length;
+    event->payload = length ? record + kRecordSize : NULL;
+    reader->offset += kRecordSize + length;
+    return true;
+}
+
+void DTWireTraceCloseReader(DTWireTraceReader *reader) {
+    if (reader->data) munmap((void *)reader->data, reader->size);
+    memset(reader, 0, sizeof(DTWireTraceReader));
+}
@@ -0,0 +1,83 @@
+#ifndef WIRETRACE_H
+#define WIRETRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Binary trace of the traffic on fetchsymbols connections.
+ *
+ * All integers are little endian. The file starts with
+ *
+ *   "DTWIRE1\0"                  magic
+ *   uint32_t flags               kDTWireTracePayload if file bodies were recorded
+ *   uint32_t reserved
+ *
+ * followed by one record per event:
+ *
+ *   uint8_t kind, uint8_t[3] padding
+ *   uint32_t connection          numbered from 1 in the order connections were opened
+ *   uint64_t start, end          nanoseconds since the trace was created
+ *   uint64_t requested           bytes asked for
+ *   int64_t result               bytes transferred, 0 or -1 on failure
+ *   uint32_t length, bytes       payload
+ *
+ * Payload is always kept for commands, command echoes, size headers and plist messages,
+ * and for file bodies (kDTWireReceiveData) only if the trace was created with payload.
+ */
+typedef enum {
+    kDTWireOpen = 1,                /* Service connection started; result -1 if it failed. */
+    kDTWireClose,
+    kDTWireSend,
+    kDTWireReceive,                 /* Command echo or size header.                        */
+    kDTWireReceiveData,             /* One chunk of a file body.                           */
+    kDTWireMessage,                 /* Plist message, payload is the serialized plist.     */
+} DTWireEventKind;
+
+#define kDTWireTracePayload 1
+
+typedef struct dt_wire_trace *DTWireTraceRef;
+
+typedef struct {
+    DTWireEventKind kind;
+    uint32_t connection;
+    uint64_t start;
+    uint64_t end;
+    uint64_t requested;
+    int64_t  result;
+    const uint8_t *payload;
+    uint32_t length;
+} DTWireEvent;
+
+/*
+ * Recording. Safe to use from several transfer threads at once.
+ */
+DTWireTraceRef DTWireTraceCreate(const char *path, bool payload);
+void DTWireTraceClose(DTWireTraceRef trace);
+uint32_t DTWireTraceNewConnection(DTWireTraceRef trace);
+
+/*
+ * Nanoseconds since the trace was created.
+ */
+uint64_t DTWireTraceNow(DTWireTraceRef trace);
+void DTWireTraceRecord(DTWireTraceRef trace, const DTWireEvent *event);
+
+/*
+ * Reading. The trace is mapped; event payloads point into the mapping.
+ */
+typedef struct {
+    const uint8_t *data;
+    uint64_t size;
+    uint64_t offset;
+    uint32_t flags;
+} DTWireTraceReader;
+
+bool DTWireTraceOpen(const char *path, DTWireTraceReader *reader);
+
+/*
+ * Returns false at the end of the trace or on a truncated record.
+ */
+bool DTWireTraceNext(DTWireTraceReader *reader, DTWireEvent *event);
+void DTWireTraceCloseReader(DTWireTraceReader *reader);
+
+#endif
@@ -0,0 +1,130 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "workpool.h"
+
+typedef struct {
+    pthread_mutex_t lock;
+    size_t next;
+    size_t end;
+} work_range_t;
+
+typedef struct {
+    work_range_t *ranges;
+    uint32_t count;
+    void (*work)(void *context, size_t index);
+    void *context;
+} work_pool_t;
+
+typedef struct {
+    work_pool_t *pool;
+    uint32_t self;
+} work_thread_t;
+
+static bool takeIndex(work_range_t *range, size_t *index) {
+    pthread_mutex_lock(&range->lock);
+    bool taken = range->next < range->end;
+    if (taken) *index = range->next++;
+    pthread_mutex_unlock(&range->lock);
+    return taken;
+}
+
+/*
+ * Moves the upper half of the fullest other range into ours. Returns false when
+ * there is nothing left anywhere.
+ */
+static bool steal(work_pool_t *pool, uint32_t self) {
+    for (;;) {
+        uint32_t victim = self;
+        size_t largest = 0;
+        for (uint32_t i = 0; i < pool->count; i++) {
+            if (i == self) continue;
+            pthread_mutex_lock(&pool->ranges[i].lock);
+            size_t remaining = pool->ranges[i].end - pool->ranges[i].next;
+            pthread_mutex_unlock(&pool->ranges[i].lock);
+            if (remaining > largest) {
+                largest = remaining;
+                victim = i;
+            }
+        }
+        if (victim == self) return false;
+
+        work_range_t *range = &pool->ranges[victim];
+        pthread_mutex_lock(&range->lock);
+        size_t remaining = range->end - range->next;
+        size_t begin = range->end - (remaining + 1) / 2;
+        size_t end = range->end;
+        if (remaining) range->end = begin;
+        pthread_mutex_unlock(&range->lock);
+        if (!remaining) continue;
+
+        pthread_mutex_lock(&pool->ranges[self].lock);
+        pool->ranges[self].next = begin;
+        pool->ranges[self].end = end;
+        pthread_mutex_unlock(&pool->ranges[self].lock);
+        return true;
+    }
+}
+
+static void *workThread(void *arg) {
+    work_thread_t *thread = arg;
+    work_pool_t *pool = thread->pool;
+    size_t index;
+    do {
+        while (takeIndex(&pool->ranges[thread->self], &index))
+            pool->work(pool->context, index);
+    } while (steal(pool, thread->self));
+    return NULL;
+}
+
+void DTWorkPoolApply(size_t count, uint32_t threads, void (*work)(void *context, size_t index), void *context) {
+    if (threads == 0) threads = 1;
+    if (threads > count) threads = (uint32_t)count;
+    if (threads <= 1) {
+        for (size_t i = 0; i < count; i++) work(context, i);
+        return;
+    }
+
+    work_pool_t pool = {calloc(threads, sizeof(work_range_t)), threads, work, context};
+    work_thread_t *arguments = calloc(threads, sizeof(work_thread_t));
+    pthread_t *handles = calloc(threads, sizeof(pthread_t));
+    bool *started = calloc(threads, sizeof(bool));
+    if (!pool.ranges || !arguments || !handles || !started) {
+        free(pool.ranges);
+        free(arguments);
+        free(handles);
+        free(started);
+        for (size_t i = 0; i < count; i++) work(context, i);
+        return;
+    }
+
+    for (uint32_t i = 0; i < threads; i++) {
+        pthread_mutex_init(&pool.ranges[i].lock, NULL);
+        pool.ranges[i].next = count * i / threads;
+        pool.ranges[i].end = count * (i + 1) / threads;
+        arguments[i].pool = &pool;
+        arguments[i].self = i;
+    }
+
+    /*
+     * Thread 0 is the caller. A thread that fails to start leaves its slice to be stolen.
+     */
+    for (uint32_t i = 1; i < threads; i++)
+        started[i] = pthread_create(&handles[i], NULL, workThread, &arguments[i]) == 0;
+    workThread(&arguments[0]);
+    for (uint32_t i = 1; i < threads; i++)
+        if (started[i]) pthread_join(handles[i], NULL);
+
+    for (uint32_t i = 0; i < threads; i++)
+        pthread_mutex_destroy(&pool.ranges[i].lock);
+    free(started);
+    free(handles);
+    free(arguments);
+    free(pool.ranges);
+}
+
+uint32_t DTWorkPoolDefaultThreads(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (uint32_t)cpus : 1;
+}
@@ -0,0 +1,22 @@
+#ifndef WORKPOOL_H
+#define WORKPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Calls work(context, i) for every i in [0, count) on 'threads' threads (the caller
+ * included) and returns when all calls have finished.
+ *
+ * Each thread starts with an equal slice of the index range. A thread that runs out
+ * steals the upper half of the largest remaining slice, so uneven work items (a huge
+ * framework next to a tiny dylib) don't leave threads idle.
+ */
+void DTWorkPoolApply(size_t count, uint32_t threads, void (*work)(void *context, size_t index), void *context);
+
+/*
+ * Number of online CPUs, at least 1.
+ */
+uint32_t DTWorkPoolDefaultThreads(void);
+
+#endif